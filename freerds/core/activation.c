@@ -0,0 +1,302 @@
+/**
+ * xrdp: A Remote Desktop Protocol server.
+ * Session Activation
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "freerds.h"
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/sysinfo.h>
+#include <winpr/interlocked.h>
+
+#include <freerds/icp_client_stubs.h>
+
+/**
+ * Finding the session of a user and connecting to its module both block,
+ * on the session manager starting it and on the module creating its pipe.
+ * An activation does both on a work pool, next to authentication, and
+ * signals its event once the pipe is connected or either step failed.
+ * The connection only takes over the pipe once it sees the event.
+ *
+ * Like authentication requests, an activation is shared by the connection
+ * and the worker, the last one to let go of it frees it.
+ *
+ * No session is looked up before admission control lets the activation
+ * in, the session it was admitted for goes to the connection with the pipe.
+ */
+
+#define FREERDS_ACTIVATION_PIPE_TIMEOUT		10000
+
+struct rds_activation
+{
+	LONG refCount;
+	HANDLE event;
+	char* username;
+	char* domain;
+	int status;
+	BOOL admitted;
+	DWORD sessionId;
+	char* endpoint;
+	HANDLE hClientPipe;
+	DWORD queueTimestamp;
+	DWORD startTimestamp;
+	DWORD sessionTimestamp;
+	DWORD endTimestamp;
+};
+
+struct rds_activation_pool
+{
+	rdsWorkPool* workers;
+	CRITICAL_SECTION lock;
+
+	UINT32 successes;
+	UINT32 failures;
+	UINT64 totalWaitTime;
+	UINT64 totalSessionTime;
+	UINT64 totalPipeTime;
+};
+typedef struct rds_activation_pool rdsActivationPool;
+
+static rdsActivationPool* g_ActivationPool = NULL;
+
+rdsActivation* freerds_activation_new(const char* username, const char* domain)
+{
+	rdsActivation* activation;
+
+	activation = (rdsActivation*) calloc(1, sizeof(rdsActivation));
+
+	if (!activation)
+		return NULL;
+
+	activation->refCount = 1;
+	activation->status = -1;
+	activation->event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	activation->username = username ? _strdup(username) : NULL;
+	activation->domain = domain ? _strdup(domain) : NULL;
+
+	if (!activation->event || (username && !activation->username) || (domain && !activation->domain))
+	{
+		freerds_activation_release(activation);
+		return NULL;
+	}
+
+	return activation;
+}
+
+void freerds_activation_release(rdsActivation* activation)
+{
+	if (!activation)
+		return;
+
+	if (InterlockedDecrement(&activation->refCount) > 0)
+		return;
+
+	/* the connection went away before taking the pipe */
+	if (activation->hClientPipe)
+		CloseHandle(activation->hClientPipe);
+
+	if (activation->admitted)
+		freerds_admission_release();
+
+	if (activation->event)
+		CloseHandle(activation->event);
+
+	free(activation->endpoint);
+	free(activation->username);
+	free(activation->domain);
+	free(activation);
+}
+
+HANDLE freerds_activation_get_event_handle(rdsActivation* activation)
+{
+	return activation ? activation->event : NULL;
+}
+
+BOOL freerds_activation_is_done(rdsActivation* activation)
+{
+	return (WaitForSingleObject(activation->event, 0) == WAIT_OBJECT_0) ? TRUE : FALSE;
+}
+
+/**
+ * Hands the session and its connected pipe over to the connector, once
+ * the activation is done. Returns -1 if it failed or was not admitted,
+ * otherwise the caller owns the admitted session from now on.
+ */
+
+int freerds_activation_attach(rdsActivation* activation, rdsModuleConnector* connector)
+{
+	if (activation->status < 0)
+		return -1;
+
+	free(connector->Endpoint);
+
+	connector->SessionId = activation->sessionId;
+	connector->Endpoint = activation->endpoint;
+	connector->hClientPipe = activation->hClientPipe;
+
+	activation->endpoint = NULL;
+	activation->hClientPipe = NULL;
+	activation->admitted = FALSE;
+
+	return 0;
+}
+
+static void freerds_activation_process(void* context)
+{
+	int status;
+	rdsActivationPool* pool = g_ActivationPool;
+	rdsActivation* activation = (rdsActivation*) context;
+
+	activation->admitted = (freerds_admission_acquire(activation->queueTimestamp) == 0) ? TRUE : FALSE;
+
+	activation->startTimestamp = GetTickCount();
+
+	/* rejections are counted by admission control */
+	status = -1;
+
+	if (activation->admitted)
+	{
+		status = freerds_icp_GetUserSession(activation->username, activation->domain,
+				(UINT32*) &(activation->sessionId), &(activation->endpoint));
+
+		if (status != 0)
+			printf("freerds_icp_GetUserSession failed %d\n", status);
+	}
+
+	activation->sessionTimestamp = GetTickCount();
+
+	if (status == 0)
+	{
+		activation->hClientPipe = freerds_named_pipe_connect_wait(activation->endpoint,
+				FREERDS_ACTIVATION_PIPE_TIMEOUT);
+
+		if (activation->hClientPipe)
+			activation->status = 0;
+		else
+			fprintf(stderr, "Failed to create named pipe %s\n", activation->endpoint);
+	}
+
+	activation->endTimestamp = GetTickCount();
+
+	EnterCriticalSection(&pool->lock);
+
+	if (activation->status == 0)
+		pool->successes++;
+	else
+		pool->failures++;
+
+	pool->totalWaitTime += activation->startTimestamp - activation->queueTimestamp;
+	pool->totalSessionTime += activation->sessionTimestamp - activation->startTimestamp;
+	pool->totalPipeTime += activation->endTimestamp - activation->sessionTimestamp;
+
+	LeaveCriticalSection(&pool->lock);
+
+	SetEvent(activation->event);
+
+	freerds_activation_release(activation);
+}
+
+/**
+ * Queues an activation, the caller keeps its own reference.
+ */
+
+int freerds_activation_submit(rdsActivation* activation)
+{
+	rdsActivationPool* pool = g_ActivationPool;
+
+	if (!pool)
+		return -1;
+
+	activation->queueTimestamp = GetTickCount();
+
+	InterlockedIncrement(&activation->refCount);
+
+	if (freerds_work_pool_submit(pool->workers, freerds_activation_process, activation) < 0)
+	{
+		InterlockedDecrement(&activation->refCount);
+		return -1;
+	}
+
+	return 0;
+}
+
+int freerds_activation_pool_start(UINT32 workerCount)
+{
+	rdsActivationPool* pool;
+
+	pool = (rdsActivationPool*) calloc(1, sizeof(rdsActivationPool));
+
+	if (!pool)
+		return -1;
+
+	InitializeCriticalSectionAndSpinCount(&pool->lock, 4000);
+
+	g_ActivationPool = pool;
+
+	pool->workers = freerds_work_pool_new(workerCount);
+
+	if (!pool->workers)
+	{
+		freerds_activation_pool_stop();
+		return -1;
+	}
+
+	return 0;
+}
+
+void freerds_activation_pool_stop(void)
+{
+	rdsActivationPool* pool = g_ActivationPool;
+
+	if (!pool)
+		return;
+
+	freerds_work_pool_free(pool->workers);
+
+	g_ActivationPool = NULL;
+
+	DeleteCriticalSection(&pool->lock);
+
+	free(pool);
+}
+
+void freerds_activation_pool_print_stats(void)
+{
+	UINT32 count;
+	rdsActivationPool* pool = g_ActivationPool;
+
+	if (!pool)
+		return;
+
+	EnterCriticalSection(&pool->lock);
+
+	count = pool->successes + pool->failures;
+
+	printf("activation: %d succeeded, %d failed, %d ms queued, %d ms finding the session "
+			"and %d ms connecting to it on average\n",
+			(int) pool->successes, (int) pool->failures,
+			count ? (int) (pool->totalWaitTime / count) : 0,
+			count ? (int) (pool->totalSessionTime / count) : 0,
+			count ? (int) (pool->totalPipeTime / count) : 0);
+
+	LeaveCriticalSection(&pool->lock);
+}
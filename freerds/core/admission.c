@@ -0,0 +1,437 @@
+/**
+ * xrdp: A Remote Desktop Protocol server.
+ * Admission Control
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "freerds.h"
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/sysinfo.h>
+
+#include <freerds/icp_client_stubs.h>
+
+/**
+ * Every session started slows down the ones already running, so new
+ * sessions are only started while the host has room for them: a session
+ * budget, processor load, available memory and how far the event workers
+ * are behind on encoding. An activation waits for room for a bounded time
+ * before it is rejected, its client meanwhile sees the logon progress.
+ *
+ * Connections not admitted yet are bounded as well, the listener closes
+ * new sockets right away once there are too many, before any TLS or PAM
+ * work is spent on them.
+ *
+ * A limit of 0 disables the check.
+ */
+
+#define FREERDS_ADMISSION_SAMPLE_INTERVAL	500
+#define FREERDS_ADMISSION_RETRY_INTERVAL	250
+
+#define FREERDS_ADMISSION_OK			0
+#define FREERDS_ADMISSION_SESSIONS		1
+#define FREERDS_ADMISSION_CPU			2
+#define FREERDS_ADMISSION_MEMORY		3
+#define FREERDS_ADMISSION_BACKLOG		4
+
+static const char* const g_AdmissionReasons[] =
+{
+	"admitted",
+	"session budget",
+	"processor load",
+	"available memory",
+	"encode backlog"
+};
+
+struct rds_admission
+{
+	rdsAdmissionSettings settings;
+	CRITICAL_SECTION lock;
+
+	UINT32 connections;
+	UINT32 sessions;
+
+	DWORD sampleTimestamp;
+	UINT64 lastBusy;
+	UINT64 lastTotal;
+	UINT32 cpuLoad;
+	UINT32 freeMemory;
+	UINT32 backlog;
+	int reason;
+	int reportStatus;
+
+	UINT32 admitted;
+	UINT32 delayed;
+	UINT32 rejected;
+	UINT32 refused;
+	UINT64 totalDelay;
+	DWORD maxDelay;
+};
+typedef struct rds_admission rdsAdmission;
+
+static rdsAdmission* g_Admission = NULL;
+
+static int freerds_admission_read_cpu(UINT64* busy, UINT64* total)
+{
+	int count;
+	FILE* fp;
+	unsigned long long user, nice, system, idle, iowait, irq, softirq, steal;
+
+	fp = fopen("/proc/stat", "r");
+
+	if (!fp)
+		return -1;
+
+	user = nice = system = idle = iowait = irq = softirq = steal = 0;
+
+	count = fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+			&user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal);
+
+	fclose(fp);
+
+	if (count < 4)
+		return -1;
+
+	*total = user + nice + system + idle + iowait + irq + softirq + steal;
+	*busy = *total - idle - iowait;
+
+	return 0;
+}
+
+/* in MiB, or -1 if the kernel does not estimate it */
+static int freerds_admission_read_free_memory(void)
+{
+	FILE* fp;
+	char line[128];
+	unsigned long long available;
+	int freeMemory = -1;
+
+	fp = fopen("/proc/meminfo", "r");
+
+	if (!fp)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (sscanf(line, "MemAvailable: %llu kB", &available) == 1)
+		{
+			freeMemory = (int) (available / 1024);
+			break;
+		}
+	}
+
+	fclose(fp);
+
+	return freeMemory;
+}
+
+/**
+ * Refreshes the host metrics, processor load being measured between two
+ * samples. Called with the lock held.
+ */
+
+static void freerds_admission_sample(rdsAdmission* admission)
+{
+	int freeMemory;
+	UINT64 busy;
+	UINT64 total;
+	DWORD now = GetTickCount();
+
+	if (admission->sampleTimestamp && ((now - admission->sampleTimestamp) < FREERDS_ADMISSION_SAMPLE_INTERVAL))
+		return;
+
+	admission->sampleTimestamp = now;
+
+	if (freerds_admission_read_cpu(&busy, &total) == 0)
+	{
+		if (total > admission->lastTotal)
+		{
+			admission->cpuLoad = (UINT32) (((busy - admission->lastBusy) * 100) /
+					(total - admission->lastTotal));
+		}
+
+		admission->lastBusy = busy;
+		admission->lastTotal = total;
+	}
+
+	freeMemory = freerds_admission_read_free_memory();
+
+	if (freeMemory >= 0)
+		admission->freeMemory = (UINT32) freeMemory;
+
+	admission->backlog = (UINT32) freerds_event_loop_get_backlog();
+}
+
+/* called with the lock held, admitted sessions may outlive their connection */
+static UINT32 freerds_admission_get_pending(rdsAdmission* admission)
+{
+	return (admission->connections > admission->sessions) ? (admission->connections - admission->sessions) : 0;
+}
+
+/* called with the lock held */
+static int freerds_admission_check(rdsAdmission* admission)
+{
+	rdsAdmissionSettings* settings = &admission->settings;
+
+	freerds_admission_sample(admission);
+
+	if (settings->maxSessions && (admission->sessions >= settings->maxSessions))
+		return FREERDS_ADMISSION_SESSIONS;
+
+	if (settings->maxCpuLoad && (admission->cpuLoad >= settings->maxCpuLoad))
+		return FREERDS_ADMISSION_CPU;
+
+	if (settings->minFreeMemory && admission->freeMemory && (admission->freeMemory < settings->minFreeMemory))
+		return FREERDS_ADMISSION_MEMORY;
+
+	if (settings->maxBacklog && (admission->backlog >= settings->maxBacklog))
+		return FREERDS_ADMISSION_BACKLOG;
+
+	return FREERDS_ADMISSION_OK;
+}
+
+/**
+ * Called by the listener for every new socket: returns 0 if the connection
+ * may go on, -1 if too many connections are waiting for admission already.
+ */
+
+int freerds_admission_accept(void)
+{
+	int status = 0;
+	rdsAdmission* admission = g_Admission;
+
+	if (!admission)
+		return 0;
+
+	EnterCriticalSection(&admission->lock);
+
+	if (admission->settings.maxPending &&
+			(freerds_admission_get_pending(admission) >= admission->settings.maxPending))
+	{
+		admission->refused++;
+		status = -1;
+	}
+	else
+	{
+		admission->connections++;
+	}
+
+	LeaveCriticalSection(&admission->lock);
+
+	return status;
+}
+
+/**
+ * Called once an accepted connection is gone, with whether it still held
+ * the session it was admitted for.
+ */
+
+void freerds_admission_close(BOOL admitted)
+{
+	rdsAdmission* admission = g_Admission;
+
+	if (!admission)
+		return;
+
+	if (admitted)
+		freerds_admission_release();
+
+	EnterCriticalSection(&admission->lock);
+
+	if (admission->connections > 0)
+		admission->connections--;
+
+	LeaveCriticalSection(&admission->lock);
+}
+
+/**
+ * Blocks an activation worker until a new session fits, at most until the
+ * activation has waited for the configured time since it was queued.
+ * Returns 0 once admitted, the caller then owns a session it gives back
+ * with freerds_admission_release, or -1 if rejected.
+ */
+
+int freerds_admission_acquire(DWORD queueTimestamp)
+{
+	int reason;
+	DWORD delay;
+	rdsAdmission* admission = g_Admission;
+
+	if (!admission)
+		return 0;
+
+	while (1)
+	{
+		EnterCriticalSection(&admission->lock);
+
+		reason = freerds_admission_check(admission);
+		admission->reason = reason;
+		delay = GetTickCount() - queueTimestamp;
+
+		if (reason == FREERDS_ADMISSION_OK)
+		{
+			admission->sessions++;
+			admission->admitted++;
+
+			if (delay >= FREERDS_ADMISSION_RETRY_INTERVAL)
+			{
+				admission->delayed++;
+				admission->totalDelay += delay;
+
+				if (delay > admission->maxDelay)
+					admission->maxDelay = delay;
+			}
+
+			LeaveCriticalSection(&admission->lock);
+			return 0;
+		}
+
+		if (delay >= admission->settings.maxWait)
+		{
+			admission->rejected++;
+			LeaveCriticalSection(&admission->lock);
+
+			fprintf(stderr, "session rejected after %d ms: %s\n", (int) delay, g_AdmissionReasons[reason]);
+			return -1;
+		}
+
+		LeaveCriticalSection(&admission->lock);
+
+		if (WaitForSingleObject(g_get_term_event(), FREERDS_ADMISSION_RETRY_INTERVAL) == WAIT_OBJECT_0)
+			return -1;
+	}
+}
+
+void freerds_admission_release(void)
+{
+	rdsAdmission* admission = g_Admission;
+
+	if (!admission)
+		return;
+
+	EnterCriticalSection(&admission->lock);
+
+	if (admission->sessions > 0)
+		admission->sessions--;
+
+	LeaveCriticalSection(&admission->lock);
+}
+
+/**
+ * Tells the session manager how loaded the host is and whether new
+ * sessions are admitted right now.
+ */
+
+int freerds_admission_report(void)
+{
+	int status;
+	BOOL acknowledged;
+	rdsAdmission* admission = g_Admission;
+	UINT32 sessions, pending, cpuLoad, freeMemory, backlog;
+	BOOL saturated;
+
+	if (!admission)
+		return -1;
+
+	EnterCriticalSection(&admission->lock);
+
+	admission->reason = freerds_admission_check(admission);
+
+	sessions = admission->sessions;
+	pending = freerds_admission_get_pending(admission);
+	cpuLoad = admission->cpuLoad;
+	freeMemory = admission->freeMemory;
+	backlog = admission->backlog;
+	saturated = (admission->reason != FREERDS_ADMISSION_OK) ? TRUE : FALSE;
+
+	LeaveCriticalSection(&admission->lock);
+
+	status = freerds_icp_ReportLoad(sessions, pending, cpuLoad, freeMemory, backlog, saturated, &acknowledged);
+
+	/* only failing to report at all is logged, not every report after it */
+	if ((status != 0) && (admission->reportStatus == 0))
+		fprintf(stderr, "freerds_icp_ReportLoad failed %d\n", status);
+
+	admission->reportStatus = status;
+
+	return (status == 0) ? 0 : -1;
+}
+
+int freerds_admission_init(rdsAdmissionSettings* settings)
+{
+	rdsAdmission* admission;
+
+	admission = (rdsAdmission*) calloc(1, sizeof(rdsAdmission));
+
+	if (!admission)
+		return -1;
+
+	CopyMemory(&admission->settings, settings, sizeof(rdsAdmissionSettings));
+
+	InitializeCriticalSectionAndSpinCount(&admission->lock, 4000);
+
+	/* first processor load sample, measured from the next one on */
+	freerds_admission_sample(admission);
+
+	g_Admission = admission;
+
+	printf("admitting up to %d sessions, %d pending connections, below %d%% load, "
+			"%d MB free and %d connections waiting for encoding, for %d ms\n",
+			(int) settings->maxSessions, (int) settings->maxPending, (int) settings->maxCpuLoad,
+			(int) settings->minFreeMemory, (int) settings->maxBacklog, (int) settings->maxWait);
+
+	return 0;
+}
+
+void freerds_admission_uninit(void)
+{
+	rdsAdmission* admission = g_Admission;
+
+	if (!admission)
+		return;
+
+	g_Admission = NULL;
+
+	DeleteCriticalSection(&admission->lock);
+
+	free(admission);
+}
+
+void freerds_admission_print_stats(void)
+{
+	rdsAdmission* admission = g_Admission;
+
+	if (!admission)
+		return;
+
+	EnterCriticalSection(&admission->lock);
+
+	printf("admission: %d sessions, %d pending, %d admitted (%d delayed by %d ms on average, %d ms at most), "
+			"%d rejected, %d refused at accept, last %s at %d%% load, %d MB free, %d waiting for encoding\n",
+			(int) admission->sessions, (int) freerds_admission_get_pending(admission),
+			(int) admission->admitted, (int) admission->delayed,
+			admission->delayed ? (int) (admission->totalDelay / admission->delayed) : 0,
+			(int) admission->maxDelay, (int) admission->rejected, (int) admission->refused,
+			g_AdmissionReasons[admission->reason], (int) admission->cpuLoad,
+			(int) admission->freeMemory, (int) admission->backlog);
+
+	LeaveCriticalSection(&admission->lock);
+}
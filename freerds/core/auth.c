@@ -24,6 +24,9 @@
 
 #include <winpr/crt.h>
 #include <winpr/path.h>
+#include <winpr/synch.h>
+#include <winpr/sysinfo.h>
+#include <winpr/interlocked.h>
 
 #include <security/pam_appl.h>
 
@@ -149,3 +152,264 @@ long freerds_authenticate(char* username, char* password, int* errorcode)
 
 	return (long) auth_info;
 }
+
+void freerds_authenticate_free(long auth)
+{
+	struct t_auth_info* auth_info = (struct t_auth_info*) auth;
+
+	if (!auth_info)
+		return;
+
+	pam_end(auth_info->ph, PAM_SUCCESS);
+
+	SecureZeroMemory(&(auth_info->user_pass), sizeof(auth_info->user_pass));
+	free(auth_info);
+}
+
+/**
+ * PAM stacks can block for a long time on remote backends or deliberate
+ * failure delays, so connections do not authenticate themselves. Requests
+ * are queued to a work pool of their own, which bounds how many PAM
+ * conversations run at once, and the event of a request is signaled once
+ * it is done. The event loop watches it like any other connection event.
+ *
+ * A request is shared by the connection and the worker handling it, the
+ * last one to let go of it frees it.
+ */
+
+struct rds_auth_request
+{
+	LONG refCount;
+	HANDLE event;
+	char* username;
+	char* password;
+	DWORD queueTimestamp;
+	DWORD startTimestamp;
+	DWORD endTimestamp;
+	int status;
+	int errorCode;
+};
+
+struct rds_auth_pool
+{
+	rdsWorkPool* workers;
+	CRITICAL_SECTION lock;
+
+	UINT32 successes;
+	UINT32 failures;
+	UINT64 totalWaitTime;
+	UINT64 totalTime;
+	DWORD maxTime;
+};
+typedef struct rds_auth_pool rdsAuthPool;
+
+static rdsAuthPool* g_AuthPool = NULL;
+
+static void freerds_auth_request_clear_password(rdsAuthRequest* request)
+{
+	if (!request->password)
+		return;
+
+	SecureZeroMemory(request->password, strlen(request->password));
+	free(request->password);
+	request->password = NULL;
+}
+
+rdsAuthRequest* freerds_auth_request_new(const char* username, const char* password)
+{
+	rdsAuthRequest* request;
+
+	request = (rdsAuthRequest*) calloc(1, sizeof(rdsAuthRequest));
+
+	if (!request)
+		return NULL;
+
+	request->refCount = 1;
+	request->status = -1;
+	request->event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	request->username = _strdup(username ? username : "");
+	request->password = _strdup(password ? password : "");
+
+	if (!request->event || !request->username || !request->password)
+	{
+		freerds_auth_request_release(request);
+		return NULL;
+	}
+
+	return request;
+}
+
+void freerds_auth_request_release(rdsAuthRequest* request)
+{
+	if (!request)
+		return;
+
+	if (InterlockedDecrement(&request->refCount) > 0)
+		return;
+
+	freerds_auth_request_clear_password(request);
+	free(request->username);
+
+	if (request->event)
+		CloseHandle(request->event);
+
+	free(request);
+}
+
+HANDLE freerds_auth_request_get_event_handle(rdsAuthRequest* request)
+{
+	return request ? request->event : NULL;
+}
+
+BOOL freerds_auth_request_is_done(rdsAuthRequest* request)
+{
+	return (WaitForSingleObject(request->event, 0) == WAIT_OBJECT_0) ? TRUE : FALSE;
+}
+
+/**
+ * Only valid once the request is done: returns 0 if the user was
+ * authenticated, -1 otherwise with the PAM error in errorCode.
+ */
+
+int freerds_auth_request_get_status(rdsAuthRequest* request, int* errorCode, DWORD* elapsed)
+{
+	if (errorCode)
+		*errorCode = request->errorCode;
+
+	if (elapsed)
+		*elapsed = request->endTimestamp - request->queueTimestamp;
+
+	return request->status;
+}
+
+static void freerds_auth_request_process(void* context)
+{
+	long auth;
+	DWORD elapsed;
+	rdsAuthPool* pool = g_AuthPool;
+	rdsAuthRequest* request = (rdsAuthRequest*) context;
+
+	request->startTimestamp = GetTickCount();
+
+	if (*(request->username))
+	{
+		auth = freerds_authenticate(request->username, request->password, &(request->errorCode));
+		request->status = auth ? 0 : -1;
+		freerds_authenticate_free(auth);
+	}
+
+	freerds_auth_request_clear_password(request);
+
+	request->endTimestamp = GetTickCount();
+	elapsed = request->endTimestamp - request->startTimestamp;
+
+	EnterCriticalSection(&pool->lock);
+
+	if (request->status == 0)
+		pool->successes++;
+	else
+		pool->failures++;
+
+	pool->totalWaitTime += request->startTimestamp - request->queueTimestamp;
+	pool->totalTime += elapsed;
+
+	if (elapsed > pool->maxTime)
+		pool->maxTime = elapsed;
+
+	LeaveCriticalSection(&pool->lock);
+
+	SetEvent(request->event);
+
+	freerds_auth_request_release(request);
+}
+
+/**
+ * Queues a request, the caller keeps its own reference.
+ */
+
+int freerds_auth_request_submit(rdsAuthRequest* request)
+{
+	rdsAuthPool* pool = g_AuthPool;
+
+	if (!pool)
+		return -1;
+
+	request->queueTimestamp = GetTickCount();
+
+	InterlockedIncrement(&request->refCount);
+
+	if (freerds_work_pool_submit(pool->workers, freerds_auth_request_process, request) < 0)
+	{
+		InterlockedDecrement(&request->refCount);
+		return -1;
+	}
+
+	return 0;
+}
+
+int freerds_auth_pool_start(UINT32 workerCount)
+{
+	rdsAuthPool* pool;
+
+	pool = (rdsAuthPool*) calloc(1, sizeof(rdsAuthPool));
+
+	if (!pool)
+		return -1;
+
+	InitializeCriticalSectionAndSpinCount(&pool->lock, 4000);
+
+	g_AuthPool = pool;
+
+	pool->workers = freerds_work_pool_new(workerCount);
+
+	if (!pool->workers)
+	{
+		freerds_auth_pool_stop();
+		return -1;
+	}
+
+	printf("authenticating up to %d users at once\n", (int) (workerCount ? workerCount : 1));
+
+	return 0;
+}
+
+/**
+ * Requests still queued are completed before the workers exit.
+ */
+
+void freerds_auth_pool_stop(void)
+{
+	rdsAuthPool* pool = g_AuthPool;
+
+	if (!pool)
+		return;
+
+	freerds_work_pool_free(pool->workers);
+
+	g_AuthPool = NULL;
+
+	DeleteCriticalSection(&pool->lock);
+
+	free(pool);
+}
+
+void freerds_auth_pool_print_stats(void)
+{
+	UINT32 count;
+	rdsAuthPool* pool = g_AuthPool;
+
+	if (!pool)
+		return;
+
+	EnterCriticalSection(&pool->lock);
+
+	count = pool->successes + pool->failures;
+
+	printf("authentication: %d succeeded, %d failed, %d ms queued and %d ms in PAM on average, %d ms at most\n",
+			(int) pool->successes, (int) pool->failures,
+			count ? (int) (pool->totalWaitTime / count) : 0,
+			count ? (int) (pool->totalTime / count) : 0,
+			(int) pool->maxTime);
+
+	LeaveCriticalSection(&pool->lock);
+}
@@ -0,0 +1,354 @@
+/**
+ * xrdp: A Remote Desktop Protocol server.
+ * Server Certificate
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "freerds.h"
+
+#include <winpr/crt.h>
+#include <winpr/file.h>
+#include <winpr/path.h>
+#include <winpr/synch.h>
+#include <winpr/interlocked.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "makecert.h"
+
+/**
+ * The server certificate and key are generated if missing and read once,
+ * at startup and again on SIGHUP, into a pair of sealed in-memory files.
+ * Connections are handed /proc/self/fd paths to those instead of the files
+ * on disk, so a reload replaces both at once and connections still setting
+ * up keep the pair they started with. FreeRDP parses them on each TLS
+ * accept, which no longer touches the disk.
+ */
+
+struct rds_certificate
+{
+	LONG refCount;
+	int certificateFd;
+	int privateKeyFd;
+	char* CertificateFile;
+	char* PrivateKeyFile;
+};
+
+static rdsCertificate* g_Certificate = NULL;
+static CRITICAL_SECTION g_CertificateLock;
+
+static const char* makecert_argv[4] =
+{
+	"makecert",
+	"-rdp",
+	"-live",
+	"-silent"
+};
+
+static int makecert_argc = (sizeof(makecert_argv) / sizeof(char*));
+
+static int freerds_certificate_generate(char* server_file_path, char* certificate_file, char* private_key_file)
+{
+	MAKECERT_CONTEXT* context;
+
+	if (PathFileExistsA(certificate_file) && PathFileExistsA(private_key_file))
+		return 0;
+
+	printf("generating server certificate in %s\n", server_file_path);
+
+	context = makecert_context_new();
+
+	if (!context)
+		return -1;
+
+	makecert_context_process(context, makecert_argc, (char**) makecert_argv);
+
+	makecert_context_set_output_file_name(context, "server");
+
+	if (!PathFileExistsA(certificate_file))
+		makecert_context_output_certificate_file(context, server_file_path);
+
+	if (!PathFileExistsA(private_key_file))
+		makecert_context_output_private_key_file(context, server_file_path);
+
+	makecert_context_free(context);
+
+	return 0;
+}
+
+static int freerds_certificate_memfd(const char* name)
+{
+#if defined(__linux__) && defined(__NR_memfd_create)
+	/* MFD_CLOEXEC | MFD_ALLOW_SEALING */
+	return (int) syscall(__NR_memfd_create, name, 0x0003U);
+#else
+	return -1;
+#endif
+}
+
+/**
+ * Copies a file into a sealed memfd, returns its descriptor or -1.
+ */
+
+static int freerds_certificate_copy(const char* file, const char* name)
+{
+	int fd;
+	int memfd;
+	BYTE* data;
+	ssize_t status;
+	struct stat sb;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return -1;
+
+	if ((fstat(fd, &sb) < 0) || (sb.st_size <= 0))
+	{
+		close(fd);
+		return -1;
+	}
+
+	data = (BYTE*) malloc(sb.st_size);
+	memfd = freerds_certificate_memfd(name);
+
+	status = -1;
+
+	if (data && (memfd >= 0))
+	{
+		status = read(fd, data, sb.st_size);
+
+		if (status == sb.st_size)
+			status = write(memfd, data, sb.st_size);
+	}
+
+	close(fd);
+
+	if (data)
+	{
+		/* the private key should not linger on the heap */
+		SecureZeroMemory(data, sb.st_size);
+		free(data);
+	}
+
+	if (status != sb.st_size)
+	{
+		if (memfd >= 0)
+			close(memfd);
+
+		return -1;
+	}
+
+#ifdef F_ADD_SEALS
+	fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+
+	return memfd;
+}
+
+static char* freerds_certificate_fd_path(int fd)
+{
+	char path[64];
+
+	sprintf_s(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+	return _strdup(path);
+}
+
+static void freerds_certificate_free(rdsCertificate* certificate)
+{
+	if (certificate->certificateFd >= 0)
+		close(certificate->certificateFd);
+
+	if (certificate->privateKeyFd >= 0)
+		close(certificate->privateKeyFd);
+
+	free(certificate->CertificateFile);
+	free(certificate->PrivateKeyFile);
+	free(certificate);
+}
+
+static rdsCertificate* freerds_certificate_load(void)
+{
+	char* config_path;
+	char* server_file_path;
+	char* certificate_file;
+	char* private_key_file;
+	rdsCertificate* certificate;
+
+	config_path = GetKnownSubPath(KNOWN_PATH_XDG_CONFIG_HOME, "freerdp");
+
+	if (!config_path)
+		return NULL;
+
+	if (!PathFileExistsA(config_path))
+		CreateDirectoryA(config_path, 0);
+
+	server_file_path = GetCombinedPath(config_path, "server");
+
+	if (!PathFileExistsA(server_file_path))
+		CreateDirectoryA(server_file_path, 0);
+
+	certificate_file = GetCombinedPath(server_file_path, "server.crt");
+	private_key_file = GetCombinedPath(server_file_path, "server.key");
+
+	freerds_certificate_generate(server_file_path, certificate_file, private_key_file);
+
+	certificate = (rdsCertificate*) calloc(1, sizeof(rdsCertificate));
+
+	if (certificate)
+	{
+		certificate->refCount = 1;
+		certificate->certificateFd = freerds_certificate_copy(certificate_file, "freerds-server.crt");
+		certificate->privateKeyFd = freerds_certificate_copy(private_key_file, "freerds-server.key");
+
+		if ((certificate->certificateFd >= 0) && (certificate->privateKeyFd >= 0))
+		{
+			certificate->CertificateFile = freerds_certificate_fd_path(certificate->certificateFd);
+			certificate->PrivateKeyFile = freerds_certificate_fd_path(certificate->privateKeyFd);
+		}
+		else
+		{
+			/* no memfd, connections read the files on disk */
+			certificate->CertificateFile = _strdup(certificate_file);
+			certificate->PrivateKeyFile = _strdup(private_key_file);
+		}
+
+		if (!PathFileExistsA(certificate->CertificateFile) || !PathFileExistsA(certificate->PrivateKeyFile))
+		{
+			fprintf(stderr, "server certificate %s or key %s is missing\n", certificate_file, private_key_file);
+			freerds_certificate_free(certificate);
+			certificate = NULL;
+		}
+	}
+
+	free(certificate_file);
+	free(private_key_file);
+	free(server_file_path);
+	free(config_path);
+
+	return certificate;
+}
+
+int freerds_certificate_init(void)
+{
+	InitializeCriticalSectionAndSpinCount(&g_CertificateLock, 4000);
+
+	g_Certificate = freerds_certificate_load();
+
+	if (!g_Certificate)
+		return -1;
+
+	printf("using server certificate %s\n", g_Certificate->CertificateFile);
+
+	return 0;
+}
+
+void freerds_certificate_uninit(void)
+{
+	if (g_Certificate)
+		freerds_certificate_release(g_Certificate);
+
+	g_Certificate = NULL;
+
+	DeleteCriticalSection(&g_CertificateLock);
+}
+
+/**
+ * Replaces the certificate for new connections, keeping the current one
+ * if the new one cannot be loaded.
+ */
+
+int freerds_certificate_reload(void)
+{
+	rdsCertificate* certificate;
+	rdsCertificate* previous;
+
+	certificate = freerds_certificate_load();
+
+	if (!certificate)
+	{
+		fprintf(stderr, "failed to reload the server certificate, keeping the current one\n");
+		return -1;
+	}
+
+	EnterCriticalSection(&g_CertificateLock);
+	previous = g_Certificate;
+	g_Certificate = certificate;
+	LeaveCriticalSection(&g_CertificateLock);
+
+	if (previous)
+		freerds_certificate_release(previous);
+
+	printf("reloaded server certificate\n");
+
+	return 0;
+}
+
+rdsCertificate* freerds_certificate_acquire(void)
+{
+	rdsCertificate* certificate;
+
+	EnterCriticalSection(&g_CertificateLock);
+
+	certificate = g_Certificate;
+
+	if (certificate)
+		InterlockedIncrement(&certificate->refCount);
+
+	LeaveCriticalSection(&g_CertificateLock);
+
+	return certificate;
+}
+
+void freerds_certificate_release(rdsCertificate* certificate)
+{
+	if (!certificate)
+		return;
+
+	if (InterlockedDecrement(&certificate->refCount) > 0)
+		return;
+
+	freerds_certificate_free(certificate);
+}
+
+/**
+ * Points the settings of a new connection at the certificate it holds.
+ */
+
+int freerds_certificate_apply(rdsCertificate* certificate, rdpSettings* settings)
+{
+	free(settings->CertificateFile);
+	free(settings->PrivateKeyFile);
+
+	settings->CertificateFile = _strdup(certificate->CertificateFile);
+	settings->PrivateKeyFile = _strdup(certificate->PrivateKeyFile);
+
+	if (!settings->CertificateFile || !settings->PrivateKeyFile)
+		return -1;
+
+	return 0;
+}
@@ -39,6 +39,20 @@ int freerds_channels_post_connect(rdsConnection* session)
 
 			freerds_icp_IsChannelAllowed(session->id, settings->ChannelDefArray[i].Name, &allowed);
 			printf("channel %s is %s\n", settings->ChannelDefArray[i].Name, allowed ? "allowed" : "not allowed");
+
+			if (allowed && (strncmp(settings->ChannelDefArray[i].Name, "drdynvc", 7) == 0))
+			{
+				/**
+				 * The graphics pipeline is a dynamic channel carried by drdynvc,
+				 * it is opened from the connection check once drdynvc is ready.
+				 */
+				printf("Channel %s registered\n", settings->ChannelDefArray[i].Name);
+
+				if (!session->rdpgfx)
+					session->rdpgfx = freerds_rdpgfx_new(session);
+
+				continue;
+			}
 #if 0
 			if (strncmp(settings->ChannelDefArray[i].Name, "cliprdr", 7) == 0)
 			{
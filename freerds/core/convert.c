@@ -0,0 +1,242 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Color Conversion
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <winpr/crt.h>
+#include <winpr/sysinfo.h>
+
+#include "convert.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define FREERDS_CONVERT_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define FREERDS_CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+pfnFreeRDSConvertTile freerds_convert_xrgb32_to_rgb565 = freerds_convert_xrgb32_to_rgb565_generic;
+static const char* freerds_convert_name = "generic";
+
+#define XRGB32_TO_RGB565(_p) \
+	((UINT16) ((((_p) >> 8) & 0xF800) | (((_p) >> 5) & 0x07E0) | (((_p) >> 3) & 0x001F)))
+
+void freerds_convert_xrgb32_to_rgb565_generic(const BYTE* src, int srcStep,
+		BYTE* dst, int dstStep, int width, int height)
+{
+	int x, y;
+	const UINT32* pSrc;
+	UINT16* pDst;
+
+	for (y = 0; y < height; y++)
+	{
+		pSrc = (const UINT32*) &src[y * srcStep];
+		pDst = (UINT16*) &dst[y * dstStep];
+
+		for (x = 0; x < width; x++)
+			pDst[x] = XRGB32_TO_RGB565(pSrc[x]);
+	}
+}
+
+#ifdef FREERDS_CONVERT_X86
+
+/**
+ * The 565 value is built in the low word of each 32-bit lane, then sign
+ * extended so that the signed saturating pack leaves it untouched.
+ */
+
+__attribute__((target("sse2")))
+static inline __m128i freerds_convert_sse2_lanes(__m128i p)
+{
+	__m128i r, g, b;
+
+	r = _mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0xF800));
+	g = _mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x07E0));
+	b = _mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x001F));
+
+	return _mm_srai_epi32(_mm_slli_epi32(_mm_or_si128(_mm_or_si128(r, g), b), 16), 16);
+}
+
+__attribute__((target("sse2")))
+static void freerds_convert_xrgb32_to_rgb565_sse2(const BYTE* src, int srcStep,
+		BYTE* dst, int dstStep, int width, int height)
+{
+	int x, y;
+	__m128i lo, hi;
+	const UINT32* pSrc;
+	UINT16* pDst;
+
+	for (y = 0; y < height; y++)
+	{
+		pSrc = (const UINT32*) &src[y * srcStep];
+		pDst = (UINT16*) &dst[y * dstStep];
+
+		for (x = 0; x + 8 <= width; x += 8)
+		{
+			lo = freerds_convert_sse2_lanes(_mm_loadu_si128((const __m128i*) &pSrc[x]));
+			hi = freerds_convert_sse2_lanes(_mm_loadu_si128((const __m128i*) &pSrc[x + 4]));
+			_mm_storeu_si128((__m128i*) &pDst[x], _mm_packs_epi32(lo, hi));
+		}
+
+		for (; x < width; x++)
+			pDst[x] = XRGB32_TO_RGB565(pSrc[x]);
+	}
+}
+
+__attribute__((target("avx2")))
+static inline __m256i freerds_convert_avx2_lanes(__m256i p)
+{
+	__m256i r, g, b;
+
+	r = _mm256_and_si256(_mm256_srli_epi32(p, 8), _mm256_set1_epi32(0xF800));
+	g = _mm256_and_si256(_mm256_srli_epi32(p, 5), _mm256_set1_epi32(0x07E0));
+	b = _mm256_and_si256(_mm256_srli_epi32(p, 3), _mm256_set1_epi32(0x001F));
+
+	return _mm256_srai_epi32(_mm256_slli_epi32(_mm256_or_si256(_mm256_or_si256(r, g), b), 16), 16);
+}
+
+__attribute__((target("avx2")))
+static void freerds_convert_xrgb32_to_rgb565_avx2(const BYTE* src, int srcStep,
+		BYTE* dst, int dstStep, int width, int height)
+{
+	int x, y;
+	__m256i lo, hi;
+	const UINT32* pSrc;
+	UINT16* pDst;
+
+	for (y = 0; y < height; y++)
+	{
+		pSrc = (const UINT32*) &src[y * srcStep];
+		pDst = (UINT16*) &dst[y * dstStep];
+
+		for (x = 0; x + 16 <= width; x += 16)
+		{
+			lo = freerds_convert_avx2_lanes(_mm256_loadu_si256((const __m256i*) &pSrc[x]));
+			hi = freerds_convert_avx2_lanes(_mm256_loadu_si256((const __m256i*) &pSrc[x + 8]));
+
+			/* packs works per 128-bit lane, restore pixel order afterwards */
+			_mm256_storeu_si256((__m256i*) &pDst[x],
+					_mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8));
+		}
+
+		for (; x < width; x++)
+			pDst[x] = XRGB32_TO_RGB565(pSrc[x]);
+	}
+}
+
+#endif
+
+#ifdef FREERDS_CONVERT_NEON
+
+static void freerds_convert_xrgb32_to_rgb565_neon(const BYTE* src, int srcStep,
+		BYTE* dst, int dstStep, int width, int height)
+{
+	int x, y;
+	uint8x8x4_t p;
+	uint16x8_t v;
+	const UINT32* pSrc;
+	UINT16* pDst;
+
+	for (y = 0; y < height; y++)
+	{
+		pSrc = (const UINT32*) &src[y * srcStep];
+		pDst = (UINT16*) &dst[y * dstStep];
+
+		for (x = 0; x + 8 <= width; x += 8)
+		{
+			p = vld4_u8((const uint8_t*) &pSrc[x]); /* b, g, r, x planes */
+
+			v = vshll_n_u8(p.val[2], 8);
+			v = vsriq_n_u16(v, vshll_n_u8(p.val[1], 8), 5);
+			v = vsriq_n_u16(v, vshll_n_u8(p.val[0], 8), 11);
+
+			vst1q_u16(&pDst[x], v);
+		}
+
+		for (; x < width; x++)
+			pDst[x] = XRGB32_TO_RGB565(pSrc[x]);
+	}
+}
+
+#endif
+
+/**
+ * Lists the kernels usable on this processor, slowest first, so that
+ * freerds_convert_init picks the last one and benchmarks can run them all.
+ */
+
+int freerds_convert_get_kernels(const char** names, pfnFreeRDSConvertTile* kernels, int count)
+{
+	int index = 0;
+
+	if (index < count)
+	{
+		names[index] = "generic";
+		kernels[index++] = freerds_convert_xrgb32_to_rgb565_generic;
+	}
+
+#ifdef FREERDS_CONVERT_X86
+	if ((index < count) && IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE))
+	{
+		names[index] = "sse2";
+		kernels[index++] = freerds_convert_xrgb32_to_rgb565_sse2;
+	}
+
+	__builtin_cpu_init();
+
+	if ((index < count) && __builtin_cpu_supports("avx2"))
+	{
+		names[index] = "avx2";
+		kernels[index++] = freerds_convert_xrgb32_to_rgb565_avx2;
+	}
+#endif
+
+#ifdef FREERDS_CONVERT_NEON
+	if (index < count)
+	{
+		names[index] = "neon";
+		kernels[index++] = freerds_convert_xrgb32_to_rgb565_neon;
+	}
+#endif
+
+	return index;
+}
+
+void freerds_convert_init(void)
+{
+	int count;
+	const char* names[FREERDS_CONVERT_MAX_KERNELS];
+	pfnFreeRDSConvertTile kernels[FREERDS_CONVERT_MAX_KERNELS];
+
+	count = freerds_convert_get_kernels(names, kernels, FREERDS_CONVERT_MAX_KERNELS);
+
+	freerds_convert_xrgb32_to_rgb565 = kernels[count - 1];
+	freerds_convert_name = names[count - 1];
+}
+
+const char* freerds_convert_get_name(void)
+{
+	return freerds_convert_name;
+}
@@ -0,0 +1,51 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Color Conversion
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FREERDS_CORE_CONVERT_H
+#define FREERDS_CORE_CONVERT_H
+
+#include <winpr/crt.h>
+
+/**
+ * Copies a width x height block of x8r8g8b8 pixels out of src
+ * into dst as r5g6b5, truncating each channel like pixman does.
+ */
+typedef void (*pfnFreeRDSConvertTile)(const BYTE* src, int srcStep,
+		BYTE* dst, int dstStep, int width, int height);
+
+#define FREERDS_CONVERT_MAX_KERNELS	4
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern pfnFreeRDSConvertTile freerds_convert_xrgb32_to_rgb565;
+
+void freerds_convert_init(void);
+const char* freerds_convert_get_name(void);
+int freerds_convert_get_kernels(const char** names, pfnFreeRDSConvertTile* kernels, int count);
+
+void freerds_convert_xrgb32_to_rgb565_generic(const BYTE* src, int srcStep,
+		BYTE* dst, int dstStep, int width, int height);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FREERDS_CORE_CONVERT_H */
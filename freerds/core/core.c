@@ -22,6 +22,7 @@
 #endif
 
 #include <winpr/crt.h>
+#include <winpr/sysinfo.h>
 
 #include <freerdp/freerdp.h>
 #include <freerdp/listener.h>
@@ -29,9 +30,15 @@
 #include <freerdp/codec/bitmap.h>
 
 #include "core.h"
+#include "convert.h"
+#include "rfx_simd.h"
 
 #include <pixman.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
 /**
  * Custom helpers
  */
@@ -65,47 +72,190 @@ int freerds_connection_init(rdsConnection* connection, rdpSettings* settings)
 
 	connection->bytesPerPixel = 4;
 
+	/* codec contexts and encode streams are created on first use */
+
+	connection->FrameList = ListDictionary_New(TRUE);
+
+	InitializeCriticalSectionAndSpinCount(&connection->damageLock, 4000);
+	pixman_region32_init(&connection->pendingDamage);
+
+	return 0;
+}
+
+void freerds_connection_uninit(rdsConnection* connection)
+{
+	freerds_connection_release_codecs(connection);
+
+	ListDictionary_Free(connection->FrameList);
+
+	pixman_region32_fini(&connection->pendingDamage);
+	DeleteCriticalSection(&connection->damageLock);
+
+	freerds_rdpgfx_free(connection->rdpgfx);
+	connection->rdpgfx = NULL;
+}
+
+/**
+ * Lazy codec state
+ */
+
+static int freerds_connection_init_bitmap(rdsConnection* connection)
+{
+	connection->codecTimestamp = GetTickCount();
+
+	if (connection->bs)
+		return 0;
+
 	connection->bs = Stream_New(NULL, 16384);
 	connection->bts = Stream_New(NULL, 16384);
+	connection->tileBuffer = (BYTE*) malloc(64 * 64 * 2);
+
+	if (!connection->bs || !connection->bts || !connection->tileBuffer)
+		return -1;
+
+	return 0;
+}
+
+static int freerds_connection_init_rfx(rdsConnection* connection)
+{
+	rdpSettings* settings = connection->settings;
+
+	connection->codecTimestamp = GetTickCount();
+
+	if (connection->rfx_context)
+		return 0;
 
 	connection->rfx_s = Stream_New(NULL, 16384);
 	connection->rfx_context = rfx_context_new(TRUE);
 
+	if (!connection->rfx_s || !connection->rfx_context)
+		return -1;
+
 	connection->rfx_context->mode = RLGR3;
 	connection->rfx_context->width = settings->DesktopWidth;
 	connection->rfx_context->height = settings->DesktopHeight;
 
+	freerds_rfx_simd_apply(connection->rfx_context);
+
+	if (connection->bytesPerPixel == 4)
+		rfx_context_set_pixel_format(connection->rfx_context, RDP_PIXEL_FORMAT_B8G8R8A8);
+	else if (connection->bytesPerPixel == 3)
+		rfx_context_set_pixel_format(connection->rfx_context, RDP_PIXEL_FORMAT_B8G8R8);
+
+	return 0;
+}
+
+static int freerds_connection_init_nsc(rdsConnection* connection)
+{
+	connection->codecTimestamp = GetTickCount();
+
+	if (connection->nsc_context)
+		return 0;
+
 	connection->nsc_s = Stream_New(NULL, 16384);
 	connection->nsc_context = nsc_context_new();
 
+	if (!connection->nsc_s || !connection->nsc_context)
+		return -1;
+
 	if (connection->bytesPerPixel == 4)
-	{
-		rfx_context_set_pixel_format(connection->rfx_context, RDP_PIXEL_FORMAT_B8G8R8A8);
 		nsc_context_set_pixel_format(connection->nsc_context, RDP_PIXEL_FORMAT_B8G8R8A8);
-	}
 	else if (connection->bytesPerPixel == 3)
-	{
-		rfx_context_set_pixel_format(connection->rfx_context, RDP_PIXEL_FORMAT_B8G8R8);
 		nsc_context_set_pixel_format(connection->nsc_context, RDP_PIXEL_FORMAT_B8G8R8);
-	}
-
-	connection->FrameList = ListDictionary_New(TRUE);
 
 	return 0;
 }
 
-void freerds_connection_uninit(rdsConnection* connection)
+void freerds_connection_release_codecs(rdsConnection* connection)
 {
-	Stream_Free(connection->bs, TRUE);
-	Stream_Free(connection->bts, TRUE);
+	if (connection->bs)
+		Stream_Free(connection->bs, TRUE);
 
-	Stream_Free(connection->rfx_s, TRUE);
-	rfx_context_free(connection->rfx_context);
+	if (connection->bts)
+		Stream_Free(connection->bts, TRUE);
 
-	Stream_Free(connection->nsc_s, TRUE);
-	nsc_context_free(connection->nsc_context);
+	free(connection->tileBuffer);
 
-	ListDictionary_Free(connection->FrameList);
+	connection->bs = connection->bts = NULL;
+	connection->tileBuffer = NULL;
+
+	if (connection->rfx_s)
+		Stream_Free(connection->rfx_s, TRUE);
+
+	if (connection->rfx_context)
+		rfx_context_free(connection->rfx_context);
+
+	connection->rfx_s = NULL;
+	connection->rfx_context = NULL;
+
+	if (connection->nsc_s)
+		Stream_Free(connection->nsc_s, TRUE);
+
+	if (connection->nsc_context)
+		nsc_context_free(connection->nsc_context);
+
+	connection->nsc_s = NULL;
+	connection->nsc_context = NULL;
+
+	freerds_rdpgfx_release_codecs(connection->rdpgfx);
+}
+
+int freerds_connection_check_idle(rdsConnection* connection)
+{
+	size_t before;
+
+	if (!connection->bs && !connection->rfx_context && !connection->nsc_context &&
+			!freerds_rdpgfx_has_codecs(connection->rdpgfx))
+		return 0;
+
+	if ((GetTickCount() - connection->codecTimestamp) < FREERDS_CODEC_IDLE_TIMEOUT)
+		return 0;
+
+	before = freerds_connection_get_memory_usage(connection);
+
+	freerds_connection_release_codecs(connection);
+
+	printf("connection %ld: idle, released codecs (%d -> %d bytes)\n", connection->id,
+			(int) before, (int) freerds_connection_get_memory_usage(connection));
+
+	return 1;
+}
+
+/**
+ * Memory held on behalf of a connection by freerds itself: encode streams,
+ * scratch buffers, the graphics pipeline cache index and the module
+ * connector streams. Allocations internal to the codec library are not
+ * visible from here.
+ */
+
+size_t freerds_connection_get_memory_usage(rdsConnection* connection)
+{
+	size_t size = sizeof(rdsConnection);
+	rdsModuleConnector* connector = connection->connector;
+
+	if (connection->bs)
+		size += Stream_Capacity(connection->bs) + Stream_Capacity(connection->bts) + (64 * 64 * 2);
+
+	if (connection->rfx_s)
+		size += Stream_Capacity(connection->rfx_s);
+
+	if (connection->nsc_s)
+		size += Stream_Capacity(connection->nsc_s);
+
+	size += freerds_rdpgfx_get_memory_usage(connection->rdpgfx);
+
+	if (connector)
+	{
+		size += sizeof(rdsModuleConnector);
+
+		if (connector->OutboundStream)
+			size += Stream_Capacity(connector->OutboundStream);
+
+		if (connector->InboundStream)
+			size += Stream_Capacity(connector->InboundStream);
+	}
+
+	return size;
 }
 
 /**
@@ -124,6 +274,60 @@ int freerds_send_bell(rdsConnection* connection)
 	return 0;
 }
 
+static UINT32 freerds_progress_color(rdsConnection* connection, BYTE red, BYTE green, BYTE blue)
+{
+	if (connection->settings->ColorDepth == 16)
+		return ((red >> 3) << 11) | ((green >> 2) << 5) | (blue >> 3);
+
+	if (connection->settings->ColorDepth == 15)
+		return ((red >> 3) << 10) | ((green >> 3) << 5) | (blue >> 3);
+
+	return red | (green << 8) | (blue << 16);
+}
+
+/**
+ * Paints a plain background with a bar of done out of total steps, drawn
+ * with two OpaqueRect orders while the session is being set up.
+ */
+
+int freerds_send_progress(rdsConnection* connection, int done, int total)
+{
+	int width;
+	int height;
+	OPAQUE_RECT_ORDER opaqueRect;
+	rdpSettings* settings = connection->settings;
+	rdpPrimaryUpdate* primary = connection->client->update->primary;
+
+	if (!settings->OrderSupport[NEG_OPAQUE_RECT_INDEX] || (total < 1))
+		return -1;
+
+	width = settings->DesktopWidth;
+	height = settings->DesktopHeight;
+
+	freerds_orders_begin_paint(connection);
+	freerds_set_bounds_rect(connection, NULL);
+
+	opaqueRect.nLeftRect = 0;
+	opaqueRect.nTopRect = 0;
+	opaqueRect.nWidth = width;
+	opaqueRect.nHeight = height;
+	opaqueRect.color = freerds_progress_color(connection, 0x1E, 0x2A, 0x38);
+
+	IFCALL(primary->OpaqueRect, (rdpContext*) connection, &opaqueRect);
+
+	opaqueRect.nLeftRect = width / 4;
+	opaqueRect.nTopRect = (height / 2) - 2;
+	opaqueRect.nWidth = ((width / 2) * done) / total;
+	opaqueRect.nHeight = 4;
+	opaqueRect.color = freerds_progress_color(connection, 0xC8, 0xD2, 0xDC);
+
+	IFCALL(primary->OpaqueRect, (rdpContext*) connection, &opaqueRect);
+
+	freerds_orders_end_paint(connection);
+
+	return 0;
+}
+
 int freerds_send_bitmap_update(rdsConnection* connection, int bpp, RDS_MSG_PAINT_RECT* msg)
 {
 	BYTE* data;
@@ -138,8 +342,6 @@ int freerds_send_bitmap_update(rdsConnection* connection, int bpp, RDS_MSG_PAINT
 	int MaxRegionWidth;
 	int MaxRegionHeight;
 	INT32 nWidth, nHeight;
-	pixman_image_t* image;
-	pixman_image_t* fbImage;
 	BITMAP_DATA* bitmapData;
 	BITMAP_UPDATE bitmapUpdate;
 	rdpUpdate* update = connection->client->update;
@@ -182,8 +384,10 @@ int freerds_send_bitmap_update(rdsConnection* connection, int bpp, RDS_MSG_PAINT
 		return 0;
 	}
 
-	tile = (BYTE*) malloc(64 * 64 * 4);
-	fbImage = (pixman_image_t*) msg->framebuffer->image;
+	if (freerds_connection_init_bitmap(connection) < 0)
+		return -1;
+
+	tile = connection->tileBuffer;
 
 	rows = (msg->nWidth + (64 - (msg->nWidth % 64))) / 64;
 	cols = (msg->nHeight + (64 - (msg->nHeight % 64))) / 64;
@@ -232,12 +436,10 @@ int freerds_send_bitmap_update(rdsConnection* connection, int bpp, RDS_MSG_PAINT
 
 				scanline = msg->framebuffer->fbScanline;
 
-				image = pixman_image_create_bits(PIXMAN_r5g6b5, nWidth, nHeight, (uint32_t*) tile, nWidth * 2);
+				/* the framebuffer is opaque, so this is a plain copy with format conversion */
+				freerds_convert_xrgb32_to_rgb565(data, scanline, tile, nWidth * 2, nWidth, nHeight);
 
-				pixman_image_composite(PIXMAN_OP_OVER, fbImage, NULL, image,
-						bitmapData[k].destLeft, bitmapData[k].destTop, 0, 0, 0, 0, nWidth, nHeight);
-
-				lines = freerdp_bitmap_compress((char*) pixman_image_get_data(image),
+				lines = freerdp_bitmap_compress((char*) tile,
 						nWidth, nHeight, s, 16, 16384, nHeight - 1, ts, e);
 				Stream_SealLength(s);
 
@@ -254,8 +456,6 @@ int freerds_send_bitmap_update(rdsConnection* connection, int bpp, RDS_MSG_PAINT
 				bitmapData[k].cbScanWidth = nWidth * 2;
 				bitmapData[k].cbUncompressedSize = nWidth * nHeight * 2;
 
-				pixman_image_unref(image);
-
 				k++;
 			}
 		}
@@ -267,11 +467,11 @@ int freerds_send_bitmap_update(rdsConnection* connection, int bpp, RDS_MSG_PAINT
 
 	for (k = 0; k < bitmapUpdate.number; k++)
 	{
+		freerds_connection_check_cork(connection, bitmapData[k].bitmapLength);
 		free(bitmapData[k].bitmapDataStream);
 	}
 
 	free(bitmapData);
-	free(tile);
 
 	return 0;
 }
@@ -328,12 +528,88 @@ int freerds_set_system_pointer(rdsConnection* connection, RDS_MSG_SET_SYSTEM_POI
 	return 0;
 }
 
+/**
+ * The peer socket is corked from BeginPaint to EndPaint, so that the many
+ * small PDUs of a frame leave in full sized segments instead of one each.
+ * Updates outside of a frame are not held back. A frame that grows past
+ * FREERDS_CORK_MAX_BYTES or stays open for FREERDS_CORK_MAX_TIME ms is
+ * pushed out early rather than waiting for the kernel's 200 ms limit.
+ */
+
+#define FREERDS_CORK_MAX_BYTES	(128 * 1024)
+#define FREERDS_CORK_MAX_TIME	10
+
+static void freerds_connection_set_cork(rdsConnection* connection, int cork)
+{
+#ifdef TCP_CORK
+	setsockopt(connection->client->sockfd, IPPROTO_TCP, TCP_CORK, (void*) &cork, sizeof(cork));
+#endif
+}
+
+static void freerds_connection_cork(rdsConnection* connection)
+{
+	if (connection->corked)
+		return;
+
+	freerds_connection_set_cork(connection, 1);
+
+	connection->corked = TRUE;
+	connection->corkedBytes = 0;
+	connection->corkTimestamp = GetTickCount();
+}
+
+static void freerds_connection_uncork(rdsConnection* connection)
+{
+	if (!connection->corked)
+		return;
+
+	freerds_connection_set_cork(connection, 0);
+
+	connection->corked = FALSE;
+}
+
+/**
+ * Pushes out what a corked socket holds back, the socket stays corked.
+ */
+
+void freerds_connection_push(rdsConnection* connection)
+{
+	if (!connection->corked)
+		return;
+
+	freerds_connection_uncork(connection);
+	freerds_connection_cork(connection);
+}
+
+/**
+ * Accounts for length bytes written to a corked socket, pushing them out
+ * once a threshold is reached.
+ */
+
+int freerds_connection_check_cork(rdsConnection* connection, UINT32 length)
+{
+	if (!connection->corked)
+		return 0;
+
+	connection->corkedBytes += length;
+
+	if ((connection->corkedBytes < FREERDS_CORK_MAX_BYTES) &&
+			((GetTickCount() - connection->corkTimestamp) < FREERDS_CORK_MAX_TIME))
+		return 0;
+
+	freerds_connection_push(connection);
+
+	return 1;
+}
+
 int freerds_orders_begin_paint(rdsConnection* connection)
 {
 	rdpUpdate* update = ((rdpContext*) connection)->update;
 
 	//printf("%s\n", __FUNCTION__);
 
+	freerds_connection_cork(connection);
+
 	update->BeginPaint((rdpContext*) connection);
 
 	return 0;
@@ -347,6 +623,8 @@ int freerds_orders_end_paint(rdsConnection* connection)
 
 	update->EndPaint((rdpContext*) connection);
 
+	freerds_connection_uncork(connection);
+
 	return 0;
 }
 
@@ -600,6 +878,9 @@ int freerds_orders_send_bitmap(rdsConnection* connection,
 	cache_bitmap.cacheIndex = cache_idx;
 	cache_bitmap.compressed = TRUE;
 
+	if (freerds_connection_init_bitmap(connection) < 0)
+		return -1;
+
 	s = connection->bs;
 	ts = connection->bts;
 
@@ -725,6 +1006,9 @@ int freerds_orders_send_bitmap2(rdsConnection* connection,
 	cache_bitmap_v2.compressed = TRUE;
 	cache_bitmap_v2.flags = 0;
 
+	if (freerds_connection_init_bitmap(connection) < 0)
+		return -1;
+
 	s = connection->bs;
 	ts = connection->bts;
 
@@ -863,6 +1147,9 @@ int freerds_send_surface_bits(rdsConnection* connection, int bpp, RDS_MSG_PAINT_
 		RFX_RECT rect;
 		RFX_MESSAGE* messages;
 
+		if (freerds_connection_init_rfx(connection) < 0)
+			return -1;
+
 		s = connection->rfx_s;
 
 		rect.x = msg->nLeftRect;
@@ -895,6 +1182,8 @@ int freerds_send_surface_bits(rdsConnection* connection, int bpp, RDS_MSG_PAINT_
 			cmd.bitmapData = Stream_Buffer(s);
 
 			IFCALL(update->SurfaceBits, update->context, &cmd);
+
+			freerds_connection_check_cork(connection, cmd.bitmapDataLength);
 		}
 
 		free(messages);
@@ -905,6 +1194,9 @@ int freerds_send_surface_bits(rdsConnection* connection, int bpp, RDS_MSG_PAINT_
 	{
 		NSC_MESSAGE* messages;
 
+		if (freerds_connection_init_nsc(connection) < 0)
+			return -1;
+
 		s = connection->nsc_s;
 
 		messages = nsc_encode_messages(connection->nsc_context, data,
@@ -932,6 +1224,8 @@ int freerds_send_surface_bits(rdsConnection* connection, int bpp, RDS_MSG_PAINT_
 			cmd.bitmapData = Stream_Buffer(s);
 
 			IFCALL(update->SurfaceBits, update->context, &cmd);
+
+			freerds_connection_check_cork(connection, cmd.bitmapDataLength);
 		}
 
 		free(messages);
@@ -37,6 +37,7 @@
 #include <freerds/freerds.h>
 
 #include "freerds.h"
+#include "rdpgfx.h"
 
 struct xrdp_brush
 {
@@ -47,6 +48,8 @@ struct xrdp_brush
 };
 typedef struct xrdp_brush xrdpBrush;
 
+#define FREERDS_CODEC_IDLE_TIMEOUT	60000
+
 struct RDS_RECT
 {
 	int left;
@@ -62,16 +65,29 @@ struct rds_connection
 
 	long id;
 	rdsModuleConnector* connector;
-	HANDLE Thread;
+	BOOL started;
 	HANDLE TermEvent;
+	rdsEventSource* eventSource;
+	rdsCertificate* certificate;
+	rdsAuthRequest* authRequest;
+	BOOL authenticated;
+	rdsActivation* activation;
+	int activationProgress;
+	BOOL admitted;
+
+	DWORD acceptTimestamp;
+	DWORD startTimestamp;
+	UINT64 workerTime;
 	freerdp_peer* client;
 	rdpSettings* settings;
 
 	BOOL codecMode;
 	int bytesPerPixel;
+	DWORD codecTimestamp;
 
 	wStream* bs;
 	wStream* bts;
+	BYTE* tileBuffer;
 
 	wStream* rfx_s;
 	RFX_CONTEXT* rfx_context;
@@ -82,6 +98,19 @@ struct rds_connection
 	UINT32 frameId;
 	wListDictionary* FrameList;
 
+	BOOL clipEnabled;
+	xrdpRect clipRect;
+
+	BOOL corked;
+	UINT32 corkedBytes;
+	DWORD corkTimestamp;
+
+	BOOL suppressOutput;
+	CRITICAL_SECTION damageLock;
+	pixman_region32_t pendingDamage;
+
+	rdsGfxContext* rdpgfx;
+
 	WTSVirtualChannelManager* vcm;
 	CliprdrServerContext* cliprdr;
 	RdpdrServerContext* rdpdr;
@@ -96,10 +125,18 @@ extern "C" {
 FREERDP_API int freerds_connection_init(rdsConnection* connection, rdpSettings* settings);
 FREERDP_API void freerds_connection_uninit(rdsConnection* connection);
 
+FREERDP_API void freerds_connection_release_codecs(rdsConnection* connection);
+FREERDP_API int freerds_connection_check_idle(rdsConnection* connection);
+FREERDP_API int freerds_connection_check_cork(rdsConnection* connection, UINT32 length);
+FREERDP_API void freerds_connection_push(rdsConnection* connection);
+FREERDP_API size_t freerds_connection_get_memory_usage(rdsConnection* connection);
+
 FREERDP_API int freerds_send_palette(rdsConnection* connection, int* palette);
 
 FREERDP_API int freerds_send_bell(rdsConnection* connection);
 
+FREERDP_API int freerds_send_progress(rdsConnection* connection, int done, int total);
+
 FREERDP_API int freerds_send_bitmap_update(rdsConnection* connection, int bpp, RDS_MSG_PAINT_RECT* msg);
 
 FREERDP_API int freerds_set_pointer(rdsConnection* connection, RDS_MSG_SET_POINTER* msg);
@@ -0,0 +1,1065 @@
+/**
+ * xrdp: A Remote Desktop Protocol server.
+ * Connection Event Loop
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "freerds.h"
+
+#include <winpr/crt.h>
+#include <winpr/pipe.h>
+#include <winpr/synch.h>
+#include <winpr/thread.h>
+#include <winpr/collections.h>
+#include <winpr/interlocked.h>
+
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+/**
+ * Connections are driven by a fixed set of I/O threads, each waiting on
+ * many connections with epoll, and a pool of workers doing the rest.
+ *
+ * Processors are split into shards of a few, each with one I/O thread, its
+ * own workers and its own listening socket, all pinned to those processors.
+ * A connection stays on the shard that accepted it.
+ *
+ * An I/O thread does what the per-connection module thread used to do:
+ * it reads the module pipe and packs server messages on a timer. Readiness
+ * of anything else, the peer socket, channels, the queue of packed
+ * messages, makes the connection runnable and it is handed to a worker,
+ * which checks it like the per-connection thread used to, encoding
+ * included. A connection is never checked by two workers at once, its
+ * descriptors are one-shot and only rearmed once a worker is done.
+ *
+ * Messages to the module are written without waiting, what the module has
+ * no room for yet is kept by the connector. A worker leaving some behind
+ * arms a retry timer, the next check writes them.
+ */
+
+#define FREERDS_WATCH_CLIENT		0
+#define FREERDS_WATCH_CHANNEL		1
+#define FREERDS_WATCH_TERM		2
+#define FREERDS_WATCH_GFX		3
+#define FREERDS_WATCH_QUEUE		4
+#define FREERDS_WATCH_IDLE		5
+#define FREERDS_WATCH_PIPE		6
+#define FREERDS_WATCH_PACK		7
+#define FREERDS_WATCH_AUTH		8
+#define FREERDS_WATCH_ACTIVATION	9
+#define FREERDS_WATCH_RETRY		10
+#define FREERDS_WATCH_COUNT		11
+
+/* owned by the shard itself rather than a connection */
+#define FREERDS_WATCH_WAKE		16
+#define FREERDS_WATCH_GLOBAL_TERM	17
+#define FREERDS_WATCH_LISTEN		18
+
+#define FREERDS_EVENT_LOOP_BATCH	64
+#define FREERDS_EVENT_SHARD_CPUS	4
+
+#define FREERDS_OUTBOUND_RETRY_INTERVAL	4
+
+typedef struct rds_event_shard rdsEventShard;
+
+struct rds_event_watch
+{
+	int fd;
+	int type;
+	rdsEventSource* source;
+	rdsEventShard* shard;
+};
+typedef struct rds_event_watch rdsEventWatch;
+
+struct rds_event_source
+{
+	rdsConnection* connection;
+	rdsEventShard* shard;
+	rdsEventWatch watches[FREERDS_WATCH_COUNT];
+
+	int fps;
+	int idleTimerFd;
+	int packTimerFd;
+	int retryTimerFd;
+
+	LONG pending;
+	LONG refCount;
+	BOOL closing;
+
+	rdsEventSource* prev;
+	rdsEventSource* next;
+	rdsEventSource* nextClosed;
+	rdsEventSource* nextResumed;
+};
+
+struct rds_event_shard
+{
+	int index;
+	int epollFd;
+	HANDLE ioThread;
+	BOOL terminating;
+	cpu_set_t cpus;
+
+	rdsEventWatch wake;
+	rdsEventWatch globalTerm;
+	rdsEventWatch listen;
+
+	UINT32 workerCount;
+	HANDLE* workers;
+	wQueue* runnable;
+
+	CRITICAL_SECTION lock;
+	rdsEventSource* sources;
+	UINT32 sourceCount;
+	rdsEventSource* closed;
+	rdsEventSource* resumed;
+};
+
+struct rds_event_loop
+{
+	UINT32 shardCount;
+	rdsEventShard* shards;
+	LONG nextShard;
+	HANDLE StopEvent;
+};
+typedef struct rds_event_loop rdsEventLoop;
+
+static rdsEventLoop* g_EventLoop = NULL;
+
+static int freerds_timer_fd_new(void)
+{
+	return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+static int freerds_timer_fd_set(int fd, UINT32 interval)
+{
+	struct itimerspec spec;
+
+	spec.it_interval.tv_sec = interval / 1000;
+	spec.it_interval.tv_nsec = (interval % 1000) * 1000000;
+
+	/* a zero value would disarm it, the first expiry is right away */
+	spec.it_value.tv_sec = 0;
+	spec.it_value.tv_nsec = 1;
+
+	return timerfd_settime(fd, 0, &spec, NULL);
+}
+
+/* single expiry after delay, zero disarms it */
+static int freerds_timer_fd_once(int fd, UINT32 delay)
+{
+	struct itimerspec spec;
+
+	ZeroMemory(&spec, sizeof(spec));
+
+	spec.it_value.tv_sec = delay / 1000;
+	spec.it_value.tv_nsec = (delay % 1000) * 1000000;
+
+	return timerfd_settime(fd, 0, &spec, NULL);
+}
+
+static void freerds_fd_drain(int fd)
+{
+	UINT64 value;
+
+	while (read(fd, &value, sizeof(value)) > 0);
+}
+
+static void freerds_event_shard_pin(rdsEventShard* shard)
+{
+	/* only a matter of locality, running anywhere is fine too */
+	sched_setaffinity(0, sizeof(cpu_set_t), &shard->cpus);
+}
+
+/**
+ * Points a watch at fd, which may be the descriptor it already has. One-shot
+ * watches are rearmed either way.
+ */
+
+static void freerds_event_watch_set(rdsEventWatch* watch, int fd, BOOL oneShot)
+{
+	int epollFd;
+	struct epoll_event event;
+
+	epollFd = watch->shard->epollFd;
+
+	ZeroMemory(&event, sizeof(event));
+	event.events = EPOLLIN | (oneShot ? EPOLLONESHOT : 0);
+	event.data.ptr = watch;
+
+	if ((fd >= 0) && (watch->fd == fd))
+	{
+		if (!oneShot)
+			return;
+
+		if (epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event) == 0)
+			return;
+
+		/* the descriptor was closed and its number reused since */
+		if (errno != ENOENT)
+			return;
+
+		watch->fd = -1;
+	}
+
+	if (watch->fd >= 0)
+	{
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, watch->fd, &event);
+		watch->fd = -1;
+	}
+
+	if (fd < 0)
+		return;
+
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+	{
+		fprintf(stderr, "failed to watch descriptor %d: %s\n", fd, strerror(errno));
+		return;
+	}
+
+	watch->fd = fd;
+}
+
+static int freerds_event_handle_fd(HANDLE handle)
+{
+	return handle ? GetEventFileDescriptor(handle) : -1;
+}
+
+/**
+ * Called by the worker that checked the connection, with whatever the
+ * check changed (channels opened, graphics pipeline, module connected).
+ */
+
+static void freerds_event_source_rearm(rdsEventSource* source)
+{
+	int queueFd;
+	freerdp_peer* client;
+	rdsConnection* connection;
+	rdsModuleConnector* connector;
+
+	connection = source->connection;
+	client = connection->client;
+	connector = connection->connector;
+
+	queueFd = -1;
+
+	if (client->activated && connector && connector->ServerQueue)
+		queueFd = freerds_event_handle_fd(connector->ServerQueue->event);
+
+	freerds_event_watch_set(&source->watches[FREERDS_WATCH_CLIENT],
+			freerds_event_handle_fd(client->GetEventHandle(client)), TRUE);
+	freerds_event_watch_set(&source->watches[FREERDS_WATCH_CHANNEL],
+			freerds_event_handle_fd(WTSVirtualChannelManagerGetEventHandle(connection->vcm)), TRUE);
+	freerds_event_watch_set(&source->watches[FREERDS_WATCH_TERM],
+			freerds_event_handle_fd(connection->TermEvent), TRUE);
+	freerds_event_watch_set(&source->watches[FREERDS_WATCH_GFX],
+			freerds_event_handle_fd(freerds_rdpgfx_get_event_handle(connection->rdpgfx)), TRUE);
+	freerds_event_watch_set(&source->watches[FREERDS_WATCH_QUEUE], queueFd, TRUE);
+	freerds_event_watch_set(&source->watches[FREERDS_WATCH_IDLE], source->idleTimerFd, TRUE);
+	freerds_event_watch_set(&source->watches[FREERDS_WATCH_AUTH],
+			freerds_event_handle_fd(freerds_auth_request_get_event_handle(connection->authRequest)), TRUE);
+	freerds_event_watch_set(&source->watches[FREERDS_WATCH_ACTIVATION],
+			freerds_event_handle_fd(freerds_activation_get_event_handle(connection->activation)), TRUE);
+
+	/* the module is behind, try again shortly rather than wait for it */
+	freerds_timer_fd_once(source->retryTimerFd, (connector && freerds_connector_outbound_pending(connector)) ?
+			FREERDS_OUTBOUND_RETRY_INTERVAL : 0);
+	freerds_event_watch_set(&source->watches[FREERDS_WATCH_RETRY], source->retryTimerFd, TRUE);
+}
+
+static void freerds_event_source_unwatch(rdsEventSource* source)
+{
+	int index;
+
+	for (index = 0; index < FREERDS_WATCH_COUNT; index++)
+		freerds_event_watch_set(&source->watches[index], -1, FALSE);
+}
+
+static void freerds_event_source_release(rdsEventSource* source)
+{
+	if (InterlockedDecrement(&source->refCount) > 0)
+		return;
+
+	freerds_connection_delete(source->connection);
+
+	if (source->idleTimerFd >= 0)
+		close(source->idleTimerFd);
+
+	if (source->packTimerFd >= 0)
+		close(source->packTimerFd);
+
+	if (source->retryTimerFd >= 0)
+		close(source->retryTimerFd);
+
+	free(source);
+}
+
+/**
+ * Makes the connection runnable, unless it already is: the worker that has
+ * it checks it once more before letting go.
+ */
+
+static void freerds_event_source_schedule(rdsEventSource* source)
+{
+	if (InterlockedIncrement(&source->pending) != 1)
+		return;
+
+	InterlockedIncrement(&source->refCount);
+	Queue_Enqueue(source->shard->runnable, source);
+}
+
+static void freerds_event_source_close(rdsEventSource* source)
+{
+	UINT64 value = 1;
+	rdsEventShard* shard = source->shard;
+
+	source->closing = TRUE;
+
+	EnterCriticalSection(&shard->lock);
+	source->nextClosed = shard->closed;
+	shard->closed = source;
+	LeaveCriticalSection(&shard->lock);
+
+	write(shard->wake.fd, &value, sizeof(value));
+}
+
+/* processor time of the calling thread, in microseconds */
+static UINT64 freerds_thread_cpu_time(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+		return 0;
+
+	return (((UINT64) ts.tv_sec) * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/**
+ * Workers are shared by all connections, the processor time a worker
+ * spends on a connection, encoding mostly, is charged to it instead.
+ */
+
+static void freerds_event_source_run(rdsEventSource* source)
+{
+	int status;
+	LONG pending;
+	UINT64 startTime;
+
+	do
+	{
+		pending = source->pending;
+
+		if (source->closing)
+			continue;
+
+		startTime = freerds_thread_cpu_time();
+		status = freerds_connection_check(source->connection);
+
+		/* before rearming, another worker may have the connection right after */
+		source->connection->workerTime += freerds_thread_cpu_time() - startTime;
+
+		if (status < 0)
+			freerds_event_source_close(source);
+		else
+			freerds_event_source_rearm(source);
+	}
+	while (InterlockedCompareExchange(&source->pending, 0, pending) != pending);
+
+	freerds_event_source_release(source);
+}
+
+/**
+ * Module side, on the I/O thread
+ */
+
+static void freerds_event_source_unwatch_module(rdsEventSource* source)
+{
+	freerds_event_watch_set(&source->watches[FREERDS_WATCH_PIPE], -1, FALSE);
+	freerds_event_watch_set(&source->watches[FREERDS_WATCH_PACK], -1, FALSE);
+}
+
+static int freerds_event_source_watch_module(rdsEventSource* source)
+{
+	rdsModuleConnector* connector = source->connection->connector;
+
+	freerds_event_watch_set(&source->watches[FREERDS_WATCH_PACK], source->packTimerFd, FALSE);
+	freerds_event_watch_set(&source->watches[FREERDS_WATCH_PIPE],
+			GetNamePipeFileDescriptor(connector->hClientPipe), FALSE);
+
+	if (source->watches[FREERDS_WATCH_PIPE].fd < 0)
+	{
+		freerds_event_source_unwatch_module(source);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void freerds_event_source_receive(rdsEventSource* source)
+{
+	if (freerds_transport_receive(source->connection->connector) < 0)
+	{
+		fprintf(stderr, "connection %ld: module connection lost\n", source->connection->id);
+		freerds_event_source_unwatch_module(source);
+	}
+}
+
+static void freerds_event_source_pack(rdsEventSource* source)
+{
+	rdsModuleConnector* connector = source->connection->connector;
+
+	freerds_fd_drain(source->packTimerFd);
+
+	/**
+	 * The worker is behind: neither read the module nor pack until it has
+	 * drained its queue, the module is held back by the pipe meanwhile.
+	 */
+	if (freerds_message_server_queue_pack(connector) > 0)
+	{
+		freerds_event_source_unwatch_module(source);
+		return;
+	}
+
+	if (connector->fps != source->fps)
+	{
+		source->fps = connector->fps;
+		freerds_timer_fd_set(source->packTimerFd, 1000 / source->fps);
+	}
+}
+
+/**
+ * I/O threads
+ */
+
+static void freerds_event_shard_terminate(rdsEventShard* shard)
+{
+	rdsEventSource* source;
+
+	shard->terminating = TRUE;
+
+	/* the listener closes the socket, no connections are accepted meanwhile */
+	freerds_event_watch_set(&shard->listen, -1, FALSE);
+
+	EnterCriticalSection(&shard->lock);
+
+	for (source = shard->sources; source; source = source->next)
+		freerds_event_source_schedule(source);
+
+	LeaveCriticalSection(&shard->lock);
+}
+
+/**
+ * Connectors resumed by their worker are read and packed again, starting
+ * with what they still had listed. New connectors come through here too.
+ */
+
+static void freerds_event_shard_resume(rdsEventShard* shard)
+{
+	rdsEventSource* source;
+	rdsEventSource* resumed;
+
+	EnterCriticalSection(&shard->lock);
+	resumed = shard->resumed;
+	shard->resumed = NULL;
+	LeaveCriticalSection(&shard->lock);
+
+	while (resumed)
+	{
+		source = resumed;
+		resumed = source->nextResumed;
+
+		if (!source->closing && source->connection->connector &&
+				(freerds_event_source_watch_module(source) == 0))
+			freerds_event_source_pack(source);
+
+		freerds_event_source_release(source);
+	}
+}
+
+/**
+ * Run after each batch of events, none of which may still refer to a
+ * connection once its descriptors are gone and its reference dropped.
+ */
+
+static void freerds_event_shard_reap(rdsEventShard* shard)
+{
+	rdsEventSource* source;
+	rdsEventSource* closed;
+
+	EnterCriticalSection(&shard->lock);
+	closed = shard->closed;
+	shard->closed = NULL;
+	LeaveCriticalSection(&shard->lock);
+
+	while (closed)
+	{
+		source = closed;
+		closed = source->nextClosed;
+
+		freerds_event_source_unwatch(source);
+
+		EnterCriticalSection(&shard->lock);
+
+		if (source->prev)
+			source->prev->next = source->next;
+		else
+			shard->sources = source->next;
+
+		if (source->next)
+			source->next->prev = source->prev;
+
+		shard->sourceCount--;
+
+		LeaveCriticalSection(&shard->lock);
+
+		freerds_event_source_release(source);
+	}
+}
+
+static void freerds_event_shard_dispatch(rdsEventShard* shard, rdsEventWatch* watch)
+{
+	rdsEventSource* source = watch->source;
+
+	switch (watch->type)
+	{
+		case FREERDS_WATCH_WAKE:
+			freerds_fd_drain(watch->fd);
+			break;
+
+		case FREERDS_WATCH_GLOBAL_TERM:
+			freerds_event_shard_terminate(shard);
+			break;
+
+		case FREERDS_WATCH_LISTEN:
+			if (!shard->terminating)
+				freerds_listener_accept(watch->fd, shard->index);
+			break;
+
+		case FREERDS_WATCH_PIPE:
+			if (!source->closing)
+				freerds_event_source_receive(source);
+			break;
+
+		case FREERDS_WATCH_PACK:
+			if (!source->closing)
+				freerds_event_source_pack(source);
+			break;
+
+		case FREERDS_WATCH_IDLE:
+		case FREERDS_WATCH_RETRY:
+			freerds_fd_drain(watch->fd);
+			freerds_event_source_schedule(source);
+			break;
+
+		default:
+			freerds_event_source_schedule(source);
+			break;
+	}
+}
+
+static void* freerds_event_shard_main(void* arg)
+{
+	int index;
+	int status;
+	UINT32 sourceCount;
+	rdsEventShard* shard = (rdsEventShard*) arg;
+	struct epoll_event events[FREERDS_EVENT_LOOP_BATCH];
+
+	freerds_event_shard_pin(shard);
+
+	while (1)
+	{
+		EnterCriticalSection(&shard->lock);
+		sourceCount = shard->sourceCount;
+		LeaveCriticalSection(&shard->lock);
+
+		if (shard->terminating && !sourceCount)
+			break;
+
+		status = epoll_wait(shard->epollFd, events, FREERDS_EVENT_LOOP_BATCH, -1);
+
+		if (status < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			fprintf(stderr, "epoll_wait failure: %s\n", strerror(errno));
+			break;
+		}
+
+		for (index = 0; index < status; index++)
+			freerds_event_shard_dispatch(shard, (rdsEventWatch*) events[index].data.ptr);
+
+		freerds_event_shard_resume(shard);
+		freerds_event_shard_reap(shard);
+	}
+
+	return NULL;
+}
+
+/**
+ * Workers
+ */
+
+static void* freerds_event_worker_main(void* arg)
+{
+	HANDLE events[2];
+	rdsEventSource* source;
+	rdsEventShard* shard = (rdsEventShard*) arg;
+
+	freerds_event_shard_pin(shard);
+
+	events[0] = Queue_Event(shard->runnable);
+	events[1] = g_EventLoop->StopEvent;
+
+	while (1)
+	{
+		WaitForMultipleObjects(2, events, FALSE, INFINITE);
+
+		source = (rdsEventSource*) Queue_Dequeue(shard->runnable);
+
+		if (source)
+		{
+			freerds_event_source_run(source);
+			continue;
+		}
+
+		if (WaitForSingleObject(g_EventLoop->StopEvent, 0) == WAIT_OBJECT_0)
+			break;
+	}
+
+	return NULL;
+}
+
+/**
+ * Shards
+ */
+
+static void freerds_event_shard_watch_init(rdsEventShard* shard, rdsEventWatch* watch, int type)
+{
+	watch->fd = -1;
+	watch->type = type;
+	watch->source = NULL;
+	watch->shard = shard;
+}
+
+static int freerds_event_shard_init(rdsEventShard* shard, int index, cpu_set_t* cpus, UINT32 workerCount)
+{
+	UINT32 worker;
+
+	ZeroMemory(shard, sizeof(rdsEventShard));
+
+	shard->index = index;
+	shard->epollFd = -1;
+	CopyMemory(&shard->cpus, cpus, sizeof(cpu_set_t));
+
+	InitializeCriticalSectionAndSpinCount(&shard->lock, 4000);
+
+	freerds_event_shard_watch_init(shard, &shard->wake, FREERDS_WATCH_WAKE);
+	freerds_event_shard_watch_init(shard, &shard->globalTerm, FREERDS_WATCH_GLOBAL_TERM);
+	freerds_event_shard_watch_init(shard, &shard->listen, FREERDS_WATCH_LISTEN);
+
+	shard->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	shard->runnable = Queue_New(TRUE, -1, -1);
+	shard->workers = (HANDLE*) calloc(workerCount, sizeof(HANDLE));
+
+	if ((shard->epollFd < 0) || !shard->runnable || !shard->workers)
+		return -1;
+
+	freerds_event_watch_set(&shard->wake, eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), FALSE);
+	freerds_event_watch_set(&shard->globalTerm, freerds_event_handle_fd(g_get_term_event()), TRUE);
+
+	if ((shard->wake.fd < 0) || (shard->globalTerm.fd < 0))
+		return -1;
+
+	for (worker = 0; worker < workerCount; worker++)
+	{
+		shard->workers[worker] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) freerds_event_worker_main,
+				(void*) shard, 0, NULL);
+
+		if (!shard->workers[worker])
+			return -1;
+
+		shard->workerCount++;
+	}
+
+	shard->ioThread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) freerds_event_shard_main,
+			(void*) shard, 0, NULL);
+
+	if (!shard->ioThread)
+		return -1;
+
+	return 0;
+}
+
+static void freerds_event_shard_join(rdsEventShard* shard)
+{
+	if (!shard->ioThread)
+		return;
+
+	WaitForSingleObject(shard->ioThread, INFINITE);
+	CloseHandle(shard->ioThread);
+	shard->ioThread = NULL;
+}
+
+/**
+ * Called once the stop event is set, the workers finish what is queued.
+ */
+
+static void freerds_event_shard_uninit(rdsEventShard* shard)
+{
+	UINT32 worker;
+
+	for (worker = 0; worker < shard->workerCount; worker++)
+	{
+		WaitForSingleObject(shard->workers[worker], INFINITE);
+		CloseHandle(shard->workers[worker]);
+	}
+
+	free(shard->workers);
+
+	if (shard->runnable)
+		Queue_Free(shard->runnable);
+
+	if (shard->wake.fd >= 0)
+		close(shard->wake.fd);
+
+	if (shard->epollFd >= 0)
+		close(shard->epollFd);
+
+	DeleteCriticalSection(&shard->lock);
+}
+
+/**
+ * Event Loop
+ */
+
+static int freerds_event_loop_get_cpus(int* cpus)
+{
+	int cpu;
+	int count;
+	cpu_set_t allowed;
+
+	count = 0;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+	{
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		{
+			if (CPU_ISSET(cpu, &allowed))
+				cpus[count++] = cpu;
+		}
+	}
+
+	if (count > 0)
+		return count;
+
+	count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (count < 1)
+		count = 1;
+
+	if (count > CPU_SETSIZE)
+		count = CPU_SETSIZE;
+
+	for (cpu = 0; cpu < count; cpu++)
+		cpus[cpu] = cpu;
+
+	return count;
+}
+
+int freerds_event_loop_start(void)
+{
+	int cpu;
+	int first;
+	int last;
+	int cpuCount;
+	UINT32 index;
+	cpu_set_t shardCpus;
+	rdsEventLoop* loop;
+	int cpus[CPU_SETSIZE];
+
+	loop = (rdsEventLoop*) calloc(1, sizeof(rdsEventLoop));
+
+	if (!loop)
+		return -1;
+
+	g_EventLoop = loop;
+
+	cpuCount = freerds_event_loop_get_cpus(cpus);
+
+	/* reading pipes and packing is little work next to encoding */
+	loop->shardCount = (cpuCount + FREERDS_EVENT_SHARD_CPUS - 1) / FREERDS_EVENT_SHARD_CPUS;
+
+	loop->StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	loop->shards = (rdsEventShard*) calloc(loop->shardCount, sizeof(rdsEventShard));
+
+	if (!loop->StopEvent || !loop->shards)
+	{
+		freerds_event_loop_stop();
+		return -1;
+	}
+
+	for (index = 0; index < loop->shardCount; index++)
+	{
+		first = (index * cpuCount) / loop->shardCount;
+		last = ((index + 1) * cpuCount) / loop->shardCount;
+
+		CPU_ZERO(&shardCpus);
+
+		for (cpu = first; cpu < last; cpu++)
+			CPU_SET(cpus[cpu], &shardCpus);
+
+		if (freerds_event_shard_init(&loop->shards[index], index, &shardCpus, last - first) < 0)
+		{
+			fprintf(stderr, "failed to start event shard %d\n", (int) index);
+			loop->shardCount = index + 1;
+			g_set_term(1);
+			freerds_event_loop_stop();
+			return -1;
+		}
+	}
+
+	printf("using %d event shards on %d processors\n", (int) loop->shardCount, cpuCount);
+
+	return 0;
+}
+
+/**
+ * Waits for the I/O threads to be done with their connections, which
+ * they are only once the global termination event has been set.
+ */
+
+void freerds_event_loop_stop(void)
+{
+	UINT32 index;
+	rdsEventLoop* loop = g_EventLoop;
+
+	if (!loop)
+		return;
+
+	if (loop->shards)
+	{
+		for (index = 0; index < loop->shardCount; index++)
+			freerds_event_shard_join(&loop->shards[index]);
+
+		SetEvent(loop->StopEvent);
+
+		for (index = 0; index < loop->shardCount; index++)
+			freerds_event_shard_uninit(&loop->shards[index]);
+	}
+
+	if (loop->StopEvent)
+		CloseHandle(loop->StopEvent);
+
+	free(loop->shards);
+	free(loop);
+
+	g_EventLoop = NULL;
+}
+
+int freerds_event_loop_get_shard_count(void)
+{
+	return g_EventLoop ? (int) g_EventLoop->shardCount : 0;
+}
+
+/**
+ * Connections runnable but still waiting for a worker, on all shards.
+ * Encoding is done by the workers, this is how far they are behind.
+ */
+
+int freerds_event_loop_get_backlog(void)
+{
+	UINT32 index;
+	int backlog = 0;
+
+	if (!g_EventLoop)
+		return 0;
+
+	for (index = 0; index < g_EventLoop->shardCount; index++)
+		backlog += Queue_Count(g_EventLoop->shards[index].runnable);
+
+	return backlog;
+}
+
+/**
+ * Connections accepted on the socket are served by the shard, which does
+ * not take ownership of it.
+ */
+
+int freerds_event_loop_listen(int shard, int fd)
+{
+	rdsEventWatch* watch;
+
+	if (!g_EventLoop || (shard < 0) || (shard >= (int) g_EventLoop->shardCount))
+		return -1;
+
+	watch = &g_EventLoop->shards[shard].listen;
+
+	freerds_event_watch_set(watch, fd, FALSE);
+
+	return (watch->fd == fd) ? 0 : -1;
+}
+
+/**
+ * Hands a new connection over to a shard, any of them for -1. It is first
+ * checked right away and deleted by the event loop once that fails.
+ */
+
+int freerds_event_loop_add(rdsConnection* connection, int shardIndex)
+{
+	int index;
+	rdsEventShard* shard;
+	rdsEventSource* source;
+
+	if (!g_EventLoop)
+		return -1;
+
+	if ((shardIndex < 0) || (shardIndex >= (int) g_EventLoop->shardCount))
+		shardIndex = (int) (((UINT32) InterlockedIncrement(&g_EventLoop->nextShard)) % g_EventLoop->shardCount);
+
+	source = (rdsEventSource*) calloc(1, sizeof(rdsEventSource));
+
+	if (!source)
+		return -1;
+
+	shard = &g_EventLoop->shards[shardIndex];
+
+	source->connection = connection;
+	source->shard = shard;
+	source->refCount = 1;
+	source->packTimerFd = -1;
+
+	for (index = 0; index < FREERDS_WATCH_COUNT; index++)
+	{
+		source->watches[index].fd = -1;
+		source->watches[index].type = index;
+		source->watches[index].source = source;
+		source->watches[index].shard = shard;
+	}
+
+	source->idleTimerFd = freerds_timer_fd_new();
+	source->retryTimerFd = freerds_timer_fd_new();
+
+	if ((source->idleTimerFd < 0) || (source->retryTimerFd < 0) ||
+			(freerds_timer_fd_set(source->idleTimerFd, FREERDS_CODEC_IDLE_TIMEOUT) < 0))
+	{
+		if (source->idleTimerFd >= 0)
+			close(source->idleTimerFd);
+
+		if (source->retryTimerFd >= 0)
+			close(source->retryTimerFd);
+
+		free(source);
+		return -1;
+	}
+
+	connection->eventSource = source;
+
+	EnterCriticalSection(&shard->lock);
+
+	source->next = shard->sources;
+
+	if (shard->sources)
+		shard->sources->prev = source;
+
+	shard->sources = source;
+	shard->sourceCount++;
+
+	LeaveCriticalSection(&shard->lock);
+
+	freerds_event_source_schedule(source);
+
+	return 0;
+}
+
+/**
+ * Called from the connection check once the module connector is set up,
+ * on a worker: its pipe and pack timer are then served by the I/O thread,
+ * which registers them itself as it does for a resumed connector. The
+ * I/O thread alone changes the module watches, it drops them on close.
+ */
+
+int freerds_event_loop_watch_connector(rdsConnection* connection)
+{
+	rdsEventSource* source;
+	rdsModuleConnector* connector;
+
+	source = connection->eventSource;
+	connector = connection->connector;
+
+	if (!source || !connector)
+		return -1;
+
+	if (source->packTimerFd < 0)
+	{
+		source->packTimerFd = freerds_timer_fd_new();
+
+		if (source->packTimerFd < 0)
+			return -1;
+	}
+
+	source->fps = connector->fps;
+
+	if (freerds_timer_fd_set(source->packTimerFd, 1000 / source->fps) < 0)
+		return -1;
+
+	if (GetNamePipeFileDescriptor(connector->hClientPipe) < 0)
+		return -1;
+
+	freerds_event_loop_resume_connector(connection);
+
+	return 0;
+}
+
+/**
+ * Called by the worker that drained the queue of a blocked connector, the
+ * I/O thread picks it up again after its current batch of events.
+ */
+
+void freerds_event_loop_resume_connector(rdsConnection* connection)
+{
+	UINT64 value = 1;
+	rdsEventShard* shard;
+	rdsEventSource* source = connection->eventSource;
+
+	if (!source)
+		return;
+
+	shard = source->shard;
+
+	InterlockedIncrement(&source->refCount);
+
+	EnterCriticalSection(&shard->lock);
+	source->nextResumed = shard->resumed;
+	shard->resumed = source;
+	LeaveCriticalSection(&shard->lock);
+
+	write(shard->wake.fd, &value, sizeof(value));
+}
@@ -32,6 +32,8 @@
 #include <signal.h>
 
 #include "freerds.h"
+#include "convert.h"
+#include "rfx_simd.h"
 
 #include <freerds/icp.h>
 
@@ -45,6 +47,7 @@
 
 char* RdsModuleName = NULL;
 static HANDLE g_TermEvent = NULL;
+static HANDLE g_ReloadEvent = NULL;
 static xrdpListener* g_listen = NULL;
 
 COMMAND_LINE_ARGUMENT_A freerds_args[] =
@@ -52,6 +55,17 @@ COMMAND_LINE_ARGUMENT_A freerds_args[] =
 	{ "kill", COMMAND_LINE_VALUE_FLAG, "", NULL, NULL, -1, NULL, "kill daemon" },
 	{ "nodaemon", COMMAND_LINE_VALUE_FLAG, "", NULL, NULL, -1, NULL, "no daemon" },
 	{ "module", COMMAND_LINE_VALUE_REQUIRED, "<module name>", NULL, NULL, -1, NULL, "module name" },
+	{ "tls-cache-size", COMMAND_LINE_VALUE_REQUIRED, "<sessions>", "4096", NULL, -1, NULL, "TLS sessions to cache, 0 to disable" },
+	{ "tls-cache-lifetime", COMMAND_LINE_VALUE_REQUIRED, "<seconds>", "300", NULL, -1, NULL, "TLS session lifetime" },
+	{ "auth-workers", COMMAND_LINE_VALUE_REQUIRED, "<count>", "4", NULL, -1, NULL, "concurrent PAM authentications" },
+	{ "activation-workers", COMMAND_LINE_VALUE_REQUIRED, "<count>", "16", NULL, -1, NULL, "concurrent session activations" },
+	{ "no-ktls", COMMAND_LINE_VALUE_FLAG, "", NULL, NULL, -1, NULL, "encrypt in userspace only" },
+	{ "max-sessions", COMMAND_LINE_VALUE_REQUIRED, "<count>", "0", NULL, -1, NULL, "sessions to admit, 0 for no limit" },
+	{ "max-pending", COMMAND_LINE_VALUE_REQUIRED, "<count>", "128", NULL, -1, NULL, "connections waiting for admission, 0 for no limit" },
+	{ "max-cpu-load", COMMAND_LINE_VALUE_REQUIRED, "<percent>", "90", NULL, -1, NULL, "processor load up to which sessions are admitted" },
+	{ "min-free-memory", COMMAND_LINE_VALUE_REQUIRED, "<MB>", "256", NULL, -1, NULL, "available memory down to which sessions are admitted" },
+	{ "max-backlog", COMMAND_LINE_VALUE_REQUIRED, "<count>", "64", NULL, -1, NULL, "connections waiting for encoding up to which sessions are admitted" },
+	{ "admission-wait", COMMAND_LINE_VALUE_REQUIRED, "<ms>", "10000", NULL, -1, NULL, "time a session waits for admission before it is rejected" },
 	{ NULL, 0, NULL, NULL, NULL, -1, NULL, NULL }
 };
 
@@ -68,6 +82,11 @@ void freerds_shutdown(int sig)
 		SetEvent(g_TermEvent);
 }
 
+void freerds_reload(int sig)
+{
+	SetEvent(g_ReloadEvent);
+}
+
 int g_is_term(void)
 {
 	return (WaitForSingleObject(g_TermEvent, 0) == WAIT_OBJECT_0) ? 1 : 0;
@@ -86,6 +105,11 @@ HANDLE g_get_term_event(void)
 	return g_TermEvent;
 }
 
+HANDLE g_get_reload_event(void)
+{
+	return g_ReloadEvent;
+}
+
 void pipe_sig(int sig_num)
 {
 	printf("FreeRDS SIGPIPE (%d)\n", sig_num);
@@ -99,11 +123,28 @@ int main(int argc, char** argv)
 	DWORD flags;
 	int no_daemon;
 	int kill_process;
+	int no_ktls;
+	UINT32 auth_workers;
+	UINT32 activation_workers;
+	UINT32 tls_cache_size;
+	UINT32 tls_cache_lifetime;
+	rdsAdmissionSettings admission;
 	char text[256];
 	char pid_file[256];
 	COMMAND_LINE_ARGUMENT_A* arg;
 
-	no_daemon = kill_process = 0;
+	no_daemon = kill_process = no_ktls = 0;
+	auth_workers = 4;
+	activation_workers = 16;
+	tls_cache_size = 4096;
+	tls_cache_lifetime = 300;
+
+	admission.maxSessions = 0;
+	admission.maxPending = 128;
+	admission.maxCpuLoad = 90;
+	admission.minFreeMemory = 256;
+	admission.maxBacklog = 64;
+	admission.maxWait = 10000;
 
 	flags = COMMAND_LINE_SEPARATOR_SPACE;
 	flags |= COMMAND_LINE_SIGIL_DASH | COMMAND_LINE_SIGIL_DOUBLE_DASH;
@@ -132,6 +173,50 @@ int main(int argc, char** argv)
 		{
 			RdsModuleName = _strdup(arg->Value);
 		}
+		CommandLineSwitchCase(arg, "auth-workers")
+		{
+			auth_workers = (UINT32) atoi(arg->Value);
+		}
+		CommandLineSwitchCase(arg, "activation-workers")
+		{
+			activation_workers = (UINT32) atoi(arg->Value);
+		}
+		CommandLineSwitchCase(arg, "no-ktls")
+		{
+			no_ktls = 1;
+		}
+		CommandLineSwitchCase(arg, "tls-cache-size")
+		{
+			tls_cache_size = (UINT32) atoi(arg->Value);
+		}
+		CommandLineSwitchCase(arg, "tls-cache-lifetime")
+		{
+			tls_cache_lifetime = (UINT32) atoi(arg->Value);
+		}
+		CommandLineSwitchCase(arg, "max-sessions")
+		{
+			admission.maxSessions = (UINT32) atoi(arg->Value);
+		}
+		CommandLineSwitchCase(arg, "max-pending")
+		{
+			admission.maxPending = (UINT32) atoi(arg->Value);
+		}
+		CommandLineSwitchCase(arg, "max-cpu-load")
+		{
+			admission.maxCpuLoad = (UINT32) atoi(arg->Value);
+		}
+		CommandLineSwitchCase(arg, "min-free-memory")
+		{
+			admission.minFreeMemory = (UINT32) atoi(arg->Value);
+		}
+		CommandLineSwitchCase(arg, "max-backlog")
+		{
+			admission.maxBacklog = (UINT32) atoi(arg->Value);
+		}
+		CommandLineSwitchCase(arg, "admission-wait")
+		{
+			admission.maxWait = (UINT32) atoi(arg->Value);
+		}
 
 		CommandLineSwitchEnd(arg)
 	}
@@ -252,6 +337,12 @@ int main(int argc, char** argv)
 		/* end of daemonizing code */
 	}
 
+	freerds_convert_init();
+	printf("using %s color conversion\n", freerds_convert_get_name());
+
+	freerds_rfx_simd_init();
+	printf("RemoteFX encoder kernels: %s\n", freerds_rfx_simd_get_name());
+
 	g_listen = freerds_listener_create();
 
 	signal(SIGINT, freerds_shutdown);
@@ -262,13 +353,67 @@ int main(int argc, char** argv)
 	pid = GetCurrentProcessId();
 
 	g_TermEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	g_ReloadEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	signal(SIGHUP, freerds_reload);
+
+	if (freerds_certificate_init() < 0)
+	{
+		printf("failed to load the server certificate\n");
+		return 1;
+	}
+
+	freerds_tls_cache_init(tls_cache_size, tls_cache_lifetime);
+	freerds_tls_offload_init(no_ktls ? FALSE : TRUE);
+
 	printf("starting icp and waiting for session manager \n");
 	freerds_icp_start();
 	printf("connected to session manager\n");
 
+	if (freerds_admission_init(&admission) < 0)
+	{
+		printf("failed to start admission control\n");
+		return 1;
+	}
+
+	if (freerds_auth_pool_start(auth_workers) < 0)
+	{
+		printf("failed to start authentication workers\n");
+		return 1;
+	}
+
+	if (freerds_activation_pool_start(activation_workers) < 0)
+	{
+		printf("failed to start activation workers\n");
+		return 1;
+	}
+
+	if (freerds_event_loop_start() < 0)
+	{
+		printf("failed to start the event loop\n");
+		return 1;
+	}
+
 	freerds_listener_main_loop(g_listen);
+
+	freerds_event_loop_stop();
 	freerds_listener_delete(g_listen);
 
+	freerds_auth_pool_print_stats();
+	freerds_auth_pool_stop();
+
+	freerds_activation_pool_print_stats();
+	freerds_activation_pool_stop();
+
+	freerds_admission_print_stats();
+	freerds_admission_uninit();
+
+	freerds_tls_cache_print_stats();
+	freerds_tls_offload_print_stats();
+	freerds_tls_cache_uninit();
+	freerds_certificate_uninit();
+
+	CloseHandle(g_ReloadEvent);
 	CloseHandle(g_TermEvent);
 
 	/* only main process should delete pid file */
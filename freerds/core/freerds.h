@@ -37,28 +37,109 @@
 #include <pixman.h>
 
 typedef struct xrdp_listener xrdpListener;
+typedef struct rds_event_source rdsEventSource;
+typedef struct rds_certificate rdsCertificate;
+typedef struct rds_auth_request rdsAuthRequest;
+typedef struct rds_activation rdsActivation;
+typedef struct rds_work_pool rdsWorkPool;
+
+typedef void (*pfnWorkCallback)(void* context);
+
+struct rds_admission_settings
+{
+	UINT32 maxSessions;
+	UINT32 maxPending;
+	UINT32 maxCpuLoad;
+	UINT32 minFreeMemory;
+	UINT32 maxBacklog;
+	UINT32 maxWait;
+};
+typedef struct rds_admission_settings rdsAdmissionSettings;
+
+struct ssl_ctx_st;
 
 #include "core.h"
 
 int g_is_term(void);
 void g_set_term(int in_val);
 HANDLE g_get_term_event(void);
+HANDLE g_get_reload_event(void);
 
-rdsConnection* freerds_connection_create(freerdp_peer* client);
+rdsConnection* freerds_connection_create(freerdp_peer* client, int shard);
 void freerds_connection_delete(rdsConnection* self);
 HANDLE freerds_connection_get_term_event(rdsConnection* self);
-void* freerds_connection_main_thread(void* arg);
+int freerds_connection_check(rdsConnection* connection);
+
+int freerds_event_loop_start(void);
+void freerds_event_loop_stop(void);
+int freerds_event_loop_get_shard_count(void);
+int freerds_event_loop_get_backlog(void);
+int freerds_event_loop_listen(int shard, int fd);
+int freerds_event_loop_add(rdsConnection* connection, int shard);
+int freerds_event_loop_watch_connector(rdsConnection* connection);
+void freerds_event_loop_resume_connector(rdsConnection* connection);
+
+int freerds_certificate_init(void);
+void freerds_certificate_uninit(void);
+int freerds_certificate_reload(void);
+rdsCertificate* freerds_certificate_acquire(void);
+void freerds_certificate_release(rdsCertificate* certificate);
+int freerds_certificate_apply(rdsCertificate* certificate, rdpSettings* settings);
+
+int freerds_tls_cache_init(UINT32 size, UINT32 lifetime);
+void freerds_tls_cache_uninit(void);
+void freerds_tls_cache_print_stats(void);
+
+int freerds_tls_offload_init(BOOL enable);
+void freerds_tls_offload_attach(struct ssl_ctx_st* ctx);
+void freerds_tls_offload_print_stats(void);
 
 xrdpListener* freerds_listener_create(void);
 void freerds_listener_delete(xrdpListener* self);
 int freerds_listener_main_loop(xrdpListener* self);
+int freerds_listener_accept(int fd, int shard);
 
 rdsModuleConnector* freerds_module_new(rdsConnection* connection);
 void freerds_module_free(rdsModuleConnector* connector);
 
 long freerds_authenticate(char* username, char* password, int* errorcode);
+void freerds_authenticate_free(long auth);
+
+int freerds_auth_pool_start(UINT32 workerCount);
+void freerds_auth_pool_stop(void);
+void freerds_auth_pool_print_stats(void);
+
+rdsAuthRequest* freerds_auth_request_new(const char* username, const char* password);
+void freerds_auth_request_release(rdsAuthRequest* request);
+int freerds_auth_request_submit(rdsAuthRequest* request);
+HANDLE freerds_auth_request_get_event_handle(rdsAuthRequest* request);
+BOOL freerds_auth_request_is_done(rdsAuthRequest* request);
+int freerds_auth_request_get_status(rdsAuthRequest* request, int* errorCode, DWORD* elapsed);
+
+int freerds_activation_pool_start(UINT32 workerCount);
+void freerds_activation_pool_stop(void);
+void freerds_activation_pool_print_stats(void);
+
+rdsActivation* freerds_activation_new(const char* username, const char* domain);
+void freerds_activation_release(rdsActivation* activation);
+int freerds_activation_submit(rdsActivation* activation);
+HANDLE freerds_activation_get_event_handle(rdsActivation* activation);
+BOOL freerds_activation_is_done(rdsActivation* activation);
+int freerds_activation_attach(rdsActivation* activation, rdsModuleConnector* connector);
+
+int freerds_admission_init(rdsAdmissionSettings* settings);
+void freerds_admission_uninit(void);
+void freerds_admission_print_stats(void);
+int freerds_admission_report(void);
+int freerds_admission_accept(void);
+void freerds_admission_close(BOOL admitted);
+int freerds_admission_acquire(DWORD queueTimestamp);
+void freerds_admission_release(void);
+
+rdsWorkPool* freerds_work_pool_new(UINT32 workerCount);
+void freerds_work_pool_free(rdsWorkPool* pool);
+int freerds_work_pool_submit(rdsWorkPool* pool, pfnWorkCallback callback, void* context);
 
-void* freerds_client_thread(void* arg);
 int freerds_client_get_event_handles(rdsModuleConnector* connector, HANDLE* events, DWORD* nCount);
 int freerds_client_check_event_handles(rdsModuleConnector* connector);
 
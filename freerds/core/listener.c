@@ -18,6 +18,10 @@
  * listen for incoming connection
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -25,73 +29,297 @@
 #include "freerds.h"
 
 #include <winpr/crt.h>
-#include <winpr/thread.h>
+#include <winpr/synch.h>
+
+#include <freerdp/peer.h>
 
 #include <errno.h>
-#include <sys/select.h>
-#include <sys/signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define FREERDS_LISTENER_PORT		3389
+#define FREERDS_LISTENER_BACKLOG	128
+
+/* the socket stays readable, what is left is accepted on the next wakeup */
+#define FREERDS_LISTENER_ACCEPT_BATCH	16
+
+/* how often the host load is reported to the session manager, in ms */
+#define FREERDS_LISTENER_REPORT_INTERVAL	5000
+
+/**
+ * Every event shard gets its own listening socket on the same port with
+ * SO_REUSEPORT, the kernel spreads incoming connections across them and
+ * each shard accepts and serves its own. Without SO_REUSEPORT all shards
+ * share one socket.
+ */
+
+struct xrdp_listener
+{
+	int port;
+	int socketCount;
+	int* sockets;
+};
+
+static int freerds_listener_bind(int family, int port, BOOL reusePort)
+{
+	int fd;
+	int option;
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+	struct sockaddr* addr;
+	socklen_t addrLength;
+
+	fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (fd < 0)
+		return -1;
+
+	option = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void*) &option, sizeof(option));
+
+	if (reusePort)
+	{
+#ifdef SO_REUSEPORT
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void*) &option, sizeof(option)) < 0)
+#endif
+		{
+			close(fd);
+			return -1;
+		}
+	}
+
+	if (family == AF_INET6)
+	{
+		/* dual stack, IPv4 clients show up as mapped addresses */
+		option = 0;
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (void*) &option, sizeof(option));
 
-void freerds_peer_accepted(freerdp_listener* instance, freerdp_peer* client)
+		ZeroMemory(&sin6, sizeof(sin6));
+		sin6.sin6_family = AF_INET6;
+		sin6.sin6_addr = in6addr_any;
+		sin6.sin6_port = htons(port);
+
+		addr = (struct sockaddr*) &sin6;
+		addrLength = sizeof(sin6);
+	}
+	else
+	{
+		ZeroMemory(&sin, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_ANY);
+		sin.sin_port = htons(port);
+
+		addr = (struct sockaddr*) &sin;
+		addrLength = sizeof(sin);
+	}
+
+	if ((bind(fd, addr, addrLength) < 0) || (listen(fd, FREERDS_LISTENER_BACKLOG) < 0))
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int freerds_listener_open(int port, BOOL reusePort)
 {
-	freerds_connection_create(client);
+	int fd;
+
+	fd = freerds_listener_bind(AF_INET6, port, reusePort);
+
+	if (fd < 0)
+		fd = freerds_listener_bind(AF_INET, port, reusePort);
+
+	return fd;
 }
 
 xrdpListener* freerds_listener_create(void)
 {
-	freerdp_listener* listener;
+	xrdpListener* listener;
+
+	listener = (xrdpListener*) calloc(1, sizeof(xrdpListener));
 
-	listener = freerdp_listener_new();
-	listener->PeerAccepted = freerds_peer_accepted;
+	if (!listener)
+		return NULL;
 
-	return (xrdpListener*) listener;
+	listener->port = FREERDS_LISTENER_PORT;
+
+	return listener;
 }
 
 void freerds_listener_delete(xrdpListener* self)
 {
-	freerdp_listener_free((freerdp_listener*) self);
+	int index;
+
+	if (!self)
+		return;
+
+	for (index = 0; index < self->socketCount; index++)
+		close(self->sockets[index]);
+
+	free(self->sockets);
+	free(self);
 }
 
+/**
+ * Called by the event shard whose listening socket is readable.
+ */
+
+int freerds_listener_accept(int fd, int shard)
+{
+	int count;
+	int peerFd;
+	void* sin_addr;
+	freerdp_peer* client;
+	socklen_t peerAddrLength;
+	struct sockaddr_storage peerAddr;
+
+	for (count = 0; count < FREERDS_LISTENER_ACCEPT_BATCH; count++)
+	{
+		peerAddrLength = sizeof(peerAddr);
+		peerFd = accept4(fd, (struct sockaddr*) &peerAddr, &peerAddrLength, SOCK_CLOEXEC);
+
+		if (peerFd < 0)
+		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+				return 0;
+
+			/* e.g. out of descriptors, the next wakeup tries again */
+			fprintf(stderr, "accept failure: %s\n", strerror(errno));
+			return -1;
+		}
+
+		/* too many connections waiting for admission, turned away before any TLS or PAM work */
+		if (freerds_admission_accept() < 0)
+		{
+			close(peerFd);
+			continue;
+		}
+
+		client = freerdp_peer_new(peerFd);
+
+		if (!client)
+		{
+			freerds_admission_close(FALSE);
+			close(peerFd);
+			continue;
+		}
+
+		sin_addr = NULL;
+
+		if (peerAddr.ss_family == AF_INET)
+			sin_addr = &(((struct sockaddr_in*) &peerAddr)->sin_addr);
+		else if (peerAddr.ss_family == AF_INET6)
+			sin_addr = &(((struct sockaddr_in6*) &peerAddr)->sin6_addr);
+
+		if (sin_addr)
+			inet_ntop(peerAddr.ss_family, sin_addr, client->hostname, sizeof(client->hostname));
+
+		if (!freerds_connection_create(client, shard))
+			freerds_admission_close(FALSE);
+	}
+
+	return 0;
+}
+
+/**
+ * Hands the listening sockets to the event shards, then waits for
+ * termination, reloading the server certificate on SIGHUP and reporting
+ * the host load to the session manager meanwhile.
+ */
+
 int freerds_listener_main_loop(xrdpListener* self)
 {
-	DWORD status;
-	DWORD nCount;
-	HANDLE events[32];
-	HANDLE TermEvent;
-	freerdp_listener* listener;
+	int fd;
+	int shard;
+	int shardCount;
+	BOOL reusePort;
+	HANDLE events[2];
 
-	listener = (freerdp_listener*) self;
+	shardCount = freerds_event_loop_get_shard_count();
 
-	listener->Open(listener, NULL, 3389);
+	if (shardCount < 1)
+		return -1;
 
-	TermEvent = g_get_term_event();
+	self->sockets = (int*) calloc(shardCount, sizeof(int));
 
-	while (1)
+	if (!self->sockets)
+		return -1;
+
+	reusePort = (shardCount > 1) ? TRUE : FALSE;
+
+	for (shard = 0; shard < shardCount; shard++)
 	{
-		nCount = 0;
-		events[nCount++] = TermEvent;
+		fd = -1;
 
-		if (listener->GetEventHandles(listener, events, &nCount) < 0)
+		if (reusePort)
 		{
-			fprintf(stderr, "Failed to get FreeRDP file descriptor\n");
-			break;
+			fd = freerds_listener_open(self->port, TRUE);
+
+			if ((fd < 0) && (shard == 0))
+			{
+				fprintf(stderr, "SO_REUSEPORT listener failed, event shards share one socket\n");
+				reusePort = FALSE;
+			}
 		}
 
-		status = WaitForMultipleObjects(nCount, events, FALSE, INFINITE);
+		if (fd < 0)
+		{
+			if (self->socketCount > 0)
+				fd = self->sockets[0];
+			else
+				fd = freerds_listener_open(self->port, FALSE);
+		}
 
-		if (WaitForSingleObject(TermEvent, 0) == WAIT_OBJECT_0)
+		if (fd < 0)
 		{
-			break;
+			fprintf(stderr, "Failed to listen on port %d: %s\n", self->port, strerror(errno));
+			g_set_term(1);
+			return -1;
 		}
 
-		if (listener->CheckFileDescriptor(listener) != TRUE)
+		if ((self->socketCount == 0) || (fd != self->sockets[0]))
+			self->sockets[self->socketCount++] = fd;
+
+		if (freerds_event_loop_listen(shard, fd) < 0)
 		{
-			fprintf(stderr, "Failed to check FreeRDP file descriptor\n");
-			break;
+			fprintf(stderr, "Failed to accept connections on event shard %d\n", shard);
+			g_set_term(1);
+			return -1;
 		}
 	}
 
-	listener->Close(listener);
+	printf("listening on port %d with %d sockets\n", self->port, self->socketCount);
+
+	events[0] = g_get_term_event();
+	events[1] = g_get_reload_event();
+
+	while (1)
+	{
+		if (WaitForMultipleObjects(2, events, FALSE, FREERDS_LISTENER_REPORT_INTERVAL) == WAIT_TIMEOUT)
+		{
+			freerds_admission_report();
+			continue;
+		}
+
+		if (WaitForSingleObject(events[0], 0) == WAIT_OBJECT_0)
+			break;
+
+		if (WaitForSingleObject(events[1], 0) == WAIT_OBJECT_0)
+		{
+			ResetEvent(events[1]);
+			freerds_certificate_reload();
+			freerds_tls_cache_print_stats();
+			freerds_tls_offload_print_stats();
+			freerds_auth_pool_print_stats();
+			freerds_activation_pool_print_stats();
+			freerds_admission_print_stats();
+		}
+	}
 
 	return 0;
 }
-
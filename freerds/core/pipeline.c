@@ -23,16 +23,157 @@
 
 #include "freerds.h"
 
+#include <winpr/interlocked.h>
+
+#define FREERDS_SERVER_LIST_SIZE	256
+#define FREERDS_SERVER_QUEUE_SIZE	4096
+
+/**
+ * Queued messages are recycled slots, payloads such as bitmap data stay
+ * in the transport buffer they were read from, which the slot references.
+ */
+
 int freerds_server_message_enqueue(rdsModuleConnector* connector, RDS_MSG_COMMON* msg)
 {
-	void* dup = NULL;
-	dup = freerds_server_message_copy(msg);
+	RDS_MSG_COMMON* node;
+
+	if (connector->ServerListCount >= connector->ServerListSize)
+	{
+		UINT32 size;
+		RDS_MSG_COMMON** list;
+
+		size = connector->ServerListSize * 2;
+		list = (RDS_MSG_COMMON**) realloc(connector->ServerList, size * sizeof(RDS_MSG_COMMON*));
+
+		if (!list)
+			return -1;
+
+		connector->ServerList = list;
+		connector->ServerListSize = size;
+	}
+
+	node = freerds_server_message_acquire(connector, msg, connector->MessageBuffer);
+
+	if (!node)
+		return -1;
+
+	connector->ServerList[connector->ServerListCount++] = node;
+
+	return 0;
+}
+
+/**
+ * Server Queue
+ */
+
+static rdsServerQueue* freerds_server_queue_new(UINT32 size)
+{
+	rdsServerQueue* queue;
+
+	queue = (rdsServerQueue*) malloc(sizeof(rdsServerQueue));
+
+	if (!queue)
+		return NULL;
+
+	ZeroMemory(queue, sizeof(rdsServerQueue));
+
+	queue->size = size;
+	queue->messages = (RDS_MSG_COMMON**) calloc(size, sizeof(RDS_MSG_COMMON*));
+	queue->event = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (!queue->messages || !queue->event)
+	{
+		if (queue->event)
+			CloseHandle(queue->event);
+
+		free(queue->messages);
+		free(queue);
+		return NULL;
+	}
+
+	return queue;
+}
+
+/**
+ * Called from the I/O thread of the connection's shard only, which serves
+ * many connections and never waits for one: returns 1 if the queue is full,
+ * the caller then keeps the message.
+ */
+
+static int freerds_server_queue_push(rdsModuleConnector* connector, RDS_MSG_COMMON* msg)
+{
+	UINT32 tail;
+	rdsServerQueue* queue;
+
+	queue = connector->ServerQueue;
+	tail = queue->tail;
+
+	if ((tail - __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST)) >= queue->size)
+		return 1;
+
+	queue->messages[tail & (queue->size - 1)] = msg;
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+	/* the consumer had caught up with everything before this message */
+	if (__atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) == tail)
+		SetEvent(queue->event);
+
+	return 0;
+}
+
+/**
+ * Pushes the message, or marks the connector blocked if the queue is full:
+ * returns 1 then, and the worker resumes the connector once it has drained
+ * the queue. A worker draining it before seeing the mark leaves it to the
+ * push to clear the mark again and retry.
+ */
+
+static int freerds_server_queue_push_or_block(rdsModuleConnector* connector, RDS_MSG_COMMON* msg)
+{
+	rdsServerQueue* queue = connector->ServerQueue;
+
+	while (freerds_server_queue_push(connector, msg) != 0)
+	{
+		__atomic_store_n(&connector->ServerQueueBlocked, 1, __ATOMIC_SEQ_CST);
 
-	LinkedList_AddLast(connector->ServerList, (void*) dup);
+		if ((queue->tail - __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST)) >= queue->size)
+			return 1;
+
+		/* the worker took the mark, it resumes the connector */
+		if (InterlockedCompareExchange(&connector->ServerQueueBlocked, 0, 1) != 1)
+			return 1;
+	}
 
 	return 0;
 }
 
+/**
+ * Called from the worker checking the connection only, returns NULL once
+ * the queue is empty and the event has been reset.
+ */
+
+static RDS_MSG_COMMON* freerds_server_queue_pop(rdsServerQueue* queue)
+{
+	UINT32 head;
+	RDS_MSG_COMMON* msg;
+
+	head = queue->head;
+
+	if (__atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) == head)
+	{
+		ResetEvent(queue->event);
+
+		/* a message pushed before the reset did not set the event again */
+		if (__atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) == head)
+			return NULL;
+	}
+
+	msg = queue->messages[head & (queue->size - 1)];
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_SEQ_CST);
+
+	return msg;
+}
+
 /**
  * Server Callbacks
  */
@@ -182,100 +323,101 @@ int freerds_message_server_window_delete(rdsModuleConnector* connector, RDS_MSG_
 	return 0;
 }
 
-int freerds_message_server_queue_process_message(rdsModuleConnector* connector, wMessage* message)
+int freerds_message_server_queue_process_message(rdsModuleConnector* connector, RDS_MSG_COMMON* msg)
 {
 	int status;
+	UINT32 type;
 	rdsServerInterface* ServerProxy;
 
 	ServerProxy = connector->ServerProxy;
 
-	if (message->id == WMQ_QUIT)
-		return 0;
+	/* the message may be reused by the I/O thread once released */
+	type = msg->type;
 
-	switch (message->id)
+	switch (type)
 	{
 		case RDS_SERVER_BEGIN_UPDATE:
-			status = ServerProxy->BeginUpdate(connector, (RDS_MSG_BEGIN_UPDATE*) message->wParam);
+			status = ServerProxy->BeginUpdate(connector, (RDS_MSG_BEGIN_UPDATE*) msg);
 			break;
 
 		case RDS_SERVER_END_UPDATE:
-			status = ServerProxy->EndUpdate(connector, (RDS_MSG_END_UPDATE*) message->wParam);
+			status = ServerProxy->EndUpdate(connector, (RDS_MSG_END_UPDATE*) msg);
 			break;
 
 		case RDS_SERVER_BEEP:
-			status = ServerProxy->Beep(connector, (RDS_MSG_BEEP*) message->wParam);
+			status = ServerProxy->Beep(connector, (RDS_MSG_BEEP*) msg);
 			break;
 
 		case RDS_SERVER_OPAQUE_RECT:
-			status = ServerProxy->OpaqueRect(connector, (RDS_MSG_OPAQUE_RECT*) message->wParam);
+			status = ServerProxy->OpaqueRect(connector, (RDS_MSG_OPAQUE_RECT*) msg);
 			break;
 
 		case RDS_SERVER_SCREEN_BLT:
-			status = ServerProxy->ScreenBlt(connector, (RDS_MSG_SCREEN_BLT*) message->wParam);
+			status = ServerProxy->ScreenBlt(connector, (RDS_MSG_SCREEN_BLT*) msg);
 			break;
 
 		case RDS_SERVER_PAINT_RECT:
-			status = ServerProxy->PaintRect(connector, (RDS_MSG_PAINT_RECT*) message->wParam);
+			status = ServerProxy->PaintRect(connector, (RDS_MSG_PAINT_RECT*) msg);
 			break;
 
 		case RDS_SERVER_PATBLT:
-			status = ServerProxy->PatBlt(connector, (RDS_MSG_PATBLT*) message->wParam);
+			status = ServerProxy->PatBlt(connector, (RDS_MSG_PATBLT*) msg);
 			break;
 
 		case RDS_SERVER_DSTBLT:
-			status = ServerProxy->DstBlt(connector, (RDS_MSG_DSTBLT*) message->wParam);
+			status = ServerProxy->DstBlt(connector, (RDS_MSG_DSTBLT*) msg);
 			break;
 
 		case RDS_SERVER_SET_POINTER:
-			status = ServerProxy->SetPointer(connector, (RDS_MSG_SET_POINTER*) message->wParam);
+			status = ServerProxy->SetPointer(connector, (RDS_MSG_SET_POINTER*) msg);
 			break;
 
 		case RDS_SERVER_SET_SYSTEM_POINTER:
-			status = ServerProxy->SetSystemPointer(connector, (RDS_MSG_SET_SYSTEM_POINTER*) message->wParam);
+			status = ServerProxy->SetSystemPointer(connector, (RDS_MSG_SET_SYSTEM_POINTER*) msg);
 			break;
 
 		case RDS_SERVER_SET_PALETTE:
-			status = ServerProxy->SetPalette(connector, (RDS_MSG_SET_PALETTE*) message->wParam);
+			status = ServerProxy->SetPalette(connector, (RDS_MSG_SET_PALETTE*) msg);
 			break;
 
 		case RDS_SERVER_SET_CLIPPING_REGION:
-			status = ServerProxy->SetClippingRegion(connector, (RDS_MSG_SET_CLIPPING_REGION*) message->wParam);
+			status = ServerProxy->SetClippingRegion(connector, (RDS_MSG_SET_CLIPPING_REGION*) msg);
 			break;
 
 		case RDS_SERVER_LINE_TO:
-			status = ServerProxy->LineTo(connector, (RDS_MSG_LINE_TO*) message->wParam);
+			status = ServerProxy->LineTo(connector, (RDS_MSG_LINE_TO*) msg);
 			break;
 
 		case RDS_SERVER_CACHE_GLYPH:
-			status = ServerProxy->CacheGlyph(connector, (RDS_MSG_CACHE_GLYPH*) message->wParam);
+			status = ServerProxy->CacheGlyph(connector, (RDS_MSG_CACHE_GLYPH*) msg);
 			break;
 
 		case RDS_SERVER_GLYPH_INDEX:
-			status = ServerProxy->GlyphIndex(connector, (RDS_MSG_GLYPH_INDEX*) message->wParam);
+			status = ServerProxy->GlyphIndex(connector, (RDS_MSG_GLYPH_INDEX*) msg);
 			break;
 
 		case RDS_SERVER_SHARED_FRAMEBUFFER:
-			status = ServerProxy->SharedFramebuffer(connector, (RDS_MSG_SHARED_FRAMEBUFFER*) message->wParam);
+			status = ServerProxy->SharedFramebuffer(connector, (RDS_MSG_SHARED_FRAMEBUFFER*) msg);
 			break;
 
 		case RDS_SERVER_RESET:
-			status = ServerProxy->Reset(connector, (RDS_MSG_RESET*) message->wParam);
+			status = ServerProxy->Reset(connector, (RDS_MSG_RESET*) msg);
 			break;
 
 		case RDS_SERVER_CREATE_OFFSCREEN_SURFACE:
-			status = ServerProxy->CreateOffscreenSurface(connector, (RDS_MSG_CREATE_OFFSCREEN_SURFACE*) message->wParam);
+			status = ServerProxy->CreateOffscreenSurface(connector, (RDS_MSG_CREATE_OFFSCREEN_SURFACE*) msg);
 			break;
 
 		case RDS_SERVER_SWITCH_OFFSCREEN_SURFACE:
-			status = ServerProxy->SwitchOffscreenSurface(connector, (RDS_MSG_SWITCH_OFFSCREEN_SURFACE*) message->wParam);
+			status = ServerProxy->SwitchOffscreenSurface(connector, (RDS_MSG_SWITCH_OFFSCREEN_SURFACE*) msg);
 			break;
 
 		case RDS_SERVER_DELETE_OFFSCREEN_SURFACE:
-			status = ServerProxy->DeleteOffscreenSurface(connector, (RDS_MSG_DELETE_OFFSCREEN_SURFACE*) message->wParam);
+			status = ServerProxy->DeleteOffscreenSurface(connector, (RDS_MSG_DELETE_OFFSCREEN_SURFACE*) msg);
 			break;
 
 		case RDS_SERVER_PAINT_OFFSCREEN_SURFACE:
-			status = ServerProxy->PaintOffscreenSurface(connector, (RDS_MSG_PAINT_OFFSCREEN_SURFACE*) message->wParam);
+			status = ServerProxy->PaintOffscreenSurface(connector, (RDS_MSG_PAINT_OFFSCREEN_SURFACE*) msg);
 			break;
 
 		default:
@@ -283,11 +425,11 @@ int freerds_message_server_queue_process_message(rdsModuleConnector* connector,
 			break;
 	}
 
-	freerds_server_message_free((RDS_MSG_COMMON*) message->wParam);
+	freerds_server_message_release(connector, msg);
 
 	if (status < 0)
 	{
-		printf("freerds_message_server_queue_process_message (%d) status: %d\n", message->id, status);
+		printf("freerds_message_server_queue_process_message (%d) status: %d\n", (int) type, status);
 		return -1;
 	}
 
@@ -333,11 +475,49 @@ int freerds_message_server_align_rect(rdsModuleConnector* connector, RDS_RECT* r
 	return 0;
 }
 
+/**
+ * With the graphics pipeline a ScreenBlt can be replayed on the client surface,
+ * but only if none of its source pixels are part of damage not yet sent.
+ */
+
+static BOOL freerds_message_server_can_forward_blt(rdsModuleConnector* connector,
+		RDS_MSG_COMMON* node, pixman_region32_t* region)
+{
+	pixman_box32_t box;
+	RDS_MSG_SCREEN_BLT* blt;
+
+	if (node->type != RDS_SERVER_SCREEN_BLT)
+		return FALSE;
+
+	if (!freerds_rdpgfx_is_ready(connector->connection->rdpgfx))
+		return FALSE;
+
+	blt = (RDS_MSG_SCREEN_BLT*) node;
+
+	box.x1 = blt->nXSrc;
+	box.y1 = blt->nYSrc;
+	box.x2 = blt->nXSrc + blt->nWidth;
+	box.y2 = blt->nYSrc + blt->nHeight;
+
+	if (pixman_region32_contains_rectangle(region, &box) != PIXMAN_REGION_OUT)
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * Hands what the module sent since the last pack over to the worker.
+ * Returns 1 if the worker's queue is full, the connector is then blocked
+ * until the worker resumes it.
+ */
+
 int freerds_message_server_queue_pack(rdsModuleConnector* connector)
 {
+	UINT32 index;
 	RDS_RECT rect;
 	int ChainedMode;
-	wLinkedList* list;
+	BOOL blocked;
+	BOOL suppressed;
 	rdsConnection* connection;
 	RDS_MSG_COMMON* node;
 	pixman_bool_t status;
@@ -345,32 +525,63 @@ int freerds_message_server_queue_pack(rdsModuleConnector* connector)
 	pixman_region32_t region;
 
 	ChainedMode = 0;
+	blocked = FALSE;
 	connection = connector->connection;
 
-	list = connector->ServerList;
-
 	pixman_region32_init(&region);
 
-	LinkedList_Enumerator_Reset(list);
+	/* pick up damage held back while output was suppressed, or requested by the client */
+
+	EnterCriticalSection(&connection->damageLock);
+
+	suppressed = connection->suppressOutput;
+
+	if (!suppressed)
+	{
+		pixman_region32_union(&region, &region, &connection->pendingDamage);
+		pixman_region32_fini(&connection->pendingDamage);
+		pixman_region32_init(&connection->pendingDamage);
+	}
 
-	while (LinkedList_Enumerator_MoveNext(list))
+	LeaveCriticalSection(&connection->damageLock);
+
+	for (index = 0; index < connector->ServerListCount; index++)
 	{
-		node = (RDS_MSG_COMMON*) LinkedList_Enumerator_Current(list);
+		node = connector->ServerList[index];
 
-		if ((!ChainedMode) && (node->msgFlags & RDS_MSG_FLAG_RECT))
+		if ((!ChainedMode) && (node->msgFlags & RDS_MSG_FLAG_RECT) &&
+				(suppressed || !freerds_message_server_can_forward_blt(connector, node, &region)))
 		{
 			status = pixman_region32_union_rect(&region, &region,
 					node->rect.x, node->rect.y, node->rect.width, node->rect.height);
+
+			/* folded into the damage region, the message itself is not needed anymore */
+			freerds_server_message_release(connector, node);
 		}
-		else
+		else if (freerds_server_queue_push_or_block(connector, node) != 0)
 		{
-			MessageQueue_Post(connector->ServerQueue, (void*) connector, node->type, (void*) node, NULL);
+			blocked = TRUE;
+			break;
 		}
 	}
 
-	LinkedList_Clear(list);
+	/* what the worker has no room for yet stays listed, in order */
+	if (index < connector->ServerListCount)
+	{
+		MoveMemory(connector->ServerList, &connector->ServerList[index],
+				(connector->ServerListCount - index) * sizeof(RDS_MSG_COMMON*));
+	}
 
-	if (!ChainedMode)
+	connector->ServerListCount -= index;
+
+	/* damage is painted after the listed messages, on the next pack */
+	if (suppressed || blocked)
+	{
+		EnterCriticalSection(&connection->damageLock);
+		pixman_region32_union(&connection->pendingDamage, &connection->pendingDamage, &region);
+		LeaveCriticalSection(&connection->damageLock);
+	}
+	else if (!ChainedMode)
 	{
 		extents = pixman_region32_extents(&region);
 
@@ -400,37 +611,39 @@ int freerds_message_server_queue_pack(rdsModuleConnector* connector)
 			paintRect.nWidth = rect.width;
 			paintRect.nHeight = rect.height;
 
-			msg = freerds_server_message_copy((RDS_MSG_COMMON*) &paintRect);
+			msg = freerds_server_message_acquire(connector, (RDS_MSG_COMMON*) &paintRect, NULL);
+
+			if (msg && (freerds_server_queue_push_or_block(connector, msg) != 0))
+			{
+				freerds_server_message_release(connector, msg);
 
-			MessageQueue_Post(connector->ServerQueue, (void*) connector, msg->type, (void*) msg, NULL);
+				EnterCriticalSection(&connection->damageLock);
+				pixman_region32_union(&connection->pendingDamage, &connection->pendingDamage, &region);
+				LeaveCriticalSection(&connection->damageLock);
+
+				blocked = TRUE;
+			}
 		}
 	}
 
 	pixman_region32_fini(&region);
 
-	return 0;
+	return blocked ? 1 : 0;
 }
 
 int freerds_message_server_queue_process_pending_messages(rdsModuleConnector* connector)
 {
-	int count;
 	int status;
-	wMessage message;
-	wMessageQueue* queue;
+	RDS_MSG_COMMON* msg;
 
-	count = 0;
 	status = 0;
-	queue = connector->ServerQueue;
 
-	while (MessageQueue_Peek(queue, &message, TRUE))
-	{
-		status = freerds_message_server_queue_process_message(connector, &message);
-
-		if (!status)
-			break;
+	while ((msg = freerds_server_queue_pop(connector->ServerQueue)) != NULL)
+		status = freerds_message_server_queue_process_message(connector, msg);
 
-		count++;
-	}
+	/* drained, the I/O thread may read and pack for this connector again */
+	if (InterlockedCompareExchange(&connector->ServerQueueBlocked, 0, 1) == 1)
+		freerds_event_loop_resume_connector(connector->connection);
 
 	return status;
 }
@@ -472,8 +685,13 @@ int freerds_message_server_connector_init(rdsModuleConnector* connector)
 	}
 
 	connector->MaxFps = connector->fps = 60;
-	connector->ServerList = LinkedList_New();
-	connector->ServerQueue = MessageQueue_New();
+	connector->ServerListCount = 0;
+	connector->ServerListSize = FREERDS_SERVER_LIST_SIZE;
+	connector->ServerList = (RDS_MSG_COMMON**) malloc(connector->ServerListSize * sizeof(RDS_MSG_COMMON*));
+	connector->ServerQueue = freerds_server_queue_new(FREERDS_SERVER_QUEUE_SIZE);
+
+	if (!connector->ServerList || !connector->ServerQueue)
+		return -1;
 
 	return 0;
 }
@@ -39,7 +39,6 @@
 
 #include <freerds/module_connector.h>
 #include <freerds/icp_client_stubs.h>
-#include "makecert.h"
 
 #include "channels.h"
 
@@ -64,7 +63,7 @@ void freerds_peer_context_free(freerdp_peer* client, rdsConnection* context)
 	WTSDestroyVirtualChannelManager(context->vcm);
 }
 
-rdsConnection* freerds_connection_create(freerdp_peer* client)
+rdsConnection* freerds_connection_create(freerdp_peer* client, int shard)
 {
 	rdsConnection* xfp;
 
@@ -76,15 +75,44 @@ rdsConnection* freerds_connection_create(freerdp_peer* client)
 	xfp = (rdsConnection*) client->context;
 
 	xfp->TermEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	xfp->acceptTimestamp = GetTickCount();
 
-	xfp->Thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) freerds_connection_main_thread, client, 0, NULL);
+	if (freerds_event_loop_add(xfp, shard) < 0)
+	{
+		fprintf(stderr, "Failed to add client %s to the event loop\n", client->hostname);
+		CloseHandle(xfp->TermEvent);
+		freerdp_peer_context_free(client);
+		freerdp_peer_free(client);
+		return NULL;
+	}
 
 	return xfp;
 }
 
+/**
+ * Called by the event loop once nothing refers to the connection anymore.
+ */
+
 void freerds_connection_delete(rdsConnection* self)
 {
+	freerdp_peer* client = self->client;
+
+	fprintf(stderr, "Client %s disconnected (%d bytes in use).\n", client->hostname,
+			(int) freerds_connection_get_memory_usage(self));
+
+	fprintf(stderr, "connection %ld: session %d used %d ms of worker time\n", self->id,
+			self->connector ? (int) self->connector->SessionId : -1, (int) (self->workerTime / 1000));
+
+	client->Disconnect(client);
+
 	CloseHandle(self->TermEvent);
+	freerds_certificate_release(self->certificate);
+	freerds_auth_request_release(self->authRequest);
+	freerds_activation_release(self->activation);
+	freerds_admission_close(self->admitted);
+
+	freerdp_peer_context_free(client);
+	freerdp_peer_free(client);
 }
 
 HANDLE freerds_connection_get_term_event(rdsConnection* self)
@@ -154,9 +182,6 @@ BOOL freerds_peer_activate(freerdp_peer* client)
 {
 	rdpSettings* settings;
 	rdsConnection* connection = (rdsConnection*) client->context;
-	int auth_status;
-	int error_code;
-	HANDLE hClientPipe;
 
 	settings = client->settings;
 	settings->BitmapCacheVersion = 2;
@@ -167,98 +192,49 @@ BOOL freerds_peer_activate(freerdp_peer* client)
 	if (settings->RemoteFxCodec || settings->NSCodec)
 		connection->codecMode = TRUE;
 
-	auth_status = freerds_authenticate(settings->Username, settings->Password, &error_code);
+	/* codecs or desktop size may have changed, recreate encoders on demand */
+	freerds_connection_release_codecs(connection);
 
-	if (!connection->connector)
-		connection->connector = freerds_module_connector_new(connection);
-
-	error_code = freerds_icp_GetUserSession(settings->Username, settings->Domain,
-	(UINT32 *)(&(connection->connector->SessionId)), (&(connection->connector->Endpoint)));
-	if (error_code != 0)
+	/* reactivated, e.g. after a desktop resize, the module is connected or being connected */
+	if (connection->connector || connection->activation)
 	{
-		printf("freerds_icp_GetUserSession failed %d\n", error_code);
-		return FALSE;
-	}
-	hClientPipe = freerds_named_pipe_connect(connection->connector->Endpoint, 20);
+		/* redrawn at the new size */
+		connection->activationProgress = 0;
 
-	if (!hClientPipe)
-	{
-		fprintf(stderr, "Failed to create named pipe %s\n", connection->connector->Endpoint);
-		return FALSE;
+		printf("Client Reactivated\n");
+		return TRUE;
 	}
-	printf("Connected to session %d\n", connection->connector->SessionId);
-
-	connection->connector->hClientPipe = hClientPipe;
-	connection->connector->GetEventHandles = freerds_client_get_event_handles;
-	connection->connector->CheckEventHandles = freerds_client_check_event_handles;
-
-	connection->connector->ServerThread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) freerds_client_thread,
-			(void*) connection->connector, CREATE_SUSPENDED, NULL);
-
-	freerds_client_inbound_connector_init(connection->connector);
-
-	ResumeThread(connection->connector->ServerThread);
-
-	printf("Client Activated\n");
-
-	return TRUE;
-}
-
-const char* makecert_argv[4] =
-{
-	"makecert",
-	"-rdp",
-	"-live",
-	"-silent"
-};
-
-int makecert_argc = (sizeof(makecert_argv) / sizeof(char*));
-
-int freerds_generate_certificate(rdpSettings* settings)
-{
-	char* config_home;
-	char* server_file_path;
-	MAKECERT_CONTEXT* context;
-
-	config_home = GetKnownPath(KNOWN_PATH_XDG_CONFIG_HOME);
-
-	if (!PathFileExistsA(config_home))
-		CreateDirectoryA(config_home, 0);
-
-	free(config_home);
-
-	if (!PathFileExistsA(settings->ConfigPath))
-		CreateDirectoryA(settings->ConfigPath, 0);
-
-	server_file_path = GetCombinedPath(settings->ConfigPath, "server");
 
-	if (!PathFileExistsA(server_file_path))
-		CreateDirectoryA(server_file_path, 0);
-
-	settings->CertificateFile = GetCombinedPath(server_file_path, "server.crt");
-	settings->PrivateKeyFile = GetCombinedPath(server_file_path, "server.key");
-
-	if ((!PathFileExistsA(settings->CertificateFile)) ||
-			(!PathFileExistsA(settings->PrivateKeyFile)))
+	/* both are completed by the connection check, which shows progress meanwhile */
+	if (!connection->authRequest)
 	{
-		context = makecert_context_new();
-
-		makecert_context_process(context, makecert_argc, (char**) makecert_argv);
+		connection->authRequest = freerds_auth_request_new(settings->Username, settings->Password);
 
-		makecert_context_set_output_file_name(context, "server");
+		if (connection->authRequest && (freerds_auth_request_submit(connection->authRequest) < 0))
+		{
+			freerds_auth_request_release(connection->authRequest);
+			connection->authRequest = NULL;
+		}
 
-		if (!PathFileExistsA(settings->CertificateFile))
-			makecert_context_output_certificate_file(context, server_file_path);
+		if (!connection->authRequest)
+			fprintf(stderr, "connection %ld: failed to queue authentication\n", connection->id);
+	}
 
-		if (!PathFileExistsA(settings->PrivateKeyFile))
-			makecert_context_output_private_key_file(context, server_file_path);
+	connection->activation = freerds_activation_new(settings->Username, settings->Domain);
 
-		makecert_context_free(context);
+	if (connection->activation && (freerds_activation_submit(connection->activation) < 0))
+	{
+		freerds_activation_release(connection->activation);
+		connection->activation = NULL;
 	}
 
-	free(server_file_path);
+	if (!connection->activation)
+	{
+		fprintf(stderr, "connection %ld: failed to queue activation\n", connection->id);
+		return FALSE;
+	}
 
-	return 0;
+	return TRUE;
 }
 
 void freerds_input_synchronize_event(rdpInput* input, UINT32 flags)
@@ -354,26 +330,58 @@ void freerds_update_frame_acknowledge(rdpContext* context, UINT32 frameId)
 	}
 }
 
-void* freerds_connection_main_thread(void* arg)
+/**
+ * While output is suppressed the pack step only accumulates damage,
+ * which is sent once output is allowed again.
+ */
+
+void freerds_update_suppress_output(rdpContext* context, BYTE allow, RECTANGLE_16* area)
+{
+	rdsConnection* connection = (rdsConnection*) context;
+
+	EnterCriticalSection(&connection->damageLock);
+	connection->suppressOutput = allow ? FALSE : TRUE;
+	LeaveCriticalSection(&connection->damageLock);
+
+	printf("connection %ld: output %s\n", connection->id, allow ? "resumed" : "suppressed");
+}
+
+void freerds_update_refresh_rect(rdpContext* context, BYTE count, RECTANGLE_16* areas)
+{
+	int index;
+	rdsConnection* connection = (rdsConnection*) context;
+
+	EnterCriticalSection(&connection->damageLock);
+
+	for (index = 0; index < count; index++)
+	{
+		pixman_region32_union_rect(&connection->pendingDamage, &connection->pendingDamage,
+				areas[index].left, areas[index].top,
+				areas[index].right - areas[index].left + 1,
+				areas[index].bottom - areas[index].top + 1);
+	}
+
+	LeaveCriticalSection(&connection->damageLock);
+}
+
+/**
+ * Called by the event loop on the first check of a new connection.
+ */
+
+static void freerds_connection_start(rdsConnection* connection)
 {
-	DWORD status;
-	DWORD nCount;
-	HANDLE events[32];
-	HANDLE ClientEvent;
-	HANDLE ChannelEvent;
-	HANDLE LocalTermEvent;
-	HANDLE GlobalTermEvent;
-	rdsConnection* connection;
 	rdpSettings* settings;
-	rdsModuleConnector* connector;
-	freerdp_peer* client = (freerdp_peer*) arg;
+	freerdp_peer* client = connection->client;
 
 	fprintf(stderr, "We've got a client %s\n", client->hostname);
 
-	connection = (rdsConnection*) client->context;
 	settings = client->settings;
 
-	freerds_generate_certificate(settings);
+	connection->startTimestamp = GetTickCount();
+	connection->certificate = freerds_certificate_acquire();
+
+	if (connection->certificate)
+		freerds_certificate_apply(connection->certificate, settings);
 
 	settings->RdpSecurity = FALSE;
 	settings->TlsSecurity = TRUE;
@@ -388,81 +396,178 @@ void* freerds_connection_main_thread(void* arg)
 	freerds_input_register_callbacks(client->input);
 
 	client->update->SurfaceFrameAcknowledge = freerds_update_frame_acknowledge;
+	client->update->SuppressOutput = freerds_update_suppress_output;
+	client->update->RefreshRect = freerds_update_refresh_rect;
+
+	connection->started = TRUE;
+}
+
+static void freerds_connection_auth_complete(rdsConnection* connection)
+{
+	int status;
+	int errorCode;
+	DWORD elapsed;
+
+	status = freerds_auth_request_get_status(connection->authRequest, &errorCode, &elapsed);
+
+	connection->authenticated = (status == 0) ? TRUE : FALSE;
 
-	ClientEvent = client->GetEventHandle(client);
-	ChannelEvent = WTSVirtualChannelManagerGetEventHandle(connection->vcm);
+	if (connection->authenticated)
+		printf("connection %ld: authenticated in %d ms\n", connection->id, (int) elapsed);
+	else
+		printf("connection %ld: authentication failed after %d ms (%d)\n", connection->id, (int) elapsed, errorCode);
 
-	GlobalTermEvent = g_get_term_event();
-	LocalTermEvent = connection->TermEvent;
+	freerds_auth_request_release(connection->authRequest);
+	connection->authRequest = NULL;
+}
 
-	while (1)
+/**
+ * Takes over the module pipe once the activation is done.
+ */
+
+static int freerds_connection_activate(rdsConnection* connection)
+{
+	rdsModuleConnector* connector;
+
+	connector = freerds_module_connector_new(connection);
+
+	if (freerds_activation_attach(connection->activation, connector) < 0)
 	{
-		nCount = 0;
-		events[nCount++] = ClientEvent;
-		events[nCount++] = ChannelEvent;
-		events[nCount++] = GlobalTermEvent;
-		events[nCount++] = LocalTermEvent;
+		fprintf(stderr, "connection %ld: activation failed or rejected\n", connection->id);
+		freerds_module_connector_free(connector);
+		return -1;
+	}
 
-		if (client->activated)
-		{
-			connector = (rdsModuleConnector*) connection->connector;
+	connection->admitted = TRUE;
 
-			if (connector)
-				connector->GetEventHandles(connection->connector, events, &nCount);
-		}
+	freerds_activation_release(connection->activation);
+	connection->activation = NULL;
 
-		status = WaitForMultipleObjects(nCount, events, FALSE, INFINITE);
+	printf("Connected to session %d\n", (int) connector->SessionId);
 
-		if (WaitForSingleObject(GlobalTermEvent, 0) == WAIT_OBJECT_0)
-		{
-			break;
-		}
+	/* the session does not depend on the PAM result, as before, it is only logged with it */
+	if (connection->authRequest)
+		printf("connection %ld: activated before authentication completed\n", connection->id);
+	else if (!connection->authenticated)
+		printf("connection %ld: activated without authentication\n", connection->id);
 
-		if (WaitForSingleObject(LocalTermEvent, 0) == WAIT_OBJECT_0)
-		{
-			break;
-		}
+	connector->GetEventHandles = freerds_client_get_event_handles;
+	connector->CheckEventHandles = freerds_client_check_event_handles;
+
+	connection->connector = connector;
+
+	freerds_client_inbound_connector_init(connector);
+
+	if (freerds_event_loop_watch_connector(connection) < 0)
+	{
+		fprintf(stderr, "Failed to watch named pipe %s\n", connector->Endpoint);
+		return -1;
+	}
+
+	printf("Client Activated\n");
+
+	printf("connection %ld: set up in %d ms, %d ms of which waiting for a worker\n", connection->id,
+			(int) (GetTickCount() - connection->acceptTimestamp),
+			(int) (connection->startTimestamp - connection->acceptTimestamp));
+
+	return 0;
+}
+
+/**
+ * Shown until the module draws its first frame, redrawn as steps complete.
+ */
+
+static void freerds_connection_show_progress(rdsConnection* connection)
+{
+	int progress;
+
+	progress = connection->authRequest ? 1 : 2;
+
+	if (progress == connection->activationProgress)
+		return;
 
-		if (WaitForSingleObject(ClientEvent, 0) == WAIT_OBJECT_0)
+	connection->activationProgress = progress;
+
+	freerds_send_progress(connection, progress, 3);
+}
+
+/**
+ * Checks everything the connection waits on once, without blocking. The
+ * event loop calls it whenever one of them is signaled, or the idle timeout
+ * expires, and deletes the connection once it returns -1.
+ */
+
+int freerds_connection_check(rdsConnection* connection)
+{
+	freerdp_peer* client;
+	rdsModuleConnector* connector;
+
+	client = connection->client;
+
+	if (!connection->started)
+		freerds_connection_start(connection);
+
+	if (WaitForSingleObject(g_get_term_event(), 0) == WAIT_OBJECT_0)
+		return -1;
+
+	if (WaitForSingleObject(connection->TermEvent, 0) == WAIT_OBJECT_0)
+		return -1;
+
+	if (WaitForSingleObject(client->GetEventHandle(client), 0) == WAIT_OBJECT_0)
+	{
+		if (client->CheckFileDescriptor(client) != TRUE)
 		{
-			if (client->CheckFileDescriptor(client) != TRUE)
-			{
-				fprintf(stderr, "Failed to check freerdp file descriptor\n");
-				break;
-			}
+			fprintf(stderr, "Failed to check freerdp file descriptor\n");
+			return -1;
 		}
+	}
 
-		if (WaitForSingleObject(ChannelEvent, 0) == WAIT_OBJECT_0)
+	if (WaitForSingleObject(WTSVirtualChannelManagerGetEventHandle(connection->vcm), 0) == WAIT_OBJECT_0)
+	{
+		if (WTSVirtualChannelManagerCheckFileDescriptor(connection->vcm) != TRUE)
 		{
-			if (WTSVirtualChannelManagerCheckFileDescriptor(connection->vcm) != TRUE)
-			{
-				fprintf(stderr, "WTSVirtualChannelManagerCheckFileDescriptor failure\n");
-				break;
-			}
+			fprintf(stderr, "WTSVirtualChannelManagerCheckFileDescriptor failure\n");
+			return -1;
 		}
+	}
 
-		if (client->activated)
-		{
-			connector = (rdsModuleConnector*) connection->connector;
+	if (connection->authRequest && freerds_auth_request_is_done(connection->authRequest))
+		freerds_connection_auth_complete(connection);
+
+	if (connection->rdpgfx)
+	{
+		if (freerds_rdpgfx_check(connection->rdpgfx) < 0)
+			fprintf(stderr, "graphics pipeline failure, falling back to surface commands\n");
+	}
 
-			if (connector)
+	if (client->activated && connection->activation)
+	{
+		if (!freerds_activation_is_done(connection->activation))
+			freerds_connection_show_progress(connection);
+		else if (freerds_connection_activate(connection) < 0)
+			return -1;
+	}
+
+	if (client->activated)
+	{
+		connector = (rdsModuleConnector*) connection->connector;
+
+		if (connector)
+		{
+			if (connector->CheckEventHandles(connection->connector) < 0)
 			{
-				if (connector->CheckEventHandles(connection->connector) < 0)
-				{
-					fprintf(stderr, "ModuleClient->CheckEventHandles failure\n");
-					break;
-				}
+				fprintf(stderr, "ModuleClient->CheckEventHandles failure\n");
+				return -1;
 			}
+
+			freerds_connector_outbound_flush(connector);
 		}
 	}
 
-	fprintf(stderr, "Client %s disconnected.\n", client->hostname);
+	/* nothing more to write for now, a frame still open is not held back */
+	freerds_connection_push(connection);
 
-	client->Disconnect(client);
+	freerds_connection_check_idle(connection);
 
-	freerdp_peer_context_free(client);
-	freerdp_peer_free(client);
-
-	return NULL;
+	return 0;
 }
-
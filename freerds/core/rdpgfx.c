@@ -0,0 +1,998 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Graphics Pipeline Extension (MS-RDPEGFX)
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <winpr/crt.h>
+#include <winpr/sysinfo.h>
+
+#include <freerdp/channels/wtsvc.h>
+
+#include "core.h"
+#include "rdpgfx.h"
+#include "rfx_simd.h"
+
+/**
+ * Server to client PDUs are wrapped in RDP_SEGMENTED_DATA [MS-RDPEGFX 2.2.5],
+ * client to server PDUs are not. We never compress, so every segment carries
+ * the RDP8 bulk header with only the compression type set.
+ */
+
+#define RDPGFX_SEGMENTED_SINGLE		0xE0
+#define RDPGFX_SEGMENTED_MULTIPART	0xE1
+#define RDPGFX_PACKET_COMPR_TYPE_RDP8	0x04
+#define RDPGFX_SEGMENT_MAX_SIZE		65535
+
+#define RDPGFX_CACHE_SLOTS		25600
+#define RDPGFX_CACHE_SLOTS_SMALL	4096
+#define RDPGFX_CACHE_SIZE		(100 * 1024 * 1024)
+#define RDPGFX_CACHE_SIZE_SMALL		(16 * 1024 * 1024)
+
+static int freerds_rdpgfx_write_segmented(rdsGfxContext* gfx, BYTE* data, UINT32 length)
+{
+	wStream* s;
+	UINT32 size;
+	UINT32 offset;
+	UINT32 written;
+	UINT16 segmentCount;
+
+	s = gfx->ps;
+	Stream_SetPosition(s, 0);
+
+	if (length <= RDPGFX_SEGMENT_MAX_SIZE)
+	{
+		Stream_EnsureRemainingCapacity(s, 2 + length);
+
+		Stream_Write_UINT8(s, RDPGFX_SEGMENTED_SINGLE);
+		Stream_Write_UINT8(s, RDPGFX_PACKET_COMPR_TYPE_RDP8);
+		Stream_Write(s, data, length);
+	}
+	else
+	{
+		segmentCount = (length + RDPGFX_SEGMENT_MAX_SIZE - 1) / RDPGFX_SEGMENT_MAX_SIZE;
+
+		Stream_EnsureRemainingCapacity(s, 7 + (segmentCount * 5) + length);
+
+		Stream_Write_UINT8(s, RDPGFX_SEGMENTED_MULTIPART);
+		Stream_Write_UINT16(s, segmentCount);
+		Stream_Write_UINT32(s, length); /* uncompressedSize */
+
+		for (offset = 0; offset < length; offset += size)
+		{
+			size = length - offset;
+
+			if (size > RDPGFX_SEGMENT_MAX_SIZE)
+				size = RDPGFX_SEGMENT_MAX_SIZE;
+
+			Stream_Write_UINT32(s, size + 1);
+			Stream_Write_UINT8(s, RDPGFX_PACKET_COMPR_TYPE_RDP8);
+			Stream_Write(s, &data[offset], size);
+		}
+	}
+
+	if (!WTSVirtualChannelWrite(gfx->channel, Stream_Buffer(s), Stream_GetPosition(s), &written))
+	{
+		fprintf(stderr, "%s: failed to write %d bytes\n", __FUNCTION__, (int) Stream_GetPosition(s));
+		return -1;
+	}
+
+	return 0;
+}
+
+static wStream* freerds_rdpgfx_pdu_begin(rdsGfxContext* gfx, UINT16 cmdId, UINT32 bodyLength)
+{
+	wStream* s = gfx->s;
+
+	Stream_SetPosition(s, 0);
+	Stream_EnsureRemainingCapacity(s, RDPGFX_HEADER_SIZE + bodyLength);
+
+	Stream_Write_UINT16(s, cmdId);
+	Stream_Write_UINT16(s, 0); /* flags */
+	Stream_Write_UINT32(s, RDPGFX_HEADER_SIZE + bodyLength); /* pduLength */
+
+	return s;
+}
+
+static int freerds_rdpgfx_pdu_end(rdsGfxContext* gfx)
+{
+	wStream* s = gfx->s;
+
+	return freerds_rdpgfx_write_segmented(gfx, Stream_Buffer(s), Stream_GetPosition(s));
+}
+
+static void freerds_rdpgfx_write_rect16(wStream* s, int left, int top, int right, int bottom)
+{
+	Stream_Write_UINT16(s, left);
+	Stream_Write_UINT16(s, top);
+	Stream_Write_UINT16(s, right);
+	Stream_Write_UINT16(s, bottom);
+}
+
+/**
+ * Server PDUs
+ */
+
+static int freerds_rdpgfx_send_caps_confirm(rdsGfxContext* gfx)
+{
+	wStream* s;
+
+	s = freerds_rdpgfx_pdu_begin(gfx, RDPGFX_CMDID_CAPSCONFIRM, 12);
+
+	Stream_Write_UINT32(s, gfx->version);
+	Stream_Write_UINT32(s, 4); /* capsDataLength */
+	Stream_Write_UINT32(s, gfx->capsFlags);
+
+	return freerds_rdpgfx_pdu_end(gfx);
+}
+
+static int freerds_rdpgfx_send_reset_graphics(rdsGfxContext* gfx)
+{
+	wStream* s;
+
+	s = freerds_rdpgfx_pdu_begin(gfx, RDPGFX_CMDID_RESETGRAPHICS,
+			RDPGFX_RESET_GRAPHICS_PDU_SIZE - RDPGFX_HEADER_SIZE);
+
+	Stream_Write_UINT32(s, gfx->surfaceWidth);
+	Stream_Write_UINT32(s, gfx->surfaceHeight);
+	Stream_Write_UINT32(s, 1); /* monitorCount */
+
+	Stream_Write_UINT32(s, 0); /* left */
+	Stream_Write_UINT32(s, 0); /* top */
+	Stream_Write_UINT32(s, gfx->surfaceWidth - 1); /* right */
+	Stream_Write_UINT32(s, gfx->surfaceHeight - 1); /* bottom */
+	Stream_Write_UINT32(s, 0x00000001); /* flags (MONITOR_PRIMARY) */
+
+	Stream_Zero(s, RDPGFX_RESET_GRAPHICS_PDU_SIZE - Stream_GetPosition(s)); /* pad */
+
+	return freerds_rdpgfx_pdu_end(gfx);
+}
+
+static int freerds_rdpgfx_send_create_surface(rdsGfxContext* gfx)
+{
+	wStream* s;
+
+	s = freerds_rdpgfx_pdu_begin(gfx, RDPGFX_CMDID_CREATESURFACE, 7);
+
+	Stream_Write_UINT16(s, gfx->surfaceId);
+	Stream_Write_UINT16(s, gfx->surfaceWidth);
+	Stream_Write_UINT16(s, gfx->surfaceHeight);
+	Stream_Write_UINT8(s, RDPGFX_PIXEL_FORMAT_XRGB_8888);
+
+	return freerds_rdpgfx_pdu_end(gfx);
+}
+
+static int freerds_rdpgfx_send_map_surface_to_output(rdsGfxContext* gfx)
+{
+	wStream* s;
+
+	s = freerds_rdpgfx_pdu_begin(gfx, RDPGFX_CMDID_MAPSURFACETOOUTPUT, 12);
+
+	Stream_Write_UINT16(s, gfx->surfaceId);
+	Stream_Write_UINT16(s, 0); /* reserved */
+	Stream_Write_UINT32(s, 0); /* outputOriginX */
+	Stream_Write_UINT32(s, 0); /* outputOriginY */
+
+	return freerds_rdpgfx_pdu_end(gfx);
+}
+
+static int freerds_rdpgfx_send_cache_import_reply(rdsGfxContext* gfx)
+{
+	wStream* s;
+
+	/* we do not keep a persistent cache, so nothing is ever imported */
+
+	s = freerds_rdpgfx_pdu_begin(gfx, RDPGFX_CMDID_CACHEIMPORTREPLY, 2);
+
+	Stream_Write_UINT16(s, 0); /* importedEntriesCount */
+
+	return freerds_rdpgfx_pdu_end(gfx);
+}
+
+static int freerds_rdpgfx_send_wire_to_surface(rdsGfxContext* gfx, UINT16 codecId,
+		int left, int top, int right, int bottom, BYTE* data, UINT32 length)
+{
+	wStream* s;
+
+	s = freerds_rdpgfx_pdu_begin(gfx, RDPGFX_CMDID_WIRETOSURFACE_1, 17 + length);
+
+	Stream_Write_UINT16(s, gfx->surfaceId);
+	Stream_Write_UINT16(s, codecId);
+	Stream_Write_UINT8(s, RDPGFX_PIXEL_FORMAT_XRGB_8888);
+	freerds_rdpgfx_write_rect16(s, left, top, right, bottom);
+	Stream_Write_UINT32(s, length);
+	Stream_Write(s, data, length);
+
+	return freerds_rdpgfx_pdu_end(gfx);
+}
+
+static int freerds_rdpgfx_send_surface_to_cache(rdsGfxContext* gfx, UINT64 cacheKey, int cacheSlot,
+		int left, int top, int right, int bottom)
+{
+	wStream* s;
+
+	s = freerds_rdpgfx_pdu_begin(gfx, RDPGFX_CMDID_SURFACETOCACHE, 20);
+
+	Stream_Write_UINT16(s, gfx->surfaceId);
+	Stream_Write_UINT64(s, cacheKey);
+	Stream_Write_UINT16(s, cacheSlot);
+	freerds_rdpgfx_write_rect16(s, left, top, right, bottom);
+
+	return freerds_rdpgfx_pdu_end(gfx);
+}
+
+static int freerds_rdpgfx_send_cache_to_surface(rdsGfxContext* gfx, int cacheSlot, int x, int y)
+{
+	wStream* s;
+
+	s = freerds_rdpgfx_pdu_begin(gfx, RDPGFX_CMDID_CACHETOSURFACE, 10);
+
+	Stream_Write_UINT16(s, cacheSlot);
+	Stream_Write_UINT16(s, gfx->surfaceId);
+	Stream_Write_UINT16(s, 1); /* destPtsCount */
+	Stream_Write_UINT16(s, x);
+	Stream_Write_UINT16(s, y);
+
+	return freerds_rdpgfx_pdu_end(gfx);
+}
+
+static int freerds_rdpgfx_create_surface(rdsGfxContext* gfx)
+{
+	rdpSettings* settings = gfx->connection->settings;
+
+	gfx->surfaceId = 1;
+	gfx->surfaceWidth = settings->DesktopWidth;
+	gfx->surfaceHeight = settings->DesktopHeight;
+
+	if (gfx->rfx_context)
+	{
+		gfx->rfx_context->width = gfx->surfaceWidth;
+		gfx->rfx_context->height = gfx->surfaceHeight;
+	}
+
+	if (freerds_rdpgfx_send_reset_graphics(gfx) < 0)
+		return -1;
+
+	if (freerds_rdpgfx_send_create_surface(gfx) < 0)
+		return -1;
+
+	if (freerds_rdpgfx_send_map_surface_to_output(gfx) < 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Bitmap cache
+ *
+ * Only full 64x64 tiles are cached. Tiles are keyed by a 64-bit hash of their
+ * pixels, slots are recycled round-robin once the client budget is exhausted.
+ */
+
+static UINT64 freerds_rdpgfx_tile_hash(BYTE* data, int scanline, int width, int height)
+{
+	int x, y;
+	UINT32* pixel;
+	UINT64 hash = 0xCBF29CE484222325ULL;
+
+	for (y = 0; y < height; y++)
+	{
+		pixel = (UINT32*) &data[y * scanline];
+
+		for (x = 0; x < width; x++)
+		{
+			hash ^= (pixel[x] & 0x00FFFFFF);
+			hash *= 0x100000001B3ULL;
+		}
+	}
+
+	return hash;
+}
+
+static int freerds_rdpgfx_cache_lookup(rdsGfxContext* gfx, UINT64 key)
+{
+	int slot;
+
+	slot = gfx->CacheBuckets[key % RDPGFX_CACHE_HASH_BUCKETS];
+
+	while (slot > 0)
+	{
+		if (gfx->CacheKeys[slot] == key)
+			return slot;
+
+		slot = gfx->CacheNext[slot];
+	}
+
+	return 0;
+}
+
+static void freerds_rdpgfx_cache_unlink(rdsGfxContext* gfx, int slot)
+{
+	int* link;
+
+	link = &(gfx->CacheBuckets[gfx->CacheKeys[slot] % RDPGFX_CACHE_HASH_BUCKETS]);
+
+	while (*link > 0)
+	{
+		if (*link == slot)
+		{
+			*link = gfx->CacheNext[slot];
+			break;
+		}
+
+		link = &(gfx->CacheNext[*link]);
+	}
+
+	gfx->CacheKeys[slot] = 0;
+	gfx->CacheNext[slot] = 0;
+}
+
+static int freerds_rdpgfx_cache_insert(rdsGfxContext* gfx, UINT64 key)
+{
+	int slot;
+	int bucket;
+
+	slot = gfx->NextCacheSlot;
+	gfx->NextCacheSlot = (slot % gfx->MaxCacheSlots) + 1;
+
+	if (gfx->CacheKeys[slot])
+		freerds_rdpgfx_cache_unlink(gfx, slot);
+
+	bucket = key % RDPGFX_CACHE_HASH_BUCKETS;
+
+	gfx->CacheKeys[slot] = key;
+	gfx->CacheNext[slot] = gfx->CacheBuckets[bucket];
+	gfx->CacheBuckets[bucket] = slot;
+
+	return slot;
+}
+
+static void freerds_rdpgfx_cache_reset(rdsGfxContext* gfx)
+{
+	int maxSlots;
+	int maxSize;
+
+	free(gfx->CacheKeys);
+	free(gfx->CacheNext);
+
+	maxSlots = (gfx->capsFlags & RDPGFX_CAPS_FLAG_SMALL_CACHE) ? RDPGFX_CACHE_SLOTS_SMALL : RDPGFX_CACHE_SLOTS;
+	maxSize = (gfx->capsFlags & RDPGFX_CAPS_FLAG_SMALL_CACHE) ? RDPGFX_CACHE_SIZE_SMALL : RDPGFX_CACHE_SIZE;
+
+	gfx->MaxCacheSlots = maxSize / (RDPGFX_CACHE_TILE_SIZE * RDPGFX_CACHE_TILE_SIZE * 4);
+
+	if (gfx->MaxCacheSlots > maxSlots)
+		gfx->MaxCacheSlots = maxSlots;
+
+	gfx->NextCacheSlot = 1;
+
+	/* cache slots are 1-based */
+	gfx->CacheKeys = (UINT64*) calloc(gfx->MaxCacheSlots + 1, sizeof(UINT64));
+	gfx->CacheNext = (int*) calloc(gfx->MaxCacheSlots + 1, sizeof(int));
+
+	ZeroMemory(gfx->CacheBuckets, sizeof(int) * RDPGFX_CACHE_HASH_BUCKETS);
+}
+
+/**
+ * Client PDUs
+ */
+
+static int freerds_rdpgfx_recv_caps_advertise(rdsGfxContext* gfx, wStream* s)
+{
+	UINT16 index;
+	UINT32 flags;
+	UINT32 version;
+	UINT16 capsSetCount;
+	UINT32 capsDataLength;
+
+	if (Stream_GetRemainingLength(s) < 2)
+		return -1;
+
+	Stream_Read_UINT16(s, capsSetCount);
+
+	gfx->version = 0;
+	gfx->capsFlags = 0;
+
+	for (index = 0; index < capsSetCount; index++)
+	{
+		if (Stream_GetRemainingLength(s) < 8)
+			return -1;
+
+		Stream_Read_UINT32(s, version);
+		Stream_Read_UINT32(s, capsDataLength);
+
+		if (Stream_GetRemainingLength(s) < capsDataLength)
+			return -1;
+
+		flags = 0;
+
+		if (capsDataLength >= 4)
+			Stream_Peek_UINT32(s, flags);
+
+		Stream_Seek(s, capsDataLength);
+
+		if ((version == RDPGFX_CAPVERSION_8) || (version == RDPGFX_CAPVERSION_81))
+		{
+			if (version >= gfx->version)
+			{
+				gfx->version = version;
+				gfx->capsFlags = flags;
+			}
+		}
+	}
+
+	if (!gfx->version)
+	{
+		fprintf(stderr, "%s: no supported graphics pipeline capability set\n", __FUNCTION__);
+		return -1;
+	}
+
+	if (freerds_rdpgfx_send_caps_confirm(gfx) < 0)
+		return -1;
+
+	gfx->capsConfirmed = TRUE;
+
+	freerds_rdpgfx_cache_reset(gfx);
+
+	if (freerds_rdpgfx_create_surface(gfx) < 0)
+		return -1;
+
+	gfx->frameId = gfx->lastAckFrameId = 0;
+	gfx->ready = TRUE;
+
+	printf("graphics pipeline ready: version 0x%08X flags 0x%08X, %d cache slots\n",
+			gfx->version, gfx->capsFlags, gfx->MaxCacheSlots);
+
+	/* the new surface starts out black, repaint it from the framebuffer */
+	freerds_rdpgfx_refresh(gfx);
+
+	return 0;
+}
+
+static int freerds_rdpgfx_recv_frame_acknowledge(rdsGfxContext* gfx, wStream* s)
+{
+	UINT32 frameId;
+
+	if (Stream_GetRemainingLength(s) < 12)
+		return -1;
+
+	Stream_Read_UINT32(s, gfx->queueDepth);
+	Stream_Read_UINT32(s, frameId);
+	Stream_Read_UINT32(s, gfx->totalFramesDecoded);
+
+	gfx->ackSuspended = (gfx->queueDepth == RDPGFX_SUSPEND_FRAME_ACKNOWLEDGEMENT) ? TRUE : FALSE;
+
+	if ((INT32) (frameId - gfx->lastAckFrameId) > 0)
+		gfx->lastAckFrameId = frameId;
+
+	return 0;
+}
+
+static int freerds_rdpgfx_recv_pdu(rdsGfxContext* gfx, wStream* s)
+{
+	int status;
+	size_t end;
+	UINT16 cmdId;
+	UINT16 flags;
+	UINT32 pduLength;
+
+	Stream_Read_UINT16(s, cmdId);
+	Stream_Read_UINT16(s, flags);
+	Stream_Read_UINT32(s, pduLength);
+
+	if ((pduLength < RDPGFX_HEADER_SIZE) ||
+			(Stream_GetRemainingLength(s) < (pduLength - RDPGFX_HEADER_SIZE)))
+		return -1;
+
+	end = Stream_GetPosition(s) + pduLength - RDPGFX_HEADER_SIZE;
+
+	switch (cmdId)
+	{
+		case RDPGFX_CMDID_CAPSADVERTISE:
+			status = freerds_rdpgfx_recv_caps_advertise(gfx, s);
+			break;
+
+		case RDPGFX_CMDID_FRAMEACKNOWLEDGE:
+			status = freerds_rdpgfx_recv_frame_acknowledge(gfx, s);
+			break;
+
+		case RDPGFX_CMDID_CACHEIMPORTOFFER:
+			status = freerds_rdpgfx_send_cache_import_reply(gfx);
+			break;
+
+		default:
+			fprintf(stderr, "%s: unhandled pdu 0x%04X\n", __FUNCTION__, cmdId);
+			status = 0;
+			break;
+	}
+
+	Stream_SetPosition(s, end);
+
+	return status;
+}
+
+/**
+ * Channel
+ */
+
+rdsGfxContext* freerds_rdpgfx_new(rdsConnection* connection)
+{
+	rdsGfxContext* gfx;
+
+	gfx = (rdsGfxContext*) calloc(1, sizeof(rdsGfxContext));
+
+	if (!gfx)
+		return NULL;
+
+	gfx->connection = connection;
+
+	gfx->s = Stream_New(NULL, 16384);
+	gfx->rs = Stream_New(NULL, 4096);
+	gfx->ps = Stream_New(NULL, 16384);
+
+	gfx->CacheBuckets = (int*) calloc(RDPGFX_CACHE_HASH_BUCKETS, sizeof(int));
+
+	return gfx;
+}
+
+void freerds_rdpgfx_free(rdsGfxContext* gfx)
+{
+	if (!gfx)
+		return;
+
+	if (gfx->channel)
+		WTSVirtualChannelClose(gfx->channel);
+
+	Stream_Free(gfx->s, TRUE);
+	Stream_Free(gfx->rs, TRUE);
+	Stream_Free(gfx->ps, TRUE);
+
+	freerds_rdpgfx_release_codecs(gfx);
+
+	free(gfx->CacheKeys);
+	free(gfx->CacheNext);
+	free(gfx->CacheBuckets);
+
+	free(gfx);
+}
+
+static int freerds_rdpgfx_init_codecs(rdsGfxContext* gfx)
+{
+	gfx->connection->codecTimestamp = GetTickCount();
+
+	if (gfx->TileBuffer)
+		return 0;
+
+	gfx->es = Stream_New(NULL, 16384);
+	gfx->TileBuffer = (BYTE*) malloc(RDPGFX_CACHE_TILE_SIZE * RDPGFX_CACHE_TILE_SIZE * 4);
+
+	if (!gfx->es || !gfx->TileBuffer)
+		return -1;
+
+	if (gfx->connection->settings->RemoteFxCodec)
+	{
+		gfx->rfx_context = rfx_context_new(TRUE);
+
+		if (!gfx->rfx_context)
+			return -1;
+
+		gfx->rfx_context->mode = RLGR3;
+		gfx->rfx_context->width = gfx->surfaceWidth;
+		gfx->rfx_context->height = gfx->surfaceHeight;
+
+		rfx_context_set_pixel_format(gfx->rfx_context, RDP_PIXEL_FORMAT_B8G8R8A8);
+		freerds_rfx_simd_apply(gfx->rfx_context);
+	}
+
+	return 0;
+}
+
+void freerds_rdpgfx_release_codecs(rdsGfxContext* gfx)
+{
+	if (!gfx)
+		return;
+
+	if (gfx->rfx_context)
+		rfx_context_free(gfx->rfx_context);
+
+	if (gfx->es)
+		Stream_Free(gfx->es, TRUE);
+
+	free(gfx->TileBuffer);
+
+	gfx->rfx_context = NULL;
+	gfx->es = NULL;
+	gfx->TileBuffer = NULL;
+}
+
+BOOL freerds_rdpgfx_has_codecs(rdsGfxContext* gfx)
+{
+	return (gfx && gfx->TileBuffer) ? TRUE : FALSE;
+}
+
+size_t freerds_rdpgfx_get_memory_usage(rdsGfxContext* gfx)
+{
+	size_t size;
+
+	if (!gfx)
+		return 0;
+
+	size = sizeof(rdsGfxContext);
+	size += Stream_Capacity(gfx->s) + Stream_Capacity(gfx->rs) + Stream_Capacity(gfx->ps);
+	size += sizeof(int) * RDPGFX_CACHE_HASH_BUCKETS;
+	size += (sizeof(UINT64) + sizeof(int)) * (gfx->MaxCacheSlots + 1);
+
+	if (gfx->es)
+		size += Stream_Capacity(gfx->es);
+
+	if (gfx->TileBuffer)
+		size += RDPGFX_CACHE_TILE_SIZE * RDPGFX_CACHE_TILE_SIZE * 4;
+
+	return size;
+}
+
+int freerds_rdpgfx_open(rdsGfxContext* gfx)
+{
+	if (gfx->channel)
+		return 0;
+
+	/* fails until the drdynvc static channel has completed its own handshake */
+	gfx->channel = WTSVirtualChannelOpenEx(gfx->connection->vcm,
+			RDPGFX_DVC_CHANNEL_NAME, WTS_CHANNEL_OPTION_DYNAMIC);
+
+	if (!gfx->channel)
+		return -1;
+
+	gfx->opened = TRUE;
+
+	return 0;
+}
+
+HANDLE freerds_rdpgfx_get_event_handle(rdsGfxContext* gfx)
+{
+	void* buffer;
+	UINT32 length;
+	HANDLE event = NULL;
+
+	if (!gfx || !gfx->channel)
+		return NULL;
+
+	if (WTSVirtualChannelQuery(gfx->channel, WTSVirtualEventHandle, &buffer, &length))
+	{
+		if (length == sizeof(HANDLE))
+			CopyMemory(&event, buffer, sizeof(HANDLE));
+
+		WTSFreeMemory(buffer);
+	}
+
+	return event;
+}
+
+int freerds_rdpgfx_check(rdsGfxContext* gfx)
+{
+	BOOL status;
+	wStream* s;
+	UINT32 bytesReturned;
+
+	if (!gfx->channel)
+	{
+		if (!gfx->opened)
+			freerds_rdpgfx_open(gfx);
+
+		return 0;
+	}
+
+	s = gfx->rs;
+
+	while (1)
+	{
+		Stream_SetPosition(s, 0);
+		bytesReturned = 0;
+
+		status = WTSVirtualChannelRead(gfx->channel, 0, Stream_Buffer(s),
+				Stream_Capacity(s), &bytesReturned);
+
+		if (!status)
+		{
+			if (bytesReturned <= Stream_Capacity(s))
+				break;
+
+			Stream_EnsureCapacity(s, bytesReturned);
+			continue;
+		}
+
+		if (bytesReturned < 1)
+			break;
+
+		Stream_SetLength(s, bytesReturned);
+
+		while (Stream_GetRemainingLength(s) >= RDPGFX_HEADER_SIZE)
+		{
+			if (freerds_rdpgfx_recv_pdu(gfx, s) < 0)
+			{
+				fprintf(stderr, "%s: malformed pdu, disabling graphics pipeline\n", __FUNCTION__);
+				gfx->ready = FALSE;
+				WTSVirtualChannelClose(gfx->channel);
+				gfx->channel = NULL;
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+BOOL freerds_rdpgfx_is_ready(rdsGfxContext* gfx)
+{
+	return (gfx && gfx->ready) ? TRUE : FALSE;
+}
+
+int freerds_rdpgfx_get_in_flight_frames(rdsGfxContext* gfx)
+{
+	if (gfx->ackSuspended)
+		return 0;
+
+	return (int) (gfx->frameId - gfx->lastAckFrameId);
+}
+
+int freerds_rdpgfx_start_frame(rdsGfxContext* gfx)
+{
+	wStream* s;
+	UINT32 timestamp;
+	SYSTEMTIME st;
+
+	GetLocalTime(&st);
+
+	timestamp = (st.wHour << 22) | (st.wMinute << 16) | (st.wSecond << 10) | st.wMilliseconds;
+
+	s = freerds_rdpgfx_pdu_begin(gfx, RDPGFX_CMDID_STARTFRAME, 8);
+
+	Stream_Write_UINT32(s, timestamp);
+	Stream_Write_UINT32(s, ++gfx->frameId);
+
+	return freerds_rdpgfx_pdu_end(gfx);
+}
+
+int freerds_rdpgfx_end_frame(rdsGfxContext* gfx)
+{
+	wStream* s;
+
+	s = freerds_rdpgfx_pdu_begin(gfx, RDPGFX_CMDID_ENDFRAME, 4);
+
+	Stream_Write_UINT32(s, gfx->frameId);
+
+	return freerds_rdpgfx_pdu_end(gfx);
+}
+
+static int freerds_rdpgfx_encode_uncompressed(rdsGfxContext* gfx, BYTE* data, int scanline, RFX_RECT* rect)
+{
+	int y;
+	BYTE* src;
+	BYTE* dst;
+	UINT32 length;
+
+	length = rect->width * rect->height * 4;
+
+	if (rect->width * rect->height > RDPGFX_CACHE_TILE_SIZE * RDPGFX_CACHE_TILE_SIZE)
+		return -1;
+
+	src = &data[(rect->y * scanline) + (rect->x * 4)];
+	dst = gfx->TileBuffer;
+
+	for (y = 0; y < rect->height; y++)
+	{
+		CopyMemory(dst, src, rect->width * 4);
+		src += scanline;
+		dst += rect->width * 4;
+	}
+
+	return freerds_rdpgfx_send_wire_to_surface(gfx, RDPGFX_CODECID_UNCOMPRESSED,
+			rect->x, rect->y, rect->x + rect->width, rect->y + rect->height, gfx->TileBuffer, length);
+}
+
+int freerds_rdpgfx_surface_bits(rdsGfxContext* gfx, RDS_MSG_PAINT_RECT* msg)
+{
+	int i, k;
+	int x, y;
+	int slot;
+	BYTE* data;
+	BYTE* tile;
+	int scanline;
+	int numRects;
+	int numMessages;
+	UINT64* keys;
+	RFX_RECT* rects;
+	RFX_MESSAGE* messages;
+	rdpSettings* settings;
+	wStream* rs;
+
+	settings = gfx->connection->settings;
+
+	if (freerds_rdpgfx_init_codecs(gfx) < 0)
+		return -1;
+
+	if (msg->fbSegmentId)
+	{
+		data = msg->framebuffer->fbSharedMemory;
+		scanline = msg->framebuffer->fbScanline;
+	}
+	else
+	{
+		return -1;
+	}
+
+	numRects = ((msg->nWidth + RDPGFX_CACHE_TILE_SIZE - 1) / RDPGFX_CACHE_TILE_SIZE) *
+			((msg->nHeight + RDPGFX_CACHE_TILE_SIZE - 1) / RDPGFX_CACHE_TILE_SIZE);
+
+	rects = (RFX_RECT*) malloc(sizeof(RFX_RECT) * numRects);
+	keys = (UINT64*) malloc(sizeof(UINT64) * numRects);
+
+	k = 0;
+
+	for (y = msg->nTopRect; y < msg->nTopRect + msg->nHeight; y += RDPGFX_CACHE_TILE_SIZE)
+	{
+		for (x = msg->nLeftRect; x < msg->nLeftRect + msg->nWidth; x += RDPGFX_CACHE_TILE_SIZE)
+		{
+			rects[k].x = x;
+			rects[k].y = y;
+			rects[k].width = MIN(RDPGFX_CACHE_TILE_SIZE, msg->nLeftRect + msg->nWidth - x);
+			rects[k].height = MIN(RDPGFX_CACHE_TILE_SIZE, msg->nTopRect + msg->nHeight - y);
+			keys[k] = 0;
+
+			if ((rects[k].width == RDPGFX_CACHE_TILE_SIZE) && (rects[k].height == RDPGFX_CACHE_TILE_SIZE))
+			{
+				tile = &data[(y * scanline) + (x * 4)];
+				keys[k] = freerds_rdpgfx_tile_hash(tile, scanline, rects[k].width, rects[k].height);
+
+				slot = freerds_rdpgfx_cache_lookup(gfx, keys[k]);
+
+				if (slot)
+				{
+					freerds_rdpgfx_send_cache_to_surface(gfx, slot, x, y);
+					continue;
+				}
+			}
+
+			k++;
+		}
+	}
+
+	numRects = k;
+
+	if (numRects > 0)
+	{
+		if (gfx->rfx_context)
+		{
+			/* RemoteFX tiles are positioned relative to the destination rectangle */
+
+			for (i = 0; i < numRects; i++)
+			{
+				rects[i].x -= msg->nLeftRect;
+				rects[i].y -= msg->nTopRect;
+			}
+
+			messages = rfx_encode_messages(gfx->rfx_context, rects, numRects,
+					&data[(msg->nTopRect * scanline) + (msg->nLeftRect * 4)],
+					msg->nWidth, msg->nHeight, scanline, &numMessages,
+					settings->MultifragMaxRequestSize);
+
+			rs = gfx->es;
+
+			for (i = 0; i < numMessages; i++)
+			{
+				Stream_SetPosition(rs, 0);
+				rfx_write_message(gfx->rfx_context, rs, &messages[i]);
+				rfx_message_free(gfx->rfx_context, &messages[i]);
+
+				freerds_rdpgfx_send_wire_to_surface(gfx, RDPGFX_CODECID_CAVIDEO,
+						msg->nLeftRect, msg->nTopRect,
+						msg->nLeftRect + msg->nWidth, msg->nTopRect + msg->nHeight,
+						Stream_Buffer(rs), Stream_GetPosition(rs));
+			}
+
+			free(messages);
+
+			for (i = 0; i < numRects; i++)
+			{
+				rects[i].x += msg->nLeftRect;
+				rects[i].y += msg->nTopRect;
+			}
+		}
+		else
+		{
+			for (i = 0; i < numRects; i++)
+				freerds_rdpgfx_encode_uncompressed(gfx, data, scanline, &rects[i]);
+		}
+
+		/* the client now holds the new tiles on the surface, copy them to the cache */
+
+		for (i = 0; i < numRects; i++)
+		{
+			if (!keys[i])
+				continue;
+
+			slot = freerds_rdpgfx_cache_insert(gfx, keys[i]);
+
+			freerds_rdpgfx_send_surface_to_cache(gfx, keys[i], slot, rects[i].x, rects[i].y,
+					rects[i].x + rects[i].width, rects[i].y + rects[i].height);
+		}
+	}
+
+	free(rects);
+	free(keys);
+
+	return 0;
+}
+
+int freerds_rdpgfx_refresh(rdsGfxContext* gfx)
+{
+	RDS_MSG_PAINT_RECT msg;
+	rdsModuleConnector* connector = gfx ? gfx->connection->connector : NULL;
+
+	if (!gfx || !gfx->ready || !connector || !connector->framebuffer.fbAttached)
+		return 0;
+
+	ZeroMemory(&msg, sizeof(RDS_MSG_PAINT_RECT));
+
+	msg.type = RDS_SERVER_PAINT_RECT;
+	msg.nWidth = MIN(gfx->surfaceWidth, connector->framebuffer.fbWidth);
+	msg.nHeight = MIN(gfx->surfaceHeight, connector->framebuffer.fbHeight);
+	msg.framebuffer = &(connector->framebuffer);
+	msg.fbSegmentId = connector->framebuffer.fbSegmentId;
+
+	freerds_rdpgfx_start_frame(gfx);
+	freerds_rdpgfx_surface_bits(gfx, &msg);
+	freerds_rdpgfx_end_frame(gfx);
+
+	return 0;
+}
+
+int freerds_rdpgfx_solid_fill(rdsGfxContext* gfx, int x, int y, int width, int height, UINT32 color)
+{
+	wStream* s;
+
+	s = freerds_rdpgfx_pdu_begin(gfx, RDPGFX_CMDID_SOLIDFILL, 16);
+
+	Stream_Write_UINT16(s, gfx->surfaceId);
+	Stream_Write_UINT8(s, color & 0xFF); /* B */
+	Stream_Write_UINT8(s, (color >> 8) & 0xFF); /* G */
+	Stream_Write_UINT8(s, (color >> 16) & 0xFF); /* R */
+	Stream_Write_UINT8(s, 0xFF); /* XA */
+	Stream_Write_UINT16(s, 1); /* fillRectCount */
+	freerds_rdpgfx_write_rect16(s, x, y, x + width, y + height);
+
+	return freerds_rdpgfx_pdu_end(gfx);
+}
+
+int freerds_rdpgfx_surface_to_surface(rdsGfxContext* gfx, int srcX, int srcY,
+		int width, int height, int dstX, int dstY)
+{
+	wStream* s;
+
+	s = freerds_rdpgfx_pdu_begin(gfx, RDPGFX_CMDID_SURFACETOSURFACE, 18);
+
+	Stream_Write_UINT16(s, gfx->surfaceId); /* surfaceIdSrc */
+	Stream_Write_UINT16(s, gfx->surfaceId); /* surfaceIdDest */
+	freerds_rdpgfx_write_rect16(s, srcX, srcY, srcX + width, srcY + height);
+	Stream_Write_UINT16(s, 1); /* destPtsCount */
+	Stream_Write_UINT16(s, dstX);
+	Stream_Write_UINT16(s, dstY);
+
+	return freerds_rdpgfx_pdu_end(gfx);
+}
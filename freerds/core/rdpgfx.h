@@ -0,0 +1,145 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Graphics Pipeline Extension (MS-RDPEGFX)
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FREERDS_CORE_RDPGFX_H
+#define FREERDS_CORE_RDPGFX_H
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/stream.h>
+
+#include <freerdp/freerdp.h>
+#include <freerdp/codec/rfx.h>
+
+#include <freerds/freerds.h>
+
+#define RDPGFX_DVC_CHANNEL_NAME			"Microsoft::Windows::RDS::Graphics"
+
+#define RDPGFX_CMDID_WIRETOSURFACE_1		0x0001
+#define RDPGFX_CMDID_WIRETOSURFACE_2		0x0002
+#define RDPGFX_CMDID_DELETEENCODINGCONTEXT	0x0003
+#define RDPGFX_CMDID_SOLIDFILL			0x0004
+#define RDPGFX_CMDID_SURFACETOSURFACE		0x0005
+#define RDPGFX_CMDID_SURFACETOCACHE		0x0006
+#define RDPGFX_CMDID_CACHETOSURFACE		0x0007
+#define RDPGFX_CMDID_EVICTCACHEENTRY		0x0008
+#define RDPGFX_CMDID_CREATESURFACE		0x0009
+#define RDPGFX_CMDID_DELETESURFACE		0x000A
+#define RDPGFX_CMDID_STARTFRAME			0x000B
+#define RDPGFX_CMDID_ENDFRAME			0x000C
+#define RDPGFX_CMDID_FRAMEACKNOWLEDGE		0x000D
+#define RDPGFX_CMDID_RESETGRAPHICS		0x000E
+#define RDPGFX_CMDID_MAPSURFACETOOUTPUT		0x000F
+#define RDPGFX_CMDID_CACHEIMPORTOFFER		0x0010
+#define RDPGFX_CMDID_CACHEIMPORTREPLY		0x0011
+#define RDPGFX_CMDID_CAPSADVERTISE		0x0012
+#define RDPGFX_CMDID_CAPSCONFIRM		0x0013
+
+#define RDPGFX_CODECID_UNCOMPRESSED		0x0000
+#define RDPGFX_CODECID_CAVIDEO			0x0003
+#define RDPGFX_CODECID_CLEARCODEC		0x0008
+#define RDPGFX_CODECID_PROGRESSIVE		0x0009
+#define RDPGFX_CODECID_PLANAR			0x000A
+
+#define RDPGFX_PIXEL_FORMAT_XRGB_8888		0x20
+#define RDPGFX_PIXEL_FORMAT_ARGB_8888		0x21
+
+#define RDPGFX_CAPVERSION_8			0x00080004
+#define RDPGFX_CAPVERSION_81			0x00080105
+
+#define RDPGFX_CAPS_FLAG_THINCLIENT		0x00000001
+#define RDPGFX_CAPS_FLAG_SMALL_CACHE		0x00000002
+
+#define RDPGFX_HEADER_SIZE			8
+#define RDPGFX_RESET_GRAPHICS_PDU_SIZE		340
+#define RDPGFX_SUSPEND_FRAME_ACKNOWLEDGEMENT	0xFFFFFFFF
+
+#define RDPGFX_CACHE_TILE_SIZE			64
+#define RDPGFX_CACHE_HASH_BUCKETS		4096
+
+struct rds_gfx_context
+{
+	rdsConnection* connection;
+
+	void* channel;
+	BOOL opened;
+	BOOL ready;
+	BOOL capsConfirmed;
+
+	UINT32 version;
+	UINT32 capsFlags;
+
+	UINT16 surfaceId;
+	UINT32 surfaceWidth;
+	UINT32 surfaceHeight;
+
+	UINT32 frameId;
+	UINT32 lastAckFrameId;
+	UINT32 queueDepth;
+	UINT32 totalFramesDecoded;
+	BOOL ackSuspended;
+
+	wStream* s;
+	wStream* rs;
+	wStream* ps;
+	wStream* es;
+
+	RFX_CONTEXT* rfx_context;
+
+	int MaxCacheSlots;
+	int NextCacheSlot;
+	UINT64* CacheKeys;
+	int* CacheNext;
+	int* CacheBuckets;
+	BYTE* TileBuffer;
+};
+typedef struct rds_gfx_context rdsGfxContext;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+rdsGfxContext* freerds_rdpgfx_new(rdsConnection* connection);
+void freerds_rdpgfx_free(rdsGfxContext* gfx);
+
+int freerds_rdpgfx_open(rdsGfxContext* gfx);
+int freerds_rdpgfx_check(rdsGfxContext* gfx);
+
+void freerds_rdpgfx_release_codecs(rdsGfxContext* gfx);
+BOOL freerds_rdpgfx_has_codecs(rdsGfxContext* gfx);
+size_t freerds_rdpgfx_get_memory_usage(rdsGfxContext* gfx);
+HANDLE freerds_rdpgfx_get_event_handle(rdsGfxContext* gfx);
+
+BOOL freerds_rdpgfx_is_ready(rdsGfxContext* gfx);
+int freerds_rdpgfx_get_in_flight_frames(rdsGfxContext* gfx);
+
+int freerds_rdpgfx_start_frame(rdsGfxContext* gfx);
+int freerds_rdpgfx_end_frame(rdsGfxContext* gfx);
+
+int freerds_rdpgfx_surface_bits(rdsGfxContext* gfx, RDS_MSG_PAINT_RECT* msg);
+int freerds_rdpgfx_refresh(rdsGfxContext* gfx);
+int freerds_rdpgfx_solid_fill(rdsGfxContext* gfx, int x, int y, int width, int height, UINT32 color);
+int freerds_rdpgfx_surface_to_surface(rdsGfxContext* gfx, int srcX, int srcY,
+		int width, int height, int dstX, int dstY);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FREERDS_CORE_RDPGFX_H */
@@ -0,0 +1,864 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * RemoteFX Encoder Kernels
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#include <winpr/crt.h>
+#include <winpr/sysinfo.h>
+
+#include <freerdp/primitives.h>
+
+#include "rfx_simd.h"
+
+/**
+ * libfreerdp-codec already selects SSE2 quantization and DWT encode
+ * routines on x86, and SSE2 color conversion through its primitives, so
+ * only what it lacks is carried here: AVX2 versions of the three stages,
+ * and NEON versions for ARM, where the codec only has NEON decode routines.
+ *
+ * Quantization and DWT are replaced through the RFX_CONTEXT routine
+ * pointers, RGB to YCbCr through the primitives table the encoder calls.
+ * RLGR3 entropy coding is called directly by the encoder and cannot be
+ * replaced from outside libfreerdp-codec.
+ *
+ * Every kernel produces exactly what the C code does, INT16 stores
+ * truncating, and is only installed once it matches the routine it
+ * replaces on fixed pseudo-random tiles, so a mismatch never reaches the
+ * wire.
+ */
+
+typedef void (*pfnRfxQuantizationEncode)(INT16* buffer, const UINT32* quantization_values);
+typedef void (*pfnRfxDwt2DEncode)(INT16* buffer, INT16* dwt_buffer);
+typedef pstatus_t (*pfnRfxRGBToYCbCr)(const INT16* pSrc[3], INT32 srcStep,
+		INT16* pDst[3], INT32 dstStep, const prim_size_t* roi);
+
+static pfnRfxQuantizationEncode g_QuantizationEncode = NULL;
+static pfnRfxDwt2DEncode g_Dwt2DEncode = NULL;
+static pfnRfxRGBToYCbCr g_RGBToYCbCr = NULL;
+static const char* g_TransformName = "codec";
+static const char* g_ColorName = "codec";
+static char g_KernelName[64] = "codec";
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define RFX_SIMD_X86
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define RFX_SIMD_NEON
+#endif
+
+#if defined(RFX_SIMD_X86) || defined(RFX_SIMD_NEON)
+
+#define RFX_CLAMP(_v, _min, _max)	(((_v) < (_min)) ? (_min) : (((_v) > (_max)) ? (_max) : (_v)))
+
+/**
+ * The C color conversion of libfreerdp-codec: 15-bit fixed point factors,
+ * the sum scaled down by 10 bits to 11.5 fixed point coefficients.
+ */
+
+static void rfx_rgb_to_ycbcr_pixel(INT32 r, INT32 g, INT32 b, INT16* y, INT16* cb, INT16* cr)
+{
+	INT32 vy = (r * 9798 + g * 19235 + b * 3735) >> 10;
+	INT32 vcb = (r * -5535 + g * -10868 + b * 16403) >> 10;
+	INT32 vcr = (r * 16377 + g * -13714 + b * -2663) >> 10;
+
+	*y = (INT16) RFX_CLAMP(vy - 4096, -4096, 4095);
+	*cb = (INT16) RFX_CLAMP(vcb, -4096, 4095);
+	*cr = (INT16) RFX_CLAMP(vcr, -4096, 4095);
+}
+
+#endif
+
+#ifdef RFX_SIMD_X86
+
+#include <immintrin.h>
+
+#define RFX_AVX2 __attribute__((target("avx2")))
+
+/* INT16 store semantics: keep the low 16 bits, sign extended */
+RFX_AVX2 static inline __m256i rfx_trunc_avx2(__m256i v)
+{
+	return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+}
+
+RFX_AVX2 static inline __m256i rfx_widen8_avx2(const INT16* p)
+{
+	return _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*) p));
+}
+
+RFX_AVX2 static inline void rfx_store8_avx2(INT16* p, __m256i v)
+{
+	v = rfx_trunc_avx2(v);
+	_mm_storeu_si128((__m128i*) p, _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+}
+
+RFX_AVX2 static inline void rfx_store16_avx2(INT16* p, __m256i lo, __m256i hi)
+{
+	__m256i v = _mm256_packs_epi32(rfx_trunc_avx2(lo), rfx_trunc_avx2(hi));
+	_mm256_storeu_si256((__m256i*) p, _mm256_permute4x64_epi64(v, 0xD8));
+}
+
+/* the even and odd samples of interleaved INT16 pairs */
+RFX_AVX2 static inline __m256i rfx_even_avx2(__m256i v)
+{
+	return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+}
+
+RFX_AVX2 static inline __m256i rfx_odd_avx2(__m256i v)
+{
+	return _mm256_srai_epi32(v, 16);
+}
+
+/**
+ * Quantization: (x + half) >> factor per sub-band, followed by the
+ * (x + 16) >> 5 pass over the whole tile, fused into one sweep.
+ */
+
+RFX_AVX2 static void rfx_quantization_encode_block_avx2(INT16* buffer, int size, UINT32 factor)
+{
+	int i;
+	__m256i lo, hi;
+	__m256i half = _mm256_set1_epi32(factor ? (1 << (factor - 1)) : 0);
+	__m128i shift = _mm_cvtsi32_si128(factor);
+	__m256i round = _mm256_set1_epi32(16);
+
+	for (i = 0; i < size; i += 16)
+	{
+		lo = rfx_widen8_avx2(&buffer[i]);
+		hi = rfx_widen8_avx2(&buffer[i + 8]);
+
+		if (factor)
+		{
+			lo = rfx_trunc_avx2(_mm256_sra_epi32(_mm256_add_epi32(lo, half), shift));
+			hi = rfx_trunc_avx2(_mm256_sra_epi32(_mm256_add_epi32(hi, half), shift));
+		}
+
+		lo = _mm256_srai_epi32(_mm256_add_epi32(lo, round), 5);
+		hi = _mm256_srai_epi32(_mm256_add_epi32(hi, round), 5);
+
+		rfx_store16_avx2(&buffer[i], lo, hi);
+	}
+}
+
+RFX_AVX2 static void rfx_quantization_encode_avx2(INT16* buffer, const UINT32* quantization_values)
+{
+	rfx_quantization_encode_block_avx2(buffer, 1024, quantization_values[8] - 6); /* HL1 */
+	rfx_quantization_encode_block_avx2(buffer + 1024, 1024, quantization_values[7] - 6); /* LH1 */
+	rfx_quantization_encode_block_avx2(buffer + 2048, 1024, quantization_values[9] - 6); /* HH1 */
+	rfx_quantization_encode_block_avx2(buffer + 3072, 256, quantization_values[5] - 6); /* HL2 */
+	rfx_quantization_encode_block_avx2(buffer + 3328, 256, quantization_values[4] - 6); /* LH2 */
+	rfx_quantization_encode_block_avx2(buffer + 3584, 256, quantization_values[6] - 6); /* HH2 */
+	rfx_quantization_encode_block_avx2(buffer + 3840, 64, quantization_values[2] - 6); /* HL3 */
+	rfx_quantization_encode_block_avx2(buffer + 3904, 64, quantization_values[1] - 6); /* LH3 */
+	rfx_quantization_encode_block_avx2(buffer + 3968, 64, quantization_values[3] - 6); /* HH3 */
+	rfx_quantization_encode_block_avx2(buffer + 4032, 64, quantization_values[0] - 6); /* LL3 */
+}
+
+/**
+ * DWT: vertical lifting over columns, 16 at a time, then horizontal lifting
+ * with even/odd samples split out of the interleaved rows.
+ */
+
+RFX_AVX2 static void rfx_dwt_vertical_avx2(INT16* buffer, INT16* dwt, int subband_width)
+{
+	int x, n;
+	INT16* l;
+	INT16* h;
+	INT16* src;
+	INT16* next;
+	__m256i h_lo, h_hi, l_lo, l_hi;
+	int total_width = subband_width << 1;
+
+	for (n = 0; n < subband_width; n++)
+	{
+		for (x = 0; x < total_width; x += 16)
+		{
+			l = dwt + n * total_width + x;
+			h = l + subband_width * total_width;
+			src = buffer + (n << 1) * total_width + x;
+			next = &src[(n < subband_width - 1) ? 2 * total_width : 0];
+
+			/* H */
+			h_lo = _mm256_add_epi32(rfx_widen8_avx2(src), rfx_widen8_avx2(next));
+			h_hi = _mm256_add_epi32(rfx_widen8_avx2(&src[8]), rfx_widen8_avx2(&next[8]));
+			h_lo = _mm256_srai_epi32(_mm256_sub_epi32(rfx_widen8_avx2(&src[total_width]), _mm256_srai_epi32(h_lo, 1)), 1);
+			h_hi = _mm256_srai_epi32(_mm256_sub_epi32(rfx_widen8_avx2(&src[total_width + 8]), _mm256_srai_epi32(h_hi, 1)), 1);
+			h_lo = rfx_trunc_avx2(h_lo);
+			h_hi = rfx_trunc_avx2(h_hi);
+
+			rfx_store16_avx2(h, h_lo, h_hi);
+
+			/* L */
+			if (n > 0)
+			{
+				l_lo = _mm256_srai_epi32(_mm256_add_epi32(h_lo, rfx_widen8_avx2(h - total_width)), 1);
+				l_hi = _mm256_srai_epi32(_mm256_add_epi32(h_hi, rfx_widen8_avx2(h - total_width + 8)), 1);
+			}
+			else
+			{
+				l_lo = h_lo;
+				l_hi = h_hi;
+			}
+
+			l_lo = _mm256_add_epi32(rfx_widen8_avx2(src), l_lo);
+			l_hi = _mm256_add_epi32(rfx_widen8_avx2(&src[8]), l_hi);
+
+			rfx_store16_avx2(l, l_lo, l_hi);
+		}
+	}
+}
+
+/* one row of the horizontal pass: src -> (high, low) sub-bands */
+RFX_AVX2 static void rfx_dwt_horizontal_row_avx2(INT16* src, INT16* hi, INT16* lo, int subband_width)
+{
+	int n, x;
+	__m256i a, b, v;
+
+	/* high band, the last sample mirrors so it is done in C */
+	for (n = 0; n + 8 < subband_width; n += 8)
+	{
+		x = n << 1;
+		a = _mm256_loadu_si256((__m256i*) &src[x]);
+		b = _mm256_loadu_si256((__m256i*) &src[x + 2]);
+
+		v = _mm256_srai_epi32(_mm256_add_epi32(rfx_even_avx2(a), rfx_even_avx2(b)), 1);
+		v = _mm256_srai_epi32(_mm256_sub_epi32(rfx_odd_avx2(a), v), 1);
+
+		rfx_store8_avx2(&hi[n], v);
+	}
+
+	for (; n < subband_width; n++)
+	{
+		x = n << 1;
+		hi[n] = (src[x + 1] - ((src[x] + src[n < subband_width - 1 ? x + 2 : x]) >> 1)) >> 1;
+	}
+
+	/* low band */
+	lo[0] = src[0] + hi[0];
+
+	for (n = 1; n + 8 <= subband_width; n += 8)
+	{
+		x = n << 1;
+		a = _mm256_loadu_si256((__m256i*) &src[x]);
+
+		v = _mm256_srai_epi32(_mm256_add_epi32(rfx_widen8_avx2(&hi[n]), rfx_widen8_avx2(&hi[n - 1])), 1);
+		v = _mm256_add_epi32(rfx_even_avx2(a), v);
+
+		rfx_store8_avx2(&lo[n], v);
+	}
+
+	for (; n < subband_width; n++)
+	{
+		x = n << 1;
+		lo[n] = src[x] + ((hi[n] + hi[n - 1]) >> 1);
+	}
+}
+
+RFX_AVX2 static void rfx_dwt_2d_encode_block_avx2(INT16* buffer, INT16* dwt, int subband_width)
+{
+	int y;
+	INT16 *hl, *lh, *hh, *ll;
+	INT16 *l_src, *h_src;
+	int total_width = subband_width << 1;
+
+	rfx_dwt_vertical_avx2(buffer, dwt, subband_width);
+
+	hl = buffer;
+	lh = buffer + subband_width * subband_width;
+	hh = buffer + subband_width * subband_width * 2;
+	ll = buffer + subband_width * subband_width * 3;
+
+	l_src = dwt;
+	h_src = dwt + subband_width * subband_width * 2;
+
+	for (y = 0; y < subband_width; y++)
+	{
+		rfx_dwt_horizontal_row_avx2(l_src, hl, ll, subband_width);
+		rfx_dwt_horizontal_row_avx2(h_src, hh, lh, subband_width);
+
+		hl += subband_width;
+		lh += subband_width;
+		hh += subband_width;
+		ll += subband_width;
+
+		l_src += total_width;
+		h_src += total_width;
+	}
+}
+
+RFX_AVX2 static void rfx_dwt_2d_encode_avx2(INT16* buffer, INT16* dwt_buffer)
+{
+	rfx_dwt_2d_encode_block_avx2(buffer, dwt_buffer, 32);
+	rfx_dwt_2d_encode_block_avx2(buffer + 3072, dwt_buffer, 16);
+	rfx_dwt_2d_encode_block_avx2(buffer + 3840, dwt_buffer, 8);
+}
+
+/**
+ * The SSE2 color conversion of libfreerdp-codec works on 16-bit lanes:
+ * samples scaled up by 6 bits, the high half of each product summed, and
+ * all three components clamped to [-128 << 5, 127 << 5].
+ */
+
+static INT16 rfx_mulhi(INT16 a, INT16 b)
+{
+	return (INT16) (((INT32) a * (INT32) b) >> 16);
+}
+
+static void rfx_rgb_to_ycbcr_mulhi_pixel(INT16 r, INT16 g, INT16 b, INT16* y, INT16* cb, INT16* cr)
+{
+	INT16 vy, vcb, vcr;
+
+	r = (INT16) (r << 6);
+	g = (INT16) (g << 6);
+	b = (INT16) (b << 6);
+
+	vy = (INT16) (rfx_mulhi(r, 9798) + rfx_mulhi(g, 19235) + rfx_mulhi(b, 3735) - 4096);
+	vcb = (INT16) (rfx_mulhi(r, -5535) + rfx_mulhi(g, -10868) + rfx_mulhi(b, 16403));
+	vcr = (INT16) (rfx_mulhi(r, 16377) + rfx_mulhi(g, -13714) + rfx_mulhi(b, -2663));
+
+	*y = RFX_CLAMP(vy, -4096, 4064);
+	*cb = RFX_CLAMP(vcb, -4096, 4064);
+	*cr = RFX_CLAMP(vcr, -4096, 4064);
+}
+
+RFX_AVX2 static inline __m256i rfx_dot_mulhi_avx2(__m256i r, __m256i g, __m256i b, INT16 fr, INT16 fg, INT16 fb)
+{
+	__m256i v = _mm256_mulhi_epi16(r, _mm256_set1_epi16(fr));
+	v = _mm256_add_epi16(v, _mm256_mulhi_epi16(g, _mm256_set1_epi16(fg)));
+	return _mm256_add_epi16(v, _mm256_mulhi_epi16(b, _mm256_set1_epi16(fb)));
+}
+
+RFX_AVX2 static pstatus_t rfx_rgb_to_ycbcr_mulhi_avx2(const INT16* pSrc[3], INT32 srcStep,
+		INT16* pDst[3], INT32 dstStep, const prim_size_t* roi)
+{
+	int x, y;
+	const INT16 *rp, *gp, *bp;
+	INT16 *yp, *cbp, *crp;
+	__m256i r, g, b, v;
+	__m256i min = _mm256_set1_epi16(-4096); /* -128 << 5 */
+	__m256i max = _mm256_set1_epi16(4064); /* 127 << 5 */
+
+	for (y = 0; y < roi->height; y++)
+	{
+		rp = (const INT16*) (((const BYTE*) pSrc[0]) + y * srcStep);
+		gp = (const INT16*) (((const BYTE*) pSrc[1]) + y * srcStep);
+		bp = (const INT16*) (((const BYTE*) pSrc[2]) + y * srcStep);
+		yp = (INT16*) (((BYTE*) pDst[0]) + y * dstStep);
+		cbp = (INT16*) (((BYTE*) pDst[1]) + y * dstStep);
+		crp = (INT16*) (((BYTE*) pDst[2]) + y * dstStep);
+
+		for (x = 0; x + 16 <= roi->width; x += 16)
+		{
+			r = _mm256_slli_epi16(_mm256_loadu_si256((const __m256i*) &rp[x]), 6);
+			g = _mm256_slli_epi16(_mm256_loadu_si256((const __m256i*) &gp[x]), 6);
+			b = _mm256_slli_epi16(_mm256_loadu_si256((const __m256i*) &bp[x]), 6);
+
+			v = _mm256_add_epi16(rfx_dot_mulhi_avx2(r, g, b, 9798, 19235, 3735), min);
+			_mm256_storeu_si256((__m256i*) &yp[x], _mm256_min_epi16(max, _mm256_max_epi16(v, min)));
+
+			v = rfx_dot_mulhi_avx2(r, g, b, -5535, -10868, 16403);
+			_mm256_storeu_si256((__m256i*) &cbp[x], _mm256_min_epi16(max, _mm256_max_epi16(v, min)));
+
+			v = rfx_dot_mulhi_avx2(r, g, b, 16377, -13714, -2663);
+			_mm256_storeu_si256((__m256i*) &crp[x], _mm256_min_epi16(max, _mm256_max_epi16(v, min)));
+		}
+
+		for (; x < roi->width; x++)
+			rfx_rgb_to_ycbcr_mulhi_pixel(rp[x], gp[x], bp[x], &yp[x], &cbp[x], &crp[x]);
+	}
+
+	return PRIMITIVES_SUCCESS;
+}
+
+/* the C conversion in 32-bit lanes, for codec builds without SSE2 */
+RFX_AVX2 static inline __m256i rfx_dot_avx2(__m256i r, __m256i g, __m256i b, INT32 fr, INT32 fg, INT32 fb)
+{
+	__m256i v = _mm256_mullo_epi32(r, _mm256_set1_epi32(fr));
+	v = _mm256_add_epi32(v, _mm256_mullo_epi32(g, _mm256_set1_epi32(fg)));
+	v = _mm256_add_epi32(v, _mm256_mullo_epi32(b, _mm256_set1_epi32(fb)));
+	return _mm256_srai_epi32(v, 10);
+}
+
+RFX_AVX2 static inline void rfx_store8_clamped_avx2(INT16* p, __m256i v)
+{
+	v = _mm256_min_epi32(_mm256_set1_epi32(4095), _mm256_max_epi32(v, _mm256_set1_epi32(-4096)));
+	rfx_store8_avx2(p, v);
+}
+
+RFX_AVX2 static pstatus_t rfx_rgb_to_ycbcr_avx2(const INT16* pSrc[3], INT32 srcStep,
+		INT16* pDst[3], INT32 dstStep, const prim_size_t* roi)
+{
+	int x, y;
+	const INT16 *rp, *gp, *bp;
+	INT16 *yp, *cbp, *crp;
+	__m256i r, g, b, v;
+
+	for (y = 0; y < roi->height; y++)
+	{
+		rp = (const INT16*) (((const BYTE*) pSrc[0]) + y * srcStep);
+		gp = (const INT16*) (((const BYTE*) pSrc[1]) + y * srcStep);
+		bp = (const INT16*) (((const BYTE*) pSrc[2]) + y * srcStep);
+		yp = (INT16*) (((BYTE*) pDst[0]) + y * dstStep);
+		cbp = (INT16*) (((BYTE*) pDst[1]) + y * dstStep);
+		crp = (INT16*) (((BYTE*) pDst[2]) + y * dstStep);
+
+		for (x = 0; x + 8 <= roi->width; x += 8)
+		{
+			r = rfx_widen8_avx2(&rp[x]);
+			g = rfx_widen8_avx2(&gp[x]);
+			b = rfx_widen8_avx2(&bp[x]);
+
+			v = _mm256_sub_epi32(rfx_dot_avx2(r, g, b, 9798, 19235, 3735), _mm256_set1_epi32(4096));
+			rfx_store8_clamped_avx2(&yp[x], v);
+
+			rfx_store8_clamped_avx2(&cbp[x], rfx_dot_avx2(r, g, b, -5535, -10868, 16403));
+			rfx_store8_clamped_avx2(&crp[x], rfx_dot_avx2(r, g, b, 16377, -13714, -2663));
+		}
+
+		for (; x < roi->width; x++)
+			rfx_rgb_to_ycbcr_pixel(rp[x], gp[x], bp[x], &yp[x], &cbp[x], &crp[x]);
+	}
+
+	return PRIMITIVES_SUCCESS;
+}
+
+#endif
+
+#ifdef RFX_SIMD_NEON
+
+#include <arm_neon.h>
+
+/**
+ * NEON has halving and rounding 16-bit operations that are exact where
+ * the C code widens to int and truncates on store, so these kernels stay
+ * in 16-bit lanes throughout.
+ */
+
+static void rfx_quantization_encode_block_neon(INT16* buffer, int size, UINT32 factor)
+{
+	int i;
+	int16x8_t v;
+	int16x8_t shift = vdupq_n_s16(-((int16_t) factor));
+
+	for (i = 0; i < size; i += 8)
+	{
+		v = vld1q_s16(&buffer[i]);
+		v = vrshlq_s16(v, shift);
+		v = vrshrq_n_s16(v, 5);
+		vst1q_s16(&buffer[i], v);
+	}
+}
+
+static void rfx_quantization_encode_neon(INT16* buffer, const UINT32* quantization_values)
+{
+	rfx_quantization_encode_block_neon(buffer, 1024, quantization_values[8] - 6); /* HL1 */
+	rfx_quantization_encode_block_neon(buffer + 1024, 1024, quantization_values[7] - 6); /* LH1 */
+	rfx_quantization_encode_block_neon(buffer + 2048, 1024, quantization_values[9] - 6); /* HH1 */
+	rfx_quantization_encode_block_neon(buffer + 3072, 256, quantization_values[5] - 6); /* HL2 */
+	rfx_quantization_encode_block_neon(buffer + 3328, 256, quantization_values[4] - 6); /* LH2 */
+	rfx_quantization_encode_block_neon(buffer + 3584, 256, quantization_values[6] - 6); /* HH2 */
+	rfx_quantization_encode_block_neon(buffer + 3840, 64, quantization_values[2] - 6); /* HL3 */
+	rfx_quantization_encode_block_neon(buffer + 3904, 64, quantization_values[1] - 6); /* LH3 */
+	rfx_quantization_encode_block_neon(buffer + 3968, 64, quantization_values[3] - 6); /* HH3 */
+	rfx_quantization_encode_block_neon(buffer + 4032, 64, quantization_values[0] - 6); /* LL3 */
+}
+
+static void rfx_dwt_vertical_neon(INT16* buffer, INT16* dwt, int subband_width)
+{
+	int x, n;
+	INT16* l;
+	INT16* h;
+	INT16* src;
+	int16x8_t s0, s1, s2, vh, vl;
+	int total_width = subband_width << 1;
+
+	for (n = 0; n < subband_width; n++)
+	{
+		for (x = 0; x < total_width; x += 8)
+		{
+			l = dwt + n * total_width + x;
+			h = l + subband_width * total_width;
+			src = buffer + (n << 1) * total_width + x;
+
+			s0 = vld1q_s16(src);
+			s1 = vld1q_s16(&src[total_width]);
+			s2 = vld1q_s16(&src[(n < subband_width - 1) ? 2 * total_width : 0]);
+
+			vh = vhsubq_s16(s1, vhaddq_s16(s0, s2));
+			vst1q_s16(h, vh);
+
+			vl = (n > 0) ? vhaddq_s16(vh, vld1q_s16(h - total_width)) : vh;
+			vst1q_s16(l, vaddq_s16(s0, vl));
+		}
+	}
+}
+
+static void rfx_dwt_horizontal_row_neon(INT16* src, INT16* hi, INT16* lo, int subband_width)
+{
+	int n, x;
+	int16x8x2_t a, b;
+
+	/* high band, the last sample mirrors so it is done in C */
+	for (n = 0; n + 8 < subband_width; n += 8)
+	{
+		x = n << 1;
+		a = vld2q_s16(&src[x]);
+		b = vld2q_s16(&src[x + 2]);
+
+		vst1q_s16(&hi[n], vhsubq_s16(a.val[1], vhaddq_s16(a.val[0], b.val[0])));
+	}
+
+	for (; n < subband_width; n++)
+	{
+		x = n << 1;
+		hi[n] = (src[x + 1] - ((src[x] + src[n < subband_width - 1 ? x + 2 : x]) >> 1)) >> 1;
+	}
+
+	/* low band */
+	lo[0] = src[0] + hi[0];
+
+	for (n = 1; n + 8 <= subband_width; n += 8)
+	{
+		x = n << 1;
+		a = vld2q_s16(&src[x]);
+
+		vst1q_s16(&lo[n], vaddq_s16(a.val[0], vhaddq_s16(vld1q_s16(&hi[n]), vld1q_s16(&hi[n - 1]))));
+	}
+
+	for (; n < subband_width; n++)
+	{
+		x = n << 1;
+		lo[n] = src[x] + ((hi[n] + hi[n - 1]) >> 1);
+	}
+}
+
+static void rfx_dwt_2d_encode_block_neon(INT16* buffer, INT16* dwt, int subband_width)
+{
+	int y;
+	INT16 *hl, *lh, *hh, *ll;
+	INT16 *l_src, *h_src;
+	int total_width = subband_width << 1;
+
+	rfx_dwt_vertical_neon(buffer, dwt, subband_width);
+
+	hl = buffer;
+	lh = buffer + subband_width * subband_width;
+	hh = buffer + subband_width * subband_width * 2;
+	ll = buffer + subband_width * subband_width * 3;
+
+	l_src = dwt;
+	h_src = dwt + subband_width * subband_width * 2;
+
+	for (y = 0; y < subband_width; y++)
+	{
+		rfx_dwt_horizontal_row_neon(l_src, hl, ll, subband_width);
+		rfx_dwt_horizontal_row_neon(h_src, hh, lh, subband_width);
+
+		hl += subband_width;
+		lh += subband_width;
+		hh += subband_width;
+		ll += subband_width;
+
+		l_src += total_width;
+		h_src += total_width;
+	}
+}
+
+static void rfx_dwt_2d_encode_neon(INT16* buffer, INT16* dwt_buffer)
+{
+	rfx_dwt_2d_encode_block_neon(buffer, dwt_buffer, 32);
+	rfx_dwt_2d_encode_block_neon(buffer + 3072, dwt_buffer, 16);
+	rfx_dwt_2d_encode_block_neon(buffer + 3840, dwt_buffer, 8);
+}
+
+static inline int32x4_t rfx_dot_neon(int16x4_t r, int16x4_t g, int16x4_t b, INT16 fr, INT16 fg, INT16 fb)
+{
+	int32x4_t v = vmull_n_s16(r, fr);
+	v = vmlal_n_s16(v, g, fg);
+	v = vmlal_n_s16(v, b, fb);
+	return vshrq_n_s32(v, 10);
+}
+
+static inline int16x8_t rfx_clamp_neon(int32x4_t lo, int32x4_t hi, int32x4_t bias)
+{
+	int32x4_t min = vdupq_n_s32(-4096);
+	int32x4_t max = vdupq_n_s32(4095);
+
+	lo = vminq_s32(max, vmaxq_s32(vsubq_s32(lo, bias), min));
+	hi = vminq_s32(max, vmaxq_s32(vsubq_s32(hi, bias), min));
+
+	return vcombine_s16(vmovn_s32(lo), vmovn_s32(hi));
+}
+
+static pstatus_t rfx_rgb_to_ycbcr_neon(const INT16* pSrc[3], INT32 srcStep,
+		INT16* pDst[3], INT32 dstStep, const prim_size_t* roi)
+{
+	int x, y;
+	const INT16 *rp, *gp, *bp;
+	INT16 *yp, *cbp, *crp;
+	int16x8_t r, g, b;
+	int32x4_t zero = vdupq_n_s32(0);
+	int32x4_t bias = vdupq_n_s32(4096);
+
+	for (y = 0; y < roi->height; y++)
+	{
+		rp = (const INT16*) (((const BYTE*) pSrc[0]) + y * srcStep);
+		gp = (const INT16*) (((const BYTE*) pSrc[1]) + y * srcStep);
+		bp = (const INT16*) (((const BYTE*) pSrc[2]) + y * srcStep);
+		yp = (INT16*) (((BYTE*) pDst[0]) + y * dstStep);
+		cbp = (INT16*) (((BYTE*) pDst[1]) + y * dstStep);
+		crp = (INT16*) (((BYTE*) pDst[2]) + y * dstStep);
+
+		for (x = 0; x + 8 <= roi->width; x += 8)
+		{
+			r = vld1q_s16(&rp[x]);
+			g = vld1q_s16(&gp[x]);
+			b = vld1q_s16(&bp[x]);
+
+			vst1q_s16(&yp[x], rfx_clamp_neon(
+					rfx_dot_neon(vget_low_s16(r), vget_low_s16(g), vget_low_s16(b), 9798, 19235, 3735),
+					rfx_dot_neon(vget_high_s16(r), vget_high_s16(g), vget_high_s16(b), 9798, 19235, 3735), bias));
+
+			vst1q_s16(&cbp[x], rfx_clamp_neon(
+					rfx_dot_neon(vget_low_s16(r), vget_low_s16(g), vget_low_s16(b), -5535, -10868, 16403),
+					rfx_dot_neon(vget_high_s16(r), vget_high_s16(g), vget_high_s16(b), -5535, -10868, 16403), zero));
+
+			vst1q_s16(&crp[x], rfx_clamp_neon(
+					rfx_dot_neon(vget_low_s16(r), vget_low_s16(g), vget_low_s16(b), 16377, -13714, -2663),
+					rfx_dot_neon(vget_high_s16(r), vget_high_s16(g), vget_high_s16(b), 16377, -13714, -2663), zero));
+		}
+
+		for (; x < roi->width; x++)
+			rfx_rgb_to_ycbcr_pixel(rp[x], gp[x], bp[x], &yp[x], &cbp[x], &crp[x]);
+	}
+
+	return PRIMITIVES_SUCCESS;
+}
+
+#endif
+
+#if defined(RFX_SIMD_X86) || defined(RFX_SIMD_NEON)
+
+static void freerds_rfx_simd_fill(INT16* buffer, UINT32 seed)
+{
+	int i;
+
+	/* coefficient range produced by the <<5 scaled RGB to YCbCr stage */
+	for (i = 0; i < 4096; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		buffer[i] = (INT16) ((int) ((seed >> 8) % 8192) - 4096);
+	}
+
+	buffer[0] = -4096;
+	buffer[1] = 4095;
+}
+
+static BOOL freerds_rfx_simd_verify(RFX_CONTEXT* reference,
+		pfnRfxQuantizationEncode quantizationEncode, pfnRfxDwt2DEncode dwt2DEncode)
+{
+	int i, round;
+	INT16* expected;
+	INT16* actual;
+	INT16* dwt;
+	BOOL match = TRUE;
+	UINT32 quant[10];
+
+	expected = (INT16*) _aligned_malloc(4096 * sizeof(INT16), 16);
+	actual = (INT16*) _aligned_malloc(4096 * sizeof(INT16), 16);
+	dwt = (INT16*) _aligned_malloc(4096 * sizeof(INT16), 16);
+
+	for (round = 0; (round < 16) && match; round++)
+	{
+		for (i = 0; i < 10; i++)
+			quant[i] = 6 + ((round + i) % 10);
+
+		freerds_rfx_simd_fill(expected, round + 1);
+		CopyMemory(actual, expected, 4096 * sizeof(INT16));
+
+		reference->dwt_2d_encode(expected, dwt);
+		dwt2DEncode(actual, dwt);
+
+		if (memcmp(expected, actual, 4096 * sizeof(INT16)) != 0)
+		{
+			fprintf(stderr, "%s: dwt mismatch\n", __FUNCTION__);
+			match = FALSE;
+			break;
+		}
+
+		reference->quantization_encode(expected, quant);
+		quantizationEncode(actual, quant);
+
+		if (memcmp(expected, actual, 4096 * sizeof(INT16)) != 0)
+		{
+			fprintf(stderr, "%s: quantization mismatch\n", __FUNCTION__);
+			match = FALSE;
+		}
+	}
+
+	_aligned_free(expected);
+	_aligned_free(actual);
+	_aligned_free(dwt);
+
+	return match;
+}
+
+/**
+ * Color conversion is checked on 64x64 sample planes like the encoder
+ * passes, with rows of black and white and the rest pseudo-random.
+ */
+
+static BOOL freerds_rfx_simd_verify_color(pfnRfxRGBToYCbCr reference, pfnRfxRGBToYCbCr rgbToYCbCr)
+{
+	int i, round;
+	UINT32 seed;
+	INT16* buffer;
+	const INT16* src[3];
+	INT16* expected[3];
+	INT16* actual[3];
+	BOOL match = TRUE;
+	prim_size_t roi = { 64, 64 };
+
+	buffer = (INT16*) _aligned_malloc(9 * 4096 * sizeof(INT16), 32);
+
+	if (!buffer)
+		return FALSE;
+
+	for (i = 0; i < 3; i++)
+	{
+		src[i] = &buffer[i * 4096];
+		expected[i] = &buffer[(3 + i) * 4096];
+		actual[i] = &buffer[(6 + i) * 4096];
+	}
+
+	for (round = 0; (round < 8) && match; round++)
+	{
+		seed = round + 1;
+
+		for (i = 0; i < 3 * 4096; i++)
+		{
+			seed = seed * 1103515245 + 12345;
+			buffer[i] = (INT16) ((seed >> 8) & 0xFF);
+		}
+
+		for (i = 0; i < 3 * 64; i++)
+		{
+			buffer[(i / 64) * 4096 + (i % 64)] = 0;
+			buffer[(i / 64) * 4096 + 64 + (i % 64)] = 255;
+		}
+
+		reference(src, 64 * sizeof(INT16), expected, 64 * sizeof(INT16), &roi);
+		rgbToYCbCr(src, 64 * sizeof(INT16), actual, 64 * sizeof(INT16), &roi);
+
+		if (memcmp(expected[0], actual[0], 3 * 4096 * sizeof(INT16)) != 0)
+			match = FALSE;
+	}
+
+	_aligned_free(buffer);
+
+	return match;
+}
+
+/* the first conversion that matches the one the codec selected wins */
+static void freerds_rfx_simd_select_color(primitives_t* prims, pfnRfxRGBToYCbCr rgbToYCbCr, const char* name)
+{
+	if (g_RGBToYCbCr)
+		return;
+
+	if (!freerds_rfx_simd_verify_color(prims->RGBToYCbCr_16s16s_P3P3, rgbToYCbCr))
+		return;
+
+	g_RGBToYCbCr = rgbToYCbCr;
+	g_ColorName = name;
+
+	prims->RGBToYCbCr_16s16s_P3P3 = rgbToYCbCr;
+}
+
+#endif
+
+void freerds_rfx_simd_init(void)
+{
+	RFX_CONTEXT* reference;
+	primitives_t* prims;
+
+	reference = rfx_context_new(TRUE);
+	prims = primitives_get();
+
+	if (!reference || !prims)
+	{
+		if (reference)
+			rfx_context_free(reference);
+		return;
+	}
+
+#ifdef RFX_SIMD_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+	{
+		if (freerds_rfx_simd_verify(reference, rfx_quantization_encode_avx2, rfx_dwt_2d_encode_avx2))
+		{
+			g_QuantizationEncode = rfx_quantization_encode_avx2;
+			g_Dwt2DEncode = rfx_dwt_2d_encode_avx2;
+			g_TransformName = "avx2";
+		}
+
+		/* whichever of the SSE2 or the C conversion the codec selected */
+		freerds_rfx_simd_select_color(prims, rfx_rgb_to_ycbcr_mulhi_avx2, "avx2");
+		freerds_rfx_simd_select_color(prims, rfx_rgb_to_ycbcr_avx2, "avx2");
+	}
+#endif
+
+#ifdef RFX_SIMD_NEON
+	if (freerds_rfx_simd_verify(reference, rfx_quantization_encode_neon, rfx_dwt_2d_encode_neon))
+	{
+		g_QuantizationEncode = rfx_quantization_encode_neon;
+		g_Dwt2DEncode = rfx_dwt_2d_encode_neon;
+		g_TransformName = "neon";
+	}
+
+	freerds_rfx_simd_select_color(prims, rfx_rgb_to_ycbcr_neon, "neon");
+#endif
+
+	sprintf_s(g_KernelName, sizeof(g_KernelName), "%s dwt and quantization, %s color conversion",
+			g_TransformName, g_ColorName);
+
+	rfx_context_free(reference);
+}
+
+void freerds_rfx_simd_apply(RFX_CONTEXT* context)
+{
+	if (!context)
+		return;
+
+	if (g_QuantizationEncode)
+		context->quantization_encode = g_QuantizationEncode;
+
+	if (g_Dwt2DEncode)
+		context->dwt_2d_encode = g_Dwt2DEncode;
+}
+
+const char* freerds_rfx_simd_get_name(void)
+{
+	return g_KernelName;
+}
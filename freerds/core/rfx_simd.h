@@ -0,0 +1,39 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * RemoteFX Encoder Kernels
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FREERDS_CORE_RFX_SIMD_H
+#define FREERDS_CORE_RFX_SIMD_H
+
+#include <winpr/crt.h>
+
+#include <freerdp/codec/rfx.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void freerds_rfx_simd_init(void);
+void freerds_rfx_simd_apply(RFX_CONTEXT* context);
+const char* freerds_rfx_simd_get_name(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FREERDS_CORE_RFX_SIMD_H */
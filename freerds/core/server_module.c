@@ -65,7 +65,36 @@ int freerds_client_inbound_opaque_rect(rdsModuleConnector* connector, RDS_MSG_OP
 
 int freerds_client_inbound_screen_blt(rdsModuleConnector* connector, RDS_MSG_SCREEN_BLT* msg)
 {
-	/* TODO */
+	int nXSrc, nYSrc;
+	xrdpRect rect;
+	rdsConnection* connection = connector->connection;
+
+	if (!freerds_rdpgfx_is_ready(connection->rdpgfx))
+		return 0;
+
+	rect.left = msg->nLeftRect;
+	rect.top = msg->nTopRect;
+	rect.right = msg->nLeftRect + msg->nWidth;
+	rect.bottom = msg->nTopRect + msg->nHeight;
+
+	if (connection->clipEnabled)
+	{
+		rect.left = MAX(rect.left, connection->clipRect.left);
+		rect.top = MAX(rect.top, connection->clipRect.top);
+		rect.right = MIN(rect.right, connection->clipRect.right);
+		rect.bottom = MIN(rect.bottom, connection->clipRect.bottom);
+	}
+
+	if ((rect.right <= rect.left) || (rect.bottom <= rect.top))
+		return 0;
+
+	nXSrc = msg->nXSrc + (rect.left - msg->nLeftRect);
+	nYSrc = msg->nYSrc + (rect.top - msg->nTopRect);
+
+	freerds_rdpgfx_start_frame(connection->rdpgfx);
+	freerds_rdpgfx_surface_to_surface(connection->rdpgfx, nXSrc, nYSrc,
+			rect.right - rect.left, rect.bottom - rect.top, rect.left, rect.top);
+	freerds_rdpgfx_end_frame(connection->rdpgfx);
 
 	return 0;
 }
@@ -83,7 +112,23 @@ int freerds_client_inbound_paint_rect(rdsModuleConnector* connector, RDS_MSG_PAI
 
 	bpp = msg->framebuffer->fbBitsPerPixel;
 
-	if (connection->codecMode)
+	if (freerds_rdpgfx_is_ready(connection->rdpgfx))
+	{
+		inFlightFrames = freerds_rdpgfx_get_in_flight_frames(connection->rdpgfx);
+
+		if (inFlightFrames > settings->FrameAcknowledge)
+			connector->fps = (100 / (inFlightFrames + 1) * connector->MaxFps) / 100;
+		else
+			connector->fps = connector->MaxFps;
+
+		if (connector->fps < 1)
+			connector->fps = 1;
+
+		freerds_rdpgfx_start_frame(connection->rdpgfx);
+		freerds_rdpgfx_surface_bits(connection->rdpgfx, msg);
+		freerds_rdpgfx_end_frame(connection->rdpgfx);
+	}
+	else if (connection->codecMode)
 	{
 		inFlightFrames = ListDictionary_Count(connection->FrameList);
 
@@ -147,7 +192,14 @@ int freerds_client_inbound_set_palette(rdsModuleConnector* connector, RDS_MSG_SE
 
 int freerds_client_inbound_set_clipping_region(rdsModuleConnector* connector, RDS_MSG_SET_CLIPPING_REGION* msg)
 {
-	/* TODO */
+	rdsConnection* connection = connector->connection;
+
+	connection->clipEnabled = msg->bNullRegion ? FALSE : TRUE;
+
+	connection->clipRect.left = msg->nLeftRect;
+	connection->clipRect.top = msg->nTopRect;
+	connection->clipRect.right = msg->nLeftRect + msg->nWidth;
+	connection->clipRect.bottom = msg->nTopRect + msg->nHeight;
 
 	return 0;
 }
@@ -185,24 +237,43 @@ int freerds_client_inbound_shared_framebuffer(rdsModuleConnector* connector, RDS
 
 	if (!connector->framebuffer.fbAttached && msg->attach)
 	{
-		connector->framebuffer.fbSharedMemory = (BYTE*) shmat(connector->framebuffer.fbSegmentId, 0, 0);
+		connector->framebuffer.fbSharedMemory = freerds_shared_framebuffer_attach(msg);
+
+		if (!connector->framebuffer.fbSharedMemory)
+		{
+			fprintf(stderr, "failed to attach shared framebuffer %d\n", msg->segmentId);
+			return -1;
+		}
+
 		connector->framebuffer.fbAttached = TRUE;
 
-		printf("attached segment %d to %p\n",
+		printf("attached %s %d to %p\n",
+				(msg->flags & RDS_SHARED_FRAMEBUFFER_MEMFD) ? "memfd" : "segment",
 				connector->framebuffer.fbSegmentId, connector->framebuffer.fbSharedMemory);
 
 		connector->framebuffer.image = (void*) pixman_image_create_bits(PIXMAN_x8r8g8b8,
 				connector->framebuffer.fbWidth, connector->framebuffer.fbHeight,
 				(uint32_t*) connector->framebuffer.fbSharedMemory, connector->framebuffer.fbScanline);
+
+		freerds_rdpgfx_refresh(connector->connection->rdpgfx);
 	}
 
 	if (connector->framebuffer.fbAttached && !msg->attach)
 	{
-		shmdt(connector->framebuffer.fbSharedMemory);
+		freerds_shared_framebuffer_detach(connector->framebuffer.fbSharedMemory,
+				connector->framebuffer.fbScanline * connector->framebuffer.fbHeight,
+				connector->framebuffer.fbSegmentId);
 		connector->framebuffer.fbAttached = FALSE;
 		connector->framebuffer.fbSharedMemory = 0;
 	}
 
+	/* a descriptor nobody mapped, e.g. sent again while already attached */
+	if ((msg->flags & RDS_SHARED_FRAMEBUFFER_MEMFD) && (msg->fd >= 0))
+	{
+		close(msg->fd);
+		msg->fd = -1;
+	}
+
 	connector->client->VBlankEvent(connector);
 
 	return 0;
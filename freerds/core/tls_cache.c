@@ -0,0 +1,578 @@
+/**
+ * xrdp: A Remote Desktop Protocol server.
+ * TLS Session Cache
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "freerds.h"
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/sysinfo.h>
+
+#include <dlfcn.h>
+
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/params.h>
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+/**
+ * FreeRDP creates an SSL_CTX of its own for each connection it accepts,
+ * which leaves every reconnect with a full handshake. There is no way to
+ * configure that context through FreeRDP, so freerds provides SSL_CTX_new
+ * itself and attaches every server context to one process wide cache:
+ * sessions are kept serialized in a direct mapped table shared by all
+ * connections, and session tickets are encrypted with keys shared by all
+ * contexts. The ticket key is replaced every session lifetime, the one
+ * before it still decrypts tickets, which are then issued again under the
+ * current key. Contexts are also set up for kernel TLS here, see
+ * tls_offload.c.
+ */
+
+#define FREERDS_TLS_SESSION_ID_MAX	32
+
+struct rds_tls_session
+{
+	UINT32 idLength;
+	BYTE id[FREERDS_TLS_SESSION_ID_MAX];
+	DWORD timestamp;
+	UINT32 length;
+	BYTE* data;
+};
+typedef struct rds_tls_session rdsTlsSession;
+
+struct rds_tls_ticket_key
+{
+	BYTE name[16];
+	BYTE aesKey[16];
+	BYTE hmacKey[16];
+};
+typedef struct rds_tls_ticket_key rdsTlsTicketKey;
+
+struct rds_tls_cache
+{
+	UINT32 size;
+	UINT32 lifetime;
+	rdsTlsSession* sessions;
+	CRITICAL_SECTION lock;
+
+	rdsTlsTicketKey ticketKey;
+	rdsTlsTicketKey previousTicketKey;
+	DWORD ticketKeyTimestamp;
+
+	UINT32 hits;
+	UINT32 misses;
+	UINT32 stores;
+	UINT32 evictions;
+	UINT32 ticketHits;
+	UINT32 ticketMisses;
+	UINT32 ticketRenewals;
+	UINT32 ticketKeyRotations;
+};
+typedef struct rds_tls_cache rdsTlsCache;
+
+typedef SSL_CTX* (*fnSSL_CTX_new)(const SSL_METHOD* method);
+
+static rdsTlsCache* g_TlsCache = NULL;
+static fnSSL_CTX_new g_SSL_CTX_new = NULL;
+
+static rdsTlsSession* freerds_tls_cache_slot(rdsTlsCache* cache, const BYTE* id, UINT32 idLength)
+{
+	UINT32 index;
+	UINT32 hash;
+
+	/* FNV-1a, session ids are random already */
+	hash = 2166136261U;
+
+	for (index = 0; index < idLength; index++)
+		hash = (hash ^ id[index]) * 16777619U;
+
+	return &cache->sessions[hash % cache->size];
+}
+
+static BOOL freerds_tls_cache_match(rdsTlsSession* session, const BYTE* id, UINT32 idLength)
+{
+	return (session->data && (session->idLength == idLength) &&
+			(memcmp(session->id, id, idLength) == 0)) ? TRUE : FALSE;
+}
+
+static void freerds_tls_cache_clear(rdsTlsSession* session)
+{
+	free(session->data);
+	session->data = NULL;
+	session->length = 0;
+	session->idLength = 0;
+}
+
+static int freerds_tls_cache_new_session(SSL* ssl, SSL_SESSION* sess)
+{
+	int length;
+	BYTE* data;
+	BYTE* pointer;
+	const BYTE* id;
+	unsigned int idLength;
+	rdsTlsSession* session;
+	rdsTlsCache* cache = g_TlsCache;
+
+	id = SSL_SESSION_get_id(sess, &idLength);
+
+	if (!id || !idLength || (idLength > FREERDS_TLS_SESSION_ID_MAX))
+		return 0;
+
+	length = i2d_SSL_SESSION(sess, NULL);
+
+	if (length <= 0)
+		return 0;
+
+	data = (BYTE*) malloc(length);
+
+	if (!data)
+		return 0;
+
+	pointer = data;
+	i2d_SSL_SESSION(sess, &pointer);
+
+	EnterCriticalSection(&cache->lock);
+
+	session = freerds_tls_cache_slot(cache, id, idLength);
+
+	if (session->data && !freerds_tls_cache_match(session, id, idLength) &&
+			((GetTickCount() - session->timestamp) < cache->lifetime))
+		cache->evictions++;
+
+	freerds_tls_cache_clear(session);
+
+	CopyMemory(session->id, id, idLength);
+	session->idLength = idLength;
+	session->timestamp = GetTickCount();
+	session->data = data;
+	session->length = length;
+
+	cache->stores++;
+
+	LeaveCriticalSection(&cache->lock);
+
+	/* the session was serialized, OpenSSL keeps its reference */
+	return 0;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static SSL_SESSION* freerds_tls_cache_get_session(SSL* ssl, const unsigned char* id, int idLength, int* copy)
+#else
+static SSL_SESSION* freerds_tls_cache_get_session(SSL* ssl, unsigned char* id, int idLength, int* copy)
+#endif
+{
+	BYTE* data;
+	UINT32 length;
+	const BYTE* pointer;
+	SSL_SESSION* sess;
+	rdsTlsSession* session;
+	rdsTlsCache* cache = g_TlsCache;
+
+	*copy = 0;
+
+	if ((idLength <= 0) || (idLength > FREERDS_TLS_SESSION_ID_MAX))
+		return NULL;
+
+	data = NULL;
+	length = 0;
+
+	EnterCriticalSection(&cache->lock);
+
+	session = freerds_tls_cache_slot(cache, id, idLength);
+
+	if (freerds_tls_cache_match(session, id, idLength))
+	{
+		if ((GetTickCount() - session->timestamp) < cache->lifetime)
+		{
+			data = (BYTE*) malloc(session->length);
+
+			if (data)
+			{
+				CopyMemory(data, session->data, session->length);
+				length = session->length;
+			}
+		}
+		else
+		{
+			freerds_tls_cache_clear(session);
+		}
+	}
+
+	if (data)
+		cache->hits++;
+	else
+		cache->misses++;
+
+	LeaveCriticalSection(&cache->lock);
+
+	if (!data)
+		return NULL;
+
+	pointer = data;
+	sess = d2i_SSL_SESSION(NULL, &pointer, length);
+
+	free(data);
+
+	return sess;
+}
+
+static void freerds_tls_cache_remove_session(SSL_CTX* ctx, SSL_SESSION* sess)
+{
+	const BYTE* id;
+	unsigned int idLength;
+	rdsTlsSession* session;
+	rdsTlsCache* cache = g_TlsCache;
+
+	id = SSL_SESSION_get_id(sess, &idLength);
+
+	if (!id || !idLength || (idLength > FREERDS_TLS_SESSION_ID_MAX))
+		return;
+
+	EnterCriticalSection(&cache->lock);
+
+	session = freerds_tls_cache_slot(cache, id, idLength);
+
+	if (freerds_tls_cache_match(session, id, idLength))
+		freerds_tls_cache_clear(session);
+
+	LeaveCriticalSection(&cache->lock);
+}
+
+static int freerds_tls_cache_new_ticket_key(rdsTlsTicketKey* key)
+{
+	if ((RAND_bytes(key->name, sizeof(key->name)) != 1) ||
+			(RAND_bytes(key->aesKey, sizeof(key->aesKey)) != 1) ||
+			(RAND_bytes(key->hmacKey, sizeof(key->hmacKey)) != 1))
+		return -1;
+
+	return 0;
+}
+
+/* called with the lock held */
+static void freerds_tls_cache_rotate_ticket_key(rdsTlsCache* cache)
+{
+	DWORD age;
+	rdsTlsTicketKey key;
+	rdsTlsTicketKey previousKey;
+
+	age = GetTickCount() - cache->ticketKeyTimestamp;
+
+	if (age < cache->lifetime)
+		return;
+
+	/* keep the current key when no new one can be made, retried with the next ticket */
+	if (freerds_tls_cache_new_ticket_key(&key) < 0)
+		return;
+
+	/* after a quiet period the current key is older than a lifetime too, retire both */
+	if (age < (cache->lifetime * 2))
+		CopyMemory(&previousKey, &cache->ticketKey, sizeof(rdsTlsTicketKey));
+	else if (freerds_tls_cache_new_ticket_key(&previousKey) < 0)
+	{
+		SecureZeroMemory(&key, sizeof(key));
+		return;
+	}
+
+	CopyMemory(&cache->previousTicketKey, &previousKey, sizeof(rdsTlsTicketKey));
+	CopyMemory(&cache->ticketKey, &key, sizeof(rdsTlsTicketKey));
+	SecureZeroMemory(&key, sizeof(key));
+	SecureZeroMemory(&previousKey, sizeof(previousKey));
+
+	cache->ticketKeyTimestamp = GetTickCount();
+	cache->ticketKeyRotations++;
+}
+
+static void freerds_tls_cache_current_ticket_key(rdsTlsCache* cache, rdsTlsTicketKey* key)
+{
+	EnterCriticalSection(&cache->lock);
+	freerds_tls_cache_rotate_ticket_key(cache);
+	CopyMemory(key, &cache->ticketKey, sizeof(rdsTlsTicketKey));
+	LeaveCriticalSection(&cache->lock);
+}
+
+/**
+ * Looks up the key a ticket was issued under, returns what the ticket key
+ * callback has to: 1 for the current key, 2 for the previous one and 0
+ * when there is no such key.
+ */
+
+static int freerds_tls_cache_find_ticket_key(rdsTlsCache* cache, const unsigned char* name, rdsTlsTicketKey* key)
+{
+	int status;
+
+	EnterCriticalSection(&cache->lock);
+
+	freerds_tls_cache_rotate_ticket_key(cache);
+
+	if (memcmp(name, cache->ticketKey.name, sizeof(cache->ticketKey.name)) == 0)
+	{
+		CopyMemory(key, &cache->ticketKey, sizeof(rdsTlsTicketKey));
+		cache->ticketHits++;
+		status = 1;
+	}
+	else if (memcmp(name, cache->previousTicketKey.name, sizeof(cache->previousTicketKey.name)) == 0)
+	{
+		/* still accepted, 2 has OpenSSL issue a new ticket under the current key */
+		CopyMemory(key, &cache->previousTicketKey, sizeof(rdsTlsTicketKey));
+		cache->ticketHits++;
+		cache->ticketRenewals++;
+		status = 2;
+	}
+	else
+	{
+		/* issued by another process, before a restart or under a retired key, do a full handshake */
+		cache->ticketMisses++;
+		status = 0;
+	}
+
+	LeaveCriticalSection(&cache->lock);
+
+	return status;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+/* HMAC_CTX is deprecated with OpenSSL 3, the ticket HMAC is an EVP_MAC there */
+static int freerds_tls_cache_set_ticket_mac(EVP_MAC_CTX* mac, rdsTlsTicketKey* key)
+{
+	OSSL_PARAM params[3];
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key->hmacKey, sizeof(key->hmacKey));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "sha256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+
+	return (EVP_MAC_CTX_set_params(mac, params) == 1) ? 0 : -1;
+}
+
+static int freerds_tls_cache_ticket_key(SSL* ssl, unsigned char* name, unsigned char* iv,
+		EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac, int enc)
+#else
+static int freerds_tls_cache_set_ticket_mac(HMAC_CTX* mac, rdsTlsTicketKey* key)
+{
+	return (HMAC_Init_ex(mac, key->hmacKey, sizeof(key->hmacKey), EVP_sha256(), NULL) == 1) ? 0 : -1;
+}
+
+static int freerds_tls_cache_ticket_key(SSL* ssl, unsigned char* name, unsigned char* iv,
+		EVP_CIPHER_CTX* cipher, HMAC_CTX* mac, int enc)
+#endif
+{
+	int status;
+	rdsTlsTicketKey key;
+	rdsTlsCache* cache = g_TlsCache;
+
+	if (enc)
+	{
+		if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1)
+			return -1;
+
+		freerds_tls_cache_current_ticket_key(cache, &key);
+
+		CopyMemory(name, key.name, sizeof(key.name));
+
+		status = 1;
+
+		if ((EVP_EncryptInit_ex(cipher, EVP_aes_128_cbc(), NULL, key.aesKey, iv) != 1) ||
+				(freerds_tls_cache_set_ticket_mac(mac, &key) < 0))
+			status = -1;
+
+		SecureZeroMemory(&key, sizeof(key));
+
+		return status;
+	}
+
+	status = freerds_tls_cache_find_ticket_key(cache, name, &key);
+
+	if (status == 0)
+		return 0;
+
+	if ((freerds_tls_cache_set_ticket_mac(mac, &key) < 0) ||
+			(EVP_DecryptInit_ex(cipher, EVP_aes_128_cbc(), NULL, key.aesKey, iv) != 1))
+		status = -1;
+
+	SecureZeroMemory(&key, sizeof(key));
+
+	return status;
+}
+
+static void freerds_tls_cache_attach(rdsTlsCache* cache, SSL_CTX* ctx)
+{
+	static const unsigned char sid_ctx[] = "freerds";
+
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+	SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+	SSL_CTX_set_timeout(ctx, cache->lifetime / 1000);
+
+	SSL_CTX_sess_set_new_cb(ctx, freerds_tls_cache_new_session);
+	SSL_CTX_sess_set_get_cb(ctx, freerds_tls_cache_get_session);
+	SSL_CTX_sess_set_remove_cb(ctx, freerds_tls_cache_remove_session);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, freerds_tls_cache_ticket_key);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(ctx, freerds_tls_cache_ticket_key);
+#endif
+}
+
+/**
+ * FreeRDP asks for the generic server method when it accepts a peer,
+ * contexts for anything else in the process, clients included, are left
+ * as OpenSSL makes them.
+ */
+
+static BOOL freerds_tls_cache_is_server_method(const SSL_METHOD* method)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	return (method == TLS_server_method()) ? TRUE : FALSE;
+#else
+	return (method == SSLv23_server_method()) ? TRUE : FALSE;
+#endif
+}
+
+SSL_CTX* SSL_CTX_new(const SSL_METHOD* method)
+{
+	SSL_CTX* ctx;
+
+	if (!g_SSL_CTX_new)
+		g_SSL_CTX_new = (fnSSL_CTX_new) dlsym(RTLD_NEXT, "SSL_CTX_new");
+
+	if (!g_SSL_CTX_new)
+		return NULL;
+
+	ctx = g_SSL_CTX_new(method);
+
+	if (!ctx || !freerds_tls_cache_is_server_method(method))
+		return ctx;
+
+	if (g_TlsCache)
+		freerds_tls_cache_attach(g_TlsCache, ctx);
+
+	freerds_tls_offload_attach(ctx);
+
+	return ctx;
+}
+
+/**
+ * A size of zero leaves FreeRDP contexts as they are, lifetime is in seconds.
+ */
+
+int freerds_tls_cache_init(UINT32 size, UINT32 lifetime)
+{
+	rdsTlsCache* cache;
+
+	g_SSL_CTX_new = (fnSSL_CTX_new) dlsym(RTLD_NEXT, "SSL_CTX_new");
+
+	if (!size || !lifetime)
+		return 0;
+
+	if (!g_SSL_CTX_new)
+	{
+		fprintf(stderr, "SSL_CTX_new not found, TLS sessions are not cached\n");
+		return -1;
+	}
+
+	cache = (rdsTlsCache*) calloc(1, sizeof(rdsTlsCache));
+
+	if (!cache)
+		return -1;
+
+	cache->size = size;
+	cache->lifetime = lifetime * 1000;
+	cache->sessions = (rdsTlsSession*) calloc(size, sizeof(rdsTlsSession));
+
+	/* the previous key starts out as one no ticket was issued under */
+	if (!cache->sessions ||
+			(freerds_tls_cache_new_ticket_key(&cache->ticketKey) < 0) ||
+			(freerds_tls_cache_new_ticket_key(&cache->previousTicketKey) < 0))
+	{
+		free(cache->sessions);
+		free(cache);
+		return -1;
+	}
+
+	cache->ticketKeyTimestamp = GetTickCount();
+
+	InitializeCriticalSectionAndSpinCount(&cache->lock, 4000);
+
+	g_TlsCache = cache;
+
+	printf("caching up to %d TLS sessions for %d seconds\n", (int) size, (int) lifetime);
+
+	return 0;
+}
+
+/**
+ * Only once no more connections are set up, contexts refer to the cache.
+ */
+
+void freerds_tls_cache_uninit(void)
+{
+	UINT32 index;
+	rdsTlsCache* cache = g_TlsCache;
+
+	if (!cache)
+		return;
+
+	g_TlsCache = NULL;
+
+	for (index = 0; index < cache->size; index++)
+		freerds_tls_cache_clear(&cache->sessions[index]);
+
+	DeleteCriticalSection(&cache->lock);
+
+	SecureZeroMemory(&cache->ticketKey, sizeof(cache->ticketKey));
+	SecureZeroMemory(&cache->previousTicketKey, sizeof(cache->previousTicketKey));
+
+	free(cache->sessions);
+	free(cache);
+}
+
+void freerds_tls_cache_print_stats(void)
+{
+	UINT32 lookups;
+	rdsTlsCache* cache = g_TlsCache;
+
+	if (!cache)
+		return;
+
+	EnterCriticalSection(&cache->lock);
+
+	lookups = cache->hits + cache->misses + cache->ticketHits + cache->ticketMisses;
+
+	printf("TLS session cache: %d%% of %d resumptions hit, %d/%d session ids, %d/%d tickets "
+			"(%d renewed), %d stored, %d evicted, %d ticket key rotations\n",
+			lookups ? (int) (((UINT64) (cache->hits + cache->ticketHits) * 100) / lookups) : 0,
+			(int) lookups, (int) cache->hits, (int) (cache->hits + cache->misses),
+			(int) cache->ticketHits, (int) (cache->ticketHits + cache->ticketMisses),
+			(int) cache->ticketRenewals, (int) cache->stores, (int) cache->evictions,
+			(int) cache->ticketKeyRotations);
+
+	LeaveCriticalSection(&cache->lock);
+}
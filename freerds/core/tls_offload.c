@@ -0,0 +1,163 @@
+/**
+ * xrdp: A Remote Desktop Protocol server.
+ * Kernel TLS Offload
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "freerds.h"
+
+#include <winpr/crt.h>
+#include <winpr/interlocked.h>
+
+#include <openssl/ssl.h>
+#include <openssl/bio.h>
+
+/**
+ * With kernel TLS the record layer of a connection moves into the socket
+ * once the handshake is done: SSL_write hands plaintext to the kernel,
+ * which encrypts it while copying it into the socket buffer instead of
+ * OpenSSL encrypting into a buffer of its own first. OpenSSL does this by
+ * itself for contexts created with SSL_OP_ENABLE_KTLS when the cipher is
+ * one the kernel knows and the tls module can be loaded, and keeps
+ * encrypting in userspace otherwise.
+ *
+ * OpenSSL switches the socket over through the write BIO of the SSL. That
+ * works when the write BIO is the socket BIO, or a filter that passes the
+ * kTLS controls through to it. FreeRDP versions that put a buffered BIO of
+ * their own between the SSL and the socket and answer these controls
+ * themselves keep every connection in userspace, as do OpenSSL builds
+ * without kTLS and kernels without the tls module. The offloaded count
+ * printed with the stats tells which case a deployment is in.
+ *
+ * The count comes from an info callback. FreeRDP may have one of its own
+ * on a context, so the one found there is kept and called first.
+ */
+
+static BOOL g_TlsOffload = FALSE;
+static LONG g_TlsHandshakes = 0;
+static LONG g_TlsOffloaded = 0;
+static int g_TlsOffloadIndex = -1;
+
+typedef void (*fnSSLInfoCallback)(const SSL* ssl, int where, int ret);
+
+struct rds_tls_offload_callback
+{
+	fnSSLInfoCallback previous;
+};
+typedef struct rds_tls_offload_callback rdsTlsOffloadCallback;
+
+static void freerds_tls_offload_info(const SSL* ssl, int where, int ret)
+{
+	rdsTlsOffloadCallback* callback;
+
+	callback = (rdsTlsOffloadCallback*) SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), g_TlsOffloadIndex);
+
+	if (callback && callback->previous)
+		callback->previous(ssl, where, ret);
+
+	if (!(where & SSL_CB_HANDSHAKE_DONE))
+		return;
+
+	InterlockedIncrement(&g_TlsHandshakes);
+
+#ifdef BIO_get_ktls_send
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+		InterlockedIncrement(&g_TlsOffloaded);
+#endif
+}
+
+static void freerds_tls_offload_free_callback(void* parent, void* ptr, CRYPTO_EX_DATA* ad,
+		int index, long argl, void* argp)
+{
+	free(ptr);
+}
+
+void freerds_tls_offload_attach(struct ssl_ctx_st* ctx)
+{
+	rdsTlsOffloadCallback* callback;
+
+	if (!g_TlsOffload)
+		return;
+
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+
+	/* without a place to keep the previous callback, offload without counting */
+	if (g_TlsOffloadIndex < 0)
+		return;
+
+	callback = (rdsTlsOffloadCallback*) calloc(1, sizeof(rdsTlsOffloadCallback));
+
+	if (!callback)
+		return;
+
+	callback->previous = SSL_CTX_get_info_callback(ctx);
+
+	if (!SSL_CTX_set_ex_data(ctx, g_TlsOffloadIndex, callback))
+	{
+		free(callback);
+		return;
+	}
+
+	SSL_CTX_set_info_callback(ctx, freerds_tls_offload_info);
+#endif
+}
+
+int freerds_tls_offload_init(BOOL enable)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+	g_TlsOffload = enable;
+
+	if (!g_TlsOffload)
+		return 0;
+
+	g_TlsOffloadIndex = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL,
+			freerds_tls_offload_free_callback);
+
+	if (g_TlsOffloadIndex < 0)
+		fprintf(stderr, "no SSL_CTX ex_data index, offloaded connections are not counted\n");
+
+	printf("offloading TLS to the kernel where possible\n");
+
+	return 0;
+#else
+	g_TlsOffload = FALSE;
+
+	if (enable)
+		printf("OpenSSL %s has no kernel TLS support\n", OPENSSL_VERSION_TEXT);
+
+	return -1;
+#endif
+}
+
+void freerds_tls_offload_print_stats(void)
+{
+	if (!g_TlsOffload)
+		return;
+
+	if (g_TlsOffloadIndex < 0)
+		return;
+
+	printf("kernel TLS: %d of %d connections offloaded\n",
+			(int) g_TlsOffloaded, (int) g_TlsHandshakes);
+
+	if (g_TlsHandshakes && !g_TlsOffloaded)
+		printf("kernel TLS: no connection offloaded, check the tls module and the BIO FreeRDP reads and writes through\n");
+}
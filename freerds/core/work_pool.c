@@ -0,0 +1,169 @@
+/**
+ * xrdp: A Remote Desktop Protocol server.
+ * Blocking Work Pool
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "freerds.h"
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/thread.h>
+#include <winpr/collections.h>
+
+/**
+ * A fixed number of threads for work that blocks, PAM conversations or
+ * calls to the session manager, which must not hold up event workers.
+ * The number of threads bounds how many such calls are made at once.
+ */
+
+struct rds_work_item
+{
+	pfnWorkCallback callback;
+	void* context;
+};
+typedef struct rds_work_item rdsWorkItem;
+
+struct rds_work_pool
+{
+	UINT32 workerCount;
+	HANDLE* workers;
+	wQueue* items;
+	HANDLE StopEvent;
+};
+
+static void* freerds_work_pool_main(void* arg)
+{
+	HANDLE events[2];
+	rdsWorkItem* item;
+	rdsWorkPool* pool = (rdsWorkPool*) arg;
+
+	events[0] = Queue_Event(pool->items);
+	events[1] = pool->StopEvent;
+
+	while (1)
+	{
+		WaitForMultipleObjects(2, events, FALSE, INFINITE);
+
+		item = (rdsWorkItem*) Queue_Dequeue(pool->items);
+
+		if (item)
+		{
+			item->callback(item->context);
+			free(item);
+			continue;
+		}
+
+		if (WaitForSingleObject(pool->StopEvent, 0) == WAIT_OBJECT_0)
+			break;
+	}
+
+	return NULL;
+}
+
+int freerds_work_pool_submit(rdsWorkPool* pool, pfnWorkCallback callback, void* context)
+{
+	rdsWorkItem* item;
+
+	if (!pool)
+		return -1;
+
+	item = (rdsWorkItem*) malloc(sizeof(rdsWorkItem));
+
+	if (!item)
+		return -1;
+
+	item->callback = callback;
+	item->context = context;
+
+	Queue_Enqueue(pool->items, item);
+
+	return 0;
+}
+
+rdsWorkPool* freerds_work_pool_new(UINT32 workerCount)
+{
+	UINT32 index;
+	rdsWorkPool* pool;
+
+	if (workerCount < 1)
+		workerCount = 1;
+
+	pool = (rdsWorkPool*) calloc(1, sizeof(rdsWorkPool));
+
+	if (!pool)
+		return NULL;
+
+	pool->StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	pool->items = Queue_New(TRUE, -1, -1);
+	pool->workers = (HANDLE*) calloc(workerCount, sizeof(HANDLE));
+
+	if (!pool->StopEvent || !pool->items || !pool->workers)
+	{
+		freerds_work_pool_free(pool);
+		return NULL;
+	}
+
+	for (index = 0; index < workerCount; index++)
+	{
+		pool->workers[index] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) freerds_work_pool_main,
+				(void*) pool, 0, NULL);
+
+		if (!pool->workers[index])
+		{
+			freerds_work_pool_free(pool);
+			return NULL;
+		}
+
+		pool->workerCount++;
+	}
+
+	return pool;
+}
+
+/**
+ * Work still queued is done before the workers exit.
+ */
+
+void freerds_work_pool_free(rdsWorkPool* pool)
+{
+	UINT32 index;
+
+	if (!pool)
+		return;
+
+	if (pool->StopEvent)
+		SetEvent(pool->StopEvent);
+
+	for (index = 0; index < pool->workerCount; index++)
+	{
+		WaitForSingleObject(pool->workers[index], INFINITE);
+		CloseHandle(pool->workers[index]);
+	}
+
+	if (pool->items)
+		Queue_Free(pool->items);
+
+	if (pool->StopEvent)
+		CloseHandle(pool->StopEvent);
+
+	free(pool->workers);
+	free(pool);
+}
@@ -150,3 +150,35 @@ int freerds_icp_GetUserSession(char *username, char * domain, UINT32 *sessionID,
 	ICP_CLIENT_STUB_CLEANUP(GetUserSession, get_user_session)
 	return PBRPC_SUCCESS;
 }
+
+int freerds_icp_ReportLoad(UINT32 sessions, UINT32 pendingConnections, UINT32 cpuLoad, UINT32 freeMemory, UINT32 encodeBacklog, BOOL saturated, BOOL *acknowledged)
+{
+	ICP_CLIENT_STUB_SETUP(ReportLoad, report_load)
+
+	request.sessions = sessions;
+	request.pendingconnections = pendingConnections;
+	request.cpuload = cpuLoad;
+	request.freememory = freeMemory;
+	request.encodebacklog = encodeBacklog;
+	request.saturated = saturated;
+
+	ICP_CLIENT_STUB_CALL(ReportLoad, report_load)
+	if (ret != 0)
+	{
+		// handle function specific frees
+		return ret;
+	}
+
+	ICP_CLIENT_STUB_UNPACK_RESPONSE(ReportLoad, report_load)
+	if (NULL == response)
+	{
+		// unpack error
+		// free function specific stuff
+		return PBRPC_BAD_RESPONSE;
+	}
+
+	*acknowledged = response->acknowledged;
+
+	ICP_CLIENT_STUB_CLEANUP(ReportLoad, report_load)
+	return PBRPC_SUCCESS;
+}
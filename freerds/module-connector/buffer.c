@@ -0,0 +1,199 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * xrdp-ng interprocess communication protocol
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <winpr/crt.h>
+#include <winpr/interlocked.h>
+
+#include <freerds/freerds.h>
+
+#include "buffer.h"
+
+struct rds_message_slot
+{
+	RDS_MSG_SERVER msg;
+	rdsMessageBuffer* buffer;
+	struct rds_message_slot* next;
+};
+typedef struct rds_message_slot rdsMessageSlot;
+
+rdsMessageBuffer* freerds_message_buffer_new(size_t size)
+{
+	rdsMessageBuffer* buffer;
+
+	buffer = (rdsMessageBuffer*) malloc(sizeof(rdsMessageBuffer));
+
+	if (!buffer)
+		return NULL;
+
+	buffer->refCount = 1;
+	buffer->s = Stream_New(NULL, size);
+
+	if (!buffer->s)
+	{
+		free(buffer);
+		return NULL;
+	}
+
+	return buffer;
+}
+
+void freerds_message_buffer_acquire(rdsMessageBuffer* buffer)
+{
+	InterlockedIncrement(&buffer->refCount);
+}
+
+void freerds_message_buffer_release(rdsMessageBuffer* buffer)
+{
+	if (!buffer)
+		return;
+
+	if (InterlockedDecrement(&buffer->refCount) > 0)
+		return;
+
+	Stream_Free(buffer->s, TRUE);
+	free(buffer);
+}
+
+/**
+ * Returns a buffer the transport can overwrite, with the bytes between
+ * offset and end moved to its beginning. That is buffer itself unless
+ * queued messages still point into it, in which case it is left to them
+ * and a new one takes its place.
+ */
+
+rdsMessageBuffer* freerds_message_buffer_reclaim(rdsMessageBuffer* buffer, size_t offset, size_t end)
+{
+	BYTE* data;
+	rdsMessageBuffer* reclaimed;
+
+	data = Stream_Buffer(buffer->s);
+
+	/* only the transport thread takes references, one means it is ours alone */
+	if (buffer->refCount == 1)
+	{
+		if (offset > 0)
+			MoveMemory(data, &data[offset], end - offset);
+
+		return buffer;
+	}
+
+	reclaimed = freerds_message_buffer_new(Stream_Capacity(buffer->s));
+
+	if (!reclaimed)
+		return NULL;
+
+	CopyMemory(Stream_Buffer(reclaimed->s), &data[offset], end - offset);
+
+	freerds_message_buffer_release(buffer);
+
+	return reclaimed;
+}
+
+/**
+ * Server messages queued by the pipeline live in recycled slots, the ones
+ * pointing into a message buffer hold a reference to it until released.
+ */
+
+RDS_MSG_COMMON* freerds_server_message_acquire(rdsModuleConnector* connector,
+		RDS_MSG_COMMON* msg, rdsMessageBuffer* buffer)
+{
+	rdsMessageSlot* slot;
+
+	EnterCriticalSection(&connector->MessagePoolLock);
+
+	slot = (rdsMessageSlot*) connector->MessagePool;
+
+	if (slot)
+	{
+		connector->MessagePool = slot->next;
+		connector->MessagePoolSize--;
+	}
+
+	LeaveCriticalSection(&connector->MessagePoolLock);
+
+	if (!slot)
+	{
+		slot = (rdsMessageSlot*) malloc(sizeof(rdsMessageSlot));
+
+		if (!slot)
+			return NULL;
+	}
+
+	CopyMemory(&slot->msg, msg, freerds_server_message_size(msg->type));
+
+	slot->buffer = NULL;
+	slot->next = NULL;
+
+	if (buffer && freerds_server_message_references_buffer(msg))
+	{
+		freerds_message_buffer_acquire(buffer);
+		slot->buffer = buffer;
+	}
+
+	return (RDS_MSG_COMMON*) &slot->msg;
+}
+
+void freerds_server_message_release(rdsModuleConnector* connector, RDS_MSG_COMMON* msg)
+{
+	rdsMessageSlot* slot;
+
+	slot = (rdsMessageSlot*) msg;
+
+	if (slot->buffer)
+	{
+		freerds_message_buffer_release(slot->buffer);
+		slot->buffer = NULL;
+	}
+
+	EnterCriticalSection(&connector->MessagePoolLock);
+
+	if (connector->MessagePoolSize < FREERDS_MESSAGE_POOL_MAX)
+	{
+		slot->next = (rdsMessageSlot*) connector->MessagePool;
+		connector->MessagePool = slot;
+		connector->MessagePoolSize++;
+		slot = NULL;
+	}
+
+	LeaveCriticalSection(&connector->MessagePoolLock);
+
+	free(slot);
+}
+
+void freerds_server_message_pool_free(rdsModuleConnector* connector)
+{
+	rdsMessageSlot* slot;
+	rdsMessageSlot* next;
+
+	slot = (rdsMessageSlot*) connector->MessagePool;
+
+	while (slot)
+	{
+		next = slot->next;
+		free(slot);
+		slot = next;
+	}
+
+	connector->MessagePool = NULL;
+	connector->MessagePoolSize = 0;
+}
@@ -0,0 +1,29 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * xrdp-ng interprocess communication protocol
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDS_NG_BUFFER_H
+#define RDS_NG_BUFFER_H
+
+#include <freerds/freerds.h>
+
+#define FREERDS_MESSAGE_POOL_MAX	1024
+
+rdsMessageBuffer* freerds_message_buffer_reclaim(rdsMessageBuffer* buffer, size_t offset, size_t end);
+
+#endif /* RDS_NG_BUFFER_H */
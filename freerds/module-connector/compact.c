@@ -0,0 +1,707 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * xrdp-ng interprocess communication protocol
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+
+#include <winpr/crt.h>
+
+#include <freerds/freerds.h>
+
+#include "protocol.h"
+
+#include "compact.h"
+
+#define ZIGZAG_ENCODE(_v)	((((UINT32) (_v)) << 1) ^ ((UINT32) (((INT32) (_v)) >> 31)))
+#define ZIGZAG_DECODE(_v)	((INT32) (((_v) >> 1) ^ (0 - ((_v) & 1))))
+
+/**
+ * Field kinds: 'u' an unsigned 32-bit field, 'i' a signed one, 'r' the
+ * nLeftRect, nTopRect, nWidth, nHeight run carried as the rect of the
+ * header, and 'd' a BYTE* followed by its UINT32 length, sent as the
+ * length and the bytes it points to.
+ */
+
+struct rds_compact_field
+{
+	char kind;
+	UINT16 offset;
+};
+typedef struct rds_compact_field RDS_COMPACT_FIELD;
+
+struct rds_compact_layout
+{
+	UINT32 type;
+	UINT32 size;
+	const RDS_COMPACT_FIELD* fields;
+};
+typedef struct rds_compact_layout RDS_COMPACT_LAYOUT;
+
+#define RDS_COMPACT_FIELD(_type, _field, _kind)	{ _kind, (UINT16) offsetof(_type, _field) }
+#define RDS_COMPACT_FIELD_END			{ 0, 0 }
+
+#define RDS_COMPACT_LAYOUT(_type, _msg, _fields)	{ _type, sizeof(_msg), _fields }
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_NO_FIELDS[] =
+{
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_SYNCHRONIZE_KEYBOARD_EVENT[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_SYNCHRONIZE_KEYBOARD_EVENT, flags, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_SCANCODE_KEYBOARD_EVENT[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_SCANCODE_KEYBOARD_EVENT, flags, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_SCANCODE_KEYBOARD_EVENT, code, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_SCANCODE_KEYBOARD_EVENT, keyboardType, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_VIRTUAL_KEYBOARD_EVENT[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_VIRTUAL_KEYBOARD_EVENT, flags, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_VIRTUAL_KEYBOARD_EVENT, code, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_UNICODE_KEYBOARD_EVENT[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_UNICODE_KEYBOARD_EVENT, flags, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_UNICODE_KEYBOARD_EVENT, code, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_MOUSE_EVENT[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_MOUSE_EVENT, flags, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_MOUSE_EVENT, x, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_MOUSE_EVENT, y, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_EXTENDED_MOUSE_EVENT[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_EXTENDED_MOUSE_EVENT, flags, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_EXTENDED_MOUSE_EVENT, x, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_EXTENDED_MOUSE_EVENT, y, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_SET_CLIPPING_REGION[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_SET_CLIPPING_REGION, bNullRegion, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_SET_CLIPPING_REGION, nLeftRect, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_SET_CLIPPING_REGION, nTopRect, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_SET_CLIPPING_REGION, nWidth, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_SET_CLIPPING_REGION, nHeight, 'i'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_OPAQUE_RECT[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_OPAQUE_RECT, nLeftRect, 'r'),
+	RDS_COMPACT_FIELD(RDS_MSG_OPAQUE_RECT, color, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_SCREEN_BLT[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_SCREEN_BLT, nLeftRect, 'r'),
+	RDS_COMPACT_FIELD(RDS_MSG_SCREEN_BLT, nXSrc, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_SCREEN_BLT, nYSrc, 'i'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_PAINT_RECT[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_PAINT_RECT, nLeftRect, 'r'),
+	RDS_COMPACT_FIELD(RDS_MSG_PAINT_RECT, nXSrc, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_PAINT_RECT, nYSrc, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_PAINT_RECT, fbSegmentId, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_PAINT_RECT, bitmapData, 'd'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_DSTBLT[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_DSTBLT, nLeftRect, 'r'),
+	RDS_COMPACT_FIELD(RDS_MSG_DSTBLT, bRop, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_LINE_TO[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_LINE_TO, nXStart, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_LINE_TO, nYStart, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_LINE_TO, nXEnd, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_LINE_TO, nYEnd, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_LINE_TO, bRop2, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_LINE_TO, penStyle, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_LINE_TO, penWidth, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_LINE_TO, penColor, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_CREATE_OFFSCREEN_SURFACE[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_CREATE_OFFSCREEN_SURFACE, cacheIndex, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_CREATE_OFFSCREEN_SURFACE, nWidth, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_CREATE_OFFSCREEN_SURFACE, nHeight, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_SWITCH_OFFSCREEN_SURFACE[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_SWITCH_OFFSCREEN_SURFACE, cacheIndex, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_DELETE_OFFSCREEN_SURFACE[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_DELETE_OFFSCREEN_SURFACE, cacheIndex, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_PAINT_OFFSCREEN_SURFACE[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_PAINT_OFFSCREEN_SURFACE, cacheIndex, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_PAINT_OFFSCREEN_SURFACE, nLeftRect, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_PAINT_OFFSCREEN_SURFACE, nTopRect, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_PAINT_OFFSCREEN_SURFACE, nWidth, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_PAINT_OFFSCREEN_SURFACE, nHeight, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_PAINT_OFFSCREEN_SURFACE, nXSrc, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_PAINT_OFFSCREEN_SURFACE, nYSrc, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_PAINT_OFFSCREEN_SURFACE, bRop, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_SET_SYSTEM_POINTER[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_SET_SYSTEM_POINTER, ptrType, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_WINDOW_DELETE[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_WINDOW_DELETE, windowId, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_LOGOFF_USER[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_LOGOFF_USER, Flags, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_SHARED_FRAMEBUFFER[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_SHARED_FRAMEBUFFER, width, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_SHARED_FRAMEBUFFER, height, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_SHARED_FRAMEBUFFER, attach, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_SHARED_FRAMEBUFFER, scanline, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_SHARED_FRAMEBUFFER, segmentId, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_SHARED_FRAMEBUFFER, bitsPerPixel, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_SHARED_FRAMEBUFFER, bytesPerPixel, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_SHARED_FRAMEBUFFER, flags, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+static const RDS_COMPACT_FIELD RDS_COMPACT_SHARED_TRANSPORT[] =
+{
+	RDS_COMPACT_FIELD(RDS_MSG_SHARED_TRANSPORT, flags, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_SHARED_TRANSPORT, segmentId, 'i'),
+	RDS_COMPACT_FIELD(RDS_MSG_SHARED_TRANSPORT, ringSize, 'u'),
+	RDS_COMPACT_FIELD(RDS_MSG_SHARED_TRANSPORT, version, 'u'),
+	RDS_COMPACT_FIELD_END
+};
+
+/**
+ * Messages not listed here, the rarely sent ones with variable bodies,
+ * keep their version 1 body.
+ */
+
+static const RDS_COMPACT_LAYOUT RDS_COMPACT_LAYOUTS[] =
+{
+	RDS_COMPACT_LAYOUT(RDS_CLIENT_SYNCHRONIZE_KEYBOARD_EVENT, RDS_MSG_SYNCHRONIZE_KEYBOARD_EVENT, RDS_COMPACT_SYNCHRONIZE_KEYBOARD_EVENT),
+	RDS_COMPACT_LAYOUT(RDS_CLIENT_SCANCODE_KEYBOARD_EVENT, RDS_MSG_SCANCODE_KEYBOARD_EVENT, RDS_COMPACT_SCANCODE_KEYBOARD_EVENT),
+	RDS_COMPACT_LAYOUT(RDS_CLIENT_VIRTUAL_KEYBOARD_EVENT, RDS_MSG_VIRTUAL_KEYBOARD_EVENT, RDS_COMPACT_VIRTUAL_KEYBOARD_EVENT),
+	RDS_COMPACT_LAYOUT(RDS_CLIENT_UNICODE_KEYBOARD_EVENT, RDS_MSG_UNICODE_KEYBOARD_EVENT, RDS_COMPACT_UNICODE_KEYBOARD_EVENT),
+	RDS_COMPACT_LAYOUT(RDS_CLIENT_MOUSE_EVENT, RDS_MSG_MOUSE_EVENT, RDS_COMPACT_MOUSE_EVENT),
+	RDS_COMPACT_LAYOUT(RDS_CLIENT_EXTENDED_MOUSE_EVENT, RDS_MSG_EXTENDED_MOUSE_EVENT, RDS_COMPACT_EXTENDED_MOUSE_EVENT),
+	RDS_COMPACT_LAYOUT(RDS_CLIENT_VBLANK_EVENT, RDS_MSG_VBLANK_EVENT, RDS_COMPACT_NO_FIELDS),
+	RDS_COMPACT_LAYOUT(RDS_CLIENT_SHARED_TRANSPORT, RDS_MSG_SHARED_TRANSPORT, RDS_COMPACT_SHARED_TRANSPORT),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_BEGIN_UPDATE, RDS_MSG_BEGIN_UPDATE, RDS_COMPACT_NO_FIELDS),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_END_UPDATE, RDS_MSG_END_UPDATE, RDS_COMPACT_NO_FIELDS),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_BEEP, RDS_MSG_BEEP, RDS_COMPACT_NO_FIELDS),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_SET_CLIPPING_REGION, RDS_MSG_SET_CLIPPING_REGION, RDS_COMPACT_SET_CLIPPING_REGION),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_OPAQUE_RECT, RDS_MSG_OPAQUE_RECT, RDS_COMPACT_OPAQUE_RECT),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_SCREEN_BLT, RDS_MSG_SCREEN_BLT, RDS_COMPACT_SCREEN_BLT),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_PAINT_RECT, RDS_MSG_PAINT_RECT, RDS_COMPACT_PAINT_RECT),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_DSTBLT, RDS_MSG_DSTBLT, RDS_COMPACT_DSTBLT),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_LINE_TO, RDS_MSG_LINE_TO, RDS_COMPACT_LINE_TO),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_CREATE_OFFSCREEN_SURFACE, RDS_MSG_CREATE_OFFSCREEN_SURFACE, RDS_COMPACT_CREATE_OFFSCREEN_SURFACE),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_SWITCH_OFFSCREEN_SURFACE, RDS_MSG_SWITCH_OFFSCREEN_SURFACE, RDS_COMPACT_SWITCH_OFFSCREEN_SURFACE),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_DELETE_OFFSCREEN_SURFACE, RDS_MSG_DELETE_OFFSCREEN_SURFACE, RDS_COMPACT_DELETE_OFFSCREEN_SURFACE),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_PAINT_OFFSCREEN_SURFACE, RDS_MSG_PAINT_OFFSCREEN_SURFACE, RDS_COMPACT_PAINT_OFFSCREEN_SURFACE),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_SET_SYSTEM_POINTER, RDS_MSG_SET_SYSTEM_POINTER, RDS_COMPACT_SET_SYSTEM_POINTER),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_WINDOW_DELETE, RDS_MSG_WINDOW_DELETE, RDS_COMPACT_WINDOW_DELETE),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_LOGOFF_USER, RDS_MSG_LOGOFF_USER, RDS_COMPACT_LOGOFF_USER),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_SHARED_FRAMEBUFFER, RDS_MSG_SHARED_FRAMEBUFFER, RDS_COMPACT_SHARED_FRAMEBUFFER),
+	RDS_COMPACT_LAYOUT(RDS_SERVER_SHARED_TRANSPORT, RDS_MSG_SHARED_TRANSPORT, RDS_COMPACT_SHARED_TRANSPORT),
+	{ 0, 0, NULL }
+};
+
+static const RDS_COMPACT_LAYOUT* freerds_compact_layout(UINT32 type)
+{
+	const RDS_COMPACT_LAYOUT* layout;
+
+	for (layout = RDS_COMPACT_LAYOUTS; layout->fields; layout++)
+	{
+		if (layout->type == type)
+			return layout;
+	}
+
+	return NULL;
+}
+
+#define RDS_COMPACT_UINT32(_msg, _offset)	(*((UINT32*) &(((BYTE*) (_msg))[_offset])))
+#define RDS_COMPACT_INT32(_msg, _offset)	(*((INT32*) &(((BYTE*) (_msg))[_offset])))
+#define RDS_COMPACT_POINTER(_msg, _offset)	(*((BYTE**) &(((BYTE*) (_msg))[_offset])))
+
+static UINT32 freerds_compact_get_uint32(const BYTE* data)
+{
+	return data[0] | (data[1] << 8) | (data[2] << 16) | (((UINT32) data[3]) << 24);
+}
+
+static void freerds_compact_set_uint32(BYTE* data, UINT32 value)
+{
+	data[0] = value & 0xFF;
+	data[1] = (value >> 8) & 0xFF;
+	data[2] = (value >> 16) & 0xFF;
+	data[3] = (value >> 24) & 0xFF;
+}
+
+/**
+ * A NULL destination only measures, like the message writers do.
+ */
+
+static UINT32 freerds_varint_write(BYTE* dst, UINT32 value)
+{
+	UINT32 count = 0;
+
+	while (value >= 0x80)
+	{
+		if (dst)
+			dst[count] = (BYTE) (value | 0x80);
+
+		value >>= 7;
+		count++;
+	}
+
+	if (dst)
+		dst[count] = (BYTE) value;
+
+	return count + 1;
+}
+
+/**
+ * Returns the number of bytes used, 0 if more data is needed, -1 if invalid.
+ */
+
+static int freerds_varint_read(const BYTE* src, size_t size, UINT32* value)
+{
+	int index;
+	UINT32 result = 0;
+
+	for (index = 0; index < 5; index++)
+	{
+		if (index >= size)
+			return 0;
+
+		/* the fifth byte only has the top 4 bits of a UINT32 left to carry */
+		if ((index == 4) && (src[index] > 0x0F))
+			return -1;
+
+		result |= ((UINT32) (src[index] & 0x7F)) << (7 * index);
+
+		if (!(src[index] & 0x80))
+		{
+			*value = result;
+			return index + 1;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Starts a container at the beginning of a batch, its length is filled in
+ * once the batch is complete. Rects are delta coded within a container.
+ */
+
+void freerds_compact_begin(rdsModuleConnector* connector, wStream* s)
+{
+	Stream_EnsureRemainingCapacity(s, RDS_COMPACT_CONTAINER_HEADER_LENGTH);
+	Stream_Seek(s, RDS_COMPACT_CONTAINER_HEADER_LENGTH);
+
+	ZeroMemory(&connector->OutboundRect, sizeof(RDS_RECT));
+}
+
+void freerds_compact_end(rdsModuleConnector* connector, wStream* s)
+{
+	freerds_compact_set_uint32(Stream_Buffer(s),
+			(UINT32) (Stream_GetPosition(s) - RDS_COMPACT_CONTAINER_HEADER_LENGTH));
+}
+
+/**
+ * Everything after the size of a message, written from the message itself.
+ * Measures when dst is NULL, the rect of the connector only moves on once
+ * the message is written.
+ */
+
+static UINT32 freerds_compact_write_payload(BYTE* dst, RDS_RECT* last, RDS_MSG_COMMON* msg,
+		const RDS_COMPACT_LAYOUT* layout, BYTE* body, UINT32 bodyLength)
+{
+	BYTE* data;
+	UINT32 length;
+	UINT32 offset = 0;
+	BYTE flags = 0;
+	const RDS_COMPACT_FIELD* field;
+
+	if (msg->msgFlags & RDS_MSG_FLAG_RECT)
+		flags |= RDS_COMPACT_FLAG_RECT;
+
+	if (msg->msgFlags & ~RDS_MSG_FLAG_RECT)
+		flags |= RDS_COMPACT_FLAG_EXTENDED;
+
+	if (layout)
+		flags |= RDS_COMPACT_FLAG_PACKED;
+
+	if (dst)
+		dst[offset] = flags;
+	offset++;
+
+	if (flags & RDS_COMPACT_FLAG_EXTENDED)
+		offset += freerds_varint_write(dst ? &dst[offset] : NULL, msg->msgFlags);
+
+	if (flags & RDS_COMPACT_FLAG_RECT)
+	{
+		offset += freerds_varint_write(dst ? &dst[offset] : NULL, ZIGZAG_ENCODE(((UINT32) msg->rect.x) - ((UINT32) last->x)));
+		offset += freerds_varint_write(dst ? &dst[offset] : NULL, ZIGZAG_ENCODE(((UINT32) msg->rect.y) - ((UINT32) last->y)));
+		offset += freerds_varint_write(dst ? &dst[offset] : NULL, ZIGZAG_ENCODE(msg->rect.width - last->width));
+		offset += freerds_varint_write(dst ? &dst[offset] : NULL, ZIGZAG_ENCODE(msg->rect.height - last->height));
+
+		if (dst)
+			CopyMemory(last, &msg->rect, sizeof(RDS_RECT));
+	}
+
+	if (!layout)
+	{
+		if (dst)
+			CopyMemory(&dst[offset], body, bodyLength);
+
+		return offset + bodyLength;
+	}
+
+	for (field = layout->fields; field->kind; field++)
+	{
+		switch (field->kind)
+		{
+			case 'u':
+				offset += freerds_varint_write(dst ? &dst[offset] : NULL,
+						RDS_COMPACT_UINT32(msg, field->offset));
+				break;
+
+			case 'i':
+				offset += freerds_varint_write(dst ? &dst[offset] : NULL,
+						ZIGZAG_ENCODE(RDS_COMPACT_INT32(msg, field->offset)));
+				break;
+
+			case 'd':
+				data = RDS_COMPACT_POINTER(msg, field->offset);
+				length = data ? RDS_COMPACT_UINT32(msg, field->offset + sizeof(BYTE*)) : 0;
+
+				offset += freerds_varint_write(dst ? &dst[offset] : NULL, length);
+
+				if (dst && length)
+					CopyMemory(&dst[offset], data, length);
+
+				offset += length;
+				break;
+		}
+	}
+
+	return offset;
+}
+
+/**
+ * Appends msg to the container being written to s, the version 1 writer
+ * of the message having set its flags already. Returns the length written.
+ */
+
+int freerds_compact_write_message(rdsModuleConnector* connector, wStream* s, RDS_MSG_COMMON* msg)
+{
+	BYTE* dst;
+	BYTE* body = NULL;
+	UINT32 bodyLength = 0;
+	UINT32 payloadLength;
+	size_t position;
+	const RDS_COMPACT_LAYOUT* layout;
+
+	layout = freerds_compact_layout(msg->type);
+
+	if (layout && (layout->fields[0].kind == 'r'))
+	{
+		msg->rect.x = RDS_COMPACT_INT32(msg, layout->fields[0].offset);
+		msg->rect.y = RDS_COMPACT_INT32(msg, layout->fields[0].offset + 4);
+		msg->rect.width = RDS_COMPACT_UINT32(msg, layout->fields[0].offset + 8);
+		msg->rect.height = RDS_COMPACT_UINT32(msg, layout->fields[0].offset + 12);
+		msg->msgFlags |= RDS_MSG_FLAG_RECT;
+	}
+
+	if (!layout)
+	{
+		/* only server messages have variable bodies */
+		if ((msg->type > 31) || !connector->EncodeStream)
+			return -1;
+
+		Stream_SetPosition(connector->EncodeStream, 0);
+		Stream_EnsureCapacity(connector->EncodeStream, freerds_server_message_write(NULL, msg));
+		freerds_server_message_write(connector->EncodeStream, msg);
+
+		body = Stream_Buffer(connector->EncodeStream) + freerds_write_common_header(NULL, msg);
+		bodyLength = msg->length - freerds_write_common_header(NULL, msg);
+	}
+
+	payloadLength = freerds_compact_write_payload(NULL, &connector->OutboundRect, msg, layout, body, bodyLength);
+
+	position = Stream_GetPosition(s);
+	Stream_EnsureRemainingCapacity(s, 10 + payloadLength);
+	dst = Stream_Pointer(s);
+
+	dst += freerds_varint_write(dst, msg->type);
+	dst += freerds_varint_write(dst, payloadLength);
+	dst += freerds_compact_write_payload(dst, &connector->OutboundRect, msg, layout, body, bodyLength);
+
+	Stream_SetPosition(s, dst - Stream_Buffer(s));
+
+	return (int) (Stream_GetPosition(s) - position);
+}
+
+/**
+ * Returns 1 with the length of the container at data, header included,
+ * 0 if more data is needed and -1 if invalid.
+ */
+
+int freerds_compact_peek_container(BYTE* data, size_t size, UINT32* length)
+{
+	UINT32 value;
+
+	if (size < RDS_COMPACT_CONTAINER_HEADER_LENGTH)
+		return 0;
+
+	value = freerds_compact_get_uint32(data);
+
+	if (value > (0x7FFFFFFF - RDS_COMPACT_CONTAINER_HEADER_LENGTH))
+		return -1;
+
+	*length = RDS_COMPACT_CONTAINER_HEADER_LENGTH + value;
+
+	return 1;
+}
+
+int freerds_compact_peek_length(BYTE* data, size_t size, UINT32* length)
+{
+	int status;
+	UINT32 value;
+	UINT32 offset;
+
+	status = freerds_varint_read(data, size, &value);
+
+	if (status <= 0)
+		return status;
+
+	offset = status;
+
+	status = freerds_varint_read(&data[offset], size - offset, &value);
+
+	if (status <= 0)
+		return status;
+
+	offset += status;
+
+	if (value > (0x7FFFFFFF - offset))
+		return -1;
+
+	*length = offset + value;
+
+	return 1;
+}
+
+/**
+ * Reads the message of length bytes at data into msg, which must have room
+ * for any message. Returns 1 once it is read in full, its data pointing
+ * into data, or 0 if it has a version 1 body, starting at bodyOffset, msg
+ * then only holding its header. Returns -1 if the message is invalid.
+ */
+
+int freerds_compact_read_message(rdsModuleConnector* connector, BYTE* data, UINT32 length,
+		RDS_MSG_COMMON* msg, UINT32* bodyOffset)
+{
+	int index;
+	int status;
+	BYTE flags;
+	UINT32 type;
+	UINT32 value;
+	UINT32 delta[4];
+	UINT32 msgFlags;
+	UINT32 offset = 0;
+	RDS_RECT* last;
+	const RDS_COMPACT_LAYOUT* layout = NULL;
+	const RDS_COMPACT_FIELD* field;
+
+	last = &connector->InboundRect;
+
+	status = freerds_varint_read(data, length, &type);
+
+	if ((status <= 0) || (type > 0xFFFF))
+		return -1;
+
+	offset += status;
+
+	status = freerds_varint_read(&data[offset], length - offset, &value);
+
+	if ((status <= 0) || ((offset + status + value) != length))
+		return -1;
+
+	offset += status;
+
+	if (offset >= length)
+		return -1;
+
+	flags = data[offset++];
+	msgFlags = (flags & RDS_COMPACT_FLAG_RECT) ? RDS_MSG_FLAG_RECT : 0;
+
+	if (flags & RDS_COMPACT_FLAG_EXTENDED)
+	{
+		status = freerds_varint_read(&data[offset], length - offset, &msgFlags);
+
+		if (status <= 0)
+			return -1;
+
+		offset += status;
+	}
+
+	if (((flags & RDS_COMPACT_FLAG_RECT) != 0) != ((msgFlags & RDS_MSG_FLAG_RECT) != 0))
+		return -1;
+
+	if (flags & RDS_COMPACT_FLAG_PACKED)
+	{
+		layout = freerds_compact_layout(type);
+
+		if (!layout)
+			return -1;
+
+		ZeroMemory(msg, layout->size);
+	}
+	else
+	{
+		ZeroMemory(msg, sizeof(RDS_MSG_COMMON));
+	}
+
+	msg->type = type;
+	msg->length = length;
+	msg->msgFlags = msgFlags;
+
+	if (flags & RDS_COMPACT_FLAG_RECT)
+	{
+		for (index = 0; index < 4; index++)
+		{
+			status = freerds_varint_read(&data[offset], length - offset, &delta[index]);
+
+			if (status <= 0)
+				return -1;
+
+			offset += status;
+		}
+
+		last->x = (INT32) (((UINT32) last->x) + ((UINT32) ZIGZAG_DECODE(delta[0])));
+		last->y = (INT32) (((UINT32) last->y) + ((UINT32) ZIGZAG_DECODE(delta[1])));
+		last->width = last->width + ((UINT32) ZIGZAG_DECODE(delta[2]));
+		last->height = last->height + ((UINT32) ZIGZAG_DECODE(delta[3]));
+
+		CopyMemory(&msg->rect, last, sizeof(RDS_RECT));
+	}
+
+	if (!layout)
+	{
+		*bodyOffset = offset;
+		return 0;
+	}
+
+	for (field = layout->fields; field->kind; field++)
+	{
+		if (field->kind == 'r')
+		{
+			if (!(flags & RDS_COMPACT_FLAG_RECT))
+				return -1;
+
+			RDS_COMPACT_INT32(msg, field->offset) = msg->rect.x;
+			RDS_COMPACT_INT32(msg, field->offset + 4) = msg->rect.y;
+			RDS_COMPACT_INT32(msg, field->offset + 8) = (INT32) msg->rect.width;
+			RDS_COMPACT_INT32(msg, field->offset + 12) = (INT32) msg->rect.height;
+			continue;
+		}
+
+		status = freerds_varint_read(&data[offset], length - offset, &value);
+
+		if (status <= 0)
+			return -1;
+
+		offset += status;
+
+		if (field->kind == 'u')
+		{
+			RDS_COMPACT_UINT32(msg, field->offset) = value;
+		}
+		else if (field->kind == 'i')
+		{
+			RDS_COMPACT_INT32(msg, field->offset) = ZIGZAG_DECODE(value);
+		}
+		else if (field->kind == 'd')
+		{
+			if (value > (length - offset))
+				return -1;
+
+			RDS_COMPACT_POINTER(msg, field->offset) = value ? &data[offset] : NULL;
+			RDS_COMPACT_UINT32(msg, field->offset + sizeof(BYTE*)) = value;
+
+			offset += value;
+		}
+	}
+
+	return (offset == length) ? 1 : -1;
+}
@@ -0,0 +1,61 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * xrdp-ng interprocess communication protocol
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDS_NG_COMPACT_H
+#define RDS_NG_COMPACT_H
+
+#include <freerds/freerds.h>
+
+/**
+ * Version 2 wire format, one container per batch:
+ *
+ * UINT32 length of the messages that follow
+ * messages, back to back
+ *
+ * and per message:
+ *
+ * varint type
+ * varint size of what follows
+ * byte flags (RDS_COMPACT_FLAG_*)
+ * [varint msgFlags] when RDS_COMPACT_FLAG_EXTENDED
+ * [4 zigzag varints] rect as a delta against the previous rect of the container
+ * body, either the fields of the message when RDS_COMPACT_FLAG_PACKED,
+ * unsigned ones as varints and signed ones as zigzag varints, or the
+ * version 1 body as is
+ *
+ * Messages with a field layout are written from and read into their
+ * structure directly, the others keep their version 1 body.
+ */
+
+#define RDS_COMPACT_FLAG_RECT		0x01
+#define RDS_COMPACT_FLAG_PACKED		0x02
+#define RDS_COMPACT_FLAG_EXTENDED	0x04
+
+#define RDS_COMPACT_CONTAINER_HEADER_LENGTH	4
+
+void freerds_compact_begin(rdsModuleConnector* connector, wStream* s);
+void freerds_compact_end(rdsModuleConnector* connector, wStream* s);
+int freerds_compact_write_message(rdsModuleConnector* connector, wStream* s, RDS_MSG_COMMON* msg);
+
+int freerds_compact_peek_container(BYTE* data, size_t size, UINT32* length);
+int freerds_compact_peek_length(BYTE* data, size_t size, UINT32* length);
+int freerds_compact_read_message(rdsModuleConnector* connector, BYTE* data, UINT32 length,
+		RDS_MSG_COMMON* msg, UINT32* bodyOffset);
+
+#endif /* RDS_NG_COMPACT_H */
@@ -0,0 +1,225 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * xrdp-ng interprocess communication protocol
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <winpr/crt.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <freerds/freerds.h>
+
+/**
+ * Framebuffer damage as seen by the kernel: pages written since the last
+ * collection have their soft-dirty bit set in /proc/self/pagemap, writing
+ * 4 to /proc/self/clear_refs clears them again. Dirty pages are turned into
+ * full width bands of the rows they cover.
+ *
+ * clear_refs applies to the whole process and anything written between
+ * reading pagemap and clearing it would be lost, so collecting has to be
+ * done by the thread drawing into the framebuffer. Clearing write-protects
+ * every page of the process, not only the framebuffer, and the next write
+ * to each of them takes a fault. The framebuffer has to be mapped without
+ * huge pages, or a dirty bit covers 2 MB of it.
+ */
+
+#define PAGEMAP_SOFT_DIRTY	(((UINT64) 1) << 55)
+
+struct rds_framebuffer_damage
+{
+	BYTE* data;
+	int width;
+	int height;
+	int scanline;
+	UINT32 pageSize;
+	size_t firstPage;
+	UINT32 pageCount;
+	UINT64* entries;
+	int pagemapFd;
+	int clearRefsFd;
+};
+
+static int freerds_framebuffer_damage_clear(rdsFramebufferDamage* damage)
+{
+	if (write(damage->clearRefsFd, "4", 1) != 1)
+		return -1;
+
+	return 0;
+}
+
+static int freerds_framebuffer_damage_read(rdsFramebufferDamage* damage)
+{
+	ssize_t length;
+	off_t offset;
+
+	length = damage->pageCount * sizeof(UINT64);
+	offset = ((off_t) damage->firstPage) * sizeof(UINT64);
+
+	if (pread(damage->pagemapFd, damage->entries, length, offset) != length)
+		return -1;
+
+	return 0;
+}
+
+void freerds_framebuffer_damage_free(rdsFramebufferDamage* damage)
+{
+	if (!damage)
+		return;
+
+	if (damage->pagemapFd >= 0)
+		close(damage->pagemapFd);
+
+	if (damage->clearRefsFd >= 0)
+		close(damage->clearRefsFd);
+
+	free(damage->entries);
+	free(damage);
+}
+
+/**
+ * Returns NULL when soft-dirty tracking is not available, which is checked
+ * by writing to the framebuffer and looking for the bit to show up.
+ */
+
+rdsFramebufferDamage* freerds_framebuffer_damage_new(BYTE* data, int width, int height, int scanline)
+{
+	size_t start;
+	size_t end;
+	rdsFramebufferDamage* damage;
+
+	if (!data || (width <= 0) || (height <= 0) || (scanline <= 0))
+		return NULL;
+
+	damage = (rdsFramebufferDamage*) calloc(1, sizeof(rdsFramebufferDamage));
+
+	if (!damage)
+		return NULL;
+
+	damage->data = data;
+	damage->width = width;
+	damage->height = height;
+	damage->scanline = scanline;
+	damage->pageSize = (UINT32) sysconf(_SC_PAGESIZE);
+
+	start = ((size_t) data) / damage->pageSize;
+	end = (((size_t) data) + ((size_t) scanline * height) + damage->pageSize - 1) / damage->pageSize;
+
+	damage->firstPage = start;
+	damage->pageCount = (UINT32) (end - start);
+
+	damage->entries = (UINT64*) calloc(damage->pageCount, sizeof(UINT64));
+	damage->pagemapFd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+	damage->clearRefsFd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+
+	if (!damage->entries || (damage->pagemapFd < 0) || (damage->clearRefsFd < 0))
+	{
+		freerds_framebuffer_damage_free(damage);
+		return NULL;
+	}
+
+	if ((freerds_framebuffer_damage_clear(damage) < 0) || (freerds_framebuffer_damage_read(damage) < 0) ||
+			(damage->entries[0] & PAGEMAP_SOFT_DIRTY))
+	{
+		freerds_framebuffer_damage_free(damage);
+		return NULL;
+	}
+
+	/* rewrite the first byte as it is, the kernel has to notice it */
+	*((volatile BYTE*) data) = *((volatile BYTE*) data);
+
+	if ((freerds_framebuffer_damage_read(damage) < 0) || !(damage->entries[0] & PAGEMAP_SOFT_DIRTY))
+	{
+		freerds_framebuffer_damage_free(damage);
+		return NULL;
+	}
+
+	return damage;
+}
+
+/**
+ * Fills bands with the rows written to since the last call and returns
+ * how many there are, or -1 on error. Past maxBands the last band is
+ * extended to cover the remaining ones.
+ */
+
+int freerds_framebuffer_damage_collect(rdsFramebufferDamage* damage, RDS_RECT* bands, int maxBands)
+{
+	int top;
+	int bottom;
+	int count;
+	UINT32 index;
+	UINT32 first;
+	size_t base;
+	size_t offset;
+	size_t limit;
+
+	if (maxBands < 1)
+		return -1;
+
+	if (freerds_framebuffer_damage_read(damage) < 0)
+		return -1;
+
+	if (freerds_framebuffer_damage_clear(damage) < 0)
+		return -1;
+
+	count = 0;
+	base = ((size_t) damage->data) - (damage->firstPage * damage->pageSize);
+	limit = (size_t) damage->scanline * damage->height;
+
+	for (index = 0; index < damage->pageCount; index++)
+	{
+		if (!(damage->entries[index] & PAGEMAP_SOFT_DIRTY))
+			continue;
+
+		/* one band per run of dirty pages */
+		first = index;
+
+		while (((index + 1) < damage->pageCount) && (damage->entries[index + 1] & PAGEMAP_SOFT_DIRTY))
+			index++;
+
+		offset = ((size_t) first) * damage->pageSize;
+		top = (offset > base) ? (int) ((offset - base) / damage->scanline) : 0;
+
+		offset = ((size_t) index + 1) * damage->pageSize - base;
+		bottom = (int) ((((offset < limit) ? offset : limit) + damage->scanline - 1) / damage->scanline);
+
+		if ((count > 0) && (top <= (bands[count - 1].y + (int) bands[count - 1].height)))
+		{
+			bands[count - 1].height = bottom - bands[count - 1].y;
+			continue;
+		}
+
+		if (count == maxBands)
+		{
+			bands[count - 1].height = bottom - bands[count - 1].y;
+			continue;
+		}
+
+		bands[count].x = 0;
+		bands[count].y = top;
+		bands[count].width = damage->width;
+		bands[count].height = bottom - top;
+		count++;
+	}
+
+	return count;
+}
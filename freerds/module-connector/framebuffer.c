@@ -0,0 +1,254 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * xrdp-ng interprocess communication protocol
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <winpr/crt.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <freerds/freerds.h>
+
+#include "transport.h"
+
+/**
+ * Shared framebuffers are memfd backed where the kernel supports it, the
+ * descriptor is handed to freerds over the module socket. Unlike a SysV
+ * segment it goes away with the last process holding it, is not limited
+ * by shmmax and can be backed by transparent huge pages.
+ *
+ * Huge pages are left out when the framebuffer damage is taken from the
+ * kernel: soft-dirty bits are then kept per 2 MB mapping, and a single
+ * write dirties hundreds of rows.
+ *
+ * The size of the memfd is sealed before it is passed: freerds maps what
+ * the module sent, a module shrinking it afterwards would have freerds
+ * fault on its next read of the framebuffer.
+ */
+
+static int freerds_memfd_create(const char* name)
+{
+#if defined(__linux__) && defined(__NR_memfd_create) && defined(F_ADD_SEALS)
+	/* MFD_CLOEXEC | MFD_ALLOW_SEALING, spelled out for C libraries without memfd_create */
+	return (int) syscall(__NR_memfd_create, name, 0x0003U);
+#else
+	return -1;
+#endif
+}
+
+/**
+ * Creates a memfd of size bytes that can no longer be resized, returns its
+ * descriptor or -1.
+ */
+
+int freerds_memfd_create_sealed(const char* name, UINT32 size)
+{
+	int fd;
+
+	fd = freerds_memfd_create(name);
+
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, size) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+#ifdef F_ADD_SEALS
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+#endif
+
+	return fd;
+}
+
+/**
+ * Checks a memfd passed by the other side: it has to be at least size
+ * bytes and sealed against shrinking, it stays mappable that way.
+ */
+
+int freerds_memfd_check_sealed(int fd, UINT64 size)
+{
+#ifdef F_GET_SEALS
+	int seals;
+	struct stat sb;
+
+	seals = fcntl(fd, F_GET_SEALS);
+
+	if ((seals < 0) || !(seals & F_SEAL_SHRINK))
+		return -1;
+
+	if ((fstat(fd, &sb) < 0) || ((UINT64) sb.st_size < size))
+		return -1;
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static void freerds_shared_framebuffer_advise(BYTE* data, UINT32 size)
+{
+#ifdef MADV_HUGEPAGE
+	/* only a hint, shmem huge pages may well be disabled */
+	madvise(data, size, MADV_HUGEPAGE);
+#endif
+}
+
+static BYTE* freerds_shared_framebuffer_create_memfd(UINT32 size, BOOL hugePages, int* fd)
+{
+	BYTE* data;
+
+	*fd = freerds_memfd_create_sealed("freerds-framebuffer", size);
+
+	if (*fd < 0)
+		return NULL;
+
+	data = (BYTE*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+
+	if (data == MAP_FAILED)
+	{
+		close(*fd);
+		*fd = -1;
+		return NULL;
+	}
+
+	if (hugePages)
+		freerds_shared_framebuffer_advise(data, size);
+
+	return data;
+}
+
+BYTE* freerds_shared_framebuffer_create(UINT32 size, BOOL hugePages, int* segmentId, int* fd)
+{
+	BYTE* data;
+
+	data = freerds_shared_framebuffer_create_memfd(size, hugePages, fd);
+
+	if (data)
+	{
+		*segmentId = -1;
+		return data;
+	}
+
+	*fd = -1;
+
+	*segmentId = shmget(IPC_PRIVATE, size, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+
+	if (*segmentId < 0)
+		return NULL;
+
+	data = (BYTE*) shmat(*segmentId, 0, 0);
+
+	if (data == (BYTE*) -1)
+	{
+		shmctl(*segmentId, IPC_RMID, 0);
+		*segmentId = -1;
+		return NULL;
+	}
+
+	return data;
+}
+
+void freerds_shared_framebuffer_destroy(BYTE* data, UINT32 size, int segmentId, int fd)
+{
+	if (!data)
+		return;
+
+	if (fd >= 0)
+	{
+		munmap(data, size);
+		close(fd);
+		return;
+	}
+
+	shmdt(data);
+	shmctl(segmentId, IPC_RMID, 0);
+}
+
+/**
+ * Maps the framebuffer announced by a module, the descriptor of a memfd
+ * framebuffer is consumed whether it can be mapped or not.
+ */
+
+BYTE* freerds_shared_framebuffer_attach(RDS_MSG_SHARED_FRAMEBUFFER* msg)
+{
+	BYTE* data;
+	UINT64 size;
+
+	if (!(msg->flags & RDS_SHARED_FRAMEBUFFER_MEMFD))
+	{
+		data = (BYTE*) shmat(msg->segmentId, 0, 0);
+		return (data == (BYTE*) -1) ? NULL : data;
+	}
+
+	if (msg->fd < 0)
+		return NULL;
+
+	data = NULL;
+	size = ((UINT64) msg->scanline) * ((UINT64) msg->height);
+
+	/* the module is not trusted to have made it as large as it says, nor to leave it that way */
+	if ((msg->scanline > 0) && (msg->height > 0) && (freerds_memfd_check_sealed(msg->fd, size) == 0))
+	{
+		/* freerds only ever reads the framebuffer */
+		data = (BYTE*) mmap(NULL, (size_t) size, PROT_READ, MAP_SHARED, msg->fd, 0);
+
+		if (data == MAP_FAILED)
+			data = NULL;
+		else
+			freerds_shared_framebuffer_advise(data, (UINT32) size);
+	}
+
+	close(msg->fd);
+	msg->fd = -1;
+
+	return data;
+}
+
+void freerds_shared_framebuffer_detach(BYTE* data, UINT32 size, int segmentId)
+{
+	if (!data)
+		return;
+
+	if (segmentId == -1)
+		munmap(data, size);
+	else
+		shmdt(data);
+}
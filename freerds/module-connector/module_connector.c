@@ -29,6 +29,8 @@
 #include <winpr/thread.h>
 #include <winpr/synch.h>
 
+#include "transport.h"
+
 rdsModuleConnector* freerds_module_connector_new(rdsConnection* connection)
 {
 	rdpSettings* settings;
@@ -46,13 +48,24 @@ rdsModuleConnector* freerds_module_connector_new(rdsConnection* connection)
 	connector->server = freerds_server_outbound_interface_new();
 
 	connector->OutboundStream = Stream_New(NULL, 8192);
-	connector->InboundStream = Stream_New(NULL, 8192);
+	connector->InboundBuffer = freerds_message_buffer_new(8192);
+	connector->InboundStream = connector->InboundBuffer->s;
 
 	connector->InboundTotalLength = 0;
 	connector->InboundTotalCount = 0;
+	connector->InboundWakeupCount = 0;
 
 	connector->OutboundTotalLength = 0;
 	connector->OutboundTotalCount = 0;
+	connector->OutboundWriteCount = 0;
+	connector->OutboundBatching = TRUE;
+	connector->OutboundFdCount = 0;
+	connector->SharedTransportFd = -1;
+
+	/* written by the shared event workers, which must not wait for a module */
+	connector->OutboundNonBlocking = TRUE;
+
+	InitializeCriticalSectionAndSpinCount(&connector->MessagePoolLock, 4000);
 
 	connector->StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 
@@ -63,11 +76,31 @@ void freerds_module_connector_free(rdsModuleConnector* connector)
 {
 	SetEvent(connector->StopEvent);
 
-	WaitForSingleObject(connector->ServerThread, INFINITE);
-	CloseHandle(connector->ServerThread);
+	if (connector->ServerThread)
+	{
+		WaitForSingleObject(connector->ServerThread, INFINITE);
+		CloseHandle(connector->ServerThread);
+	}
+
+	freerds_shm_transport_free(connector);
+	freerds_transport_close_fds(connector);
+
+	if (connector->framebuffer.fbAttached)
+	{
+		freerds_shared_framebuffer_detach(connector->framebuffer.fbSharedMemory,
+				connector->framebuffer.fbScanline * connector->framebuffer.fbHeight,
+				connector->framebuffer.fbSegmentId);
+	}
 
 	Stream_Free(connector->OutboundStream, TRUE);
-	Stream_Free(connector->InboundStream, TRUE);
+
+	if (connector->OutboundPending)
+		Stream_Free(connector->OutboundPending, TRUE);
+
+	freerds_message_buffer_release(connector->InboundBuffer);
+
+	freerds_server_message_pool_free(connector);
+	DeleteCriticalSection(&connector->MessagePoolLock);
 
 	CloseHandle(connector->StopEvent);
 	CloseHandle(connector->hClientPipe);
@@ -23,10 +23,291 @@
 
 #include <freerds/freerds.h>
 
+#include <winpr/sysinfo.h>
+
 #include "transport.h"
 
 #include "outbound.h"
 
+#include "shm_transport.h"
+#include "compact.h"
+
+/**
+ * Returns how many bytes are waiting for the peer to make room for them,
+ * only non-blocking connectors ever hold any.
+ */
+
+UINT32 freerds_connector_outbound_pending(rdsModuleConnector* connector)
+{
+	if (!connector->OutboundPending)
+		return 0;
+
+	return (UINT32) Stream_GetPosition(connector->OutboundPending);
+}
+
+/**
+ * Descriptors waiting to be passed go with the next bytes written to the
+ * named pipe, those are never behind the message they belong to. Every
+ * write carries one, all but the last with a single byte so that none is
+ * left behind once its message has been written.
+ */
+
+static int freerds_outbound_pipe_write_some(rdsModuleConnector* connector, BYTE* data, UINT32 length)
+{
+	int status;
+
+	if (!connector->OutboundFdCount)
+		return freerds_named_pipe_write_some(connector->hClientPipe, data, length);
+
+	if (connector->OutboundFdCount > 1)
+		length = 1;
+
+	status = freerds_named_pipe_write_fd(connector->hClientPipe, data, length, connector->OutboundFds[0]);
+
+	if (status > 0)
+	{
+		connector->OutboundFdCount--;
+		MoveMemory(&connector->OutboundFds[0], &connector->OutboundFds[1],
+				connector->OutboundFdCount * sizeof(int));
+	}
+
+	return status;
+}
+
+static int freerds_outbound_pipe_write(rdsModuleConnector* connector, BYTE* data, UINT32 length)
+{
+	int status;
+	UINT32 total = length;
+
+	while ((connector->OutboundFdCount > 0) && (length > 0))
+	{
+		status = freerds_outbound_pipe_write_some(connector, data, length);
+
+		if (status <= 0)
+			return -1;
+
+		data += status;
+		length -= status;
+	}
+
+	if (length > 0)
+	{
+		if (freerds_named_pipe_write(connector->hClientPipe, data, length) < 0)
+			return -1;
+	}
+
+	return total;
+}
+
+/**
+ * The leading OutboundPendingPipe bytes were queued for the named pipe
+ * before the switch to the ring, they and the descriptors waiting with them
+ * go out before anything is written to the ring.
+ */
+
+static int freerds_outbound_write_some(rdsModuleConnector* connector, BYTE* data, UINT32 length)
+{
+	int status;
+	BYTE wakeup = 0;
+
+	if (connector->OutboundPendingPipe > 0)
+	{
+		status = freerds_outbound_pipe_write_some(connector, data, MIN(length, connector->OutboundPendingPipe));
+
+		if (status > 0)
+			connector->OutboundPendingPipe -= status;
+
+		return status;
+	}
+
+	if (!connector->OutboundRingActive)
+		return freerds_outbound_pipe_write_some(connector, data, length);
+
+	while (connector->OutboundFdCount > 0)
+	{
+		status = freerds_outbound_pipe_write_some(connector, &wakeup, 1);
+
+		if (status <= 0)
+			return status;
+	}
+
+	return freerds_shm_transport_write_some(connector, data, length);
+}
+
+/**
+ * Non-blocking connectors write what the transport accepts right away and
+ * keep the rest, in order, until the next flush. A stall lasts from the
+ * first byte left behind until the pending bytes are all written.
+ */
+
+static int freerds_outbound_queue(rdsModuleConnector* connector, BYTE* data, UINT32 length)
+{
+	int status;
+	BYTE* buffer;
+	UINT32 pending;
+	UINT32 written;
+	wStream* ps;
+
+	if (!connector->OutboundPending)
+		connector->OutboundPending = Stream_New(NULL, FREERDS_OUTBOUND_BATCH_SIZE);
+
+	ps = connector->OutboundPending;
+
+	if (length > 0)
+	{
+		Stream_EnsureRemainingCapacity(ps, length);
+		Stream_Write(ps, data, length);
+	}
+
+	buffer = Stream_Buffer(ps);
+	pending = (UINT32) Stream_GetPosition(ps);
+
+	status = 0;
+	written = 0;
+
+	/* until the transport is full, queued descriptors and a switch take several writes */
+	while (written < pending)
+	{
+		status = freerds_outbound_write_some(connector, &buffer[written], pending - written);
+
+		if (status < 0)
+			return -1;
+
+		if (!status)
+			break;
+
+		written += status;
+	}
+
+	if (written > 0)
+	{
+		MoveMemory(buffer, &buffer[written], pending - written);
+		Stream_SetPosition(ps, pending - written);
+	}
+
+	if (Stream_GetPosition(ps) > 0)
+	{
+		if (!connector->OutboundStallStart)
+		{
+			connector->OutboundStallStart = GetTickCount();
+			connector->OutboundStallCount++;
+		}
+	}
+	else if (connector->OutboundStallStart)
+	{
+		connector->OutboundStallTime += GetTickCount() - connector->OutboundStallStart;
+		connector->OutboundStallStart = 0;
+	}
+
+	return status;
+}
+
+/**
+ * Queues the last bytes for the named pipe ahead of a switch to the ring,
+ * when nothing else is pending. Whatever is queued after them goes to the
+ * ring once they are out.
+ */
+
+int freerds_outbound_queue_pipe(rdsModuleConnector* connector, BYTE* data, UINT32 length)
+{
+	if (freerds_connector_outbound_pending(connector) > 0)
+		return -1;
+
+	connector->OutboundPendingPipe = length;
+
+	return freerds_outbound_queue(connector, data, length);
+}
+
+/**
+ * Outbound messages are serialized back to back into OutboundStream and
+ * written out in a single call when the batch is flushed, instead of one
+ * write per message. Without batching every message is flushed on its own.
+ */
+
+int freerds_connector_outbound_flush(rdsModuleConnector* connector)
+{
+	int status;
+	int length;
+	wStream* s;
+
+	s = connector->OutboundStream;
+	length = (int) Stream_GetPosition(s);
+
+	status = 0;
+
+	if (length > 0)
+	{
+		if (connector->OutboundVersion >= RDS_PROTOCOL_VERSION_2)
+			freerds_compact_end(connector, s);
+
+		Stream_SetPosition(s, 0);
+
+		if (connector->OutboundNonBlocking)
+			status = freerds_outbound_queue(connector, Stream_Buffer(s), length);
+		else if (connector->OutboundRingActive)
+			status = freerds_shm_transport_write(connector, Stream_Buffer(s), length);
+		else
+			status = freerds_outbound_pipe_write(connector, Stream_Buffer(s), length);
+
+		connector->OutboundWriteCount++;
+	}
+	else if (freerds_connector_outbound_pending(connector) > 0)
+	{
+		status = freerds_outbound_queue(connector, NULL, 0);
+	}
+
+	if (status < 0)
+		return -1;
+
+	/* the switch marker must not overtake bytes still waiting to be written */
+	if (freerds_connector_outbound_pending(connector) > 0)
+		return status;
+
+	/* switching transport or wire format happens between two batches */
+	if (freerds_shm_transport_switch(connector) < 0)
+		return -1;
+
+	return status;
+}
+
+static wStream* freerds_outbound_prepare(rdsModuleConnector* connector, int length)
+{
+	wStream* s;
+
+	s = connector->OutboundStream;
+
+	if (!connector->OutboundBatching)
+		Stream_SetPosition(s, 0);
+	else if ((Stream_GetPosition(s) + length) > FREERDS_OUTBOUND_BATCH_SIZE)
+		freerds_connector_outbound_flush(connector);
+
+	if (Stream_GetPosition(s) == 0)
+	{
+		connector->OutboundBatchTime = GetTickCount();
+
+		if (connector->OutboundVersion >= RDS_PROTOCOL_VERSION_2)
+			freerds_compact_begin(connector, s);
+	}
+
+	Stream_EnsureRemainingCapacity(s, length);
+
+	return s;
+}
+
+static int freerds_outbound_commit(rdsModuleConnector* connector, int length, BOOL flush)
+{
+	connector->OutboundTotalLength += length;
+	connector->OutboundTotalCount++;
+
+	if (!connector->OutboundBatching || flush)
+		return freerds_connector_outbound_flush(connector);
+
+	if ((GetTickCount() - connector->OutboundBatchTime) >= FREERDS_OUTBOUND_FLUSH_DEADLINE)
+		return freerds_connector_outbound_flush(connector);
+
+	return length;
+}
+
 int freerds_client_outbound_synchronize_keyboard_event(rdsModuleConnector* connector, DWORD flags)
 {
 	int length;
@@ -39,13 +320,19 @@ int freerds_client_outbound_synchronize_keyboard_event(rdsModuleConnector* conne
 
 	msg.flags = flags;
 
-	s = connector->OutboundStream;
-	Stream_SetPosition(s, 0);
-
 	length = freerds_write_synchronize_keyboard_event(NULL, &msg);
-	freerds_write_synchronize_keyboard_event(s, &msg);
 
-	status = freerds_named_pipe_write(connector->hClientPipe, Stream_Buffer(s), length);
+	s = freerds_outbound_prepare(connector, length);
+
+	if (connector->OutboundVersion >= RDS_PROTOCOL_VERSION_2)
+		length = freerds_compact_write_message(connector, s, (RDS_MSG_COMMON*) &msg);
+	else
+		freerds_write_synchronize_keyboard_event(s, &msg);
+
+	if (length < 0)
+		return -1;
+
+	status = freerds_outbound_commit(connector, length, FALSE);
 
 	return status;
 }
@@ -64,13 +351,19 @@ int freerds_client_outbound_scancode_keyboard_event(rdsModuleConnector* connecto
 	msg.code = code;
 	msg.keyboardType = keyboardType;
 
-	s = connector->OutboundStream;
-	Stream_SetPosition(s, 0);
-
 	length = freerds_write_scancode_keyboard_event(NULL, &msg);
-	freerds_write_scancode_keyboard_event(s, &msg);
 
-	status = freerds_named_pipe_write(connector->hClientPipe, Stream_Buffer(s), length);
+	s = freerds_outbound_prepare(connector, length);
+
+	if (connector->OutboundVersion >= RDS_PROTOCOL_VERSION_2)
+		length = freerds_compact_write_message(connector, s, (RDS_MSG_COMMON*) &msg);
+	else
+		freerds_write_scancode_keyboard_event(s, &msg);
+
+	if (length < 0)
+		return -1;
+
+	status = freerds_outbound_commit(connector, length, FALSE);
 
 	return status;
 }
@@ -88,13 +381,19 @@ int freerds_client_outbound_virtual_keyboard_event(rdsModuleConnector* connector
 	msg.flags = flags;
 	msg.code = code;
 
-	s = connector->OutboundStream;
-	Stream_SetPosition(s, 0);
-
 	length = freerds_write_virtual_keyboard_event(NULL, &msg);
-	freerds_write_virtual_keyboard_event(s, &msg);
 
-	status = freerds_named_pipe_write(connector->hClientPipe, Stream_Buffer(s), length);
+	s = freerds_outbound_prepare(connector, length);
+
+	if (connector->OutboundVersion >= RDS_PROTOCOL_VERSION_2)
+		length = freerds_compact_write_message(connector, s, (RDS_MSG_COMMON*) &msg);
+	else
+		freerds_write_virtual_keyboard_event(s, &msg);
+
+	if (length < 0)
+		return -1;
+
+	status = freerds_outbound_commit(connector, length, FALSE);
 
 	return status;
 }
@@ -112,13 +411,19 @@ int freerds_client_outbound_unicode_keyboard_event(rdsModuleConnector* connector
 	msg.flags = flags;
 	msg.code = code;
 
-	s = connector->OutboundStream;
-	Stream_SetPosition(s, 0);
-
 	length = freerds_write_unicode_keyboard_event(NULL, &msg);
-	freerds_write_unicode_keyboard_event(s, &msg);
 
-	status = freerds_named_pipe_write(connector->hClientPipe, Stream_Buffer(s), length);
+	s = freerds_outbound_prepare(connector, length);
+
+	if (connector->OutboundVersion >= RDS_PROTOCOL_VERSION_2)
+		length = freerds_compact_write_message(connector, s, (RDS_MSG_COMMON*) &msg);
+	else
+		freerds_write_unicode_keyboard_event(s, &msg);
+
+	if (length < 0)
+		return -1;
+
+	status = freerds_outbound_commit(connector, length, FALSE);
 
 	return status;
 }
@@ -137,13 +442,19 @@ int freerds_client_outbound_mouse_event(rdsModuleConnector* connector, DWORD fla
 	msg.x = x;
 	msg.y = y;
 
-	s = connector->OutboundStream;
-	Stream_SetPosition(s, 0);
-
 	length = freerds_write_mouse_event(NULL, &msg);
-	freerds_write_mouse_event(s, &msg);
 
-	status = freerds_named_pipe_write(connector->hClientPipe, Stream_Buffer(s), length);
+	s = freerds_outbound_prepare(connector, length);
+
+	if (connector->OutboundVersion >= RDS_PROTOCOL_VERSION_2)
+		length = freerds_compact_write_message(connector, s, (RDS_MSG_COMMON*) &msg);
+	else
+		freerds_write_mouse_event(s, &msg);
+
+	if (length < 0)
+		return -1;
+
+	status = freerds_outbound_commit(connector, length, FALSE);
 
 	return status;
 }
@@ -162,13 +473,19 @@ int freerds_client_outbound_extended_mouse_event(rdsModuleConnector* connector,
 	msg.x = x;
 	msg.y = y;
 
-	s = connector->OutboundStream;
-	Stream_SetPosition(s, 0);
-
 	length = freerds_write_extended_mouse_event(NULL, &msg);
-	freerds_write_extended_mouse_event(s, &msg);
 
-	status = freerds_named_pipe_write(connector->hClientPipe, Stream_Buffer(s), length);
+	s = freerds_outbound_prepare(connector, length);
+
+	if (connector->OutboundVersion >= RDS_PROTOCOL_VERSION_2)
+		length = freerds_compact_write_message(connector, s, (RDS_MSG_COMMON*) &msg);
+	else
+		freerds_write_extended_mouse_event(s, &msg);
+
+	if (length < 0)
+		return -1;
+
+	status = freerds_outbound_commit(connector, length, FALSE);
 
 	return status;
 }
@@ -183,13 +500,19 @@ int freerds_client_outbound_vblank_event(rdsModuleConnector* connector)
 	msg.msgFlags = 0;
 	msg.type = RDS_CLIENT_VBLANK_EVENT;
 
-	s = connector->OutboundStream;
-	Stream_SetPosition(s, 0);
-
 	length = freerds_write_vblank_event(NULL, &msg);
-	freerds_write_vblank_event(s, &msg);
 
-	status = freerds_named_pipe_write(connector->hClientPipe, Stream_Buffer(s), length);
+	s = freerds_outbound_prepare(connector, length);
+
+	if (connector->OutboundVersion >= RDS_PROTOCOL_VERSION_2)
+		length = freerds_compact_write_message(connector, s, (RDS_MSG_COMMON*) &msg);
+	else
+		freerds_write_vblank_event(s, &msg);
+
+	if (length < 0)
+		return -1;
+
+	status = freerds_outbound_commit(connector, length, FALSE);
 
 	return status;
 }
@@ -219,17 +542,23 @@ rdsClientInterface* freerds_client_outbound_interface_new()
 
 int freerds_server_outbound_write_message(rdsModuleConnector* connector, RDS_MSG_COMMON* msg)
 {
+	int length;
 	int status;
 	wStream* s;
 
-	s = connector->OutboundStream;
-	Stream_SetPosition(s, 0);
+	length = freerds_server_message_write(NULL, msg);
 
-	freerds_server_message_write(NULL, msg);
-	Stream_EnsureRemainingCapacity(s, msg->length);
-	freerds_server_message_write(s, msg);
+	s = freerds_outbound_prepare(connector, length);
 
-	status = freerds_named_pipe_write(connector->hClientPipe, Stream_Buffer(s), msg->length);
+	if (connector->OutboundVersion >= RDS_PROTOCOL_VERSION_2)
+		length = freerds_compact_write_message(connector, s, msg);
+	else
+		freerds_server_message_write(s, msg);
+
+	if (length < 0)
+		return -1;
+
+	status = freerds_outbound_commit(connector, length, (msg->type == RDS_SERVER_END_UPDATE));
 
 	return status;
 }
@@ -329,9 +658,50 @@ int freerds_server_outbound_glyph_index(rdsModuleConnector* connector, RDS_MSG_G
 	return freerds_server_outbound_write_message(connector, (RDS_MSG_COMMON*) msg);
 }
 
+/**
+ * Over the shared transport the named pipe only carries wakeups, the
+ * descriptor is sent right away with one of its own ahead of the message.
+ * Otherwise it is queued until the batch holding its message is written,
+ * flushing first when freerds could not take another one.
+ */
+
+int freerds_outbound_pass_fd(rdsModuleConnector* connector, int fd)
+{
+	BYTE wakeup = 0;
+
+	/* behind bytes still waiting for the named pipe it has to wait as well */
+	if (!connector->OutboundRingActive || connector->OutboundPendingPipe)
+	{
+		if (connector->OutboundFdCount >= FREERDS_OUTBOUND_FDS_MAX)
+			freerds_connector_outbound_flush(connector);
+
+		if (connector->OutboundFdCount >= FREERDS_OUTBOUND_FDS_MAX)
+		{
+			fprintf(stderr, "%s: %d descriptors still waiting to be passed\n",
+					__FUNCTION__, (int) connector->OutboundFdCount);
+			return -1;
+		}
+
+		connector->OutboundFds[connector->OutboundFdCount++] = fd;
+		return 0;
+	}
+
+	if (freerds_named_pipe_write_fd(connector->hClientPipe, &wakeup, 1, fd) <= 0)
+		return -1;
+
+	return 0;
+}
+
 int freerds_server_outbound_shared_framebuffer(rdsModuleConnector* connector, RDS_MSG_SHARED_FRAMEBUFFER* msg)
 {
 	msg->type = RDS_SERVER_SHARED_FRAMEBUFFER;
+
+	if (msg->flags & RDS_SHARED_FRAMEBUFFER_MEMFD)
+	{
+		if (freerds_outbound_pass_fd(connector, msg->fd) < 0)
+			return -1;
+	}
+
 	return freerds_server_outbound_write_message(connector, (RDS_MSG_COMMON*) msg);
 }
 
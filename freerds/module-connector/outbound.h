@@ -22,4 +22,10 @@
 
 #include <freerds/freerds.h>
 
+#define FREERDS_OUTBOUND_BATCH_SIZE		0xFFFF
+#define FREERDS_OUTBOUND_FLUSH_DEADLINE		4
+
+int freerds_outbound_pass_fd(rdsModuleConnector* connector, int fd);
+int freerds_outbound_queue_pipe(rdsModuleConnector* connector, BYTE* data, UINT32 length);
+
 #endif /* RDS_NG_OUTBOUND_H */
@@ -38,9 +38,13 @@ struct _RDS_MSG_DEFINITION
 	pXrdpMessageWrite Write;
 	pXrdpMessageCopy Copy;
 	pXrdpMessageFree Free;
+	UINT32 Flags;
 };
 typedef struct _RDS_MSG_DEFINITION RDS_MSG_DEFINITION;
 
+/* fields of the message read point into the stream it was read from */
+#define RDS_MSG_DEFINITION_FLAG_VIEW	0x00000001
+
 UINT32 freerds_peek_common_header_length(BYTE* data)
 {
 	UINT32 length;
@@ -268,6 +272,37 @@ int freerds_write_vblank_event(wStream* s, RDS_MSG_VBLANK_EVENT* msg)
 	return 0;
 }
 
+int freerds_read_shared_transport(wStream* s, RDS_MSG_SHARED_TRANSPORT* msg)
+{
+	if (Stream_GetRemainingLength(s) < 16)
+		return -1;
+
+	Stream_Read_UINT32(s, msg->flags);
+	Stream_Read_UINT32(s, msg->segmentId);
+	Stream_Read_UINT32(s, msg->ringSize);
+	Stream_Read_UINT32(s, msg->version);
+
+	return 0;
+}
+
+int freerds_write_shared_transport(wStream* s, RDS_MSG_SHARED_TRANSPORT* msg)
+{
+	msg->msgFlags = 0;
+	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 16;
+
+	if (!s)
+		return msg->length;
+
+	freerds_write_common_header(s, (RDS_MSG_COMMON*) msg);
+
+	Stream_Write_UINT32(s, msg->flags);
+	Stream_Write_UINT32(s, msg->segmentId);
+	Stream_Write_UINT32(s, msg->ringSize);
+	Stream_Write_UINT32(s, msg->version);
+
+	return 0;
+}
+
 
 int freerds_read_capabilities(wStream* s, RDS_MSG_CAPABILITIES* msg)
 {
@@ -392,7 +427,8 @@ static RDS_MSG_DEFINITION RDS_MSG_BEGIN_UPDATE_DEFINITION =
 	(pXrdpMessageRead) freerds_read_begin_update,
 	(pXrdpMessageWrite) freerds_write_begin_update,
 	(pXrdpMessageCopy) freerds_begin_update_copy,
-	(pXrdpMessageFree) freerds_begin_update_free
+	(pXrdpMessageFree) freerds_begin_update_free,
+	0
 };
 
 /**
@@ -438,7 +474,8 @@ static RDS_MSG_DEFINITION RDS_MSG_END_UPDATE_DEFINITION =
 	(pXrdpMessageRead) freerds_read_end_update,
 	(pXrdpMessageWrite) freerds_write_end_update,
 	(pXrdpMessageCopy) freerds_end_update_copy,
-	(pXrdpMessageFree) freerds_end_update_free
+	(pXrdpMessageFree) freerds_end_update_free,
+	0
 };
 
 /**
@@ -499,7 +536,8 @@ static RDS_MSG_DEFINITION RDS_MSG_SET_CLIPPING_REGION_DEFINITION =
 	(pXrdpMessageRead) freerds_read_set_clipping_region,
 	(pXrdpMessageWrite) freerds_write_set_clipping_region,
 	(pXrdpMessageCopy) freerds_set_clipping_region_copy,
-	(pXrdpMessageFree) freerds_set_clipping_region_free
+	(pXrdpMessageFree) freerds_set_clipping_region_free,
+	0
 };
 
 /**
@@ -565,7 +603,8 @@ static RDS_MSG_DEFINITION RDS_MSG_OPAQUE_RECT_DEFINITION =
 	(pXrdpMessageRead) freerds_read_opaque_rect,
 	(pXrdpMessageWrite) freerds_write_opaque_rect,
 	(pXrdpMessageCopy) freerds_opaque_rect_copy,
-	(pXrdpMessageFree) freerds_opaque_rect_free
+	(pXrdpMessageFree) freerds_opaque_rect_free,
+	0
 };
 
 /**
@@ -633,7 +672,8 @@ static RDS_MSG_DEFINITION RDS_MSG_SCREEN_BLT_DEFINITION =
 	(pXrdpMessageRead) freerds_read_screen_blt,
 	(pXrdpMessageWrite) freerds_write_screen_blt,
 	(pXrdpMessageCopy) freerds_screen_blt_copy,
-	(pXrdpMessageFree) freerds_screen_blt_free
+	(pXrdpMessageFree) freerds_screen_blt_free,
+	0
 };
 
 /**
@@ -750,7 +790,8 @@ static RDS_MSG_DEFINITION RDS_MSG_PAINT_RECT_DEFINITION =
 	(pXrdpMessageRead) freerds_read_paint_rect,
 	(pXrdpMessageWrite) freerds_write_paint_rect,
 	(pXrdpMessageCopy) freerds_paint_rect_copy,
-	(pXrdpMessageFree) freerds_paint_rect_free
+	(pXrdpMessageFree) freerds_paint_rect_free,
+	RDS_MSG_DEFINITION_FLAG_VIEW
 };
 
 /**
@@ -836,7 +877,8 @@ static RDS_MSG_DEFINITION RDS_MSG_PATBLT_DEFINITION =
 	(pXrdpMessageRead) freerds_read_patblt,
 	(pXrdpMessageWrite) freerds_write_patblt,
 	(pXrdpMessageCopy) freerds_patblt_copy,
-	(pXrdpMessageFree) freerds_patblt_free
+	(pXrdpMessageFree) freerds_patblt_free,
+	0
 };
 
 /**
@@ -902,7 +944,8 @@ static RDS_MSG_DEFINITION RDS_MSG_DSTBLT_DEFINITION =
 	(pXrdpMessageRead) freerds_read_dstblt,
 	(pXrdpMessageWrite) freerds_write_dstblt,
 	(pXrdpMessageCopy) freerds_dstblt_copy,
-	(pXrdpMessageFree) freerds_dstblt_free
+	(pXrdpMessageFree) freerds_dstblt_free,
+	0
 };
 
 /**
@@ -969,7 +1012,8 @@ static RDS_MSG_DEFINITION RDS_MSG_LINE_TO_DEFINITION =
 	(pXrdpMessageRead) freerds_read_line_to,
 	(pXrdpMessageWrite) freerds_write_line_to,
 	(pXrdpMessageCopy) freerds_line_to_copy,
-	(pXrdpMessageFree) freerds_line_to_free
+	(pXrdpMessageFree) freerds_line_to_free,
+	0
 };
 
 /**
@@ -1026,7 +1070,8 @@ static RDS_MSG_DEFINITION RDS_MSG_CREATE_OFFSCREEN_SURFACE_DEFINITION =
 	(pXrdpMessageRead) freerds_read_create_offscreen_surface,
 	(pXrdpMessageWrite) freerds_write_create_offscreen_surface,
 	(pXrdpMessageCopy) freerds_create_offscreen_surface_copy,
-	(pXrdpMessageFree) freerds_create_offscreen_surface_free
+	(pXrdpMessageFree) freerds_create_offscreen_surface_free,
+	0
 };
 
 /**
@@ -1079,7 +1124,8 @@ static RDS_MSG_DEFINITION RDS_MSG_SWITCH_OFFSCREEN_SURFACE_DEFINITION =
 	(pXrdpMessageRead) freerds_read_switch_offscreen_surface,
 	(pXrdpMessageWrite) freerds_write_switch_offscreen_surface,
 	(pXrdpMessageCopy) freerds_switch_offscreen_surface_copy,
-	(pXrdpMessageFree) freerds_switch_offscreen_surface_free
+	(pXrdpMessageFree) freerds_switch_offscreen_surface_free,
+	0
 };
 
 /**
@@ -1131,7 +1177,8 @@ static RDS_MSG_DEFINITION RDS_MSG_DELETE_OFFSCREEN_SURFACE_DEFINITION =
 	(pXrdpMessageRead) freerds_read_delete_offscreen_surface,
 	(pXrdpMessageWrite) freerds_write_delete_offscreen_surface,
 	(pXrdpMessageCopy) freerds_delete_offscreen_surface_copy,
-	(pXrdpMessageFree) freerds_delete_offscreen_surface_free
+	(pXrdpMessageFree) freerds_delete_offscreen_surface_free,
+	0
 };
 
 /**
@@ -1197,7 +1244,8 @@ static RDS_MSG_DEFINITION RDS_MSG_PAINT_OFFSCREEN_SURFACE_DEFINITION =
 	(pXrdpMessageRead) freerds_read_paint_offscreen_surface,
 	(pXrdpMessageWrite) freerds_write_paint_offscreen_surface,
 	(pXrdpMessageCopy) freerds_paint_offscreen_surface_copy,
-	(pXrdpMessageFree) freerds_paint_offscreen_surface_free
+	(pXrdpMessageFree) freerds_paint_offscreen_surface_free,
+	0
 };
 
 /**
@@ -1234,7 +1282,8 @@ static RDS_MSG_DEFINITION RDS_MSG_SET_PALETTE_DEFINITION =
 	(pXrdpMessageRead) freerds_read_set_palette,
 	(pXrdpMessageWrite) freerds_write_set_palette,
 	(pXrdpMessageCopy) freerds_set_palette_copy,
-	(pXrdpMessageFree) freerds_set_palette_free
+	(pXrdpMessageFree) freerds_set_palette_free,
+	0
 };
 
 /**
@@ -1272,7 +1321,8 @@ static RDS_MSG_DEFINITION RDS_MSG_CACHE_GLYPH_DEFINITION =
 	(pXrdpMessageRead) freerds_read_cache_glyph,
 	(pXrdpMessageWrite) freerds_write_cache_glyph,
 	(pXrdpMessageCopy) freerds_cache_glyph_copy,
-	(pXrdpMessageFree) freerds_cache_glyph_free
+	(pXrdpMessageFree) freerds_cache_glyph_free,
+	0
 };
 
 /**
@@ -1310,7 +1360,8 @@ static RDS_MSG_DEFINITION RDS_MSG_GLYPH_INDEX_DEFINITION =
 	(pXrdpMessageRead) freerds_read_glyph_index,
 	(pXrdpMessageWrite) freerds_write_glyph_index,
 	(pXrdpMessageCopy) freerds_glyph_index_copy,
-	(pXrdpMessageFree) freerds_glyph_index_free
+	(pXrdpMessageFree) freerds_glyph_index_free,
+	0
 };
 
 /**
@@ -1423,7 +1474,8 @@ static RDS_MSG_DEFINITION RDS_MSG_SET_POINTER_DEFINITION =
 	(pXrdpMessageRead) freerds_read_set_pointer,
 	(pXrdpMessageWrite) freerds_write_set_pointer,
 	(pXrdpMessageCopy) freerds_set_pointer_copy,
-	(pXrdpMessageFree) freerds_set_pointer_free
+	(pXrdpMessageFree) freerds_set_pointer_free,
+	RDS_MSG_DEFINITION_FLAG_VIEW
 };
 
 /**
@@ -1475,7 +1527,8 @@ static RDS_MSG_DEFINITION RDS_MSG_SET_SYSTEM_POINTER_DEFINITION =
 	(pXrdpMessageRead) freerds_read_set_system_pointer,
 	(pXrdpMessageWrite) freerds_write_set_system_pointer,
 	(pXrdpMessageCopy) freerds_set_system_pointer_copy,
-	(pXrdpMessageFree) freerds_set_system_pointer_free
+	(pXrdpMessageFree) freerds_set_system_pointer_free,
+	0
 };
 
 /**
@@ -1495,13 +1548,20 @@ int freerds_read_shared_framebuffer(wStream* s, RDS_MSG_SHARED_FRAMEBUFFER* msg)
 	Stream_Read_UINT32(s, msg->bitsPerPixel);
 	Stream_Read_UINT32(s, msg->bytesPerPixel);
 
+	msg->flags = 0;
+	msg->fd = -1;
+
+	/* older modules do not send flags */
+	if (Stream_GetRemainingLength(s) >= 4)
+		Stream_Read_UINT32(s, msg->flags);
+
 	return 0;
 }
 
 int freerds_write_shared_framebuffer(wStream* s, RDS_MSG_SHARED_FRAMEBUFFER* msg)
 {
 	msg->msgFlags = 0;
-	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 28;
+	msg->length = freerds_write_common_header(NULL, (RDS_MSG_COMMON*) msg) + 32;
 
 	if (!s)
 		return msg->length;
@@ -1515,6 +1575,7 @@ int freerds_write_shared_framebuffer(wStream* s, RDS_MSG_SHARED_FRAMEBUFFER* msg
 	Stream_Write_UINT32(s, msg->segmentId);
 	Stream_Write_UINT32(s, msg->bitsPerPixel);
 	Stream_Write_UINT32(s, msg->bytesPerPixel);
+	Stream_Write_UINT32(s, msg->flags);
 
 	return 0;
 }
@@ -1540,7 +1601,8 @@ static RDS_MSG_DEFINITION RDS_MSG_SHARED_FRAMEBUFFER_DEFINITION =
 	(pXrdpMessageRead) freerds_read_shared_framebuffer,
 	(pXrdpMessageWrite) freerds_write_shared_framebuffer,
 	(pXrdpMessageCopy) freerds_shared_framebuffer_copy,
-	(pXrdpMessageFree) freerds_shared_framebuffer_free
+	(pXrdpMessageFree) freerds_shared_framebuffer_free,
+	0
 };
 
 /**
@@ -1578,7 +1640,8 @@ static RDS_MSG_DEFINITION RDS_MSG_BEEP_DEFINITION =
 	(pXrdpMessageRead) freerds_read_beep,
 	(pXrdpMessageWrite) freerds_write_beep,
 	(pXrdpMessageCopy) freerds_beep_copy,
-	(pXrdpMessageFree) freerds_beep_free
+	(pXrdpMessageFree) freerds_beep_free,
+	0
 };
 
 /**
@@ -1616,7 +1679,8 @@ static RDS_MSG_DEFINITION RDS_MSG_RESET_DEFINITION =
 	(pXrdpMessageRead) freerds_read_reset,
 	(pXrdpMessageWrite) freerds_write_reset,
 	(pXrdpMessageCopy) freerds_reset_copy,
-	(pXrdpMessageFree) freerds_reset_free
+	(pXrdpMessageFree) freerds_reset_free,
+	0
 };
 
 /**
@@ -1847,7 +1911,8 @@ static RDS_MSG_DEFINITION RDS_MSG_WINDOW_NEW_UPDATE_DEFINITION =
 	(pXrdpMessageRead) freerds_read_window_new_update,
 	(pXrdpMessageWrite) freerds_write_window_new_update,
 	(pXrdpMessageCopy) freerds_window_new_update_copy,
-	(pXrdpMessageFree) freerds_window_new_update_free
+	(pXrdpMessageFree) freerds_window_new_update_free,
+	RDS_MSG_DEFINITION_FLAG_VIEW
 };
 
 /**
@@ -1900,7 +1965,8 @@ static RDS_MSG_DEFINITION RDS_MSG_WINDOW_DELETE_DEFINITION =
 	(pXrdpMessageRead) freerds_read_window_delete,
 	(pXrdpMessageWrite) freerds_write_window_delete,
 	(pXrdpMessageCopy) freerds_window_delete_copy,
-	(pXrdpMessageFree) freerds_window_delete_free
+	(pXrdpMessageFree) freerds_window_delete_free,
+	0
 };
 
 /**
@@ -2025,7 +2091,8 @@ static RDS_MSG_DEFINITION RDS_MSG_LOGON_USER_DEFINITION =
 	(pXrdpMessageRead) freerds_read_logon_user,
 	(pXrdpMessageWrite) freerds_write_logon_user,
 	(pXrdpMessageCopy) freerds_logon_user_copy,
-	(pXrdpMessageFree) freerds_logon_user_free
+	(pXrdpMessageFree) freerds_logon_user_free,
+	0
 };
 
 /**
@@ -2079,7 +2146,37 @@ static RDS_MSG_DEFINITION RDS_MSG_LOGOFF_USER_DEFINITION =
 	(pXrdpMessageRead) freerds_read_logoff_user,
 	(pXrdpMessageWrite) freerds_write_logoff_user,
 	(pXrdpMessageCopy) freerds_logoff_user_copy,
-	(pXrdpMessageFree) freerds_logoff_user_free
+	(pXrdpMessageFree) freerds_logoff_user_free,
+	0
+};
+
+/**
+ * SharedTransport
+ */
+
+void* freerds_shared_transport_copy(RDS_MSG_SHARED_TRANSPORT* msg)
+{
+	RDS_MSG_SHARED_TRANSPORT* dup = NULL;
+
+	dup = (RDS_MSG_SHARED_TRANSPORT*) malloc(sizeof(RDS_MSG_SHARED_TRANSPORT));
+	CopyMemory(dup, msg, sizeof(RDS_MSG_SHARED_TRANSPORT));
+
+	return (void*) dup;
+}
+
+void freerds_shared_transport_free(RDS_MSG_SHARED_TRANSPORT* msg)
+{
+	free(msg);
+}
+
+static RDS_MSG_DEFINITION RDS_MSG_SHARED_TRANSPORT_DEFINITION =
+{
+	sizeof(RDS_MSG_SHARED_TRANSPORT), "SharedTransport",
+	(pXrdpMessageRead) freerds_read_shared_transport,
+	(pXrdpMessageWrite) freerds_write_shared_transport,
+	(pXrdpMessageCopy) freerds_shared_transport_copy,
+	(pXrdpMessageFree) freerds_shared_transport_free,
+	0
 };
 
 /**
@@ -2114,7 +2211,7 @@ static RDS_MSG_DEFINITION* RDS_SERVER_MSG_DEFINITIONS[32] =
 	&RDS_MSG_SET_SYSTEM_POINTER_DEFINITION, /* 23 */
 	&RDS_MSG_LOGON_USER_DEFINITION, /* 24 */
 	&RDS_MSG_LOGOFF_USER_DEFINITION, /* 25 */
-	NULL, /* 26 */
+	&RDS_MSG_SHARED_TRANSPORT_DEFINITION, /* 26 */
 	NULL, /* 27 */
 	NULL, /* 28 */
 	NULL, /* 29 */
@@ -2205,6 +2302,40 @@ void* freerds_server_message_copy(RDS_MSG_COMMON* msg)
 	return dup;
 }
 
+/**
+ * Whether the decoded message points into the buffer it was read from,
+ * which then has to outlive it. Decided by what was actually read: a
+ * PaintRect of a shared framebuffer segment carries no bitmap data.
+ */
+
+BOOL freerds_server_message_references_buffer(RDS_MSG_COMMON* msg)
+{
+	RDS_MSG_DEFINITION* msgDef;
+
+	if (msg->type > 31)
+		return FALSE;
+
+	msgDef = RDS_SERVER_MSG_DEFINITIONS[msg->type];
+
+	if (!msgDef)
+		return FALSE;
+
+	if (!(msgDef->Flags & RDS_MSG_DEFINITION_FLAG_VIEW))
+		return FALSE;
+
+	switch (msg->type)
+	{
+		case RDS_SERVER_PAINT_RECT:
+			return (((RDS_MSG_PAINT_RECT*) msg)->bitmapDataLength > 0) ? TRUE : FALSE;
+
+		case RDS_SERVER_WINDOW_NEW_UPDATE:
+			return (((RDS_MSG_WINDOW_NEW_UPDATE*) msg)->numWindowRects > 0) ? TRUE : FALSE;
+
+		default:
+			return TRUE;
+	}
+}
+
 void freerds_server_message_free(RDS_MSG_COMMON* msg)
 {
 	RDS_MSG_DEFINITION* msgDef;
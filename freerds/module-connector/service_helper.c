@@ -62,6 +62,9 @@ void* freerds_service_listener_thread(void* arg)
 
 		if (service->Accept)
 		{
+			if (freerds_shm_transport_offer(connector) < 0)
+				fprintf(stderr, "failed to send the transport offer\n");
+
 			service->Accept(service);
 
 			service->ClientThread = CreateThread(NULL, 0,
@@ -126,13 +129,19 @@ rdsService* freerds_service_new(DWORD SessionId, const char* endpoint)
 		connector->server = freerds_server_outbound_interface_new();
 
 		connector->OutboundStream = Stream_New(NULL, 8192);
-		connector->InboundStream = Stream_New(NULL, 8192);
+		connector->InboundBuffer = freerds_message_buffer_new(8192);
+		connector->InboundStream = connector->InboundBuffer->s;
 
 		connector->InboundTotalLength = 0;
 		connector->InboundTotalCount = 0;
+		connector->InboundWakeupCount = 0;
 
 		connector->OutboundTotalLength = 0;
 		connector->OutboundTotalCount = 0;
+		connector->OutboundWriteCount = 0;
+		connector->OutboundBatching = FALSE;
+		connector->OutboundFdCount = 0;
+		connector->SharedTransportFd = -1;
 
 		service->StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 	}
@@ -154,8 +163,14 @@ void freerds_service_free(rdsService* service)
 		WaitForSingleObject(service->ServerThread, INFINITE);
 		CloseHandle(service->ServerThread);
 
+		freerds_shm_transport_free(connector);
+
 		Stream_Free(connector->OutboundStream, TRUE);
-		Stream_Free(connector->InboundStream, TRUE);
+
+		if (connector->OutboundPending)
+			Stream_Free(connector->OutboundPending, TRUE);
+
+		freerds_message_buffer_release(connector->InboundBuffer);
 
 		if (connector->Endpoint)
 			free(connector->Endpoint);
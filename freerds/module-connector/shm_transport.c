@@ -0,0 +1,586 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * xrdp-ng interprocess communication protocol
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/sysinfo.h>
+
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <freerds/freerds.h>
+
+#include "transport.h"
+#include "outbound.h"
+
+#include "shm_transport.h"
+
+/**
+ * The module creates the segment with one ring per direction:
+ * the first one carries server messages, the second one client messages.
+ */
+
+#define FREERDS_SHM_RING_LENGTH(_size)	(sizeof(rdsShmRing) + (_size))
+
+static void freerds_shm_ring_init(rdsShmRing* ring, UINT32 size)
+{
+	ZeroMemory(ring, sizeof(rdsShmRing));
+
+	ring->size = size;
+
+	/* the peer has not looked at the ring yet, the first write must wake it up */
+	ring->sleeping = 1;
+}
+
+static void freerds_shm_transport_set_rings(rdsModuleConnector* connector, BYTE* base, UINT32 size)
+{
+	rdsShmRing* serverRing;
+	rdsShmRing* clientRing;
+
+	serverRing = (rdsShmRing*) base;
+	clientRing = (rdsShmRing*) &base[FREERDS_SHM_RING_LENGTH(size)];
+
+	connector->SharedTransport = base;
+	connector->InboundRing = connector->ServerMode ? clientRing : serverRing;
+	connector->OutboundRing = connector->ServerMode ? serverRing : clientRing;
+}
+
+static void freerds_shm_transport_detach(rdsModuleConnector* connector)
+{
+	if (!connector->SharedTransport)
+		return;
+
+	if (connector->SharedTransportLength)
+		munmap(connector->SharedTransport, connector->SharedTransportLength);
+	else
+		shmdt(connector->SharedTransport);
+
+	if (connector->SharedTransportFd >= 0)
+		close(connector->SharedTransportFd);
+
+	connector->SharedTransport = NULL;
+	connector->SharedTransportLength = 0;
+	connector->SharedTransportFd = -1;
+	connector->InboundRing = NULL;
+	connector->OutboundRing = NULL;
+	connector->InboundRingActive = FALSE;
+	connector->OutboundRingActive = FALSE;
+}
+
+/**
+ * The rings are a sealed memfd where the kernel has them, passed to freerds
+ * with the offer. The module keeps the descriptor until the transport goes
+ * away, it is sent from the outbound queue.
+ */
+
+static BYTE* freerds_shm_transport_create_memfd(rdsModuleConnector* connector, UINT32 length)
+{
+	int fd;
+	BYTE* base;
+
+	fd = freerds_memfd_create_sealed("freerds-transport", length);
+
+	if (fd < 0)
+		return NULL;
+
+	base = (BYTE*) mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (base == MAP_FAILED)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	connector->SharedTransportLength = length;
+	connector->SharedTransportFd = fd;
+
+	return base;
+}
+
+static BYTE* freerds_shm_transport_create_segment(int* segmentId, UINT32 length)
+{
+	BYTE* base;
+
+	*segmentId = shmget(IPC_PRIVATE, length, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+
+	if (*segmentId < 0)
+		return NULL;
+
+	base = (BYTE*) shmat(*segmentId, 0, 0);
+
+	/**
+	 * Linux lets freerds attach a segment already marked for removal,
+	 * this way it goes away with the last process using it.
+	 */
+	shmctl(*segmentId, IPC_RMID, 0);
+
+	return (base == ((BYTE*) -1)) ? NULL : base;
+}
+
+/**
+ * Returns the segment id of the rings, -1 for a memfd and -2 if there is
+ * no shared transport.
+ */
+
+static int freerds_shm_transport_create(rdsModuleConnector* connector)
+{
+	int segmentId = -1;
+	BYTE* base;
+	UINT32 length;
+
+	/* a new client, whatever the previous one had goes away */
+	freerds_shm_transport_detach(connector);
+
+	length = 2 * FREERDS_SHM_RING_LENGTH(FREERDS_SHM_RING_SIZE);
+
+	base = freerds_shm_transport_create_memfd(connector, length);
+
+	if (!base)
+		base = freerds_shm_transport_create_segment(&segmentId, length);
+
+	if (!base)
+		return -2;
+
+	freerds_shm_ring_init((rdsShmRing*) base, FREERDS_SHM_RING_SIZE);
+	freerds_shm_ring_init((rdsShmRing*) &base[FREERDS_SHM_RING_LENGTH(FREERDS_SHM_RING_SIZE)],
+			FREERDS_SHM_RING_SIZE);
+
+	freerds_shm_transport_set_rings(connector, base, FREERDS_SHM_RING_SIZE);
+
+	return connector->SharedTransportLength ? -1 : segmentId;
+}
+
+int freerds_shm_transport_offer(rdsModuleConnector* connector)
+{
+	RDS_MSG_SHARED_TRANSPORT msg;
+
+	ZeroMemory(&msg, sizeof(RDS_MSG_SHARED_TRANSPORT));
+	msg.type = RDS_SERVER_SHARED_TRANSPORT;
+	msg.flags = RDS_SHARED_TRANSPORT_OFFER;
+	msg.version = RDS_PROTOCOL_VERSION_2;
+
+	msg.segmentId = freerds_shm_transport_create(connector);
+
+	if (!connector->SharedTransport)
+	{
+		fprintf(stderr, "shared transport unavailable, using the named pipe\n");
+	}
+	else
+	{
+		msg.ringSize = FREERDS_SHM_RING_SIZE;
+
+		if (connector->SharedTransportFd >= 0)
+		{
+			msg.flags |= RDS_SHARED_TRANSPORT_MEMFD;
+
+			if (freerds_outbound_pass_fd(connector, connector->SharedTransportFd) < 0)
+				return -1;
+		}
+	}
+
+	return freerds_server_outbound_write_message(connector, (RDS_MSG_COMMON*) &msg);
+}
+
+/**
+ * A memfd is checked for its seals, it is mapped and the descriptor closed.
+ * A SysV segment id is only a number, freerds could attach any segment on
+ * the system with it: it has to belong to the user at the other end of the
+ * module pipe.
+ */
+
+static int freerds_shm_transport_attach_memfd(rdsModuleConnector* connector, int fd, UINT32 length)
+{
+	BYTE* base = NULL;
+
+	if (freerds_memfd_check_sealed(fd, length) == 0)
+	{
+		base = (BYTE*) mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+		if (base == MAP_FAILED)
+			base = NULL;
+	}
+
+	close(fd);
+
+	if (!base)
+		return -1;
+
+	connector->SharedTransportLength = length;
+	freerds_shm_transport_set_rings(connector, base, FREERDS_SHM_RING_SIZE);
+
+	return 0;
+}
+
+static int freerds_shm_transport_attach_segment(rdsModuleConnector* connector, int segmentId, UINT32 length)
+{
+	BYTE* base;
+	struct ucred cred;
+	socklen_t credLength;
+	struct shmid_ds ds;
+
+	credLength = sizeof(cred);
+
+	if (getsockopt(GetNamePipeFileDescriptor(connector->hClientPipe), SOL_SOCKET, SO_PEERCRED,
+			&cred, &credLength) < 0)
+		return -1;
+
+	if (shmctl(segmentId, IPC_STAT, &ds) < 0)
+		return -1;
+
+	if ((ds.shm_perm.uid != cred.uid) || (ds.shm_perm.cuid != cred.uid))
+	{
+		fprintf(stderr, "%s: segment %d does not belong to uid %d\n", __FUNCTION__, segmentId, (int) cred.uid);
+		return -1;
+	}
+
+	if (ds.shm_segsz < length)
+		return -1;
+
+	base = (BYTE*) shmat(segmentId, 0, 0);
+
+	if (base == ((BYTE*) -1))
+		return -1;
+
+	freerds_shm_transport_set_rings(connector, base, FREERDS_SHM_RING_SIZE);
+
+	return 0;
+}
+
+static int freerds_shm_transport_attach(rdsModuleConnector* connector, RDS_MSG_SHARED_TRANSPORT* msg)
+{
+	int fd = -1;
+	UINT32 length;
+
+	/* taken first, the descriptor is consumed either way */
+	if (msg->flags & RDS_SHARED_TRANSPORT_MEMFD)
+	{
+		fd = freerds_transport_take_fd(connector);
+
+		if (fd < 0)
+			return -1;
+	}
+
+	/* both sides are built from the same tree, the segment content is never trusted for sizes */
+	if (connector->SharedTransport || (msg->ringSize != FREERDS_SHM_RING_SIZE))
+	{
+		if (fd >= 0)
+			close(fd);
+
+		return -1;
+	}
+
+	length = 2 * FREERDS_SHM_RING_LENGTH(FREERDS_SHM_RING_SIZE);
+
+	if (fd >= 0)
+		return freerds_shm_transport_attach_memfd(connector, fd, length);
+
+	if (msg->segmentId < 0)
+		return -1;
+
+	return freerds_shm_transport_attach_segment(connector, msg->segmentId, length);
+}
+
+void freerds_shm_transport_free(rdsModuleConnector* connector)
+{
+	freerds_shm_transport_detach(connector);
+
+	connector->OutboundRingPending = FALSE;
+
+	if (connector->EncodeStream)
+	{
+		Stream_Free(connector->EncodeStream, TRUE);
+		connector->EncodeStream = NULL;
+	}
+}
+
+int freerds_shm_transport_control(rdsModuleConnector* connector, wStream* s, RDS_MSG_COMMON* common)
+{
+	RDS_MSG_SHARED_TRANSPORT msg;
+
+	if (!s)
+	{
+		CopyMemory(&msg, common, sizeof(RDS_MSG_SHARED_TRANSPORT));
+	}
+	else
+	{
+		CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
+
+		if (freerds_read_shared_transport(s, &msg) < 0)
+			return -1;
+	}
+
+	if ((msg.flags & RDS_SHARED_TRANSPORT_OFFER) && !connector->ServerMode)
+	{
+		if (freerds_shm_transport_attach(connector, &msg) < 0)
+		{
+			fprintf(stderr, "shared transport unavailable, staying on the named pipe\n");
+		}
+
+		connector->TransportVersion = RDS_PROTOCOL_VERSION_1;
+
+		if (msg.version >= RDS_PROTOCOL_VERSION_2)
+			connector->TransportVersion = RDS_PROTOCOL_VERSION_2;
+
+		if (!connector->SharedTransport && (connector->TransportVersion < RDS_PROTOCOL_VERSION_2))
+			return 0;
+
+		/* the writer thread announces the switch on its next flush */
+		__atomic_store_n(&connector->OutboundRingPending, TRUE, __ATOMIC_RELEASE);
+	}
+
+	if (msg.flags & RDS_SHARED_TRANSPORT_SWITCH)
+	{
+		if ((msg.version < RDS_PROTOCOL_VERSION_1) || (msg.version > RDS_PROTOCOL_VERSION_2))
+			return -1;
+
+		if (msg.flags & RDS_SHARED_TRANSPORT_RING)
+		{
+			if (!connector->SharedTransport)
+				return -1;
+
+			connector->InboundRingActive = TRUE;
+		}
+		else if (connector->ServerMode)
+		{
+			/* freerds could not attach, keep the module on the pipe as well */
+			freerds_shm_transport_detach(connector);
+		}
+
+		connector->InboundVersion = msg.version;
+
+		/* freerds has made its choice, the module follows it */
+		if (connector->ServerMode)
+		{
+			connector->TransportVersion = msg.version;
+			__atomic_store_n(&connector->OutboundRingPending, TRUE, __ATOMIC_RELEASE);
+		}
+	}
+
+	return 0;
+}
+
+int freerds_shm_transport_switch(rdsModuleConnector* connector)
+{
+	int status;
+	wStream* s;
+	RDS_MSG_SHARED_TRANSPORT msg;
+
+	if (!__atomic_load_n(&connector->OutboundRingPending, __ATOMIC_ACQUIRE))
+		return 0;
+
+	connector->OutboundRingPending = FALSE;
+
+	ZeroMemory(&msg, sizeof(RDS_MSG_SHARED_TRANSPORT));
+	msg.type = connector->ServerMode ? RDS_SERVER_SHARED_TRANSPORT : RDS_CLIENT_SHARED_TRANSPORT;
+	msg.flags = RDS_SHARED_TRANSPORT_SWITCH;
+	msg.version = connector->TransportVersion;
+
+	if (connector->SharedTransport)
+		msg.flags |= RDS_SHARED_TRANSPORT_RING;
+
+	s = Stream_New(NULL, freerds_write_shared_transport(NULL, &msg));
+
+	if (!s)
+		return -1;
+
+	freerds_write_shared_transport(s, &msg);
+
+	/* this is the last message on the named pipe in this direction, it is never waited for */
+	if (connector->OutboundNonBlocking)
+		status = freerds_outbound_queue_pipe(connector, Stream_Buffer(s), Stream_GetPosition(s));
+	else
+		status = freerds_named_pipe_write(connector->hClientPipe, Stream_Buffer(s), Stream_GetPosition(s));
+
+	Stream_Free(s, TRUE);
+
+	if (status < 0)
+		return -1;
+
+	/* holds the version 1 body of messages without a compact layout */
+	if ((connector->TransportVersion >= RDS_PROTOCOL_VERSION_2) && !connector->EncodeStream)
+		connector->EncodeStream = Stream_New(NULL, 8192);
+
+	connector->OutboundRingActive = (connector->SharedTransport != NULL);
+	connector->OutboundVersion = connector->TransportVersion;
+
+	return 1;
+}
+
+static void freerds_shm_transport_notify(rdsModuleConnector* connector, rdsShmRing* ring)
+{
+	BYTE wakeup = 0;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	/* a full pipe already holds a wakeup the consumer has yet to read */
+	if (__atomic_exchange_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST))
+		freerds_named_pipe_write_some(connector->hClientPipe, &wakeup, 1);
+}
+
+/**
+ * Copies as much of data as the ring has room for without waiting and
+ * returns how much that was, the consumer is woken up either way.
+ */
+
+int freerds_shm_transport_write_some(rdsModuleConnector* connector, BYTE* data, UINT32 length)
+{
+	BYTE* buffer;
+	UINT32 head;
+	UINT32 tail;
+	UINT32 count;
+	UINT32 offset;
+	UINT32 first;
+	rdsShmRing* ring;
+
+	ring = (rdsShmRing*) connector->OutboundRing;
+	buffer = (BYTE*) &ring[1];
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	count = FREERDS_SHM_RING_SIZE - (head - tail);
+
+	if (count > FREERDS_SHM_RING_SIZE)
+		return -1;
+
+	if (count > length)
+		count = length;
+
+	if (count > 0)
+	{
+		offset = head & (FREERDS_SHM_RING_SIZE - 1);
+		first = FREERDS_SHM_RING_SIZE - offset;
+
+		if (first > count)
+			first = count;
+
+		CopyMemory(&buffer[offset], data, first);
+		CopyMemory(buffer, &data[first], count - first);
+
+		__atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+	}
+
+	freerds_shm_transport_notify(connector, ring);
+
+	return (int) count;
+}
+
+/**
+ * Waits for room as long as FREERDS_SHM_RING_TIMEOUT, only for connectors
+ * that are not non-blocking. freerds and X11rdp queue what does not fit.
+ */
+
+int freerds_shm_transport_write(rdsModuleConnector* connector, BYTE* data, UINT32 length)
+{
+	int status;
+	DWORD start = 0;
+	UINT32 total = length;
+
+	while (length > 0)
+	{
+		status = freerds_shm_transport_write_some(connector, data, length);
+
+		if (status < 0)
+			return -1;
+
+		if (status == 0)
+		{
+			/* full, the consumer has been woken up, give it some time */
+			if (!start)
+				start = GetTickCount();
+			else if ((GetTickCount() - start) > FREERDS_SHM_RING_TIMEOUT)
+				return -1;
+
+			Sleep(1);
+			continue;
+		}
+
+		data += status;
+		length -= status;
+	}
+
+	return total;
+}
+
+int freerds_shm_transport_read(rdsModuleConnector* connector, BYTE* data, UINT32 length)
+{
+	BYTE* buffer;
+	UINT32 head;
+	UINT32 tail;
+	UINT32 count;
+	UINT32 offset;
+	UINT32 first;
+	rdsShmRing* ring;
+
+	ring = (rdsShmRing*) connector->InboundRing;
+	buffer = (BYTE*) &ring[1];
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	count = head - tail;
+
+	if (count > FREERDS_SHM_RING_SIZE)
+		return -1;
+
+	if (count > length)
+		count = length;
+
+	offset = tail & (FREERDS_SHM_RING_SIZE - 1);
+	first = FREERDS_SHM_RING_SIZE - offset;
+
+	if (first > count)
+		first = count;
+
+	CopyMemory(data, &buffer[offset], first);
+	CopyMemory(&data[first], buffer, count - first);
+
+	__atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+
+	return count;
+}
+
+/**
+ * Called by the consumer once the ring looks empty, returns 1 if data
+ * came in meanwhile, 0 if the producer will wake us up through the pipe.
+ */
+
+int freerds_shm_transport_wait(rdsModuleConnector* connector)
+{
+	rdsShmRing* ring = (rdsShmRing*) connector->InboundRing;
+
+	__atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail)
+		return 1;
+
+	return 0;
+}
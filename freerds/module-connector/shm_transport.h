@@ -0,0 +1,55 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * xrdp-ng interprocess communication protocol
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDS_NG_SHM_TRANSPORT_H
+#define RDS_NG_SHM_TRANSPORT_H
+
+#include <freerds/freerds.h>
+
+#define FREERDS_SHM_RING_SIZE		0x40000
+#define FREERDS_SHM_RING_TIMEOUT	5000
+
+/**
+ * Single producer, single consumer byte ring living in shared memory.
+ * head is only written by the producer and tail by the consumer, they are
+ * kept on separate cache lines. The consumer sets sleeping before it waits
+ * on the named pipe so that the producer knows it has to send a wakeup.
+ */
+
+struct rds_shm_ring
+{
+	UINT32 size;
+	UINT32 head;
+	BYTE headPad[56];
+	UINT32 tail;
+	UINT32 sleeping;
+	BYTE tailPad[56];
+};
+typedef struct rds_shm_ring rdsShmRing;
+
+int freerds_shm_transport_control(rdsModuleConnector* connector, wStream* s, RDS_MSG_COMMON* common);
+int freerds_shm_transport_switch(rdsModuleConnector* connector);
+
+int freerds_shm_transport_read(rdsModuleConnector* connector, BYTE* data, UINT32 length);
+int freerds_shm_transport_write(rdsModuleConnector* connector, BYTE* data, UINT32 length);
+int freerds_shm_transport_write_some(rdsModuleConnector* connector, BYTE* data, UINT32 length);
+
+int freerds_shm_transport_wait(rdsModuleConnector* connector);
+
+#endif /* RDS_NG_SHM_TRANSPORT_H */
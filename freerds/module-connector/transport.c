@@ -29,11 +29,25 @@
 #include <winpr/path.h>
 #include <winpr/print.h>
 #include <winpr/thread.h>
+#include <winpr/sysinfo.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
 
 #include "protocol.h"
 
 #include "transport.h"
 
+#include "shm_transport.h"
+#include "compact.h"
+#include "buffer.h"
+
 int freerds_named_pipe_read(HANDLE hNamedPipe, BYTE* data, DWORD length)
 {
 	BOOL fSuccess = FALSE;
@@ -81,6 +95,61 @@ int freerds_named_pipe_write(HANDLE hNamedPipe, BYTE* data, DWORD length)
 	return TotalNumberOfBytesWritten;
 }
 
+/**
+ * Single write that never waits, whatever the mode of the pipe, returns 0
+ * when the pipe is full.
+ */
+
+int freerds_named_pipe_write_some(HANDLE hNamedPipe, BYTE* data, DWORD length)
+{
+	ssize_t status;
+
+	status = send(GetNamePipeFileDescriptor(hNamedPipe), data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+	if (status < 0)
+		return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+
+	return (int) status;
+}
+
+/**
+ * Single write passing fd along with the data, the named pipe is a unix
+ * domain socket underneath. Returns 0 when the pipe is full.
+ */
+
+int freerds_named_pipe_write_fd(HANDLE hNamedPipe, BYTE* data, DWORD length, int fd)
+{
+	ssize_t status;
+	struct iovec iov;
+	struct msghdr mh;
+	struct cmsghdr* cmsg;
+	BYTE control[CMSG_SPACE(sizeof(int))];
+
+	iov.iov_base = data;
+	iov.iov_len = length;
+
+	ZeroMemory(&mh, sizeof(mh));
+	ZeroMemory(control, sizeof(control));
+
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	CopyMemory(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	status = sendmsg(GetNamePipeFileDescriptor(hNamedPipe), &mh, MSG_NOSIGNAL);
+
+	if (status < 0)
+		return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+
+	return (int) status;
+}
+
 void freerds_named_pipe_get_endpoint_name(DWORD id, const char *endpoint, char *dest, int len)
 {
 	sprintf_s(dest, len, "\\\\.\\pipe\\FreeRDS_%d_%s", (int) id, endpoint);
@@ -134,6 +203,97 @@ HANDLE freerds_named_pipe_connect(const char* pipeName, DWORD nTimeOut)
 
 }
 
+/**
+ * Waits for the socket of a pipe to be created, woken up by inotify rather
+ * than checking for it every few milliseconds. Returns -1 if inotify cannot
+ * be used, otherwise whether the socket exists.
+ */
+
+static int freerds_named_pipe_wait(const char* pipeName, DWORD nTimeOut)
+{
+#ifdef __linux__
+	int fd;
+	int status;
+	char* separator;
+	char* filename;
+	DWORD elapsed;
+	DWORD startTime;
+	struct pollfd pfd;
+	char buffer[1024];
+
+	filename = GetNamedPipeUnixDomainSocketFilePathA(pipeName);
+
+	if (!filename)
+		return -1;
+
+	separator = strrchr(filename, '/');
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	status = -1;
+
+	if (separator && (fd >= 0))
+	{
+		*separator = '\0';
+
+		if (inotify_add_watch(fd, filename, IN_CREATE | IN_MOVED_TO) >= 0)
+			status = 0;
+
+		*separator = '/';
+	}
+
+	startTime = GetTickCount();
+
+	/* checked after the watch is set up, a socket created meanwhile is not missed */
+	while ((status == 0) && !PathFileExistsA(filename))
+	{
+		elapsed = GetTickCount() - startTime;
+
+		if (elapsed >= nTimeOut)
+			break;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+
+		if ((poll(&pfd, 1, nTimeOut - elapsed) < 0) && (errno != EINTR))
+			status = -1;
+
+		while (read(fd, buffer, sizeof(buffer)) > 0);
+	}
+
+	if ((status == 0) && PathFileExistsA(filename))
+		status = 1;
+
+	if (fd >= 0)
+		close(fd);
+
+	free(filename);
+
+	return status;
+#else
+	return -1;
+#endif
+}
+
+/**
+ * Like freerds_named_pipe_connect, for a pipe that may not have been
+ * created yet.
+ */
+
+HANDLE freerds_named_pipe_connect_wait(const char* pipeName, DWORD nTimeOut)
+{
+	int status;
+
+	status = freerds_named_pipe_wait(pipeName, nTimeOut);
+
+	if (status == 0)
+	{
+		fprintf(stderr, "WaitNamedPipe failure: %s\n", pipeName);
+		return NULL;
+	}
+
+	return freerds_named_pipe_connect(pipeName, (status < 0) ? nTimeOut : 20);
+}
+
 HANDLE freerds_named_pipe_connect_endpoint(DWORD id, const char* endpoint, DWORD nTimeOut)
 {
 	char pipeName[255];
@@ -190,6 +350,126 @@ HANDLE freerds_named_pipe_accept(HANDLE hServerPipe)
 	return hClientPipe;
 }
 
+/**
+ * Reads from the named pipe, keeping the descriptors modules pass along
+ * with their messages. The kernel hands them over with the bytes they were
+ * sent with, so they are queued before the message using them is read.
+ */
+
+static int freerds_transport_read_pipe(rdsModuleConnector* connector, BYTE* data, DWORD length)
+{
+	int fd;
+	int index;
+	int count;
+	ssize_t status;
+	struct iovec iov;
+	struct msghdr mh;
+	struct cmsghdr* cmsg;
+	BYTE control[CMSG_SPACE(sizeof(int) * FREERDS_INBOUND_FDS_MAX)];
+
+	/* only freerds is ever passed descriptors */
+	if (connector->ServerMode)
+		return freerds_named_pipe_read(connector->hClientPipe, data, length);
+
+	iov.iov_base = data;
+	iov.iov_len = length;
+
+	ZeroMemory(&mh, sizeof(mh));
+
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+
+	status = recvmsg(GetNamePipeFileDescriptor(connector->hClientPipe), &mh, MSG_CMSG_CLOEXEC);
+
+	if (status <= 0)
+		return -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg))
+	{
+		if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS))
+			continue;
+
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+		for (index = 0; index < count; index++)
+		{
+			CopyMemory(&fd, CMSG_DATA(cmsg) + (index * sizeof(int)), sizeof(int));
+
+			if (connector->InboundFdCount < FREERDS_INBOUND_FDS_MAX)
+				connector->InboundFds[connector->InboundFdCount++] = fd;
+			else
+				close(fd);
+		}
+	}
+
+	return (int) status;
+}
+
+/**
+ * Returns the oldest descriptor passed by the module, or -1. Over the
+ * shared transport it comes with a wakeup that may not have been read yet,
+ * the module sends it before the message so that read does not block.
+ */
+
+int freerds_transport_take_fd(rdsModuleConnector* connector)
+{
+	int fd;
+	BYTE wakeups[64];
+
+	if (!connector->InboundFdCount && connector->InboundRingActive)
+	{
+		if (freerds_transport_read_pipe(connector, wakeups, sizeof(wakeups)) < 0)
+			return -1;
+	}
+
+	if (!connector->InboundFdCount)
+		return -1;
+
+	fd = connector->InboundFds[0];
+
+	connector->InboundFdCount--;
+	MoveMemory(&connector->InboundFds[0], &connector->InboundFds[1],
+			connector->InboundFdCount * sizeof(int));
+
+	return fd;
+}
+
+void freerds_transport_close_fds(rdsModuleConnector* connector)
+{
+	UINT32 index;
+
+	for (index = 0; index < connector->InboundFdCount; index++)
+		close(connector->InboundFds[index]);
+
+	connector->InboundFdCount = 0;
+}
+
+typedef int (*pRdsMessageRead)(wStream* s, RDS_MSG_COMMON* msg);
+
+/**
+ * Fills msg from the header in common and the body read from s, or from
+ * common alone when s is NULL, common then being a message decoded in full.
+ */
+
+static void freerds_receive_body(wStream* s, RDS_MSG_COMMON* common, RDS_MSG_COMMON* msg,
+		size_t size, pRdsMessageRead read)
+{
+	if (!s)
+	{
+		CopyMemory(msg, common, size);
+		return;
+	}
+
+	CopyMemory(msg, common, sizeof(RDS_MSG_COMMON));
+
+	if (read)
+		read(s, msg);
+	else
+		freerds_server_message_read(s, msg);
+}
+
 int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RDS_MSG_COMMON* common)
 {
 	int status = 0;
@@ -202,8 +482,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_BEGIN_UPDATE:
 			{
 				RDS_MSG_BEGIN_UPDATE msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->BeginUpdate(connector, &msg);
 			}
 			break;
@@ -211,8 +490,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_END_UPDATE:
 			{
 				RDS_MSG_END_UPDATE msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->EndUpdate(connector, &msg);
 			}
 			break;
@@ -220,8 +498,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_OPAQUE_RECT:
 			{
 				RDS_MSG_OPAQUE_RECT msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->OpaqueRect(connector, &msg);
 			}
 			break;
@@ -229,8 +506,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_SCREEN_BLT:
 			{
 				RDS_MSG_SCREEN_BLT msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->ScreenBlt(connector, &msg);
 			}
 			break;
@@ -238,8 +514,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_PATBLT:
 			{
 				RDS_MSG_PATBLT msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->PatBlt(connector, &msg);
 			}
 			break;
@@ -247,8 +522,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_DSTBLT:
 			{
 				RDS_MSG_DSTBLT msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->DstBlt(connector, &msg);
 			}
 			break;
@@ -257,12 +531,11 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 			{
 				int status;
 				RDS_MSG_PAINT_RECT msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
 
 				msg.fbSegmentId = 0;
 				msg.framebuffer = NULL;
 
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 
 				if (msg.fbSegmentId)
 					msg.framebuffer = &(connector->framebuffer);
@@ -274,8 +547,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_SET_CLIPPING_REGION:
 			{
 				RDS_MSG_SET_CLIPPING_REGION msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->SetClippingRegion(connector, &msg);
 			}
 			break;
@@ -283,8 +555,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_LINE_TO:
 			{
 				RDS_MSG_LINE_TO msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->LineTo(connector, &msg);
 			}
 			break;
@@ -292,8 +563,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_SET_POINTER:
 			{
 				RDS_MSG_SET_POINTER msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->SetPointer(connector, &msg);
 			}
 			break;
@@ -301,8 +571,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_SET_SYSTEM_POINTER:
 			{
 				RDS_MSG_SET_SYSTEM_POINTER msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->SetSystemPointer(connector, &msg);
 			}
 			break;
@@ -310,8 +579,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_CREATE_OFFSCREEN_SURFACE:
 			{
 				RDS_MSG_CREATE_OFFSCREEN_SURFACE msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->CreateOffscreenSurface(connector, &msg);
 			}
 			break;
@@ -319,8 +587,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_SWITCH_OFFSCREEN_SURFACE:
 			{
 				RDS_MSG_SWITCH_OFFSCREEN_SURFACE msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->SwitchOffscreenSurface(connector, &msg);
 			}
 			break;
@@ -328,8 +595,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_DELETE_OFFSCREEN_SURFACE:
 			{
 				RDS_MSG_DELETE_OFFSCREEN_SURFACE msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->DeleteOffscreenSurface(connector, &msg);
 			}
 			break;
@@ -337,8 +603,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_PAINT_OFFSCREEN_SURFACE:
 			{
 				RDS_MSG_PAINT_OFFSCREEN_SURFACE msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->PaintOffscreenSurface(connector, &msg);
 			}
 			break;
@@ -346,8 +611,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_WINDOW_NEW_UPDATE:
 			{
 				RDS_MSG_WINDOW_NEW_UPDATE msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->WindowNewUpdate(connector, &msg);
 			}
 			break;
@@ -355,8 +619,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_WINDOW_DELETE:
 			{
 				RDS_MSG_WINDOW_DELETE msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->WindowDelete(connector, &msg);
 			}
 			break;
@@ -364,8 +627,11 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_SHARED_FRAMEBUFFER:
 			{
 				RDS_MSG_SHARED_FRAMEBUFFER msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
+
+				if (msg.flags & RDS_SHARED_FRAMEBUFFER_MEMFD)
+					msg.fd = freerds_transport_take_fd(connector);
+
 				status = server->SharedFramebuffer(connector, &msg);
 			}
 			break;
@@ -373,8 +639,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_LOGON_USER:
 			{
 				RDS_MSG_LOGON_USER msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->LogonUser(connector, &msg);
 			}
 			break;
@@ -382,8 +647,7 @@ int freerds_receive_server_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_SERVER_LOGOFF_USER:
 			{
 				RDS_MSG_LOGOFF_USER msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_server_message_read(s, (RDS_MSG_COMMON*) &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg), NULL);
 				status = server->LogoffUser(connector, &msg);
 			}
 			break;
@@ -408,8 +672,8 @@ int freerds_receive_client_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_CLIENT_SYNCHRONIZE_KEYBOARD_EVENT:
 			{
 				RDS_MSG_SYNCHRONIZE_KEYBOARD_EVENT msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_read_synchronize_keyboard_event(s, &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg),
+						(pRdsMessageRead) freerds_read_synchronize_keyboard_event);
 				status = client->SynchronizeKeyboardEvent(connector, msg.flags);
 			}
 			break;
@@ -417,8 +681,8 @@ int freerds_receive_client_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_CLIENT_SCANCODE_KEYBOARD_EVENT:
 			{
 				RDS_MSG_SCANCODE_KEYBOARD_EVENT msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_read_scancode_keyboard_event(s, &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg),
+						(pRdsMessageRead) freerds_read_scancode_keyboard_event);
 				status = client->ScancodeKeyboardEvent(connector, msg.flags, msg.code, msg.keyboardType);
 			}
 			break;
@@ -426,8 +690,8 @@ int freerds_receive_client_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_CLIENT_VIRTUAL_KEYBOARD_EVENT:
 			{
 				RDS_MSG_VIRTUAL_KEYBOARD_EVENT msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_read_virtual_keyboard_event(s, &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg),
+						(pRdsMessageRead) freerds_read_virtual_keyboard_event);
 				status = client->VirtualKeyboardEvent(connector, msg.flags, msg.code);
 			}
 			break;
@@ -435,8 +699,8 @@ int freerds_receive_client_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_CLIENT_UNICODE_KEYBOARD_EVENT:
 			{
 				RDS_MSG_UNICODE_KEYBOARD_EVENT msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_read_unicode_keyboard_event(s, &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg),
+						(pRdsMessageRead) freerds_read_unicode_keyboard_event);
 				status = client->UnicodeKeyboardEvent(connector, msg.flags, msg.code);
 			}
 			break;
@@ -444,8 +708,8 @@ int freerds_receive_client_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_CLIENT_MOUSE_EVENT:
 			{
 				RDS_MSG_MOUSE_EVENT msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_read_mouse_event(s, &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg),
+						(pRdsMessageRead) freerds_read_mouse_event);
 				status = client->MouseEvent(connector, msg.flags, msg.x, msg.y);
 			}
 			break;
@@ -453,8 +717,8 @@ int freerds_receive_client_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_CLIENT_EXTENDED_MOUSE_EVENT:
 			{
 				RDS_MSG_EXTENDED_MOUSE_EVENT msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_read_extended_mouse_event(s, &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg),
+						(pRdsMessageRead) freerds_read_extended_mouse_event);
 				status = client->ExtendedMouseEvent(connector, msg.flags, msg.x, msg.y);
 			}
 			break;
@@ -462,8 +726,8 @@ int freerds_receive_client_message(rdsModuleConnector* connector, wStream* s, RD
 		case RDS_CLIENT_VBLANK_EVENT:
 			{
 				RDS_MSG_VBLANK_EVENT msg;
-				CopyMemory(&msg, common, sizeof(RDS_MSG_COMMON));
-				freerds_read_vblank_event(s, &msg);
+				freerds_receive_body(s, common, (RDS_MSG_COMMON*) &msg, sizeof(msg),
+						(pRdsMessageRead) freerds_read_vblank_event);
 				if (client->VBlankEvent)
 					status = client->VBlankEvent(connector);
 				else
@@ -481,66 +745,265 @@ int freerds_receive_client_message(rdsModuleConnector* connector, wStream* s, RD
 
 int freerds_receive_message(rdsModuleConnector* connector, wStream* s, RDS_MSG_COMMON* common)
 {
+	if ((common->type == RDS_SERVER_SHARED_TRANSPORT) || (common->type == RDS_CLIENT_SHARED_TRANSPORT))
+		return freerds_shm_transport_control(connector, s, common);
+
 	if (connector->ServerMode)
 		return freerds_receive_client_message(connector, s, common);
 	else
 		return freerds_receive_server_message(connector, s, common);
 }
 
-int freerds_transport_receive(rdsModuleConnector* connector)
+static int freerds_transport_read(rdsModuleConnector* connector, BYTE* data, DWORD length)
+{
+	if (connector->InboundRingActive)
+		return freerds_shm_transport_read(connector, data, length);
+
+	return freerds_transport_read_pipe(connector, data, length);
+}
+
+/**
+ * Appends whatever the transport has available to the inbound stream,
+ * partial messages stay at the beginning of it until they are complete.
+ */
+
+static int freerds_transport_fill(rdsModuleConnector* connector)
 {
-	wStream* s;
 	int status;
-	int position;
-	UINT32 length;
-	RDS_MSG_COMMON common;
+	wStream* s;
 
 	s = connector->InboundStream;
 
-	if (Stream_GetPosition(s) < RDS_ORDER_HEADER_LENGTH)
+	Stream_EnsureRemainingCapacity(s, PIPE_BUFFER_SIZE);
+
+	status = freerds_transport_read(connector, Stream_Pointer(s),
+			Stream_Capacity(s) - Stream_GetPosition(s));
+
+	if (status > 0)
+		Stream_Seek(s, status);
+
+	return status;
+}
+
+/**
+ * Returns 1 with the length of the message at data once its header is
+ * complete, 0 if more data is needed and -1 on a malformed header.
+ */
+
+static int freerds_transport_peek_length(rdsModuleConnector* connector, BYTE* data, size_t size, UINT32* length)
+{
+	if (connector->InboundVersion >= RDS_PROTOCOL_VERSION_2)
+		return freerds_compact_peek_container(data, size, length);
+
+	if (size < RDS_ORDER_HEADER_LENGTH)
+		return 0;
+
+	*length = freerds_peek_common_header_length(data);
+
+	return (*length < RDS_ORDER_HEADER_LENGTH) ? -1 : 1;
+}
+
+/**
+ * Dispatches the messages of the version 2 container of length bytes at
+ * offset in the inbound stream, and returns how many there were. Bodies
+ * are read in place, like version 1 messages.
+ */
+
+static int freerds_transport_dispatch_container(rdsModuleConnector* connector, wStream* s, size_t offset, UINT32 length)
+{
+	int status;
+	int count = 0;
+	BYTE* buffer;
+	size_t end;
+	UINT32 msgLength;
+	UINT32 bodyOffset;
+	RDS_MSG_SERVER msg;
+
+	buffer = Stream_Buffer(s);
+	end = offset + length;
+	offset += RDS_COMPACT_CONTAINER_HEADER_LENGTH;
+
+	ZeroMemory(&connector->InboundRect, sizeof(RDS_RECT));
+
+	while (offset < end)
 	{
-		status = freerds_named_pipe_read(connector->hClientPipe, Stream_Pointer(s),
-				RDS_ORDER_HEADER_LENGTH - Stream_GetPosition(s));
+		if (freerds_compact_peek_length(&buffer[offset], end - offset, &msgLength) <= 0)
+			return -1;
+
+		if (msgLength > (end - offset))
+			return -1;
+
+		status = freerds_compact_read_message(connector, &buffer[offset], msgLength,
+				(RDS_MSG_COMMON*) &msg, &bodyOffset);
 
 		if (status < 0)
 			return -1;
 
 		if (status > 0)
-			Stream_Seek(s, status);
+		{
+			freerds_receive_message(connector, NULL, (RDS_MSG_COMMON*) &msg);
+		}
+		else
+		{
+			Stream_SetPosition(s, offset + bodyOffset);
+			Stream_SetLength(s, offset + msgLength);
+
+			freerds_receive_message(connector, s, (RDS_MSG_COMMON*) &msg);
+		}
+
+		offset += msgLength;
+		count++;
 	}
 
-	if (Stream_GetPosition(s) >= RDS_ORDER_HEADER_LENGTH)
+	return count;
+}
+
+/**
+ * Dispatches every complete message in the inbound stream, in place,
+ * and returns how many were handled.
+ */
+
+static int freerds_transport_dispatch(rdsModuleConnector* connector)
+{
+	int status;
+	wStream* s;
+	BYTE* buffer;
+	int count = 0;
+	BOOL ringActive;
+	UINT32 length;
+	UINT32 needed = 0;
+	size_t offset = 0;
+	size_t end;
+	RDS_MSG_COMMON common;
+
+	s = connector->InboundStream;
+	end = Stream_GetPosition(s);
+
+	while (offset < end)
 	{
-		length = freerds_peek_common_header_length(Stream_Buffer(s));
+		buffer = Stream_Buffer(s);
+
+		status = freerds_transport_peek_length(connector, &buffer[offset], end - offset, &length);
+
+		if (status < 0)
+			return -1;
+
+		if (status == 0)
+			break;
+
+		if ((end - offset) < length)
+		{
+			/* make room for the rest of it on the next read */
+			needed = length;
+			break;
+		}
+
+		ringActive = connector->InboundRingActive;
 
-		if (length - Stream_GetPosition(s))
+		connector->MessageBuffer = connector->InboundBuffer;
+
+		if (connector->InboundVersion >= RDS_PROTOCOL_VERSION_2)
 		{
-			status = freerds_named_pipe_read(connector->hClientPipe, Stream_Pointer(s),
-				length - Stream_GetPosition(s));
+			status = freerds_transport_dispatch_container(connector, s, offset, length);
 
 			if (status < 0)
 				return -1;
+		}
+		else
+		{
+			Stream_SetPosition(s, offset);
+			Stream_SetLength(s, offset + length);
+
+			freerds_read_common_header(s, &common);
+			freerds_receive_message(connector, s, &common);
 
-			if (status > 0)
-				Stream_Seek(s, status);
+			status = 1;
 		}
-	}
 
-	if (Stream_GetPosition(s) >= RDS_ORDER_HEADER_LENGTH)
-	{
-		length = freerds_peek_common_header_length(Stream_Buffer(s));
+		connector->MessageBuffer = NULL;
+
+		offset += length;
+		count += status;
 
-		if (Stream_GetPosition(s) >= length)
+		connector->InboundTotalLength += length;
+		connector->InboundTotalCount += status;
+
+		if (!ringActive && connector->InboundRingActive)
 		{
-			position = Stream_GetPosition(s);
+			/* that was the last message on the pipe, what follows are wakeups */
+			offset = end;
+			break;
+		}
+	}
 
-			Stream_SetPosition(s, 0);
-			freerds_read_common_header(s, &common);
+	connector->InboundBuffer = freerds_message_buffer_reclaim(connector->InboundBuffer, offset, end);
+
+	if (!connector->InboundBuffer)
+		return -1;
+
+	s = connector->InboundStream = connector->InboundBuffer->s;
+
+	if (needed)
+		Stream_EnsureCapacity(s, needed);
+
+	Stream_SetLength(s, Stream_Capacity(s));
+	Stream_SetPosition(s, end - offset);
+
+	return count;
+}
 
-			status = freerds_receive_message(connector, s, &common);
-			Stream_SetPosition(s, 0);
+/**
+ * Once the shared transport is active the named pipe only carries wakeups,
+ * everything queued in the ring is dispatched before going back to sleep.
+ */
+
+static int freerds_shm_transport_drain(rdsModuleConnector* connector)
+{
+	int status;
+
+	do
+	{
+		while ((status = freerds_transport_fill(connector)) > 0)
+		{
+			if (freerds_transport_dispatch(connector) < 0)
+				return -1;
 		}
+
+		if (status < 0)
+			return -1;
 	}
+	while (freerds_shm_transport_wait(connector));
+
+	return 0;
+}
+
+static int freerds_shm_transport_receive(rdsModuleConnector* connector)
+{
+	BYTE wakeups[64];
+
+	if (freerds_transport_read_pipe(connector, wakeups, sizeof(wakeups)) < 0)
+		return -1;
+
+	connector->InboundWakeupCount++;
+
+	return freerds_shm_transport_drain(connector);
+}
+
+int freerds_transport_receive(rdsModuleConnector* connector)
+{
+	if (connector->InboundRingActive)
+		return freerds_shm_transport_receive(connector);
+
+	if (freerds_transport_fill(connector) < 0)
+		return -1;
+
+	connector->InboundWakeupCount++;
+
+	if (freerds_transport_dispatch(connector) < 0)
+		return -1;
+
+	if (connector->InboundRingActive)
+		return freerds_shm_transport_drain(connector);
 
 	return 0;
 }
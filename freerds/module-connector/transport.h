@@ -24,4 +24,13 @@
 
 #define PIPE_BUFFER_SIZE	0xFFFF
 
+int freerds_named_pipe_write_some(HANDLE hNamedPipe, BYTE* data, DWORD length);
+int freerds_named_pipe_write_fd(HANDLE hNamedPipe, BYTE* data, DWORD length, int fd);
+
+int freerds_transport_take_fd(rdsModuleConnector* connector);
+void freerds_transport_close_fds(rdsModuleConnector* connector);
+
+int freerds_memfd_create_sealed(const char* name, UINT32 size);
+int freerds_memfd_check_sealed(int fd, UINT64 size);
+
 #endif /* RDS_NG_TRANSPORT_H */
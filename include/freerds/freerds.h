@@ -77,11 +77,47 @@ struct _RDS_FRAMEBUFFER
 	int fbSegmentId;
 	int fbBitsPerPixel;
 	int fbBytesPerPixel;
+	int fbMemFd;
 	BYTE* fbSharedMemory;
 	void* image;
 };
 typedef struct _RDS_FRAMEBUFFER RDS_FRAMEBUFFER;
 
+typedef struct rds_framebuffer_damage rdsFramebufferDamage;
+
+/**
+ * Reference counted stream messages are read from. Message fields such as
+ * bitmap data point into it, so queued messages keep a reference instead
+ * of copying their payload.
+ */
+
+struct rds_message_buffer
+{
+	LONG refCount;
+	wStream* s;
+};
+typedef struct rds_message_buffer rdsMessageBuffer;
+
+/**
+ * Bounded single producer, single consumer queue of server messages from
+ * the I/O thread reading the module to the worker checking the connection.
+ * head is only written by the consumer and tail by the producer, the event
+ * is only set when the queue goes from empty to non-empty.
+ */
+
+struct rds_server_queue
+{
+	UINT32 size;
+	RDS_MSG_COMMON** messages;
+	HANDLE event;
+	BYTE pad[52];
+	UINT32 head;
+	BYTE headPad[60];
+	UINT32 tail;
+	BYTE tailPad[60];
+};
+typedef struct rds_server_queue rdsServerQueue;
+
 #define RDS_CODEC_JPEG			0x00000001
 #define RDS_CODEC_NSCODEC		0x00000002
 #define RDS_CODEC_REMOTEFX		0x00000004
@@ -110,6 +146,7 @@ int freerds_write_common_header(wStream* s, RDS_MSG_COMMON* msg);
 #define RDS_CLIENT_MOUSE_EVENT			108
 #define RDS_CLIENT_EXTENDED_MOUSE_EVENT		109
 #define RDS_CLIENT_VBLANK_EVENT			110
+#define RDS_CLIENT_SHARED_TRANSPORT		111
 
 struct _RDS_MSG_SYNCHRONIZE_KEYBOARD_EVENT
 {
@@ -192,6 +229,34 @@ struct _RDS_MSG_VBLANK_EVENT
 };
 typedef struct _RDS_MSG_VBLANK_EVENT RDS_MSG_VBLANK_EVENT;
 
+/**
+ * SharedTransport is sent in both directions: the module offers a shared
+ * memory segment holding one ring per direction along with the highest wire
+ * format version it speaks, and each side announces with a switch that
+ * everything it sends from then on uses the agreed version, and its ring if
+ * the RING flag is set, the named pipe then only carrying wakeups. With the
+ * MEMFD flag the segment is a sealed memfd passed along with the offer.
+ */
+
+#define RDS_SHARED_TRANSPORT_OFFER		0x00000001
+#define RDS_SHARED_TRANSPORT_SWITCH		0x00000002
+#define RDS_SHARED_TRANSPORT_RING		0x00000004
+#define RDS_SHARED_TRANSPORT_MEMFD		0x00000008
+
+#define RDS_PROTOCOL_VERSION_1			1
+#define RDS_PROTOCOL_VERSION_2			2
+
+struct _RDS_MSG_SHARED_TRANSPORT
+{
+	DEFINE_MSG_COMMON();
+
+	UINT32 flags;
+	int segmentId;
+	UINT32 ringSize;
+	UINT32 version;
+};
+typedef struct _RDS_MSG_SHARED_TRANSPORT RDS_MSG_SHARED_TRANSPORT;
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -224,6 +289,9 @@ int freerds_write_refresh_rect(wStream* s, RDS_MSG_REFRESH_RECT* msg);
 int freerds_read_vblank_event(wStream* s, RDS_MSG_VBLANK_EVENT* msg);
 int freerds_write_vblank_event(wStream* s, RDS_MSG_VBLANK_EVENT* msg);
 
+int freerds_read_shared_transport(wStream* s, RDS_MSG_SHARED_TRANSPORT* msg);
+int freerds_write_shared_transport(wStream* s, RDS_MSG_SHARED_TRANSPORT* msg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -256,6 +324,7 @@ int freerds_write_vblank_event(wStream* s, RDS_MSG_VBLANK_EVENT* msg);
 #define RDS_SERVER_SET_SYSTEM_POINTER		23
 #define RDS_SERVER_LOGON_USER			24
 #define RDS_SERVER_LOGOFF_USER			25
+#define RDS_SERVER_SHARED_TRANSPORT		26
 
 struct _RDS_MSG_BEGIN_UPDATE
 {
@@ -570,6 +639,13 @@ struct _RDS_MSG_LOGOFF_USER
 };
 typedef struct _RDS_MSG_LOGOFF_USER RDS_MSG_LOGOFF_USER;
 
+/**
+ * A memfd framebuffer has no SysV segment, its segmentId is -1 and the
+ * descriptor is passed over the module socket along with the message.
+ */
+
+#define RDS_SHARED_FRAMEBUFFER_MEMFD		0x00000001
+
 struct _RDS_MSG_SHARED_FRAMEBUFFER
 {
 	DEFINE_MSG_COMMON();
@@ -581,6 +657,8 @@ struct _RDS_MSG_SHARED_FRAMEBUFFER
 	int segmentId;
 	int bitsPerPixel;
 	int bytesPerPixel;
+	int flags;
+	int fd;
 };
 typedef struct _RDS_MSG_SHARED_FRAMEBUFFER RDS_MSG_SHARED_FRAMEBUFFER;
 
@@ -609,6 +687,7 @@ union _RDS_MSG_SERVER
 	RDS_MSG_RESET Reset;
 	RDS_MSG_WINDOW_NEW_UPDATE WindowNewUpdate;
 	RDS_MSG_WINDOW_DELETE WindowDelete;
+	RDS_MSG_SHARED_TRANSPORT SharedTransport;
 };
 typedef union _RDS_MSG_SERVER RDS_MSG_SERVER;
 
@@ -700,6 +779,9 @@ struct rds_server_interface
 };
 typedef struct rds_server_interface rdsServerInterface;
 
+#define FREERDS_INBOUND_FDS_MAX		4
+#define FREERDS_OUTBOUND_FDS_MAX	FREERDS_INBOUND_FDS_MAX
+
 struct rds_module_connector
 {
 
@@ -713,10 +795,40 @@ struct rds_module_connector
 	HANDLE hServerPipe;
 	wStream* OutboundStream;
 	wStream* InboundStream;
+	rdsMessageBuffer* InboundBuffer;
+	rdsMessageBuffer* MessageBuffer;
 	UINT32 InboundTotalLength;
 	UINT32 InboundTotalCount;
+	UINT32 InboundWakeupCount;
 	UINT32 OutboundTotalLength;
 	UINT32 OutboundTotalCount;
+	UINT32 OutboundWriteCount;
+	DWORD OutboundBatchTime;
+	BOOL OutboundBatching;
+	BOOL OutboundNonBlocking;
+	wStream* OutboundPending;
+	UINT32 OutboundPendingPipe;
+	UINT32 OutboundStallCount;
+	DWORD OutboundStallStart;
+	DWORD OutboundStallTime;
+	int OutboundFds[FREERDS_OUTBOUND_FDS_MAX];
+	UINT32 OutboundFdCount;
+	int InboundFds[FREERDS_INBOUND_FDS_MAX];
+	UINT32 InboundFdCount;
+	BYTE* SharedTransport;
+	UINT32 SharedTransportLength;
+	int SharedTransportFd;
+	void* InboundRing;
+	void* OutboundRing;
+	BOOL InboundRingActive;
+	BOOL OutboundRingActive;
+	BOOL OutboundRingPending;
+	UINT32 TransportVersion;
+	UINT32 InboundVersion;
+	UINT32 OutboundVersion;
+	RDS_RECT InboundRect;
+	RDS_RECT OutboundRect;
+	wStream* EncodeStream;
 	pRdsGetEventHandles GetEventHandles;
 	pRdsCheckEventHandles CheckEventHandles;
 
@@ -732,8 +844,14 @@ struct rds_module_connector
 	HANDLE StopEvent;
 	HANDLE ServerTimer;
 	HANDLE ServerThread;
-	wLinkedList* ServerList;
-	wMessageQueue* ServerQueue;
+	RDS_MSG_COMMON** ServerList;
+	UINT32 ServerListCount;
+	UINT32 ServerListSize;
+	rdsServerQueue* ServerQueue;
+	LONG ServerQueueBlocked;
+	void* MessagePool;
+	int MessagePoolSize;
+	CRITICAL_SECTION MessagePoolLock;
 	rdsServerInterface* ServerProxy;
 };
 
@@ -749,6 +867,16 @@ FREERDP_API int freerds_server_message_write(wStream* s, RDS_MSG_COMMON* msg);
 
 FREERDP_API void* freerds_server_message_copy(RDS_MSG_COMMON* msg);
 FREERDP_API void freerds_server_message_free(RDS_MSG_COMMON* msg);
+FREERDP_API BOOL freerds_server_message_references_buffer(RDS_MSG_COMMON* msg);
+
+FREERDP_API rdsMessageBuffer* freerds_message_buffer_new(size_t size);
+FREERDP_API void freerds_message_buffer_acquire(rdsMessageBuffer* buffer);
+FREERDP_API void freerds_message_buffer_release(rdsMessageBuffer* buffer);
+
+FREERDP_API RDS_MSG_COMMON* freerds_server_message_acquire(rdsModuleConnector* connector,
+		RDS_MSG_COMMON* msg, rdsMessageBuffer* buffer);
+FREERDP_API void freerds_server_message_release(rdsModuleConnector* connector, RDS_MSG_COMMON* msg);
+FREERDP_API void freerds_server_message_pool_free(rdsModuleConnector* connector);
 
 /**
  * New Clean Module Interface API
@@ -764,10 +892,25 @@ FREERDP_API int freerds_named_pipe_read(HANDLE hNamedPipe, BYTE* data, DWORD len
 FREERDP_API int freerds_named_pipe_write(HANDLE hNamedPipe, BYTE* data, DWORD length);
 
 FREERDP_API int freerds_server_outbound_write_message(rdsModuleConnector* connector, RDS_MSG_COMMON* msg);
+FREERDP_API int freerds_connector_outbound_flush(rdsModuleConnector* connector);
+FREERDP_API UINT32 freerds_connector_outbound_pending(rdsModuleConnector* connector);
+
+FREERDP_API BYTE* freerds_shared_framebuffer_create(UINT32 size, BOOL hugePages, int* segmentId, int* fd);
+FREERDP_API void freerds_shared_framebuffer_destroy(BYTE* data, UINT32 size, int segmentId, int fd);
+FREERDP_API BYTE* freerds_shared_framebuffer_attach(RDS_MSG_SHARED_FRAMEBUFFER* msg);
+FREERDP_API void freerds_shared_framebuffer_detach(BYTE* data, UINT32 size, int segmentId);
+
+FREERDP_API rdsFramebufferDamage* freerds_framebuffer_damage_new(BYTE* data, int width, int height, int scanline);
+FREERDP_API void freerds_framebuffer_damage_free(rdsFramebufferDamage* damage);
+FREERDP_API int freerds_framebuffer_damage_collect(rdsFramebufferDamage* damage, RDS_RECT* bands, int maxBands);
+
+FREERDP_API int freerds_shm_transport_offer(rdsModuleConnector* connector);
+FREERDP_API void freerds_shm_transport_free(rdsModuleConnector* connector);
 
 FREERDP_API void freerds_named_pipe_get_endpoint_name(DWORD id, const char *endpoint, char *dest, int len);
 FREERDP_API int freerds_named_pipe_clean(const char* pipeName);
 FREERDP_API HANDLE freerds_named_pipe_connect(const char* pipeName, DWORD nTimeOut);
+FREERDP_API HANDLE freerds_named_pipe_connect_wait(const char* pipeName, DWORD nTimeOut);
 FREERDP_API HANDLE freerds_named_pipe_create(const char* pipeName);
 
 FREERDP_API int freerds_named_pipe_clean_endpoint(DWORD id, const char* endpoint);
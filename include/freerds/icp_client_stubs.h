@@ -25,4 +25,5 @@
 int freerds_icp_IsChannelAllowed(int sessionId, char *channelName, BOOL *isAllowed);
 int freerds_icp_Ping(BOOL *pong);
 int freerds_icp_GetUserSession(char *username, char * domain, UINT32 *sessionID, char **serviceEndpoint);
+int freerds_icp_ReportLoad(UINT32 sessions, UINT32 pendingConnections, UINT32 cpuLoad, UINT32 freeMemory, UINT32 encodeBacklog, BOOL saturated, BOOL *acknowledged);
 #endif // _ICP_CLIENT_STUBS_H
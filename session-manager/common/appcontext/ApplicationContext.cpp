@@ -105,6 +105,10 @@ namespace freerds
 			mPropertyManager.setPropertyNumber(Global,0,"module.x11.xres",1024);
 			mPropertyManager.setPropertyNumber(Global,0,"module.x11.yres",768);
 			mPropertyManager.setPropertyNumber(Global,0,"module.x11.colordepth",24);
+			// set session.cgroup.root to a delegated cgroup v2 directory to isolate sessions
+			mPropertyManager.setPropertyNumber(Global,0,"session.cgroup.cpuweight",100);
+			mPropertyManager.setPropertyNumber(Global,0,"session.cgroup.memoryhigh",0);
+			mPropertyManager.setPropertyNumber(Global,0,"session.cgroup.pidsmax",0);
 		}
 	}
 }
@@ -0,0 +1,97 @@
+/**
+ * Class for rpc call ReportLoad (freerds to session manager)
+ *
+ * Copyright 2013 Thinstuff Technologies GmbH
+ * Copyright 2013 DI (FH) Martin Haimberger <martin.haimberger@thinstuff.at>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "CallInReportLoad.h"
+#include <appcontext/ApplicationContext.h>
+
+using freerds::icp::ReportLoadRequest;
+using freerds::icp::ReportLoadResponse;
+
+namespace freerds{
+	namespace sessionmanager{
+		namespace call{
+
+		CallInReportLoad::CallInReportLoad() {
+			mSessions = 0;
+			mPendingConnections = 0;
+			mCpuLoad = 0;
+			mFreeMemory = 0;
+			mEncodeBacklog = 0;
+			mSaturated = false;
+		};
+
+		CallInReportLoad::~CallInReportLoad() {
+
+		};
+
+		unsigned long CallInReportLoad::getCallType() {
+			return freerds::icp::ReportLoad;
+		};
+
+		int CallInReportLoad::decodeRequest() {
+			// decode protocol buffers
+			ReportLoadRequest req;
+			if (!req.ParseFromString(mEncodedRequest)) {
+				// failed to parse
+				mResult = 1;// will report error with answer
+				return -1;
+			}
+			mSessions = req.sessions();
+			mPendingConnections = req.pendingconnections();
+			mCpuLoad = req.cpuload();
+			mFreeMemory = req.freememory();
+			mEncodeBacklog = req.encodebacklog();
+			mSaturated = req.saturated();
+			return 0;
+		};
+
+		int CallInReportLoad::encodeResponse() {
+			// encode protocol buffers
+			ReportLoadResponse resp;
+			resp.set_acknowledged(true);
+
+			if (!resp.SerializeToString(&mEncodedResponse)) {
+				// failed to serialize
+				mResult = 1;
+				return -1;
+			}
+			return 0;
+		};
+
+		int CallInReportLoad::doStuff() {
+			// latest host load as seen by freerds admission control
+			configNS::PropertyManager * propertyManager = APP_CONTEXT.getPropertyManager();
+
+			propertyManager->setPropertyNumber(Global, 0, "freerds.load.sessions", mSessions);
+			propertyManager->setPropertyNumber(Global, 0, "freerds.load.pending", mPendingConnections);
+			propertyManager->setPropertyNumber(Global, 0, "freerds.load.cpu", mCpuLoad);
+			propertyManager->setPropertyNumber(Global, 0, "freerds.load.freememory", mFreeMemory);
+			propertyManager->setPropertyNumber(Global, 0, "freerds.load.backlog", mEncodeBacklog);
+			propertyManager->setPropertyBool(Global, 0, "freerds.load.saturated", mSaturated);
+			return 0;
+		}
+
+
+		}
+	}
+}
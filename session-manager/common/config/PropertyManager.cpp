@@ -101,7 +101,7 @@ namespace freerds{
 				helper.type = BoolType;
 				helper.boolValue = value;
 
-				mPropertyGlobalMap.insert(std::make_pair(path,helper));
+				mPropertyGlobalMap[path] = helper;
 				return 0;
 			}
 
@@ -112,7 +112,7 @@ namespace freerds{
 				helper.type = NumberType;
 				helper.numberValue = value;
 
-				mPropertyGlobalMap.insert(std::make_pair(path,helper));
+				mPropertyGlobalMap[path] = helper;
 				return 0;
 			}
 
@@ -123,7 +123,7 @@ namespace freerds{
 				helper.type = StringType;
 				helper.stringValue = value;
 
-				mPropertyGlobalMap.insert(std::make_pair(path,helper));
+				mPropertyGlobalMap[path] = helper;
 				return 0;
 			}
 
@@ -24,7 +24,12 @@
 #include "Session.h"
 
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <pwd.h>
+#include <signal.h>
+#include <sys/stat.h>
 
 #include <winpr/wlog.h>
 #include <winpr/sspicli.h>
@@ -138,9 +143,16 @@ namespace freerds{
 				mCurrentModuleContext->userToken = mUserToken;
 				mCurrentModuleContext->envBlock = &mpEnvBlock;
 
+				// without a cgroup the session shares the resources of the session manager
+				mCurrentModuleContext->cgroupPath = NULL;
+				if (createCGroup()) {
+					mCurrentModuleContext->cgroupPath = mCGroupPath.c_str();
+				}
+
 				pName = currentModule->start(mCurrentModuleContext);
 				if (pName.length() == 0) {
 					WLog_Print(logger_Session, WLOG_ERROR, "startModule failed, no pipeName was returned");
+					removeCGroup();
 					return false;
 				} else {
 					pipeName = pName;
@@ -164,8 +176,205 @@ namespace freerds{
 
 				currentModule->freeContext(mCurrentModuleContext);
 				mCurrentModuleContext = NULL;
+
+				removeCGroup();
+				return true;
+
+			}
+
+			static bool writeCGroupFile(std::string path, const char * name, std::string value) {
+				int fd;
+				ssize_t written;
+				std::string fileName = path + "/" + name;
+
+				fd = open(fileName.c_str(), O_WRONLY | O_CLOEXEC);
+				if (fd < 0) {
+					WLog_Print(logger_Session, WLOG_ERROR, "failed to open %s: %s", fileName.c_str(), strerror(errno));
+					return false;
+				}
+
+				written = write(fd, value.c_str(), value.length());
+				close(fd);
+
+				if (written != (ssize_t) value.length()) {
+					WLog_Print(logger_Session, WLOG_ERROR, "failed to write %s to %s: %s", value.c_str(), fileName.c_str(), strerror(errno));
+					return false;
+				}
+				return true;
+			}
+
+			static bool readCGroupFile(std::string path, const char * name, std::string & value) {
+				int fd;
+				ssize_t length;
+				char buffer[4096];
+				std::string fileName = path + "/" + name;
+
+				value.clear();
+
+				fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+				if (fd < 0) {
+					return false;
+				}
+
+				while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+					value.append(buffer, length);
+				}
+				close(fd);
+
+				return (length == 0);
+			}
+
+			static bool cgroupPopulated(std::string path) {
+				std::string events;
+
+				// unreadable counts as populated, the rmdir then tells
+				if (!readCGroupFile(path, "cgroup.events", events)) {
+					return true;
+				}
+				return (events.find("populated 0") == std::string::npos);
+			}
+
+			static void killCGroup(std::string path) {
+				std::string procs;
+				const char * cursor;
+				char * end;
+				long pid;
+
+				// cgroup.kill also catches processes forking meanwhile, it needs Linux 5.14
+				if (access((path + "/cgroup.kill").c_str(), W_OK) == 0) {
+					writeCGroupFile(path, "cgroup.kill", "1");
+					return;
+				}
+
+				if (!readCGroupFile(path, "cgroup.procs", procs)) {
+					return;
+				}
+
+				// one pid per line, strtol skips the newlines
+				for (cursor = procs.c_str(); ; cursor = end) {
+					pid = strtol(cursor, &end, 10);
+					if (end == cursor) {
+						break;
+					}
+					if (pid > 0) {
+						kill((pid_t) pid, SIGKILL);
+					}
+				}
+			}
+
+#define CGROUP_REMOVE_TIMEOUT	5000
+#define CGROUP_REMOVE_INTERVAL	10
+
+			/**
+			 * Kills what is left in a session cgroup and removes it. Killed processes
+			 * keep the directory busy until they are reaped, so the removal is retried
+			 * for up to CGROUP_REMOVE_TIMEOUT ms.
+			 */
+			static bool destroyCGroup(std::string path) {
+				int waited = 0;
+				int error;
+
+				for (;;) {
+					if ((rmdir(path.c_str()) == 0) || (errno == ENOENT)) {
+						return true;
+					}
+					error = errno;
+					if ((error != EBUSY) || (waited >= CGROUP_REMOVE_TIMEOUT)) {
+						break;
+					}
+
+					if (cgroupPopulated(path)) {
+						killCGroup(path);
+					}
+					usleep(CGROUP_REMOVE_INTERVAL * 1000);
+					waited += CGROUP_REMOVE_INTERVAL;
+				}
+
+				WLog_Print(logger_Session, WLOG_WARN, "failed to remove cgroup %s: %s", path.c_str(), strerror(error));
+				return false;
+			}
+
+			static std::string cgroupLimit(long value) {
+				char buffer[32];
+
+				// 0 leaves the resource unlimited
+				if (value <= 0) {
+					return "max";
+				}
+				sprintf_s(buffer, sizeof(buffer), "%ld", value);
+				return buffer;
+			}
+
+			/**
+			 * Every session gets its own cgroup v2 directory below session.cgroup.root,
+			 * which must be delegated to the session manager and hold no processes
+			 * itself. X11rdp, the window manager and everything they start are moved
+			 * into it by the module, so the kernel weighs sessions against each other
+			 * rather than processes:
+			 *  - session.cgroup.cpuweight: cpu.weight, 1 to 10000, 100 by default
+			 *  - session.cgroup.memoryhigh: memory.high in MB, 0 for no limit
+			 *  - session.cgroup.pidsmax: pids.max, 0 for no limit
+			 */
+			bool Session::createCGroup() {
+				std::string root;
+				long cpuWeight = 100;
+				long memoryHigh = 0;
+				long pidsMax = 0;
+				char name[64];
+				configNS::PropertyManager * propertyManager = APP_CONTEXT.getPropertyManager();
+
+				mCGroupPath.clear();
+
+				if (!propertyManager->getPropertyString(mSessionID, "session.cgroup.root", root) || (root.length() == 0)) {
+					// not configured
+					return false;
+				}
+
+				propertyManager->getPropertyNumber(mSessionID, "session.cgroup.cpuweight", cpuWeight);
+				propertyManager->getPropertyNumber(mSessionID, "session.cgroup.memoryhigh", memoryHigh);
+				propertyManager->getPropertyNumber(mSessionID, "session.cgroup.pidsmax", pidsMax);
+
+				// each controller on its own, one the kernel lacks does not disable the others
+				writeCGroupFile(root, "cgroup.subtree_control", "+cpu");
+				writeCGroupFile(root, "cgroup.subtree_control", "+memory");
+				writeCGroupFile(root, "cgroup.subtree_control", "+pids");
+
+				sprintf_s(name, sizeof(name), "/session-%ld", mSessionID);
+				std::string path = root + name;
+
+				if (mkdir(path.c_str(), 0755) < 0) {
+					if (errno != EEXIST) {
+						WLog_Print(logger_Session, WLOG_ERROR, "createCGroup failed to create %s: %s", path.c_str(), strerror(errno));
+						return false;
+					}
+
+					// left behind by an earlier session with this id, possibly with its processes
+					WLog_Print(logger_Session, WLOG_WARN, "createCGroup found a stale %s, replacing it", path.c_str());
+					if (!destroyCGroup(path) || (mkdir(path.c_str(), 0755) < 0)) {
+						WLog_Print(logger_Session, WLOG_ERROR, "createCGroup failed to replace %s", path.c_str());
+						return false;
+					}
+				}
+
+				if (cpuWeight > 0) {
+					writeCGroupFile(path, "cpu.weight", cgroupLimit(cpuWeight));
+				}
+				writeCGroupFile(path, "memory.high", cgroupLimit((memoryHigh > 0) ? (memoryHigh * 1024 * 1024) : 0));
+				writeCGroupFile(path, "pids.max", cgroupLimit(pidsMax));
+
+				mCGroupPath = path;
 				return true;
+			}
+
+			void Session::removeCGroup() {
+				if (mCGroupPath.length() == 0) {
+					return;
+				}
+
+				// processes outliving the module belong to the session and go with it
+				destroyCGroup(mCGroupPath);
 
+				mCGroupPath.clear();
 			}
 
 }
@@ -50,6 +50,9 @@ namespace freerds{
 			bool startModule(std::string & pipeName);
 			bool stopModule();
 
+			bool createCGroup();
+			void removeCGroup();
+
 
 
 		private:
@@ -65,6 +68,8 @@ namespace freerds{
 			std::string mModuleName;
 			RDS_MODULE_COMMON * mCurrentModuleContext;
 
+			std::string mCGroupPath;
+
 		};
 
 		}
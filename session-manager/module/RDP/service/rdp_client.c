@@ -143,6 +143,8 @@ int rds_check_shared_framebuffer(rdsContext* rds)
 		msg.segmentId = rds->framebuffer.fbSegmentId;
 		msg.bitsPerPixel = rds->framebuffer.fbBitsPerPixel;
 		msg.bytesPerPixel = rds->framebuffer.fbBytesPerPixel;
+		msg.flags = (rds->framebuffer.fbMemFd >= 0) ? RDS_SHARED_FRAMEBUFFER_MEMFD : 0;
+		msg.fd = rds->framebuffer.fbMemFd;
 
 		msg.type = RDS_SERVER_SHARED_FRAMEBUFFER;
 		connector->server->SharedFramebuffer(connector, &msg);
@@ -309,10 +311,8 @@ BOOL rds_post_connect(freerdp* instance)
 	rds->framebuffer.fbScanline = rds->framebuffer.fbWidth * rds->framebuffer.fbBytesPerPixel;
 	rds->framebufferSize = rds->framebuffer.fbScanline * rds->framebuffer.fbHeight;
 
-	rds->framebuffer.fbSegmentId = shmget(IPC_PRIVATE, rds->framebufferSize,
-			IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-
-	rds->framebuffer.fbSharedMemory = (BYTE*) shmat(rds->framebuffer.fbSegmentId, 0, 0);
+	rds->framebuffer.fbSharedMemory = freerds_shared_framebuffer_create(rds->framebufferSize,
+			TRUE, &rds->framebuffer.fbSegmentId, &rds->framebuffer.fbMemFd);
 
 	gdi_init(instance, flags, rds->framebuffer.fbSharedMemory);
 	gdi = instance->context->gdi;
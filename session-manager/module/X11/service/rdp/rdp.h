@@ -89,6 +89,19 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #define X11RDPVER "0.7.7"
 
+/* in milliseconds, how soon to retry writing to a backed up pipe */
+#define RDP_OUTBOUND_RETRY_DELAY 2
+
+/* past either, accumulated damage is sent as its extents */
+#define RDP_MAX_DAMAGE_RECTS 16
+#define RDP_DAMAGE_EXTENTS_COVERAGE 75
+
+/* where framebuffer damage comes from, see -damage */
+#define RDP_DAMAGE_OPS 0
+#define RDP_DAMAGE_KERNEL 1
+#define RDP_DAMAGE_CHECK 2
+#define RDP_MAX_KERNEL_DAMAGE_BANDS 32
+
 #define PixelDPI 100
 #define PixelToMM(_size) (((_size) * 254 + (PixelDPI) * 5) / ((PixelDPI) * 10))
 
@@ -143,9 +156,13 @@ struct _rdpScreenInfoRec
 	GlyphsProcPtr Glyphs;
 
 	int segmentId;
+	int fbMemFd;
 	int sharedMemory;
 	int fbAttached;
 
+	int damageMode;
+	rdsFramebufferDamage* damage;
+
 	int rdp_width;
 	int rdp_height;
 	int rdp_bpp;
@@ -270,6 +287,8 @@ UINT32 rdpup_convert_opcode(int opcode);
 UINT32 rdp_dstblt_rop(int opcode);
 int rdpup_init(void);
 int rdpup_check(void);
+int rdpup_flush(void);
+int rdpup_pending(void);
 int rdpup_begin_update(void);
 int rdpup_end_update(void);
 int rdpup_check_attach_framebuffer();
@@ -49,6 +49,7 @@ static void rdpPutImageOrg(DrawablePtr pDst, GCPtr pGC, int depth, int x, int y,
 void rdpPutImage(DrawablePtr pDst, GCPtr pGC, int depth, int x, int y, int w, int h, int leftPad, int format, char *pBits)
 {
 	RegionRec clip_reg;
+	RegionRec box_reg;
 	int cd;
 	int j;
 	int post_process;
@@ -99,14 +100,21 @@ void rdpPutImage(DrawablePtr pDst, GCPtr pGC, int depth, int x, int y, int w, in
 	{
 		rdpup_begin_update();
 
+		/* only the visible part of the image, not all of it once per clip rect */
+		box.x1 = pDst->x + x;
+		box.y1 = pDst->y + y;
+		box.x2 = box.x1 + w;
+		box.y2 = box.y1 + h;
+		RegionInit(&box_reg, &box, 0);
+		RegionIntersect(&clip_reg, &clip_reg, &box_reg);
+
 		for (j = REGION_NUM_RECTS(&clip_reg) - 1; j >= 0; j--)
 		{
 			box = REGION_RECTS(&clip_reg)[j];
-			rdpup_set_clip(box.x1, box.y1, (box.x2 - box.x1), (box.y2 - box.y1));
-			rdpup_send_area(pDst->x + x, pDst->y + y, w, h);
+			rdpup_send_area(box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1);
 		}
 
-		rdpup_reset_clip();
+		RegionUninit(&box_reg);
 		rdpup_end_update();
 	}
 
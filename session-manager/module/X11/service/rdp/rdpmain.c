@@ -177,6 +177,11 @@ static void rdpWakeupHandler(ScreenPtr pScreen, unsigned long result, pointer pR
 
 static void rdpBlockHandler1(pointer blockData, OSTimePtr pTimeout, pointer pReadmask)
 {
+	rdpup_flush();
+
+	/* the pipe is only watched for reading, come back to finish writing */
+	if (rdpup_pending())
+		AdjustWaitForDelay(pTimeout, RDP_OUTBOUND_RETRY_DELAY);
 }
 
 static void rdpWakeupHandler1(pointer blockData, int result, pointer pReadmask)
@@ -264,19 +269,18 @@ static Bool rdpScreenInit(ScreenPtr pScreen, int argc, char** argv)
 
 		if (g_rdpScreen.sharedMemory)
 		{
-			/* allocate shared memory segment */
-			g_rdpScreen.segmentId = shmget(IPC_PRIVATE, g_rdpScreen.sizeInBytes,
-					IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-
-			/* attach the shared memory segment */
-			g_rdpScreen.pfbMemory = (char*) shmat(g_rdpScreen.segmentId, 0, 0);
+			/* memfd backed if possible, a shared memory segment otherwise */
+			g_rdpScreen.pfbMemory = (char*) freerds_shared_framebuffer_create(g_rdpScreen.sizeInBytes,
+					(g_rdpScreen.damageMode == RDP_DAMAGE_OPS), &g_rdpScreen.segmentId, &g_rdpScreen.fbMemFd);
 
-			ErrorF("sizeInBytes %d segmentId: %d pfbMemory: %p\n",
-					g_rdpScreen.sizeInBytes, g_rdpScreen.segmentId, g_rdpScreen.pfbMemory);
+			ErrorF("sizeInBytes %d segmentId: %d fbMemFd: %d pfbMemory: %p\n",
+					g_rdpScreen.sizeInBytes, g_rdpScreen.segmentId,
+					g_rdpScreen.fbMemFd, g_rdpScreen.pfbMemory);
 		}
 		else
 		{
 			g_rdpScreen.pfbMemory = (char*) malloc(g_rdpScreen.sizeInBytes);
+			g_rdpScreen.fbMemFd = -1;
 		}
 
 		if (!g_rdpScreen.pfbMemory)
@@ -286,6 +290,18 @@ static Bool rdpScreenInit(ScreenPtr pScreen, int argc, char** argv)
 		}
 
 		ZeroMemory(g_rdpScreen.pfbMemory, g_rdpScreen.sizeInBytes);
+
+		if (g_rdpScreen.sharedMemory && (g_rdpScreen.damageMode != RDP_DAMAGE_OPS))
+		{
+			g_rdpScreen.damage = freerds_framebuffer_damage_new((BYTE*) g_rdpScreen.pfbMemory,
+					g_rdpScreen.width, g_rdpScreen.height, g_rdpScreen.paddedWidthInBytes);
+
+			if (!g_rdpScreen.damage)
+			{
+				ErrorF("kernel damage tracking is not available, using GC op damage\n");
+				g_rdpScreen.damageMode = RDP_DAMAGE_OPS;
+			}
+		}
 	}
 
 	miClearVisualTypes();
@@ -604,6 +620,28 @@ int ddxProcessArgument(int argc, char **argv, int i)
 		return 2;
 	}
 
+	if (strcmp(argv[i], "-damage") == 0)
+	{
+		if (i + 1 >= argc)
+		{
+			UseMsg();
+		}
+
+		if (strcmp(argv[i + 1], "ops") == 0)
+			g_rdpScreen.damageMode = RDP_DAMAGE_OPS;
+		else if (strcmp(argv[i + 1], "kernel") == 0)
+			g_rdpScreen.damageMode = RDP_DAMAGE_KERNEL;
+		else if (strcmp(argv[i + 1], "check") == 0)
+			g_rdpScreen.damageMode = RDP_DAMAGE_CHECK;
+		else
+		{
+			ErrorF("Invalid damage source %s\n", argv[i + 1]);
+			UseMsg();
+		}
+
+		return 2;
+	}
+
 	return 0;
 }
 
@@ -714,14 +752,14 @@ void ddxGiveUp(enum ExitCode error)
 
 	ErrorF("ddxGiveUp:\n");
 
+	freerds_framebuffer_damage_free(g_rdpScreen.damage);
+	g_rdpScreen.damage = NULL;
+
 	if (g_rdpScreen.sharedMemory)
 	{
-		/* detach shared memory segment */
-		shmdt(g_rdpScreen.pfbMemory);
+		freerds_shared_framebuffer_destroy((BYTE*) g_rdpScreen.pfbMemory, g_rdpScreen.sizeInBytes,
+				g_rdpScreen.segmentId, g_rdpScreen.fbMemFd);
 		g_rdpScreen.pfbMemory = NULL;
-
-		/* deallocate shared memory segment */
-		shmctl(g_rdpScreen.segmentId, IPC_RMID, 0);
 	}
 	else
 	{
@@ -775,6 +813,12 @@ void ddxUseMsg(void)
 	ErrorF("X11rdp specific options\n");
 	ErrorF("-geometry WxH          set framebuffer width & height\n");
 	ErrorF("-depth D               set framebuffer depth\n");
+	ErrorF("-damage ops|kernel|check\n");
+	ErrorF("                       take damage from GC ops, from the kernel's\n");
+	ErrorF("                       soft-dirty bits or compare the two; kernel\n");
+	ErrorF("                       damage write-protects the whole server heap\n");
+	ErrorF("                       on every collection and costs a fault on the\n");
+	ErrorF("                       first write to each page after it\n");
 	ErrorF("\n");
 	exit(1);
 }
@@ -40,6 +40,12 @@ static int g_connected = 0;
 static int g_button_mask = 0;
 static BYTE* pfbBackBufferMemory = NULL;
 
+/* damage accumulated until the block handler sends it from the framebuffer */
+static int g_deferring = 0;
+static RegionRec g_screenDamage;
+
+static RegionRec g_reportedRows;
+
 extern ScreenPtr g_pScreen;
 extern int g_Bpp;
 extern int g_Bpp_mask;
@@ -232,6 +238,158 @@ int rdpup_end_update(void)
 	return 0;
 }
 
+/**
+ * A screen copy from pixels whose damage has not been sent yet would copy
+ * stale pixels on the client. The kernel is only asked about damage from
+ * the block handler, so with it every screen copy is suspect.
+ */
+
+static int rdpup_screen_blt_reads_damage(RDS_MSG_COMMON* msg)
+{
+	int status;
+	BoxRec box;
+	RegionRec src;
+	RDS_MSG_SCREEN_BLT* screenBlt;
+
+	if (msg->type != RDS_SERVER_SCREEN_BLT)
+		return 0;
+
+	if (g_rdpScreen.damageMode == RDP_DAMAGE_KERNEL)
+		return 1;
+
+	if (!RegionNotEmpty(&g_screenDamage))
+		return 0;
+
+	screenBlt = (RDS_MSG_SCREEN_BLT*) msg;
+
+	box.x1 = screenBlt->nXSrc;
+	box.y1 = screenBlt->nYSrc;
+	box.x2 = screenBlt->nXSrc + screenBlt->nWidth;
+	box.y2 = screenBlt->nYSrc + screenBlt->nHeight;
+
+	RegionInit(&src, &box, 0);
+	RegionIntersect(&src, &src, &g_screenDamage);
+	status = RegionNotEmpty(&src);
+	RegionUninit(&src);
+
+	return status;
+}
+
+/**
+ * While freerds is not keeping up with the pipe, drawing orders are folded
+ * into the damage region instead of queueing behind each other. The region
+ * is sent from the shared framebuffer once the outbound queue has drained,
+ * clipping changes meanwhile are dropped since no order is using them.
+ * Screen copies reading from damage are folded into it as well.
+ */
+
+static int rdpup_defer_update(RDS_MSG_COMMON* msg)
+{
+	BoxRec box;
+	RegionRec reg;
+	int backedUp = 0;
+	rdsModuleConnector* connector = (rdsModuleConnector*) g_Service;
+
+	if (g_rdpScreen.fbAttached && (g_deferring || freerds_connector_outbound_pending(connector)))
+		backedUp = 1;
+	else if (!rdpup_screen_blt_reads_damage(msg))
+		return 0;
+
+	switch (msg->type)
+	{
+		case RDS_SERVER_SET_CLIPPING_REGION:
+			g_deferring = 1;
+			return 1;
+
+		case RDS_SERVER_PAINT_RECT:
+			{
+				RDS_MSG_PAINT_RECT* paintRect = (RDS_MSG_PAINT_RECT*) msg;
+
+				if (paintRect->bitmapDataLength)
+					return 0;
+
+				box.x1 = paintRect->nLeftRect;
+				box.y1 = paintRect->nTopRect;
+				box.x2 = paintRect->nLeftRect + paintRect->nWidth;
+				box.y2 = paintRect->nTopRect + paintRect->nHeight;
+			}
+			break;
+
+		case RDS_SERVER_OPAQUE_RECT:
+			{
+				RDS_MSG_OPAQUE_RECT* opaqueRect = (RDS_MSG_OPAQUE_RECT*) msg;
+
+				box.x1 = opaqueRect->nLeftRect;
+				box.y1 = opaqueRect->nTopRect;
+				box.x2 = opaqueRect->nLeftRect + opaqueRect->nWidth;
+				box.y2 = opaqueRect->nTopRect + opaqueRect->nHeight;
+			}
+			break;
+
+		case RDS_SERVER_SCREEN_BLT:
+			{
+				RDS_MSG_SCREEN_BLT* screenBlt = (RDS_MSG_SCREEN_BLT*) msg;
+
+				box.x1 = screenBlt->nLeftRect;
+				box.y1 = screenBlt->nTopRect;
+				box.x2 = screenBlt->nLeftRect + screenBlt->nWidth;
+				box.y2 = screenBlt->nTopRect + screenBlt->nHeight;
+			}
+			break;
+
+		case RDS_SERVER_PATBLT:
+			{
+				RDS_MSG_PATBLT* patblt = (RDS_MSG_PATBLT*) msg;
+
+				box.x1 = patblt->nLeftRect;
+				box.y1 = patblt->nTopRect;
+				box.x2 = patblt->nLeftRect + patblt->nWidth;
+				box.y2 = patblt->nTopRect + patblt->nHeight;
+			}
+			break;
+
+		case RDS_SERVER_DSTBLT:
+			{
+				RDS_MSG_DSTBLT* dstblt = (RDS_MSG_DSTBLT*) msg;
+
+				box.x1 = dstblt->nLeftRect;
+				box.y1 = dstblt->nTopRect;
+				box.x2 = dstblt->nLeftRect + dstblt->nWidth;
+				box.y2 = dstblt->nTopRect + dstblt->nHeight;
+			}
+			break;
+
+		case RDS_SERVER_LINE_TO:
+			{
+				int width;
+				RDS_MSG_LINE_TO* lineTo = (RDS_MSG_LINE_TO*) msg;
+
+				width = lineTo->penWidth + 1;
+
+				box.x1 = min(lineTo->nXStart, lineTo->nXEnd) - width;
+				box.y1 = min(lineTo->nYStart, lineTo->nYEnd) - width;
+				box.x2 = max(lineTo->nXStart, lineTo->nXEnd) + width;
+				box.y2 = max(lineTo->nYStart, lineTo->nYEnd) + width;
+			}
+			break;
+
+		default:
+			return 0;
+	}
+
+	if (backedUp)
+		g_deferring = 1;
+
+	if ((box.x2 <= box.x1) || (box.y2 <= box.y1))
+		return 1;
+
+	RegionInit(&reg, &box, 0);
+	RegionUnion(&g_screenDamage, &g_screenDamage, &reg);
+	RegionUninit(&reg);
+
+	return 1;
+}
+
 int rdpup_update(RDS_MSG_COMMON* msg)
 {
 	int status;
@@ -245,6 +403,9 @@ int rdpup_update(RDS_MSG_COMMON* msg)
 			return 0;
 		}
 
+		if (rdpup_defer_update(msg))
+			return 0;
+
 		status = freerds_server_outbound_write_message(connector, (RDS_MSG_COMMON*) msg);
 
 		LLOGLN(0, ("rdpup_update: adding %s message (%d)", freerds_server_message_name(msg->type), msg->type));
@@ -270,6 +431,8 @@ int rdpup_check_attach_framebuffer()
 		msg.segmentId = g_rdpScreen.segmentId;
 		msg.bitsPerPixel = g_rdpScreen.depth;
 		msg.bytesPerPixel = g_Bpp;
+		msg.flags = (g_rdpScreen.fbMemFd >= 0) ? RDS_SHARED_FRAMEBUFFER_MEMFD : 0;
+		msg.fd = g_rdpScreen.fbMemFd;
 
 		msg.type = RDS_SERVER_SHARED_FRAMEBUFFER;
 		rdpup_update((RDS_MSG_COMMON*) &msg);
@@ -383,7 +546,7 @@ int rdpup_set_pointer(RDS_MSG_SET_POINTER* msg)
 	return 0;
 }
 
-void rdpup_send_area(int x, int y, int w, int h)
+static void rdpup_send_framebuffer_area(int x, int y, int w, int h)
 {
 	int bitmapLength;
 	RDS_MSG_PAINT_RECT msg;
@@ -435,6 +598,8 @@ void rdpup_send_area(int x, int y, int w, int h)
 		msg.segmentId = g_rdpScreen.segmentId;
 		msg.bitsPerPixel = g_rdpScreen.depth;
 		msg.bytesPerPixel = g_Bpp;
+		msg.flags = (g_rdpScreen.fbMemFd >= 0) ? RDS_SHARED_FRAMEBUFFER_MEMFD : 0;
+		msg.fd = g_rdpScreen.fbMemFd;
 
 		msg.type = RDS_SERVER_SHARED_FRAMEBUFFER;
 		rdpup_update((RDS_MSG_COMMON*) &msg);
@@ -457,6 +622,42 @@ void rdpup_send_area(int x, int y, int w, int h)
 	rdpup_update((RDS_MSG_COMMON*) &msg);
 }
 
+/**
+ * Damage reported by the GC op wrappers, accumulated until the block
+ * handler. With kernel damage tracking it is left to the kernel, when
+ * checking it is also compared to what the kernel saw being written.
+ */
+
+void rdpup_send_area(int x, int y, int w, int h)
+{
+	BoxRec box;
+	RegionRec reg;
+
+	if ((g_rdpScreen.damageMode == RDP_DAMAGE_KERNEL) || (w <= 0) || (h <= 0))
+		return;
+
+	if (g_rdpScreen.damageMode == RDP_DAMAGE_CHECK)
+	{
+		box.x1 = 0;
+		box.y1 = y;
+		box.x2 = g_rdpScreen.width;
+		box.y2 = y + h;
+
+		RegionInit(&reg, &box, 0);
+		RegionUnion(&g_reportedRows, &g_reportedRows, &reg);
+		RegionUninit(&reg);
+	}
+
+	box.x1 = x;
+	box.y1 = y;
+	box.x2 = x + w;
+	box.y2 = y + h;
+
+	RegionInit(&reg, &box, 0);
+	RegionUnion(&g_screenDamage, &g_screenDamage, &reg);
+	RegionUninit(&reg);
+}
+
 void rdpup_shared_framebuffer(RDS_MSG_SHARED_FRAMEBUFFER* msg)
 {
 	msg->type = RDS_SERVER_SHARED_FRAMEBUFFER;
@@ -692,6 +893,21 @@ int rds_service_accept(rdsService* service)
 	g_rdpScreen.fbAttached = 0;
 	AddEnabledDevice(g_clientfd);
 
+	/* whatever was waiting was meant for the previous client */
+	g_deferring = 0;
+	RegionEmpty(&g_screenDamage);
+	RegionEmpty(&g_reportedRows);
+
+	if (connector->OutboundPending)
+		Stream_SetPosition(connector->OutboundPending, 0);
+
+	connector->OutboundStallStart = 0;
+	connector->OutboundPendingPipe = 0;
+	connector->OutboundFdCount = 0;
+
+	if (freerds_shm_transport_offer(connector) < 0)
+		LLOGLN(0, ("rds_service_accept: failed to send the transport offer"));
+
 	fprintf(stderr, "RdsServiceAccept\n");
 
 	return 0;
@@ -730,6 +946,12 @@ int rdpup_init(void)
 		connector->client->MouseEvent = rds_client_mouse_event;
 		connector->client->ExtendedMouseEvent = rds_client_extended_mouse_event;
 
+		connector->OutboundBatching = TRUE;
+		connector->OutboundNonBlocking = TRUE;
+
+		RegionInit(&g_screenDamage, NullBox, 0);
+		RegionInit(&g_reportedRows, NullBox, 0);
+
 		connector->hServerPipe = freerds_named_pipe_create_endpoint(connector->SessionId, connector->Endpoint);
 		connector->hClientPipe = freerds_named_pipe_accept(connector->hServerPipe);
 		service->Accept(service);
@@ -738,6 +960,193 @@ int rdpup_init(void)
 	return 1;
 }
 
+/**
+ * Sends the accumulated damage, as its extents when it is made of too many
+ * rectangles or when they cover most of the extents anyway.
+ */
+
+static void rdpup_send_screen_damage(void)
+{
+	int index;
+	int count;
+	INT64 area;
+	INT64 extentsArea;
+	BoxPtr boxes;
+	BoxPtr extents;
+	RegionRec damage;
+
+	RegionInit(&damage, NullBox, 0);
+	RegionCopy(&damage, &g_screenDamage);
+	RegionEmpty(&g_screenDamage);
+
+	count = RegionNumRects(&damage);
+	boxes = RegionRects(&damage);
+
+	if (count > 1)
+	{
+		area = 0;
+		extents = RegionExtents(&damage);
+		extentsArea = ((INT64) (extents->x2 - extents->x1)) * (extents->y2 - extents->y1);
+
+		for (index = 0; index < count; index++)
+			area += ((INT64) (boxes[index].x2 - boxes[index].x1)) * (boxes[index].y2 - boxes[index].y1);
+
+		if ((count > RDP_MAX_DAMAGE_RECTS) || ((area * 100) >= (extentsArea * RDP_DAMAGE_EXTENTS_COVERAGE)))
+		{
+			count = 1;
+			boxes = extents;
+		}
+	}
+
+	for (index = 0; index < count; index++)
+	{
+		rdpup_send_framebuffer_area(boxes[index].x1, boxes[index].y1,
+				boxes[index].x2 - boxes[index].x1, boxes[index].y2 - boxes[index].y1);
+	}
+
+	RegionUninit(&damage);
+}
+
+/**
+ * Logs the rows the kernel saw written without the GC op wrappers having
+ * reported anything on them, and the reported rows nothing was written to.
+ * Bands are whole pages wide, only bands without any reported row in them
+ * count as missed.
+ */
+
+static void rdpup_check_damage(RDS_RECT* bands, int count)
+{
+	int index;
+	int missed = 0;
+	int wasted = 0;
+	BoxRec box;
+	BoxPtr boxes;
+	RegionRec band;
+	RegionRec written;
+	RegionRec overlap;
+
+	RegionInit(&written, NullBox, 0);
+	RegionInit(&overlap, NullBox, 0);
+
+	for (index = 0; index < count; index++)
+	{
+		box.x1 = 0;
+		box.y1 = bands[index].y;
+		box.x2 = g_rdpScreen.width;
+		box.y2 = bands[index].y + bands[index].height;
+
+		RegionInit(&band, &box, 0);
+
+		RegionIntersect(&overlap, &band, &g_reportedRows);
+
+		if (!RegionNotEmpty(&overlap))
+			missed += bands[index].height;
+
+		RegionUnion(&written, &written, &band);
+		RegionUninit(&band);
+	}
+
+	RegionSubtract(&overlap, &g_reportedRows, &written);
+
+	boxes = RegionRects(&overlap);
+
+	for (index = 0; index < RegionNumRects(&overlap); index++)
+		wasted += boxes[index].y2 - boxes[index].y1;
+
+	if (missed || wasted)
+	{
+		LLOGLN(0, ("rdpup_check_damage: %d written rows not reported, %d reported rows not written",
+				missed, wasted));
+	}
+
+	RegionEmpty(&g_reportedRows);
+
+	RegionUninit(&overlap);
+	RegionUninit(&written);
+}
+
+/**
+ * Asks the kernel which framebuffer rows were written since the last time,
+ * either adding them to the damage or checking the GC op damage against them.
+ */
+
+static void rdpup_collect_kernel_damage(void)
+{
+	int index;
+	int count;
+	BoxRec box;
+	RegionRec reg;
+	RDS_RECT bands[RDP_MAX_KERNEL_DAMAGE_BANDS];
+
+	count = freerds_framebuffer_damage_collect(g_rdpScreen.damage, bands, RDP_MAX_KERNEL_DAMAGE_BANDS);
+
+	if (count < 0)
+		return;
+
+	if (g_rdpScreen.damageMode == RDP_DAMAGE_CHECK)
+	{
+		rdpup_check_damage(bands, count);
+		return;
+	}
+
+	for (index = 0; index < count; index++)
+	{
+		box.x1 = bands[index].x;
+		box.y1 = bands[index].y;
+		box.x2 = bands[index].x + bands[index].width;
+		box.y2 = bands[index].y + bands[index].height;
+
+		RegionInit(&reg, &box, 0);
+		RegionUnion(&g_screenDamage, &g_screenDamage, &reg);
+		RegionUninit(&reg);
+	}
+}
+
+int rdpup_flush(void)
+{
+	int status;
+	rdsModuleConnector* connector = (rdsModuleConnector*) g_Service;
+
+	if (!g_connected)
+		return 0;
+
+	status = freerds_connector_outbound_flush(connector);
+
+	/* while backed up damage and dirty bits keep accumulating */
+	if ((status < 0) || freerds_connector_outbound_pending(connector))
+		return status;
+
+	if (g_rdpScreen.damage)
+		rdpup_collect_kernel_damage();
+
+	if (g_deferring)
+	{
+		g_deferring = 0;
+
+		/* clipping changes were dropped, start over from no clipping */
+		rdpup_reset_clip();
+	}
+
+	if (RegionNotEmpty(&g_screenDamage))
+		rdpup_send_screen_damage();
+
+	return freerds_connector_outbound_flush(connector);
+}
+
+/**
+ * Non-zero while outbound data or damage is waiting for freerds to catch up.
+ */
+
+int rdpup_pending(void)
+{
+	rdsModuleConnector* connector = (rdsModuleConnector*) g_Service;
+
+	if (!g_connected)
+		return 0;
+
+	return (freerds_connector_outbound_pending(connector) > 0) || g_deferring;
+}
+
 int rdpup_check(void)
 {
 	rdsModuleConnector* connector;
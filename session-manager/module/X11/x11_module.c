@@ -19,6 +19,10 @@
  * limitations under the License.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -26,6 +30,9 @@
 #include <pwd.h>
 #include <grp.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,6 +44,11 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/sched.h>
+#endif
+
 #include <winpr/crt.h>
 #include <winpr/pipe.h>
 #include <winpr/path.h>
@@ -49,6 +61,12 @@
 
 #include "x11_module.h"
 
+#if defined(__NR_clone3) && defined(CLONE_INTO_CGROUP)
+#define X11_RDS_MODULE_CLONE_INTO_CGROUP	1
+#endif
+
+extern char** environ;
+
 pgetPropertyBool gGetPropertyBool;
 pgetPropertyNumber gGetPropertyNumber;
 pgetPropertyString gGetPropertyString;
@@ -102,6 +120,166 @@ void x11_rds_module_free(RDS_MODULE_COMMON * module)
 	free(module);
 }
 
+/**
+ * Moves a process started for the session into the cgroup of the session,
+ * what it starts from then on is placed there by the kernel. Only used when
+ * the process could not be cloned into the cgroup: anything it forks before
+ * it is moved stays outside.
+ */
+
+static int x11_rds_module_attach_cgroup(rdsModuleX11* x11, DWORD processId)
+{
+	int fd;
+	int length;
+	char path[512];
+	char value[32];
+
+	if (!x11->commonModule.cgroupPath || !processId)
+		return 0;
+
+	sprintf_s(path, sizeof(path), "%s/cgroup.procs", x11->commonModule.cgroupPath);
+	length = sprintf_s(value, sizeof(value), "%d", (int) processId);
+
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+
+	if ((fd < 0) || (write(fd, value, length) != length))
+	{
+		fprintf(stderr, "Failed to move process %d into %s: %s\n", (int) processId,
+				x11->commonModule.cgroupPath, strerror(errno));
+
+		if (fd >= 0)
+			close(fd);
+
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+/**
+ * Starts a process right inside the cgroup of the session, as the user
+ * if pwnam is set, with clone3(CLONE_INTO_CGROUP) from Linux 5.7 on.
+ * CreateProcess gives no hook between fork and exec, so a process it starts
+ * is only moved into the cgroup after it runs. Returns the process id, or 0
+ * when the process has to be started with CreateProcess instead.
+ */
+
+static pid_t x11_rds_module_spawn(rdsModuleX11* x11, struct passwd* pwnam, const char* commandLine)
+{
+#ifdef X11_RDS_MODULE_CLONE_INTO_CGROUP
+	int fd;
+	int argc;
+	int envc;
+	int maxfd;
+	int ngroups;
+	pid_t pid;
+	char* env;
+	char** argv;
+	char** envp;
+	gid_t* groups;
+	struct clone_args args;
+
+	if (!x11->commonModule.cgroupPath)
+		return 0;
+
+	argv = CommandLineToArgvA(commandLine, &argc);
+
+	if (!argv || (argc < 1))
+	{
+		free(argv);
+		return 0;
+	}
+
+	/* everything the child needs is set up here, it may not allocate */
+	envp = environ;
+	env = *(x11->commonModule.envBlock);
+
+	if (env)
+	{
+		for (envc = 0; *env; env += strlen(env) + 1)
+			envc++;
+
+		envp = (char**) calloc(envc + 1, sizeof(char*));
+
+		if (!envp)
+		{
+			free(argv);
+			return 0;
+		}
+
+		for (envc = 0, env = *(x11->commonModule.envBlock); *env; env += strlen(env) + 1)
+			envp[envc++] = env;
+	}
+
+	ngroups = 0;
+	groups = NULL;
+
+	if (pwnam)
+	{
+		getgrouplist(pwnam->pw_name, pwnam->pw_gid, NULL, &ngroups);
+		groups = (gid_t*) calloc(ngroups + 1, sizeof(gid_t));
+
+		if (!groups || (getgrouplist(pwnam->pw_name, pwnam->pw_gid, groups, &ngroups) < 0))
+		{
+			ngroups = -1;
+			errno = ENOMEM;
+		}
+	}
+
+	maxfd = (int) sysconf(_SC_OPEN_MAX);
+	fd = open(x11->commonModule.cgroupPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	pid = -1;
+
+	if ((fd >= 0) && (ngroups >= 0))
+	{
+		ZeroMemory(&args, sizeof(args));
+		args.flags = CLONE_INTO_CGROUP;
+		args.exit_signal = SIGCHLD;
+		args.cgroup = (UINT64) fd;
+
+		pid = (pid_t) syscall(__NR_clone3, &args, sizeof(args));
+
+		if (pid == 0)
+		{
+			/* a copy of a multithreaded process, only async-signal-safe calls from here on */
+			if (pwnam && ((setgroups(ngroups, groups) < 0) ||
+					(setgid(pwnam->pw_gid) < 0) || (setuid(pwnam->pw_uid) < 0)))
+				_exit(127);
+
+			for (fd = 3; fd < maxfd; fd++)
+				close(fd);
+
+			execvpe(argv[0], argv, envp);
+			_exit(127);
+		}
+	}
+
+	if (pid < 0)
+	{
+		/* ENOSYS before Linux 5.3, E2BIG or EINVAL before 5.7 */
+		fprintf(stderr, "Failed to start %s in %s: %s\n", argv[0],
+				x11->commonModule.cgroupPath, strerror(errno));
+		pid = 0;
+	}
+
+	if (fd >= 0)
+		close(fd);
+
+	if (envp != environ)
+		free(envp);
+
+	free(groups);
+	free(argv);
+
+	return pid;
+#else
+	return 0;
+#endif
+}
+
 char * x11_rds_module_start(RDS_MODULE_COMMON * module)
 {
 	BOOL status;
@@ -158,9 +336,21 @@ char * x11_rds_module_start(RDS_MODULE_COMMON * module)
 	sprintf_s(lpCommandLine, sizeof(lpCommandLine), "%s :%d -geometry %dx%d -depth %d -uds -terminate",
 			"X11rdp", (int) (displayNum), xres, yres, colordepth);
 
-	status = CreateProcessA(NULL, lpCommandLine,
-			NULL, NULL, FALSE, 0, *(x11->commonModule.envBlock), NULL,
-			&(x11->X11StartupInfo), &(x11->X11ProcessInformation));
+	x11->X11ProcessInformation.dwProcessId = x11_rds_module_spawn(x11, NULL, lpCommandLine);
+
+	if (x11->X11ProcessInformation.dwProcessId)
+	{
+		status = TRUE;
+	}
+	else
+	{
+		status = CreateProcessA(NULL, lpCommandLine,
+				NULL, NULL, FALSE, 0, *(x11->commonModule.envBlock), NULL,
+				&(x11->X11StartupInfo), &(x11->X11ProcessInformation));
+
+		if (status)
+			x11_rds_module_attach_cgroup(x11, x11->X11ProcessInformation.dwProcessId);
+	}
 
 	fprintf(stderr, "Process started: %d\n", status);
 
@@ -181,10 +371,22 @@ char * x11_rds_module_start(RDS_MODULE_COMMON * module)
 	CloseHandle(hClientPipe);
 #endif
 
-	status = CreateProcessAsUserA(x11->commonModule.userToken,
-			NULL, "startwm.sh",
-			NULL, NULL, FALSE, 0, *(x11->commonModule.envBlock), NULL,
-			&(x11->WMStartupInfo), &(x11->WMProcessInformation));
+	x11->WMProcessInformation.dwProcessId = pwnam ? x11_rds_module_spawn(x11, pwnam, "startwm.sh") : 0;
+
+	if (x11->WMProcessInformation.dwProcessId)
+	{
+		status = TRUE;
+	}
+	else
+	{
+		status = CreateProcessAsUserA(x11->commonModule.userToken,
+				NULL, "startwm.sh",
+				NULL, NULL, FALSE, 0, *(x11->commonModule.envBlock), NULL,
+				&(x11->WMStartupInfo), &(x11->WMProcessInformation));
+
+		if (status)
+			x11_rds_module_attach_cgroup(x11, x11->WMProcessInformation.dwProcessId);
+	}
 
 	fprintf(stderr, "User process started: %d\n", status);
 
@@ -20,6 +20,8 @@ struct _RDS_MODULE_COMMON
 	char * userName;
 	HANDLE userToken;
 	char ** envBlock;
+	/* cgroup v2 directory of the session, NULL if not isolated, owned by the session */
+	const char * cgroupPath;
 };
 typedef struct _RDS_MODULE_COMMON RDS_MODULE_COMMON;
 
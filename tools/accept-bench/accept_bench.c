@@ -0,0 +1,249 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Listener Accept Rate Benchmark
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <winpr/crt.h>
+#include <winpr/synch.h>
+#include <winpr/thread.h>
+#include <winpr/sysinfo.h>
+
+/**
+ * Measures how fast a running freerds sets up connections on loopback.
+ * Every client thread connects, sends an X.224 connection request asking
+ * for TLS, waits for the connection confirm and closes, over and over, the
+ * way a logon storm looks to the accept path before the TLS handshake.
+ * Run it against freerds with one event shard and with several to compare
+ * a single listener with the SO_REUSEPORT ones.
+ *
+ * usage: freerds-accept-bench [<client threads> [<seconds> [<port>]]]
+ */
+
+#define ACCEPT_BENCH_THREADS	8
+#define ACCEPT_BENCH_SECONDS	10
+#define ACCEPT_BENCH_PORT	3389
+#define ACCEPT_BENCH_TIMEOUT	5000
+
+/* latency histogram buckets of 100 microseconds, the last one holds the rest */
+#define ACCEPT_BENCH_BUCKETS	1000
+
+/* TPKT, X.224 connection request, RDP negotiation request for PROTOCOL_SSL */
+static const BYTE g_ConnectionRequest[19] =
+{
+	0x03, 0x00, 0x00, 0x13,
+	0x0E, 0xE0, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x01, 0x00, 0x08, 0x00, 0x01, 0x00, 0x00, 0x00
+};
+
+#define X224_TPDU_CONNECTION_CONFIRM	0xD0
+
+struct accept_bench_client
+{
+	int port;
+	HANDLE thread;
+	DWORD deadline;
+	UINT32 connections;
+	UINT32 failures;
+	UINT32 latency[ACCEPT_BENCH_BUCKETS];
+};
+typedef struct accept_bench_client acceptBenchClient;
+
+static UINT64 accept_bench_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((UINT64) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static int accept_bench_connect(int port)
+{
+	int fd;
+	int status;
+	int option = 1;
+	BYTE buffer[64];
+	struct pollfd pfd;
+	struct linger linger;
+	struct sockaddr_in sin;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0)
+		return -1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*) &option, sizeof(option));
+
+	/* reset on close, thousands of TIME_WAIT sockets would run out of ports */
+	linger.l_onoff = 1;
+	linger.l_linger = 0;
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, (void*) &linger, sizeof(linger));
+
+	ZeroMemory(&sin, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	status = -1;
+
+	if (connect(fd, (struct sockaddr*) &sin, sizeof(sin)) < 0)
+		goto out;
+
+	if (send(fd, g_ConnectionRequest, sizeof(g_ConnectionRequest), MSG_NOSIGNAL) != sizeof(g_ConnectionRequest))
+		goto out;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	if (poll(&pfd, 1, ACCEPT_BENCH_TIMEOUT) != 1)
+		goto out;
+
+	/* the confirm fits in one segment on loopback */
+	if ((recv(fd, buffer, sizeof(buffer), 0) > 5) && (buffer[0] == 0x03) &&
+			((buffer[5] & 0xF0) == X224_TPDU_CONNECTION_CONFIRM))
+		status = 0;
+
+out:
+	close(fd);
+	return status;
+}
+
+static void* accept_bench_client_main(void* arg)
+{
+	UINT64 start;
+	UINT64 bucket;
+	acceptBenchClient* client = (acceptBenchClient*) arg;
+
+	while ((INT32) (GetTickCount() - client->deadline) < 0)
+	{
+		start = accept_bench_time_us();
+
+		if (accept_bench_connect(client->port) < 0)
+		{
+			client->failures++;
+			continue;
+		}
+
+		bucket = (accept_bench_time_us() - start) / 100;
+		client->latency[MIN(bucket, ACCEPT_BENCH_BUCKETS - 1)]++;
+		client->connections++;
+	}
+
+	return NULL;
+}
+
+/* returns the latency below which the given share of connections were set up, in microseconds */
+static int accept_bench_percentile(UINT32* latency, UINT32 total, int percent)
+{
+	int bucket;
+	UINT64 count = 0;
+
+	for (bucket = 0; bucket < ACCEPT_BENCH_BUCKETS; bucket++)
+	{
+		count += latency[bucket];
+
+		if (count * 100 >= (UINT64) total * percent)
+			break;
+	}
+
+	return (MIN(bucket, ACCEPT_BENCH_BUCKETS - 1) + 1) * 100;
+}
+
+int main(int argc, char** argv)
+{
+	int port;
+	int index;
+	int bucket;
+	int seconds;
+	int threadCount;
+	UINT32 total = 0;
+	UINT32 failures = 0;
+	UINT32 latency[ACCEPT_BENCH_BUCKETS];
+	DWORD deadline;
+	acceptBenchClient* clients;
+
+	threadCount = (argc > 1) ? atoi(argv[1]) : ACCEPT_BENCH_THREADS;
+	seconds = (argc > 2) ? atoi(argv[2]) : ACCEPT_BENCH_SECONDS;
+	port = (argc > 3) ? atoi(argv[3]) : ACCEPT_BENCH_PORT;
+
+	if ((threadCount < 1) || (seconds < 1))
+	{
+		fprintf(stderr, "usage: %s [<client threads> [<seconds> [<port>]]]\n", argv[0]);
+		return 1;
+	}
+
+	clients = (acceptBenchClient*) calloc(threadCount, sizeof(acceptBenchClient));
+
+	if (!clients)
+		return 1;
+
+	deadline = GetTickCount() + (seconds * 1000);
+
+	for (index = 0; index < threadCount; index++)
+	{
+		clients[index].port = port;
+		clients[index].deadline = deadline;
+		clients[index].thread = CreateThread(NULL, 0,
+				(LPTHREAD_START_ROUTINE) accept_bench_client_main, &clients[index], 0, NULL);
+	}
+
+	ZeroMemory(latency, sizeof(latency));
+
+	for (index = 0; index < threadCount; index++)
+	{
+		if (clients[index].thread)
+		{
+			WaitForSingleObject(clients[index].thread, INFINITE);
+			CloseHandle(clients[index].thread);
+		}
+
+		total += clients[index].connections;
+		failures += clients[index].failures;
+
+		for (bucket = 0; bucket < ACCEPT_BENCH_BUCKETS; bucket++)
+			latency[bucket] += clients[index].latency[bucket];
+	}
+
+	free(clients);
+
+	printf("%d client threads, %d s: %d connections/s, %d failed\n", threadCount, seconds,
+			(int) (total / seconds), (int) failures);
+
+	if (total > 0)
+	{
+		printf("setup latency: p50 %d us, p99 %d us\n",
+				accept_bench_percentile(latency, total, 50),
+				accept_bench_percentile(latency, total, 99));
+	}
+
+	return (total > 0) ? 0 : 1;
+}
@@ -0,0 +1,656 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Compact Wire Format Test
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winpr/crt.h>
+#include <winpr/stream.h>
+
+#include <freerds/freerds.h>
+
+#include "compact.h"
+
+/**
+ * Checks the version 2 wire format of the module connector:
+ *
+ * - one container holding a message of every type with a field layout,
+ *   and one keeping its version 1 body, reads back as it was written;
+ * - every packed message, cut short anywhere, is rejected, with its size
+ *   left as it was or made to match what is left;
+ * - varints running past 32 bits, 'd' fields longer than the message and
+ *   otherwise inconsistent messages are rejected.
+ *
+ * usage: freerds-compact-test
+ */
+
+#define COMPACT_TEST_MAX_MESSAGES	64
+
+union compact_test_message
+{
+	RDS_MSG_COMMON common;
+	RDS_MSG_SERVER server;
+	RDS_MSG_SYNCHRONIZE_KEYBOARD_EVENT SynchronizeKeyboardEvent;
+	RDS_MSG_SCANCODE_KEYBOARD_EVENT ScancodeKeyboardEvent;
+	RDS_MSG_VIRTUAL_KEYBOARD_EVENT VirtualKeyboardEvent;
+	RDS_MSG_UNICODE_KEYBOARD_EVENT UnicodeKeyboardEvent;
+	RDS_MSG_MOUSE_EVENT MouseEvent;
+	RDS_MSG_EXTENDED_MOUSE_EVENT ExtendedMouseEvent;
+	RDS_MSG_VBLANK_EVENT VBlankEvent;
+	RDS_MSG_LOGOFF_USER LogoffUser;
+};
+typedef union compact_test_message compactTestMessage;
+
+struct compact_test_type
+{
+	UINT32 type;
+	UINT32 size;
+	BOOL packed;
+};
+typedef struct compact_test_type compactTestType;
+
+#define COMPACT_TEST_TYPE(_type, _msg, _packed)	{ _type, sizeof(_msg), _packed }
+
+/* the opaque rect is there twice, the second rect is then sent as a delta */
+static const compactTestType g_Types[] =
+{
+	COMPACT_TEST_TYPE(RDS_CLIENT_SYNCHRONIZE_KEYBOARD_EVENT, RDS_MSG_SYNCHRONIZE_KEYBOARD_EVENT, TRUE),
+	COMPACT_TEST_TYPE(RDS_CLIENT_SCANCODE_KEYBOARD_EVENT, RDS_MSG_SCANCODE_KEYBOARD_EVENT, TRUE),
+	COMPACT_TEST_TYPE(RDS_CLIENT_VIRTUAL_KEYBOARD_EVENT, RDS_MSG_VIRTUAL_KEYBOARD_EVENT, TRUE),
+	COMPACT_TEST_TYPE(RDS_CLIENT_UNICODE_KEYBOARD_EVENT, RDS_MSG_UNICODE_KEYBOARD_EVENT, TRUE),
+	COMPACT_TEST_TYPE(RDS_CLIENT_MOUSE_EVENT, RDS_MSG_MOUSE_EVENT, TRUE),
+	COMPACT_TEST_TYPE(RDS_CLIENT_EXTENDED_MOUSE_EVENT, RDS_MSG_EXTENDED_MOUSE_EVENT, TRUE),
+	COMPACT_TEST_TYPE(RDS_CLIENT_VBLANK_EVENT, RDS_MSG_VBLANK_EVENT, TRUE),
+	COMPACT_TEST_TYPE(RDS_CLIENT_SHARED_TRANSPORT, RDS_MSG_SHARED_TRANSPORT, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_BEGIN_UPDATE, RDS_MSG_BEGIN_UPDATE, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_END_UPDATE, RDS_MSG_END_UPDATE, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_BEEP, RDS_MSG_BEEP, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_SET_CLIPPING_REGION, RDS_MSG_SET_CLIPPING_REGION, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_OPAQUE_RECT, RDS_MSG_OPAQUE_RECT, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_OPAQUE_RECT, RDS_MSG_OPAQUE_RECT, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_SCREEN_BLT, RDS_MSG_SCREEN_BLT, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_PAINT_RECT, RDS_MSG_PAINT_RECT, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_DSTBLT, RDS_MSG_DSTBLT, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_LINE_TO, RDS_MSG_LINE_TO, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_CREATE_OFFSCREEN_SURFACE, RDS_MSG_CREATE_OFFSCREEN_SURFACE, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_SWITCH_OFFSCREEN_SURFACE, RDS_MSG_SWITCH_OFFSCREEN_SURFACE, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_DELETE_OFFSCREEN_SURFACE, RDS_MSG_DELETE_OFFSCREEN_SURFACE, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_PAINT_OFFSCREEN_SURFACE, RDS_MSG_PAINT_OFFSCREEN_SURFACE, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_SET_SYSTEM_POINTER, RDS_MSG_SET_SYSTEM_POINTER, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_WINDOW_DELETE, RDS_MSG_WINDOW_DELETE, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_LOGOFF_USER, RDS_MSG_LOGOFF_USER, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_SHARED_FRAMEBUFFER, RDS_MSG_SHARED_FRAMEBUFFER, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_SHARED_TRANSPORT, RDS_MSG_SHARED_TRANSPORT, TRUE),
+	COMPACT_TEST_TYPE(RDS_SERVER_SET_POINTER, RDS_MSG_SET_POINTER, FALSE),
+	{ 0, 0, FALSE }
+};
+
+/* field values, picked in turn: each varint length and both signs are covered */
+static const UINT32 g_Values[] =
+{
+	0, 1, 0x7F, 0x80, 0x3FFF, 0x4000, 0x1FFFFF, 0x200000,
+	0x0FFFFFFF, 0x10000000, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFF, 0xFFFFFF80, 0xFFFFC000, 0x12345678
+};
+
+/**
+ * Malformed messages, type and size included, all of which the reader has
+ * to reject. Types are 4 (opaque rect), 6 (paint rect), 15 (cache glyph,
+ * no field layout) and 108 (mouse event).
+ */
+
+struct compact_test_case
+{
+	const char* what;
+	UINT32 length;
+	BYTE data[24];
+};
+typedef struct compact_test_case compactTestCase;
+
+static const compactTestCase g_Cases[] =
+{
+	{ "over-long type varint", 8,
+		{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x00, 0x01, 0x02 } },
+	{ "type varint past 32 bits", 7,
+		{ 0xFF, 0xFF, 0xFF, 0xFF, 0x1F, 0x01, 0x02 } },
+	{ "type past 16 bits", 5,
+		{ 0x80, 0x80, 0x04, 0x01, 0x02 } },
+	{ "over-long size varint", 8,
+		{ 0x6C, 0x80, 0x80, 0x80, 0x80, 0x80, 0x00, 0x02 } },
+	{ "over-long field varint", 11,
+		{ 0x6C, 0x09, 0x02, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01, 0x00, 0x00 } },
+	{ "field varint past 32 bits", 10,
+		{ 0x6C, 0x08, 0x02, 0xFF, 0xFF, 0xFF, 0xFF, 0x7F, 0x00, 0x00 } },
+	{ "over-long msgFlags varint", 12,
+		{ 0x6C, 0x0A, 0x06, 0x80, 0x80, 0x80, 0x80, 0x80, 0x00, 0x00, 0x00, 0x00 } },
+	{ "over-long rect varint", 13,
+		{ 0x04, 0x0B, 0x03, 0x80, 0x80, 0x80, 0x80, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00 } },
+	{ "'d' field longer than the message", 13,
+		{ 0x06, 0x0B, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0xAA, 0xBB } },
+	{ "'d' field of 4 GB", 17,
+		{ 0x06, 0x0F, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0x0F, 0xAA, 0xBB } },
+	{ "bytes left after the last field", 7,
+		{ 0x6C, 0x05, 0x02, 0x01, 0x02, 0x03, 0x00 } },
+	{ "packed body for a type without a layout", 4,
+		{ 0x0F, 0x02, 0x02, 0x00 } },
+	{ "rect layout without a rect", 4,
+		{ 0x04, 0x02, 0x02, 0x00 } },
+	{ "rect without RDS_MSG_FLAG_RECT in msgFlags", 9,
+		{ 0x04, 0x07, 0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } },
+	{ "size past the end of the message", 6,
+		{ 0x6C, 0x09, 0x02, 0x01, 0x02, 0x03 } },
+	{ NULL, 0, { 0 } }
+};
+
+struct compact_test
+{
+	rdsModuleConnector* connector;
+	wStream* s;
+	UINT32 valueIndex;
+	compactTestMessage messages[COMPACT_TEST_MAX_MESSAGES];
+	UINT32 offsets[COMPACT_TEST_MAX_MESSAGES];
+	UINT32 lengths[COMPACT_TEST_MAX_MESSAGES];
+	BYTE bitmap[256];
+	BYTE xorMask[3 * 32 * 32];
+	BYTE andMask[32 * (32 / 8)];
+	int failures;
+};
+typedef struct compact_test compactTest;
+
+static void compact_test_check(compactTest* test, BOOL condition, const char* what)
+{
+	printf("%-56s %s\n", what, condition ? "ok" : "FAILED");
+
+	if (!condition)
+		test->failures++;
+}
+
+static UINT32 compact_test_value(compactTest* test)
+{
+	return g_Values[(test->valueIndex++) % (sizeof(g_Values) / sizeof(g_Values[0]))];
+}
+
+#define COMPACT_TEST_U(_field)	(_field) = compact_test_value(test)
+#define COMPACT_TEST_I(_field)	(_field) = (INT32) compact_test_value(test)
+
+#define COMPACT_TEST_RECT(_msg) \
+	COMPACT_TEST_I((_msg)->nLeftRect); \
+	COMPACT_TEST_I((_msg)->nTopRect); \
+	COMPACT_TEST_I((_msg)->nWidth); \
+	COMPACT_TEST_I((_msg)->nHeight)
+
+/**
+ * Fills in every field the wire format carries, the others are left zero
+ * as the reader leaves them.
+ */
+
+static void compact_test_fill(compactTest* test, compactTestMessage* msg, UINT32 type)
+{
+	ZeroMemory(msg, sizeof(compactTestMessage));
+
+	msg->common.type = type;
+
+	switch (type)
+	{
+		case RDS_CLIENT_SYNCHRONIZE_KEYBOARD_EVENT:
+			COMPACT_TEST_U(msg->SynchronizeKeyboardEvent.flags);
+			break;
+
+		case RDS_CLIENT_SCANCODE_KEYBOARD_EVENT:
+			COMPACT_TEST_U(msg->ScancodeKeyboardEvent.flags);
+			COMPACT_TEST_U(msg->ScancodeKeyboardEvent.code);
+			COMPACT_TEST_U(msg->ScancodeKeyboardEvent.keyboardType);
+			break;
+
+		case RDS_CLIENT_VIRTUAL_KEYBOARD_EVENT:
+			COMPACT_TEST_U(msg->VirtualKeyboardEvent.flags);
+			COMPACT_TEST_U(msg->VirtualKeyboardEvent.code);
+			break;
+
+		case RDS_CLIENT_UNICODE_KEYBOARD_EVENT:
+			COMPACT_TEST_U(msg->UnicodeKeyboardEvent.flags);
+			COMPACT_TEST_U(msg->UnicodeKeyboardEvent.code);
+			break;
+
+		case RDS_CLIENT_MOUSE_EVENT:
+			COMPACT_TEST_U(msg->MouseEvent.flags);
+			COMPACT_TEST_U(msg->MouseEvent.x);
+			COMPACT_TEST_U(msg->MouseEvent.y);
+			break;
+
+		case RDS_CLIENT_EXTENDED_MOUSE_EVENT:
+			/* msgFlags beyond the rect one go as a varint of their own */
+			msg->common.msgFlags = 0x00010000;
+			COMPACT_TEST_U(msg->ExtendedMouseEvent.flags);
+			COMPACT_TEST_U(msg->ExtendedMouseEvent.x);
+			COMPACT_TEST_U(msg->ExtendedMouseEvent.y);
+			break;
+
+		case RDS_CLIENT_SHARED_TRANSPORT:
+		case RDS_SERVER_SHARED_TRANSPORT:
+			COMPACT_TEST_U(msg->server.SharedTransport.flags);
+			COMPACT_TEST_I(msg->server.SharedTransport.segmentId);
+			COMPACT_TEST_U(msg->server.SharedTransport.ringSize);
+			COMPACT_TEST_U(msg->server.SharedTransport.version);
+			break;
+
+		case RDS_SERVER_SET_CLIPPING_REGION:
+			msg->server.SetClippingRegion.bNullRegion = TRUE;
+			COMPACT_TEST_RECT(&msg->server.SetClippingRegion);
+			break;
+
+		case RDS_SERVER_OPAQUE_RECT:
+			COMPACT_TEST_RECT(&msg->server.OpaqueRect);
+			COMPACT_TEST_U(msg->server.OpaqueRect.color);
+			break;
+
+		case RDS_SERVER_SCREEN_BLT:
+			COMPACT_TEST_RECT(&msg->server.ScreenBlt);
+			COMPACT_TEST_I(msg->server.ScreenBlt.nXSrc);
+			COMPACT_TEST_I(msg->server.ScreenBlt.nYSrc);
+			break;
+
+		case RDS_SERVER_PAINT_RECT:
+			COMPACT_TEST_RECT(&msg->server.PaintRect);
+			COMPACT_TEST_I(msg->server.PaintRect.nXSrc);
+			COMPACT_TEST_I(msg->server.PaintRect.nYSrc);
+			COMPACT_TEST_U(msg->server.PaintRect.fbSegmentId);
+			msg->server.PaintRect.bitmapData = test->bitmap;
+			msg->server.PaintRect.bitmapDataLength = sizeof(test->bitmap);
+			break;
+
+		case RDS_SERVER_DSTBLT:
+			COMPACT_TEST_RECT(&msg->server.DstBlt);
+			COMPACT_TEST_U(msg->server.DstBlt.bRop);
+			break;
+
+		case RDS_SERVER_LINE_TO:
+			COMPACT_TEST_I(msg->server.LineTo.nXStart);
+			COMPACT_TEST_I(msg->server.LineTo.nYStart);
+			COMPACT_TEST_I(msg->server.LineTo.nXEnd);
+			COMPACT_TEST_I(msg->server.LineTo.nYEnd);
+			COMPACT_TEST_U(msg->server.LineTo.bRop2);
+			COMPACT_TEST_U(msg->server.LineTo.penStyle);
+			COMPACT_TEST_U(msg->server.LineTo.penWidth);
+			COMPACT_TEST_U(msg->server.LineTo.penColor);
+			break;
+
+		case RDS_SERVER_CREATE_OFFSCREEN_SURFACE:
+			COMPACT_TEST_U(msg->server.CreateOffscreenSurface.cacheIndex);
+			COMPACT_TEST_U(msg->server.CreateOffscreenSurface.nWidth);
+			COMPACT_TEST_U(msg->server.CreateOffscreenSurface.nHeight);
+			break;
+
+		case RDS_SERVER_SWITCH_OFFSCREEN_SURFACE:
+			COMPACT_TEST_U(msg->server.SwitchOffscreenSurface.cacheIndex);
+			break;
+
+		case RDS_SERVER_DELETE_OFFSCREEN_SURFACE:
+			COMPACT_TEST_U(msg->server.DeleteOffscreenSurface.cacheIndex);
+			break;
+
+		case RDS_SERVER_PAINT_OFFSCREEN_SURFACE:
+			COMPACT_TEST_U(msg->server.PaintOffscreenSurface.cacheIndex);
+			COMPACT_TEST_RECT(&msg->server.PaintOffscreenSurface);
+			COMPACT_TEST_I(msg->server.PaintOffscreenSurface.nXSrc);
+			COMPACT_TEST_I(msg->server.PaintOffscreenSurface.nYSrc);
+			COMPACT_TEST_U(msg->server.PaintOffscreenSurface.bRop);
+			break;
+
+		case RDS_SERVER_SET_SYSTEM_POINTER:
+			COMPACT_TEST_U(msg->server.SetSystemPointer.ptrType);
+			break;
+
+		case RDS_SERVER_WINDOW_DELETE:
+			COMPACT_TEST_U(msg->server.WindowDelete.windowId);
+			break;
+
+		case RDS_SERVER_LOGOFF_USER:
+			COMPACT_TEST_U(msg->LogoffUser.Flags);
+			break;
+
+		case RDS_SERVER_SHARED_FRAMEBUFFER:
+			COMPACT_TEST_I(msg->server.SharedFramebuffer.width);
+			COMPACT_TEST_I(msg->server.SharedFramebuffer.height);
+			COMPACT_TEST_I(msg->server.SharedFramebuffer.attach);
+			COMPACT_TEST_I(msg->server.SharedFramebuffer.scanline);
+			COMPACT_TEST_I(msg->server.SharedFramebuffer.segmentId);
+			COMPACT_TEST_I(msg->server.SharedFramebuffer.bitsPerPixel);
+			COMPACT_TEST_I(msg->server.SharedFramebuffer.bytesPerPixel);
+			COMPACT_TEST_I(msg->server.SharedFramebuffer.flags);
+			break;
+
+		case RDS_SERVER_SET_POINTER:
+			msg->server.SetPointer.xPos = 7;
+			msg->server.SetPointer.yPos = 31;
+			msg->server.SetPointer.xorBpp = 24;
+			msg->server.SetPointer.lengthXorMask = sizeof(test->xorMask);
+			msg->server.SetPointer.lengthAndMask = sizeof(test->andMask);
+			msg->server.SetPointer.xorMaskData = test->xorMask;
+			msg->server.SetPointer.andMaskData = test->andMask;
+			break;
+	}
+}
+
+/**
+ * Compares a packed message with the one written, its data pointing into
+ * the container instead.
+ */
+
+static BOOL compact_test_compare(compactTestMessage* written, compactTestMessage* read,
+		const compactTestType* type)
+{
+	compactTestMessage expected;
+
+	CopyMemory(&expected, written, sizeof(compactTestMessage));
+	expected.common.length = read->common.length;
+
+	if (type->type == RDS_SERVER_PAINT_RECT)
+	{
+		if ((read->server.PaintRect.bitmapDataLength != written->server.PaintRect.bitmapDataLength) ||
+				!read->server.PaintRect.bitmapData ||
+				(memcmp(read->server.PaintRect.bitmapData, written->server.PaintRect.bitmapData,
+						written->server.PaintRect.bitmapDataLength) != 0))
+			return FALSE;
+
+		expected.server.PaintRect.bitmapData = read->server.PaintRect.bitmapData;
+	}
+
+	return (memcmp(&expected, read, type->size) == 0) ? TRUE : FALSE;
+}
+
+/**
+ * A message keeping its version 1 body is read the way the transport does,
+ * with the version 1 reader of the message over the body.
+ */
+
+static BOOL compact_test_compare_body(compactTest* test, compactTestMessage* written,
+		compactTestMessage* read, BYTE* data, UINT32 length, UINT32 bodyOffset)
+{
+	BOOL match;
+	wStream* s;
+	RDS_MSG_SET_POINTER* pointer;
+
+	if (bodyOffset > length)
+		return FALSE;
+
+	s = Stream_New(&data[bodyOffset], length - bodyOffset);
+
+	if (!s)
+		return FALSE;
+
+	match = (freerds_server_message_read(s, &read->common) == 0) &&
+			(Stream_GetRemainingLength(s) == 0) ? TRUE : FALSE;
+
+	Stream_Free(s, FALSE);
+
+	if (!match)
+		return FALSE;
+
+	pointer = &read->server.SetPointer;
+
+	return ((pointer->xPos == written->server.SetPointer.xPos) &&
+			(pointer->yPos == written->server.SetPointer.yPos) &&
+			(pointer->xorBpp == written->server.SetPointer.xorBpp) &&
+			(pointer->lengthXorMask == sizeof(test->xorMask)) &&
+			(pointer->lengthAndMask == sizeof(test->andMask)) &&
+			(memcmp(pointer->xorMaskData, test->xorMask, sizeof(test->xorMask)) == 0) &&
+			(memcmp(pointer->andMaskData, test->andMask, sizeof(test->andMask)) == 0)) ? TRUE : FALSE;
+}
+
+static int compact_test_round_trip(compactTest* test)
+{
+	int index;
+	int status;
+	UINT32 end;
+	UINT32 offset;
+	UINT32 bodyOffset;
+	UINT32 containerLength;
+	BYTE* buffer;
+	BOOL written = TRUE;
+	BOOL framed = TRUE;
+	BOOL matched = TRUE;
+	compactTestMessage msg;
+	const compactTestType* type;
+
+	Stream_SetPosition(test->s, 0);
+	freerds_compact_begin(test->connector, test->s);
+
+	for (type = g_Types, index = 0; type->type; type++, index++)
+	{
+		compact_test_fill(test, &test->messages[index], type->type);
+
+		if (freerds_compact_write_message(test->connector, test->s, &test->messages[index].common) <= 0)
+			written = FALSE;
+	}
+
+	freerds_compact_end(test->connector, test->s);
+
+	compact_test_check(test, written, "every message type is written");
+
+	buffer = Stream_Buffer(test->s);
+	end = (UINT32) Stream_GetPosition(test->s);
+
+	if ((freerds_compact_peek_container(buffer, end, &containerLength) != 1) || (containerLength != end))
+	{
+		compact_test_check(test, FALSE, "container length matches what was written");
+		return -1;
+	}
+
+	ZeroMemory(&test->connector->InboundRect, sizeof(RDS_RECT));
+
+	offset = RDS_COMPACT_CONTAINER_HEADER_LENGTH;
+
+	for (type = g_Types, index = 0; type->type; type++, index++)
+	{
+		if ((offset >= end) || (freerds_compact_peek_length(&buffer[offset], end - offset,
+				&test->lengths[index]) != 1) || (test->lengths[index] > (end - offset)))
+		{
+			framed = FALSE;
+			break;
+		}
+
+		test->offsets[index] = offset;
+
+		status = freerds_compact_read_message(test->connector, &buffer[offset], test->lengths[index],
+				&msg.common, &bodyOffset);
+
+		if (status != (type->packed ? 1 : 0))
+		{
+			fprintf(stderr, "message type %d: read returned %d\n", (int) type->type, status);
+			matched = FALSE;
+		}
+		else if (type->packed && !compact_test_compare(&test->messages[index], &msg, type))
+		{
+			fprintf(stderr, "message type %d: fields differ\n", (int) type->type);
+			matched = FALSE;
+		}
+		else if (!type->packed && !compact_test_compare_body(test, &test->messages[index], &msg,
+				&buffer[offset], test->lengths[index], bodyOffset))
+		{
+			fprintf(stderr, "message type %d: version 1 body differs\n", (int) type->type);
+			matched = FALSE;
+		}
+
+		offset += test->lengths[index];
+	}
+
+	compact_test_check(test, framed && (offset == end), "container splits into the messages written");
+	compact_test_check(test, matched, "every message type reads back as written");
+
+	return (framed && matched) ? 0 : -1;
+}
+
+static int compact_test_read(compactTest* test, BYTE* data, UINT32 length)
+{
+	UINT32 bodyOffset;
+	compactTestMessage msg;
+
+	ZeroMemory(&test->connector->InboundRect, sizeof(RDS_RECT));
+
+	return freerds_compact_read_message(test->connector, data, length, &msg.common, &bodyOffset);
+}
+
+static UINT32 compact_test_varint(BYTE* dst, UINT32 value)
+{
+	UINT32 count = 0;
+
+	while (value >= 0x80)
+	{
+		dst[count++] = (BYTE) (value | 0x80);
+		value >>= 7;
+	}
+
+	dst[count++] = (BYTE) value;
+
+	return count;
+}
+
+/**
+ * Cuts every packed message of the round trip short by each possible
+ * number of bytes, once as is and once with its size rewritten to match.
+ */
+
+static void compact_test_truncated(compactTest* test)
+{
+	int index;
+	UINT32 cut;
+	UINT32 type;
+	UINT32 size;
+	UINT32 header;
+	UINT32 length;
+	UINT32 payload;
+	BYTE* data;
+	BYTE* message;
+	BOOL rejected = TRUE;
+	BOOL resizedRejected = TRUE;
+
+	data = (BYTE*) malloc(Stream_GetPosition(test->s));
+
+	if (!data)
+	{
+		compact_test_check(test, FALSE, "truncated messages are rejected");
+		return;
+	}
+
+	for (index = 0; g_Types[index].type; index++)
+	{
+		if (!g_Types[index].packed)
+			continue;
+
+		message = Stream_Buffer(test->s) + test->offsets[index];
+		length = test->lengths[index];
+
+		for (cut = 1; cut < length; cut++)
+		{
+			CopyMemory(data, message, length - cut);
+
+			if (compact_test_read(test, data, length - cut) != -1)
+				rejected = FALSE;
+		}
+
+		type = g_Types[index].type;
+		header = compact_test_varint(data, type);
+		header += compact_test_varint(&data[header], length);
+		payload = length - header;
+
+		for (cut = 1; cut <= payload; cut++)
+		{
+			size = compact_test_varint(data, type);
+			size += compact_test_varint(&data[size], payload - cut);
+			CopyMemory(&data[size], &message[header], payload - cut);
+
+			if (compact_test_read(test, data, size + payload - cut) != -1)
+			{
+				fprintf(stderr, "message type %d: accepted with %d of %d bytes\n",
+						(int) type, (int) (payload - cut), (int) payload);
+				resizedRejected = FALSE;
+			}
+		}
+	}
+
+	free(data);
+
+	compact_test_check(test, rejected, "truncated messages are rejected");
+	compact_test_check(test, resizedRejected, "truncated messages with a matching size are rejected");
+}
+
+static void compact_test_malformed(compactTest* test)
+{
+	const compactTestCase* testCase;
+	BYTE data[sizeof(testCase->data)];
+
+	for (testCase = g_Cases; testCase->what; testCase++)
+	{
+		/* a copy, the reader is handed writable buffers */
+		CopyMemory(data, testCase->data, testCase->length);
+
+		compact_test_check(test, compact_test_read(test, data, testCase->length) == -1, testCase->what);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	UINT32 index;
+	compactTest* test;
+	int failures;
+
+	test = (compactTest*) calloc(1, sizeof(compactTest));
+
+	if (!test)
+		return 1;
+
+	test->connector = (rdsModuleConnector*) calloc(1, sizeof(rdsModuleConnector));
+	test->s = Stream_New(NULL, 1024);
+
+	if (!test->connector || !test->s)
+		return 1;
+
+	/* messages without a field layout are written through it */
+	test->connector->EncodeStream = Stream_New(NULL, 1024);
+
+	if (!test->connector->EncodeStream)
+		return 1;
+
+	for (index = 0; index < sizeof(test->bitmap); index++)
+		test->bitmap[index] = (BYTE) (index * 7);
+
+	for (index = 0; index < sizeof(test->xorMask); index++)
+		test->xorMask[index] = (BYTE) (index * 13);
+
+	for (index = 0; index < sizeof(test->andMask); index++)
+		test->andMask[index] = (BYTE) ~index;
+
+	if (compact_test_round_trip(test) == 0)
+		compact_test_truncated(test);
+
+	compact_test_malformed(test);
+
+	failures = test->failures;
+
+	Stream_Free(test->connector->EncodeStream, TRUE);
+	Stream_Free(test->s, TRUE);
+	free(test->connector);
+	free(test);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,238 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Color Conversion Benchmark
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winpr/crt.h>
+#include <winpr/sysinfo.h>
+
+#include <pixman.h>
+
+#include "convert.h"
+
+/**
+ * Cuts a framebuffer into 64x64 tiles the way freerds_send_bitmap_update
+ * does and converts each one to r5g6b5, first with the per-tile pixman
+ * image and PIXMAN_OP_OVER composite the bitmap path used to do, then with
+ * every conversion kernel this processor supports. Each kernel has to
+ * match the pixman output before its tiles per second are reported.
+ *
+ * usage: freerds-convert-bench [<width> <height>]
+ */
+
+#define CONVERT_BENCH_DURATION	1000
+
+struct convert_bench
+{
+	int width;
+	int height;
+	int scanline;
+	BYTE* framebuffer;
+	pixman_image_t* fbImage;
+	BYTE* reference;
+	BYTE* tiles;
+};
+typedef struct convert_bench convertBench;
+
+static void convert_bench_synthesize(convertBench* bench)
+{
+	int x, y;
+	UINT32 seed = 1;
+	UINT32* row;
+
+	for (y = 0; y < bench->height; y++)
+	{
+		row = (UINT32*) &bench->framebuffer[y * bench->scanline];
+
+		for (x = 0; x < bench->width; x++)
+		{
+			seed = seed * 1103515245 + 12345;
+
+			/* the alpha byte of the shared framebuffer is undefined, do not rely on it */
+			row[x] = seed;
+		}
+	}
+}
+
+/* the bitmap path before the conversion kernels, one image and buffer per tile */
+static void convert_bench_pixman(convertBench* bench, BYTE* dst)
+{
+	int x, y;
+	int nWidth, nHeight;
+	BYTE* tile;
+	pixman_image_t* image;
+
+	for (y = 0; y < bench->height; y += 64)
+	{
+		for (x = 0; x < bench->width; x += 64)
+		{
+			nWidth = MIN(64, bench->width - x);
+			nHeight = MIN(64, bench->height - y);
+
+			tile = (BYTE*) malloc(64 * 64 * 4);
+
+			image = pixman_image_create_bits(PIXMAN_r5g6b5, nWidth, nHeight, (uint32_t*) tile, nWidth * 2);
+
+			pixman_image_composite(PIXMAN_OP_OVER, bench->fbImage, NULL, image,
+					x, y, 0, 0, 0, 0, nWidth, nHeight);
+
+			CopyMemory(dst, pixman_image_get_data(image), nWidth * nHeight * 2);
+			dst += nWidth * nHeight * 2;
+
+			pixman_image_unref(image);
+			free(tile);
+		}
+	}
+}
+
+static void convert_bench_kernel(convertBench* bench, pfnFreeRDSConvertTile kernel, BYTE* dst)
+{
+	int x, y;
+	int nWidth, nHeight;
+	BYTE* data;
+
+	for (y = 0; y < bench->height; y += 64)
+	{
+		for (x = 0; x < bench->width; x += 64)
+		{
+			nWidth = MIN(64, bench->width - x);
+			nHeight = MIN(64, bench->height - y);
+
+			data = &bench->framebuffer[(y * bench->scanline) + (x * 4)];
+
+			kernel(data, bench->scanline, dst, nWidth * 2, nWidth, nHeight);
+			dst += nWidth * nHeight * 2;
+		}
+	}
+}
+
+static int convert_bench_tile_count(convertBench* bench)
+{
+	return ((bench->width + 63) / 64) * ((bench->height + 63) / 64);
+}
+
+static void convert_bench_report(convertBench* bench, const char* name, UINT64 frames, DWORD elapsed)
+{
+	printf("%-8s %10d tiles/s\n", name,
+			(int) ((frames * convert_bench_tile_count(bench) * 1000) / elapsed));
+}
+
+int main(int argc, char** argv)
+{
+	int index;
+	int count;
+	int status = 0;
+	size_t size;
+	UINT64 frames;
+	DWORD start, elapsed;
+	convertBench bench;
+	const char* names[FREERDS_CONVERT_MAX_KERNELS];
+	pfnFreeRDSConvertTile kernels[FREERDS_CONVERT_MAX_KERNELS];
+
+	ZeroMemory(&bench, sizeof(bench));
+
+	bench.width = 1024;
+	bench.height = 768;
+
+	if (argc >= 3)
+	{
+		bench.width = atoi(argv[1]);
+		bench.height = atoi(argv[2]);
+	}
+
+	if ((bench.width < 1) || (bench.height < 1))
+	{
+		fprintf(stderr, "usage: %s [<width> <height>]\n", argv[0]);
+		return 1;
+	}
+
+	bench.scanline = bench.width * 4;
+	size = (size_t) bench.width * bench.height * 2;
+
+	bench.framebuffer = (BYTE*) malloc((size_t) bench.scanline * bench.height);
+	bench.reference = (BYTE*) malloc(size);
+	bench.tiles = (BYTE*) malloc(size);
+
+	if (!bench.framebuffer || !bench.reference || !bench.tiles)
+		return 1;
+
+	convert_bench_synthesize(&bench);
+
+	bench.fbImage = pixman_image_create_bits(PIXMAN_x8r8g8b8, bench.width, bench.height,
+			(uint32_t*) bench.framebuffer, bench.scanline);
+
+	printf("%dx%d framebuffer, %d tiles per frame\n", bench.width, bench.height,
+			convert_bench_tile_count(&bench));
+
+	convert_bench_pixman(&bench, bench.reference);
+
+	frames = 0;
+	start = GetTickCount();
+
+	do
+	{
+		convert_bench_pixman(&bench, bench.tiles);
+		frames++;
+		elapsed = GetTickCount() - start;
+	}
+	while (elapsed < CONVERT_BENCH_DURATION);
+
+	convert_bench_report(&bench, "pixman", frames, elapsed);
+
+	count = freerds_convert_get_kernels(names, kernels, FREERDS_CONVERT_MAX_KERNELS);
+
+	for (index = 0; index < count; index++)
+	{
+		ZeroMemory(bench.tiles, size);
+		convert_bench_kernel(&bench, kernels[index], bench.tiles);
+
+		if (memcmp(bench.tiles, bench.reference, size) != 0)
+		{
+			fprintf(stderr, "%s: %s output differs from pixman\n", __FUNCTION__, names[index]);
+			status = 1;
+			continue;
+		}
+
+		frames = 0;
+		start = GetTickCount();
+
+		do
+		{
+			convert_bench_kernel(&bench, kernels[index], bench.tiles);
+			frames++;
+			elapsed = GetTickCount() - start;
+		}
+		while (elapsed < CONVERT_BENCH_DURATION);
+
+		convert_bench_report(&bench, names[index], frames, elapsed);
+	}
+
+	pixman_image_unref(bench.fbImage);
+
+	free(bench.framebuffer);
+	free(bench.reference);
+	free(bench.tiles);
+
+	return status;
+}
@@ -0,0 +1,179 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * PAM Stub Module
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#define PAM_SM_AUTH
+#define PAM_SM_ACCOUNT
+
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+
+/**
+ * Stands in for a slow PAM backend when testing the freerds auth workers,
+ * for instance in /etc/pam.d/freerds:
+ *
+ * auth    required pam_freerds_stub.so delay=2000 password=secret
+ * account required pam_freerds_stub.so delay=100
+ *
+ * delay=<ms>    time each call takes, like a remote backend or sssd
+ * fail=<ms>     time added to a failed authentication, like pam_faildelay
+ * password=<pw> the only password accepted, any password when absent
+ */
+
+struct pam_stub_args
+{
+	long delay;
+	long fail;
+	const char* password;
+};
+typedef struct pam_stub_args pamStubArgs;
+
+static void pam_stub_parse_args(pamStubArgs* args, int argc, const char** argv)
+{
+	int index;
+
+	args->delay = 0;
+	args->fail = 0;
+	args->password = NULL;
+
+	for (index = 0; index < argc; index++)
+	{
+		if (strncmp(argv[index], "delay=", 6) == 0)
+			args->delay = strtol(&argv[index][6], NULL, 10);
+		else if (strncmp(argv[index], "fail=", 5) == 0)
+			args->fail = strtol(&argv[index][5], NULL, 10);
+		else if (strncmp(argv[index], "password=", 9) == 0)
+			args->password = &argv[index][9];
+	}
+}
+
+static void pam_stub_sleep(long milliseconds)
+{
+	struct timespec ts;
+
+	if (milliseconds <= 0)
+		return;
+
+	ts.tv_sec = milliseconds / 1000;
+	ts.tv_nsec = (milliseconds % 1000) * 1000000;
+
+	while ((nanosleep(&ts, &ts) < 0) && (errno == EINTR))
+		;
+}
+
+/* the password is asked for with the echo off prompt freerds answers */
+static int pam_stub_get_password(pam_handle_t* pamh, char** password)
+{
+	int status;
+	const void* item = NULL;
+	const struct pam_conv* conv = NULL;
+	struct pam_message message;
+	const struct pam_message* messages[1];
+	struct pam_response* response = NULL;
+
+	*password = NULL;
+
+	if ((pam_get_item(pamh, PAM_AUTHTOK, &item) == PAM_SUCCESS) && item)
+	{
+		*password = strdup((const char*) item);
+		return *password ? PAM_SUCCESS : PAM_BUF_ERR;
+	}
+
+	status = pam_get_item(pamh, PAM_CONV, (const void**) &conv);
+
+	if ((status != PAM_SUCCESS) || !conv || !conv->conv)
+		return PAM_CONV_ERR;
+
+	message.msg_style = PAM_PROMPT_ECHO_OFF;
+	message.msg = "Password: ";
+	messages[0] = &message;
+
+	status = conv->conv(1, messages, &response, conv->appdata_ptr);
+
+	if (status != PAM_SUCCESS)
+		return status;
+
+	if (!response || !response[0].resp)
+	{
+		free(response);
+		return PAM_CONV_ERR;
+	}
+
+	*password = response[0].resp;
+	free(response);
+
+	return PAM_SUCCESS;
+}
+
+PAM_EXTERN int pam_sm_authenticate(pam_handle_t* pamh, int flags, int argc, const char** argv)
+{
+	int status;
+	char* password;
+	const char* user = NULL;
+	pamStubArgs args;
+
+	pam_stub_parse_args(&args, argc, argv);
+
+	status = pam_get_user(pamh, &user, NULL);
+
+	if ((status != PAM_SUCCESS) || !user)
+		return PAM_USER_UNKNOWN;
+
+	status = pam_stub_get_password(pamh, &password);
+
+	if (status != PAM_SUCCESS)
+		return status;
+
+	pam_stub_sleep(args.delay);
+
+	if (args.password && (strcmp(password, args.password) != 0))
+		status = PAM_AUTH_ERR;
+
+	memset(password, 0, strlen(password));
+	free(password);
+
+	if (status != PAM_SUCCESS)
+		pam_stub_sleep(args.fail);
+
+	return status;
+}
+
+PAM_EXTERN int pam_sm_setcred(pam_handle_t* pamh, int flags, int argc, const char** argv)
+{
+	return PAM_SUCCESS;
+}
+
+PAM_EXTERN int pam_sm_acct_mgmt(pam_handle_t* pamh, int flags, int argc, const char** argv)
+{
+	pamStubArgs args;
+
+	pam_stub_parse_args(&args, argc, argv);
+	pam_stub_sleep(args.delay);
+
+	return PAM_SUCCESS;
+}
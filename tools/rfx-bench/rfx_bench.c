@@ -0,0 +1,429 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * RemoteFX Encoder Microbenchmark
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <winpr/crt.h>
+#include <winpr/stream.h>
+#include <winpr/sysinfo.h>
+
+#include <freerdp/primitives.h>
+#include <freerdp/codec/rfx.h>
+
+#include "rfx_simd.h"
+
+/**
+ * Encodes framebuffer captures with the kernels libfreerdp-codec selects,
+ * then again once freerds has installed its own, and reports tiles per
+ * second for the whole encoder and for each stage freerds can replace.
+ * The encoded messages of both runs are compared byte for byte.
+ *
+ * usage: freerds-rfx-bench [<width> <height> [<capture> ...]]
+ *
+ * Captures are raw XRGB32 frames of width by height pixels, as found in
+ * the shared framebuffer of a session. Without any, synthetic frames with
+ * flat areas, gradients, text-like detail and noise are encoded.
+ */
+
+#define RFX_BENCH_DURATION	2000
+#define RFX_BENCH_MAX_FRAMES	16
+
+struct rfx_bench
+{
+	int width;
+	int height;
+	int scanline;
+	int frameCount;
+	BYTE* frames[RFX_BENCH_MAX_FRAMES];
+	wStream* s;
+	BYTE* reference;
+	size_t referenceLength;
+};
+typedef struct rfx_bench rfxBench;
+
+static const UINT32 g_Quantization[10] = { 6, 6, 6, 6, 7, 7, 8, 8, 8, 9 };
+
+static UINT32 rfx_bench_random(UINT32* seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+static void rfx_bench_synthesize(rfxBench* bench, BYTE* frame, int index)
+{
+	int x, y;
+	UINT32 pixel;
+	UINT32 seed = index + 1;
+	UINT32* row;
+
+	for (y = 0; y < bench->height; y++)
+	{
+		row = (UINT32*) &frame[y * bench->scanline];
+
+		for (x = 0; x < bench->width; x++)
+		{
+			switch (((x / 256) + (y / 192) + index) % 4)
+			{
+				case 0:
+					/* window background */
+					pixel = 0xFFECE9D8;
+					break;
+
+				case 1:
+					/* gradient */
+					pixel = 0xFF000000 | ((x & 0xFF) << 16) | ((y & 0xFF) << 8) | ((x + y) & 0xFF);
+					break;
+
+				case 2:
+					/* text-like detail */
+					pixel = (rfx_bench_random(&seed) & 0x7) ? 0xFFFFFFFF : 0xFF000000;
+					break;
+
+				default:
+					/* noise */
+					pixel = 0xFF000000 | (rfx_bench_random(&seed) & 0xFFFFFF);
+					break;
+			}
+
+			row[x] = pixel;
+		}
+	}
+}
+
+static int rfx_bench_load(rfxBench* bench, const char* filename)
+{
+	FILE* fp;
+	BYTE* frame;
+	size_t size;
+
+	if (bench->frameCount >= RFX_BENCH_MAX_FRAMES)
+		return -1;
+
+	size = (size_t) bench->scanline * bench->height;
+	frame = (BYTE*) _aligned_malloc(size, 16);
+
+	if (!frame)
+		return -1;
+
+	fp = fopen(filename, "rb");
+
+	if (!fp || (fread(frame, 1, size, fp) != size))
+	{
+		fprintf(stderr, "%s: %s is not a %dx%d XRGB32 capture\n", __FUNCTION__,
+				filename, bench->width, bench->height);
+
+		if (fp)
+			fclose(fp);
+
+		_aligned_free(frame);
+		return -1;
+	}
+
+	fclose(fp);
+
+	bench->frames[bench->frameCount++] = frame;
+
+	return 0;
+}
+
+static RFX_CONTEXT* rfx_bench_context_new(rfxBench* bench, BOOL install)
+{
+	RFX_CONTEXT* context;
+
+	context = rfx_context_new(TRUE);
+
+	if (!context)
+		return NULL;
+
+	context->mode = RLGR3;
+	context->width = bench->width;
+	context->height = bench->height;
+
+	if (install)
+		freerds_rfx_simd_apply(context);
+
+	rfx_context_set_pixel_format(context, RDP_PIXEL_FORMAT_B8G8R8A8);
+
+	return context;
+}
+
+/* encodes one frame, returns the number of tiles, the messages left in bench->s */
+static int rfx_bench_encode_frame(rfxBench* bench, RFX_CONTEXT* context, BYTE* frame)
+{
+	int i;
+	int tiles = 0;
+	int numMessages = 0;
+	RFX_RECT rect;
+	RFX_MESSAGE* messages;
+
+	rect.x = 0;
+	rect.y = 0;
+	rect.width = bench->width;
+	rect.height = bench->height;
+
+	messages = rfx_encode_messages(context, &rect, 1, frame, bench->width, bench->height,
+			bench->scanline, &numMessages, 0x3F0000);
+
+	if (!messages)
+		return -1;
+
+	Stream_SetPosition(bench->s, 0);
+
+	for (i = 0; i < numMessages; i++)
+	{
+		tiles += messages[i].numTiles;
+
+		Stream_EnsureRemainingCapacity(bench->s, 0x3F0000);
+		rfx_write_message(context, bench->s, &messages[i]);
+		rfx_message_free(context, &messages[i]);
+	}
+
+	free(messages);
+
+	return tiles;
+}
+
+static int rfx_bench_encode(rfxBench* bench, RFX_CONTEXT* context, const char* name)
+{
+	int frame;
+	int tiles;
+	UINT64 total = 0;
+	DWORD start, elapsed;
+	size_t length;
+
+	/* the first frame doubles as the bit-exactness check */
+	if (rfx_bench_encode_frame(bench, context, bench->frames[0]) < 0)
+		return -1;
+
+	length = Stream_GetPosition(bench->s);
+
+	if (!bench->reference)
+	{
+		bench->reference = (BYTE*) malloc(length);
+
+		if (!bench->reference)
+			return -1;
+
+		CopyMemory(bench->reference, Stream_Buffer(bench->s), length);
+		bench->referenceLength = length;
+	}
+	else if ((length != bench->referenceLength) ||
+			(memcmp(bench->reference, Stream_Buffer(bench->s), length) != 0))
+	{
+		fprintf(stderr, "%s: %s output differs from the codec kernels\n", __FUNCTION__, name);
+		return -1;
+	}
+
+	start = GetTickCount();
+	frame = 0;
+
+	do
+	{
+		tiles = rfx_bench_encode_frame(bench, context, bench->frames[frame]);
+
+		if (tiles < 0)
+			return -1;
+
+		total += tiles;
+		frame = (frame + 1) % bench->frameCount;
+		elapsed = GetTickCount() - start;
+	}
+	while (elapsed < RFX_BENCH_DURATION);
+
+	printf("%-24s encode          %8d tiles/s\n", name, (int) ((total * 1000) / elapsed));
+
+	return 0;
+}
+
+static void rfx_bench_stages(RFX_CONTEXT* context, const char* name)
+{
+	int i;
+	UINT64 count;
+	DWORD start, elapsed;
+	UINT32 seed = 1;
+	INT16* buffer;
+	INT16* tile;
+	INT16* dwt;
+	INT16* planes;
+	const INT16* src[3];
+	INT16* dst[3];
+	prim_size_t roi = { 64, 64 };
+	primitives_t* prims = primitives_get();
+
+	buffer = (INT16*) _aligned_malloc(4096 * sizeof(INT16), 32);
+	tile = (INT16*) _aligned_malloc(4096 * sizeof(INT16), 32);
+	dwt = (INT16*) _aligned_malloc(4096 * sizeof(INT16), 32);
+	planes = (INT16*) _aligned_malloc(6 * 4096 * sizeof(INT16), 32);
+
+	if (!buffer || !tile || !dwt || !planes)
+		goto out;
+
+	for (i = 0; i < 4096; i++)
+		tile[i] = (INT16) ((int) (rfx_bench_random(&seed) % 8192) - 4096);
+
+	for (i = 0; i < 3 * 4096; i++)
+		planes[i] = (INT16) (rfx_bench_random(&seed) & 0xFF);
+
+	for (i = 0; i < 3; i++)
+	{
+		src[i] = &planes[i * 4096];
+		dst[i] = &planes[(3 + i) * 4096];
+	}
+
+	/* each stage runs on three components per tile */
+	count = 0;
+	start = GetTickCount();
+
+	do
+	{
+		CopyMemory(buffer, tile, 4096 * sizeof(INT16));
+		context->dwt_2d_encode(buffer, dwt);
+		count++;
+		elapsed = GetTickCount() - start;
+	}
+	while (elapsed < RFX_BENCH_DURATION / 4);
+
+	printf("%-24s dwt             %8d tiles/s\n", name, (int) ((count * 1000) / (elapsed * 3)));
+
+	count = 0;
+	start = GetTickCount();
+
+	do
+	{
+		CopyMemory(buffer, tile, 4096 * sizeof(INT16));
+		context->quantization_encode(buffer, g_Quantization);
+		count++;
+		elapsed = GetTickCount() - start;
+	}
+	while (elapsed < RFX_BENCH_DURATION / 4);
+
+	printf("%-24s quantization    %8d tiles/s\n", name, (int) ((count * 1000) / (elapsed * 3)));
+
+	count = 0;
+	start = GetTickCount();
+
+	do
+	{
+		prims->RGBToYCbCr_16s16s_P3P3(src, 64 * sizeof(INT16), dst, 64 * sizeof(INT16), &roi);
+		count++;
+		elapsed = GetTickCount() - start;
+	}
+	while (elapsed < RFX_BENCH_DURATION / 4);
+
+	printf("%-24s color conversion %7d tiles/s\n", name, (int) ((count * 1000) / elapsed));
+
+out:
+	_aligned_free(buffer);
+	_aligned_free(tile);
+	_aligned_free(dwt);
+	_aligned_free(planes);
+}
+
+static int rfx_bench_run(rfxBench* bench, BOOL install, const char* name)
+{
+	int status;
+	RFX_CONTEXT* context;
+
+	context = rfx_bench_context_new(bench, install);
+
+	if (!context)
+		return -1;
+
+	status = rfx_bench_encode(bench, context, name);
+
+	if (status == 0)
+		rfx_bench_stages(context, name);
+
+	rfx_context_free(context);
+
+	return status;
+}
+
+int main(int argc, char** argv)
+{
+	int index;
+	int status;
+	rfxBench bench;
+
+	ZeroMemory(&bench, sizeof(bench));
+
+	bench.width = 1024;
+	bench.height = 768;
+
+	if (argc >= 3)
+	{
+		bench.width = atoi(argv[1]);
+		bench.height = atoi(argv[2]);
+	}
+
+	if ((bench.width < 64) || (bench.height < 64))
+	{
+		fprintf(stderr, "usage: %s [<width> <height> [<capture> ...]]\n", argv[0]);
+		return 1;
+	}
+
+	bench.scanline = bench.width * 4;
+
+	for (index = 3; index < argc; index++)
+	{
+		if (rfx_bench_load(&bench, argv[index]) < 0)
+			return 1;
+	}
+
+	while (bench.frameCount < ((argc > 3) ? 0 : 4))
+	{
+		bench.frames[bench.frameCount] = (BYTE*) _aligned_malloc((size_t) bench.scanline * bench.height, 16);
+
+		if (!bench.frames[bench.frameCount])
+			return 1;
+
+		rfx_bench_synthesize(&bench, bench.frames[bench.frameCount], bench.frameCount);
+		bench.frameCount++;
+	}
+
+	bench.s = Stream_New(NULL, 0x3F0000);
+
+	if (!bench.s)
+		return 1;
+
+	printf("%d %dx%d frame(s), %d ms per kernel set\n", bench.frameCount, bench.width, bench.height,
+			RFX_BENCH_DURATION);
+
+	/* the codec kernels first, installing the freerds ones replaces some of them process-wide */
+	status = rfx_bench_run(&bench, FALSE, "codec");
+
+	if (status == 0)
+	{
+		freerds_rfx_simd_init();
+		status = rfx_bench_run(&bench, TRUE, freerds_rfx_simd_get_name());
+	}
+
+	Stream_Free(bench.s, TRUE);
+	free(bench.reference);
+
+	for (index = 0; index < bench.frameCount; index++)
+		_aligned_free(bench.frames[index]);
+
+	return (status == 0) ? 0 : 1;
+}
@@ -0,0 +1,283 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * Loopback Connection Scale Test
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <winpr/crt.h>
+#include <winpr/sysinfo.h>
+
+/**
+ * Opens connections to a running freerds on loopback and keeps them open,
+ * reporting the thread count and resident memory of the freerds process
+ * before and after. Every connection sends an X.224 connection request
+ * asking for TLS and waits for the connection confirm, so that freerds has
+ * created its peer and is waiting for the TLS handshake when it is counted.
+ *
+ * usage: freerds-scale-test <freerds pid> [<connections> [<port>]]
+ */
+
+#define SCALE_TEST_CONNECTIONS	500
+#define SCALE_TEST_PORT		3389
+#define SCALE_TEST_TIMEOUT	30000
+
+/* TPKT, X.224 connection request, RDP negotiation request for PROTOCOL_SSL */
+static const BYTE g_ConnectionRequest[19] =
+{
+	0x03, 0x00, 0x00, 0x13,
+	0x0E, 0xE0, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x01, 0x00, 0x08, 0x00, 0x01, 0x00, 0x00, 0x00
+};
+
+#define X224_TPDU_CONNECTION_CONFIRM	0xD0
+
+struct scale_test_process
+{
+	int threads;
+	int rssKB;
+};
+typedef struct scale_test_process scaleTestProcess;
+
+static int scale_test_sample(int pid, scaleTestProcess* process)
+{
+	FILE* fp;
+	char line[256];
+	char filename[64];
+
+	sprintf_s(filename, sizeof(filename), "/proc/%d/status", pid);
+
+	fp = fopen(filename, "r");
+
+	if (!fp)
+		return -1;
+
+	process->threads = 0;
+	process->rssKB = 0;
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (strncmp(line, "Threads:", 8) == 0)
+			process->threads = atoi(&line[8]);
+		else if (strncmp(line, "VmRSS:", 6) == 0)
+			process->rssKB = atoi(&line[6]);
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+static int scale_test_connect(int port)
+{
+	int fd;
+	int option = 1;
+	struct sockaddr_in sin;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0)
+		return -1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*) &option, sizeof(option));
+
+	ZeroMemory(&sin, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (connect(fd, (struct sockaddr*) &sin, sizeof(sin)) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	if (send(fd, g_ConnectionRequest, sizeof(g_ConnectionRequest), MSG_NOSIGNAL) != sizeof(g_ConnectionRequest))
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* waits for the connection confirm on every socket, returns how many got one */
+static int scale_test_confirm(int* fds, int count)
+{
+	int index;
+	int status;
+	int pending;
+	int confirmed = 0;
+	BYTE buffer[64];
+	DWORD start;
+	struct pollfd* pfds;
+
+	pfds = (struct pollfd*) calloc(count, sizeof(struct pollfd));
+
+	if (!pfds)
+		return -1;
+
+	for (index = 0; index < count; index++)
+	{
+		pfds[index].fd = fds[index];
+		pfds[index].events = POLLIN;
+	}
+
+	pending = count;
+	start = GetTickCount();
+
+	while ((pending > 0) && ((GetTickCount() - start) < SCALE_TEST_TIMEOUT))
+	{
+		status = poll(pfds, count, 1000);
+
+		if (status < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		for (index = 0; index < count; index++)
+		{
+			if (!pfds[index].revents)
+				continue;
+
+			/* the confirm fits in one segment on loopback */
+			status = recv(pfds[index].fd, buffer, sizeof(buffer), 0);
+
+			if ((status > 5) && (buffer[0] == 0x03) && ((buffer[5] & 0xF0) == X224_TPDU_CONNECTION_CONFIRM))
+				confirmed++;
+			else
+				fprintf(stderr, "connection %d: no connection confirm\n", index);
+
+			/* a negative fd is skipped by poll */
+			pfds[index].fd = -1;
+			pfds[index].revents = 0;
+			pending--;
+		}
+	}
+
+	free(pfds);
+
+	return confirmed;
+}
+
+int main(int argc, char** argv)
+{
+	int pid;
+	int port;
+	int index;
+	int count;
+	int opened;
+	int confirmed;
+	int* fds;
+	DWORD start;
+	struct rlimit limit;
+	scaleTestProcess before;
+	scaleTestProcess after;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s <freerds pid> [<connections> [<port>]]\n", argv[0]);
+		return 1;
+	}
+
+	pid = atoi(argv[1]);
+	count = (argc > 2) ? atoi(argv[2]) : SCALE_TEST_CONNECTIONS;
+	port = (argc > 3) ? atoi(argv[3]) : SCALE_TEST_PORT;
+
+	if (count < 1)
+		return 1;
+
+	/* the process needs a descriptor per connection, and so does freerds */
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+	{
+		if (limit.rlim_cur < (rlim_t) count + 16)
+		{
+			limit.rlim_cur = MIN(limit.rlim_max, (rlim_t) count + 16);
+			setrlimit(RLIMIT_NOFILE, &limit);
+		}
+	}
+
+	if (scale_test_sample(pid, &before) < 0)
+	{
+		fprintf(stderr, "%s: no process %d\n", __FUNCTION__, pid);
+		return 1;
+	}
+
+	fds = (int*) malloc(count * sizeof(int));
+
+	if (!fds)
+		return 1;
+
+	start = GetTickCount();
+
+	for (opened = 0; opened < count; opened++)
+	{
+		fds[opened] = scale_test_connect(port);
+
+		if (fds[opened] < 0)
+		{
+			fprintf(stderr, "connection %d: %s\n", opened, strerror(errno));
+			break;
+		}
+	}
+
+	confirmed = scale_test_confirm(fds, opened);
+
+	printf("%d of %d connections opened, %d confirmed in %d ms\n", opened, count, confirmed,
+			(int) (GetTickCount() - start));
+
+	/* give freerds a moment to settle before it is measured */
+	sleep(1);
+
+	if (scale_test_sample(pid, &after) < 0)
+	{
+		fprintf(stderr, "%s: process %d went away\n", __FUNCTION__, pid);
+		after.threads = 0;
+		after.rssKB = 0;
+	}
+
+	printf("threads: %d before, %d after\n", before.threads, after.threads);
+	printf("resident memory: %d kB before, %d kB after", before.rssKB, after.rssKB);
+
+	if (confirmed > 0)
+		printf(", %d kB per connection", (after.rssKB - before.rssKB) / confirmed);
+
+	printf("\n");
+
+	for (index = 0; index < opened; index++)
+		close(fds[index]);
+
+	free(fds);
+
+	return (confirmed == count) ? 0 : 1;
+}
@@ -0,0 +1,471 @@
+/**
+ * FreeRDP: A Remote Desktop Protocol Implementation
+ * TLS Session Resumption Test
+ *
+ * Copyright 2013 Marc-Andre Moreau <marcandre.moreau@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "freerds.h"
+
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+/**
+ * Without arguments, links the freerds session cache in and checks it with
+ * handshakes over memory BIOs, each against a new server context the way
+ * FreeRDP makes one per peer:
+ *
+ * - client contexts are left alone by the SSL_CTX_new override;
+ * - a session id is resumed by later handshakes;
+ * - a ticket is resumed by later handshakes;
+ * - a ticket issued under the ticket key before the current one is still
+ *   resumed, and renewed under the current key.
+ *
+ * With a port, does the handshakes against a running freerds on loopback
+ * instead, after the X.224 negotiation, and reports how many resumed.
+ *
+ * usage: freerds-tls-resume-test [<port> [<handshakes> [ids|tickets]]]
+ */
+
+#define TLS_RESUME_TEST_LIFETIME	3
+#define TLS_RESUME_TEST_HANDSHAKES	10
+
+/* TPKT, X.224 connection request, RDP negotiation request for PROTOCOL_SSL */
+static const BYTE g_ConnectionRequest[19] =
+{
+	0x03, 0x00, 0x00, 0x13,
+	0x0E, 0xE0, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x01, 0x00, 0x08, 0x00, 0x01, 0x00, 0x00, 0x00
+};
+
+#define X224_TPDU_CONNECTION_CONFIRM	0xD0
+
+struct tls_resume_test
+{
+	EVP_PKEY* key;
+	X509* certificate;
+	SSL_CTX* client;
+	SSL_SESSION* session;
+	int failures;
+};
+typedef struct tls_resume_test tlsResumeTest;
+
+static void tls_resume_test_check(tlsResumeTest* test, BOOL condition, const char* what)
+{
+	printf("%-56s %s\n", what, condition ? "ok" : "FAILED");
+
+	if (!condition)
+		test->failures++;
+}
+
+static int tls_resume_test_certificate(tlsResumeTest* test)
+{
+	EVP_PKEY_CTX* keyCtx;
+
+	keyCtx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+
+	if (!keyCtx)
+		return -1;
+
+	if ((EVP_PKEY_keygen_init(keyCtx) <= 0) ||
+			(EVP_PKEY_CTX_set_rsa_keygen_bits(keyCtx, 2048) <= 0) ||
+			(EVP_PKEY_keygen(keyCtx, &test->key) <= 0))
+	{
+		EVP_PKEY_CTX_free(keyCtx);
+		return -1;
+	}
+
+	EVP_PKEY_CTX_free(keyCtx);
+
+	test->certificate = X509_new();
+
+	if (!test->certificate)
+		return -1;
+
+	X509_set_version(test->certificate, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(test->certificate), 1);
+	X509_gmtime_adj(X509_get_notBefore(test->certificate), 0);
+	X509_gmtime_adj(X509_get_notAfter(test->certificate), 3600);
+	X509_set_pubkey(test->certificate, test->key);
+
+	if (!X509_sign(test->certificate, test->key, EVP_sha256()))
+		return -1;
+
+	return 0;
+}
+
+static int tls_resume_test_client(tlsResumeTest* test, BOOL tickets)
+{
+	if (test->client)
+		SSL_CTX_free(test->client);
+
+	if (test->session)
+		SSL_SESSION_free(test->session);
+
+	test->session = NULL;
+	test->client = SSL_CTX_new(TLS_client_method());
+
+	if (!test->client)
+		return -1;
+
+	/* session ids and tickets of TLS 1.2, 1.3 only has tickets and resumes them differently */
+	SSL_CTX_set_max_proto_version(test->client, TLS1_2_VERSION);
+	SSL_CTX_set_session_cache_mode(test->client, SSL_SESS_CACHE_CLIENT);
+
+	if (!tickets)
+		SSL_CTX_set_options(test->client, SSL_OP_NO_TICKET);
+
+	return 0;
+}
+
+/* keeps the client session for the next handshake, returns whether this one resumed */
+static int tls_resume_test_finish(tlsResumeTest* test, SSL* ssl)
+{
+	int reused;
+
+	reused = SSL_session_reused(ssl) ? 1 : 0;
+
+	if (test->session)
+		SSL_SESSION_free(test->session);
+
+	test->session = SSL_get1_session(ssl);
+
+	return reused;
+}
+
+static const BYTE* tls_resume_test_ticket(SSL_SESSION* session, size_t* length)
+{
+	const BYTE* ticket = NULL;
+
+	*length = 0;
+
+	if (session && SSL_SESSION_has_ticket(session))
+		SSL_SESSION_get0_ticket(session, &ticket, length);
+
+	return ticket;
+}
+
+/* one handshake over a BIO pair against a new server context, returns 1 when resumed */
+static int tls_resume_test_memory_handshake(tlsResumeTest* test)
+{
+	int round;
+	int status;
+	int clientStatus;
+	int serverStatus;
+	BIO* clientBio;
+	BIO* serverBio;
+	SSL* client;
+	SSL* server;
+	SSL_CTX* serverCtx;
+
+	/* what FreeRDP does for every peer it accepts */
+	serverCtx = SSL_CTX_new(SSLv23_server_method());
+
+	if (!serverCtx)
+		return -1;
+
+	SSL_CTX_use_certificate(serverCtx, test->certificate);
+	SSL_CTX_use_PrivateKey(serverCtx, test->key);
+
+	client = SSL_new(test->client);
+	server = SSL_new(serverCtx);
+
+	if (!client || !server || !BIO_new_bio_pair(&clientBio, 0, &serverBio, 0))
+	{
+		SSL_free(client);
+		SSL_free(server);
+		SSL_CTX_free(serverCtx);
+		return -1;
+	}
+
+	SSL_set_bio(client, clientBio, clientBio);
+	SSL_set_bio(server, serverBio, serverBio);
+
+	SSL_set_connect_state(client);
+	SSL_set_accept_state(server);
+
+	if (test->session)
+		SSL_set_session(client, test->session);
+
+	status = -1;
+
+	for (round = 0; round < 100; round++)
+	{
+		clientStatus = SSL_do_handshake(client);
+		serverStatus = SSL_do_handshake(server);
+
+		if ((clientStatus == 1) && (serverStatus == 1))
+		{
+			status = tls_resume_test_finish(test, client);
+			break;
+		}
+	}
+
+	/* a connection that is not shut down takes its session out of the cache */
+	SSL_shutdown(client);
+	SSL_shutdown(server);
+
+	SSL_free(client);
+	SSL_free(server);
+	SSL_CTX_free(serverCtx);
+
+	return status;
+}
+
+static void tls_resume_test_wait_until(DWORD deadline)
+{
+	while ((INT32) (GetTickCount() - deadline) < 0)
+		usleep(10000);
+}
+
+static int tls_resume_test_memory(tlsResumeTest* test)
+{
+	int index;
+	int resumed;
+	DWORD rotation;
+	size_t length;
+	size_t renewedLength;
+	const BYTE* ticket;
+	BYTE* previousTicket;
+	SSL_CTX* ctx;
+
+	if (freerds_tls_cache_init(64, TLS_RESUME_TEST_LIFETIME) < 0)
+		return -1;
+
+	/* the ticket key is first replaced one lifetime after the cache was made */
+	rotation = GetTickCount() + (TLS_RESUME_TEST_LIFETIME * 1000);
+
+	if (tls_resume_test_certificate(test) < 0)
+		return -1;
+
+	ctx = SSL_CTX_new(TLS_client_method());
+	tls_resume_test_check(test, ctx && !SSL_CTX_sess_get_new_cb(ctx),
+			"client contexts are not attached to the cache");
+	SSL_CTX_free(ctx);
+
+	ctx = SSL_CTX_new(SSLv23_server_method());
+	tls_resume_test_check(test, ctx && SSL_CTX_sess_get_new_cb(ctx),
+			"server contexts are attached to the cache");
+	SSL_CTX_free(ctx);
+
+	/* session ids */
+	if (tls_resume_test_client(test, FALSE) < 0)
+		return -1;
+
+	resumed = 0;
+
+	for (index = 0; index < 3; index++)
+		resumed += (tls_resume_test_memory_handshake(test) == 1) ? 1 : 0;
+
+	tls_resume_test_check(test, (resumed == 2), "session id resumed by a new server context");
+
+	/* tickets */
+	if (tls_resume_test_client(test, TRUE) < 0)
+		return -1;
+
+	resumed = 0;
+
+	for (index = 0; index < 3; index++)
+		resumed += (tls_resume_test_memory_handshake(test) == 1) ? 1 : 0;
+
+	tls_resume_test_check(test, (resumed == 2), "ticket resumed by a new server context");
+
+	/* a ticket issued shortly before the ticket key is replaced, resumed shortly after */
+	if (tls_resume_test_client(test, TRUE) < 0)
+		return -1;
+
+	tls_resume_test_wait_until(rotation - 700);
+	tls_resume_test_memory_handshake(test);
+
+	ticket = tls_resume_test_ticket(test->session, &length);
+	previousTicket = ticket ? (BYTE*) malloc(length) : NULL;
+
+	if (previousTicket)
+		CopyMemory(previousTicket, ticket, length);
+
+	tls_resume_test_wait_until(rotation + 300);
+
+	resumed = tls_resume_test_memory_handshake(test);
+	ticket = tls_resume_test_ticket(test->session, &renewedLength);
+
+	tls_resume_test_check(test, (resumed == 1), "ticket under the previous key resumed");
+	tls_resume_test_check(test, previousTicket && ticket &&
+			((renewedLength != length) || (memcmp(ticket, previousTicket, length) != 0)),
+			"ticket under the previous key renewed");
+
+	free(previousTicket);
+
+	freerds_tls_cache_print_stats();
+	freerds_tls_cache_uninit();
+
+	return 0;
+}
+
+static int tls_resume_test_connect(int port)
+{
+	int fd;
+	int option = 1;
+	BYTE buffer[64];
+	struct sockaddr_in sin;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0)
+		return -1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*) &option, sizeof(option));
+
+	ZeroMemory(&sin, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((connect(fd, (struct sockaddr*) &sin, sizeof(sin)) < 0) ||
+			(send(fd, g_ConnectionRequest, sizeof(g_ConnectionRequest), MSG_NOSIGNAL) != sizeof(g_ConnectionRequest)))
+	{
+		close(fd);
+		return -1;
+	}
+
+	/* the confirm fits in one segment on loopback, TLS starts right after it */
+	if ((recv(fd, buffer, sizeof(buffer), 0) <= 5) || (buffer[0] != 0x03) ||
+			((buffer[5] & 0xF0) != X224_TPDU_CONNECTION_CONFIRM))
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int tls_resume_test_socket(tlsResumeTest* test, int port, int handshakes, BOOL tickets)
+{
+	int fd;
+	int index;
+	int status;
+	int resumed = 0;
+	int completed = 0;
+	SSL* ssl;
+
+	if (tls_resume_test_client(test, tickets) < 0)
+		return -1;
+
+	for (index = 0; index < handshakes; index++)
+	{
+		fd = tls_resume_test_connect(port);
+
+		if (fd < 0)
+		{
+			fprintf(stderr, "handshake %d: no connection confirm\n", index);
+			continue;
+		}
+
+		ssl = SSL_new(test->client);
+
+		if (!ssl)
+		{
+			close(fd);
+			continue;
+		}
+
+		SSL_set_fd(ssl, fd);
+
+		if (test->session)
+			SSL_set_session(ssl, test->session);
+
+		if (SSL_connect(ssl) == 1)
+		{
+			status = tls_resume_test_finish(test, ssl);
+			resumed += status;
+			completed++;
+
+			SSL_shutdown(ssl);
+		}
+		else
+		{
+			fprintf(stderr, "handshake %d failed\n", index);
+		}
+
+		SSL_free(ssl);
+		close(fd);
+	}
+
+	printf("%d of %d handshakes completed, %d resumed by %s\n", completed, handshakes, resumed,
+			tickets ? "ticket" : "session id");
+
+	/* every handshake after the first one should have resumed */
+	tls_resume_test_check(test, (completed == handshakes) && (resumed == completed - 1),
+			"handshakes after the first one resumed");
+
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	int port;
+	int status;
+	int handshakes;
+	BOOL tickets;
+	tlsResumeTest test;
+
+	ZeroMemory(&test, sizeof(test));
+
+	SSL_library_init();
+	SSL_load_error_strings();
+
+	if (argc > 1)
+	{
+		port = atoi(argv[1]);
+		handshakes = (argc > 2) ? atoi(argv[2]) : TLS_RESUME_TEST_HANDSHAKES;
+		tickets = ((argc > 3) && (strcmp(argv[3], "ids") == 0)) ? FALSE : TRUE;
+
+		if ((port < 1) || (handshakes < 2))
+		{
+			fprintf(stderr, "usage: %s [<port> [<handshakes> [ids|tickets]]]\n", argv[0]);
+			return 1;
+		}
+
+		status = tls_resume_test_socket(&test, port, handshakes, tickets);
+	}
+	else
+	{
+		status = tls_resume_test_memory(&test);
+	}
+
+	if (test.session)
+		SSL_SESSION_free(test.session);
+
+	if (test.client)
+		SSL_CTX_free(test.client);
+
+	X509_free(test.certificate);
+	EVP_PKEY_free(test.key);
+
+	return ((status == 0) && (test.failures == 0)) ? 0 : 1;
+}